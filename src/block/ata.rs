@@ -0,0 +1,184 @@
+use crate::block::*;
+use crate::cpu::io::*;
+use crate::mm::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+
+use alloc::sync::Arc;
+
+// the registers of the primary bus
+const ATA_DATA         : u16 = 0x1F0;
+const ATA_ERROR        : u16 = 0x1F1;
+const ATA_SECTOR_COUNT : u16 = 0x1F2;
+const ATA_LBA_LOW      : u16 = 0x1F3;
+const ATA_LBA_MID      : u16 = 0x1F4;
+const ATA_LBA_HIGH     : u16 = 0x1F5;
+const ATA_DRIVE        : u16 = 0x1F6;
+const ATA_COMMAND      : u16 = 0x1F7;
+const ATA_STATUS       : u16 = 0x1F7;
+const ATA_CONTROL      : u16 = 0x3F6;
+
+// status bits
+const ATA_SR_ERR : u8 = 0x01;
+const ATA_SR_DRQ : u8 = 0x08;
+const ATA_SR_DF  : u8 = 0x20;
+const ATA_SR_BSY : u8 = 0x80;
+
+// commands
+const ATA_CMD_READ_PIO    : u8 = 0x20;
+const ATA_CMD_WRITE_PIO   : u8 = 0x30;
+const ATA_CMD_CACHE_FLUSH : u8 = 0xE7;
+const ATA_CMD_IDENTIFY    : u8 = 0xEC;
+
+// interrupts are not used, completion is polled
+const ATA_CONTROL_NIEN : u8 = 0x02;
+
+// LBA28 transfers are limited to 256 sectors
+const ATA_MAX_SECTORS : usize = 256;
+
+const WORDS_PER_SECTOR : usize = SECTOR_SIZE / 2;
+
+// the bus is shared by the master and the slave drive
+#[allow(non_upper_case_globals)]
+static ata_bus : SpinLock<()> = SpinLock::new(());
+
+/// A drive of the primary ATA bus, driven with polled PIO transfers
+///
+/// Transfers complete before `queue_request()` returns, but callers must
+/// not rely on that and wait for the completion as with any other device.
+pub(crate) struct AtaDrive {
+    slave   : bool,
+    sectors : u64,
+}
+
+/// Waits for the drive to be ready, failing on errors
+fn wait_ready(data:bool) -> KResult<()> {
+    // reading the alternate status 4 times gives the drive 400ns to update it
+    for _ in 0..4 {
+        inb(ATA_CONTROL);
+    }
+    loop {
+        let status = inb(ATA_STATUS);
+        if status & ATA_SR_BSY != 0 {
+            continue;
+        }
+        if status & (ATA_SR_ERR | ATA_SR_DF) != 0 {
+            return Err(EIO);
+        }
+        if !data || status & ATA_SR_DRQ != 0 {
+            return Ok(());
+        }
+    }
+}
+
+impl AtaDrive {
+    fn select(&self, lba:u64) {
+        let drive = 0xE0 | ((self.slave as u8) << 4) | ((lba >> 24) as u8 & 0x0F);
+        outb(ATA_DRIVE, drive);
+    }
+
+    /// Identifies the drive, returning None if absent or not an ATA disk
+    fn probe(slave:bool) -> Option<Self> {
+        let _bus = ata_bus.lock();
+        outb(ATA_CONTROL, ATA_CONTROL_NIEN);
+        outb(ATA_DRIVE, 0xA0 | ((slave as u8) << 4));
+        outb(ATA_SECTOR_COUNT, 0);
+        outb(ATA_LBA_LOW, 0);
+        outb(ATA_LBA_MID, 0);
+        outb(ATA_LBA_HIGH, 0);
+        outb(ATA_COMMAND, ATA_CMD_IDENTIFY);
+        if inb(ATA_STATUS) == 0 {
+            return None;
+        }
+        while inb(ATA_STATUS) & ATA_SR_BSY != 0 {}
+        // ATAPI and SATA devices report their signature here
+        if inb(ATA_LBA_MID) != 0 || inb(ATA_LBA_HIGH) != 0 {
+            return None;
+        }
+        wait_ready(true).ok()?;
+        let mut identify = [0_u16; WORDS_PER_SECTOR];
+        for word in identify.iter_mut() {
+            *word = inw(ATA_DATA);
+        }
+        let sectors = identify[60] as u64 | (identify[61] as u64) << 16;
+        if sectors == 0 {
+            return None;
+        }
+        Some(AtaDrive { slave, sectors })
+    }
+
+    /// Transfers `count` sectors starting at `lba` from or to `buffer`
+    fn transfer(&self, op:BlockOp, lba:u64, buffer:*mut u16, count:usize) -> KResult<()> {
+        self.select(lba);
+        outb(ATA_ERROR, 0);
+        outb(ATA_SECTOR_COUNT, count as u8);
+        outb(ATA_LBA_LOW, lba as u8);
+        outb(ATA_LBA_MID, (lba >> 8) as u8);
+        outb(ATA_LBA_HIGH, (lba >> 16) as u8);
+        outb(ATA_COMMAND, if op == BlockOp::Read { ATA_CMD_READ_PIO } else { ATA_CMD_WRITE_PIO });
+        for sector in 0..count {
+            wait_ready(true)?;
+            let words = unsafe { buffer.add(sector * WORDS_PER_SECTOR) };
+            for i in 0..WORDS_PER_SECTOR {
+                unsafe {
+                    match op {
+                        BlockOp::Read  => *words.add(i) = inw(ATA_DATA),
+                        BlockOp::Write => outw(ATA_DATA, *words.add(i)),
+                    }
+                }
+            }
+        }
+        if op == BlockOp::Write {
+            outb(ATA_COMMAND, ATA_CMD_CACHE_FLUSH);
+            wait_ready(false)?;
+        }
+        Ok(())
+    }
+
+    /// Runs `request` through its scatter-gather list, merging the pieces
+    /// contiguous in memory into transfers of up to 256 sectors
+    fn run(&self, request:&BlockRequest) -> KResult<()> {
+        let end = request.sector + request.sectors();
+        if end > self.sectors {
+            return Err(EIO);
+        }
+        let _bus = ata_bus.lock();
+        let mut sector = request.sector;
+        let mut start = 0;
+        let mut length = 0;
+        for (addr, size) in request.segments() {
+            if length > 0 && (start + length != addr || (length + size) / SECTOR_SIZE > ATA_MAX_SECTORS) {
+                self.transfer(request.op, sector, phys_to_virt(start) as *mut u16, length / SECTOR_SIZE)?;
+                sector += (length / SECTOR_SIZE) as u64;
+                length = 0;
+            }
+            if length == 0 {
+                start = addr;
+            }
+            length += size;
+        }
+        if length > 0 {
+            self.transfer(request.op, sector, phys_to_virt(start) as *mut u16, length / SECTOR_SIZE)?;
+        }
+        Ok(())
+    }
+}
+
+impl BlockDriver for AtaDrive {
+    fn sector_count(&self) -> u64 {
+        self.sectors
+    }
+
+    fn queue_request(&self, _queue:usize, request:Arc<BlockRequest>) {
+        request.complete(self.run(&request));
+    }
+}
+
+/// Registers the drives found on the primary bus, as 'hda' and 'hdb'
+pub(crate) fn init() {
+    for (slave, name) in [(false, "hda"), (true, "hdb")] {
+        if let Some(drive) = AtaDrive::probe(slave) {
+            let _ = register_block_device(name, Arc::new(drive));
+        }
+    }
+}
@@ -0,0 +1,216 @@
+pub(crate) mod ata;
+pub(crate) mod queue;
+pub(crate) mod ramdisk;
+
+pub(crate) use queue::*;
+
+use crate::cpu::*;
+use crate::mm::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+
+use alloc::boxed::Box;
+use alloc::sync::Arc;
+use alloc::vec::Vec;
+use core::sync::atomic::{AtomicUsize, Ordering};
+
+pub(crate) const SECTOR_SIZE       : usize = 512;
+pub(crate) const SECTORS_PER_PAGE  : usize = PAGE_SIZE / SECTOR_SIZE;
+
+// the number of block devices that can be registered
+pub(crate) const MAX_BLOCK_DEVICES : usize = 8;
+
+// the processor of a request not submitted yet
+const NO_CPU : usize = usize::MAX;
+
+/// Run once a request completes, by whoever completes it, with the outcome
+pub(crate) type EndIo = Box<dyn FnOnce(&BlockRequest, KResult<()>) + Send>;
+
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub(crate) enum BlockOp {
+    Read,
+    Write,
+}
+
+/// A transfer between consecutive sectors of a device and a list of frames
+///
+/// The request starts at `sector` and spans one page per frame, except
+/// for the first frame, used from `offset` on, and the last one, which
+/// may be used only in part: `segments()` is the resulting scatter-gather
+/// list, whose pieces are all whole sectors. It is submitted to
+/// a device, which completes it later, possibly from another thread;
+/// submitters wait for the completion only when they need to, or hand
+/// the rest of the work to an `EndIo` run at completion. The requests in
+/// flight together are not ordered.
+///
+/// The completion is finished on the processor which submitted the
+/// request, where its data is likely cached.
+pub(crate) struct BlockRequest {
+    pub(crate) op     : BlockOp,
+    pub(crate) sector : u64,
+    pub(crate) pages  : Vec<usize>,
+    offset            : usize,
+    count             : u64,
+    status            : SpinLock<Option<KResult<()>>>,
+    waiters           : WaitQueue,
+    end_io            : SpinLock<Option<EndIo>>,
+    cpu               : AtomicUsize,
+}
+
+impl BlockRequest {
+    pub(crate) fn new(op:BlockOp, sector:u64, pages:Vec<usize>) -> Arc<Self> {
+        let count = (pages.len() * SECTORS_PER_PAGE) as u64;
+        Self::with_sectors(op, sector, pages, count)
+    }
+
+    /// Creates a request transferring only `count` sectors, from the beginning of `pages`
+    pub(crate) fn with_sectors(op:BlockOp, sector:u64, pages:Vec<usize>, count:u64) -> Arc<Self> {
+        Self::with_offset(op, sector, pages, 0, count)
+    }
+
+    /// Creates a request transferring `count` sectors from `offset` Bytes
+    /// into the first of `pages`, which must be a multiple of the sector size
+    pub(crate) fn with_offset(op:BlockOp, sector:u64, pages:Vec<usize>, offset:usize, count:u64) -> Arc<Self> {
+        debug_assert!(offset % SECTOR_SIZE == 0 && offset < PAGE_SIZE);
+        debug_assert!(offset + count as usize * SECTOR_SIZE <= pages.len() * PAGE_SIZE);
+        Arc::new(BlockRequest {
+            op,
+            sector,
+            pages,
+            offset,
+            count,
+            status  : SpinLock::new(None),
+            waiters : WaitQueue::new(),
+            end_io  : SpinLock::new(None),
+            cpu     : AtomicUsize::new(NO_CPU),
+        })
+    }
+
+    /// Sets the function run at completion, to be called before submitting
+    pub(crate) fn set_end_io(&self, end_io:EndIo) {
+        *self.end_io.lock() = Some(end_io);
+    }
+
+    /// Returns the number of sectors transferred
+    pub(crate) fn sectors(&self) -> u64 {
+        self.count
+    }
+
+    /// Returns where the transfer begins in the first frame, in Bytes
+    pub(crate) fn offset(&self) -> usize {
+        self.offset
+    }
+
+    /// Checks whether the transfer goes on to the end of the last frame
+    pub(crate) fn ends_whole(&self) -> bool {
+        self.offset + self.count as usize * SECTOR_SIZE == self.pages.len() * PAGE_SIZE
+    }
+
+    /// Returns the scatter-gather list of the transfer: the physical
+    /// address and the size in Bytes of each piece, in order
+    pub(crate) fn segments(&self) -> impl Iterator<Item = (usize, usize)> + '_ {
+        let mut left = self.count as usize * SECTOR_SIZE;
+        let mut offset = self.offset;
+        self.pages.iter().map(move |&paddr| {
+            let size = core::cmp::min(left, PAGE_SIZE - offset);
+            let segment = (paddr + offset, size);
+            left -= size;
+            offset = 0;
+            segment
+        }).filter(|&(_, size)| size > 0)
+    }
+
+    /// Records the processor submitting the request
+    pub(crate) fn set_cpu(&self, cpu:usize) {
+        self.cpu.store(cpu, Ordering::Relaxed);
+    }
+
+    /// Records the outcome of the transfer, then finishes the request, or
+    /// defers it to the processor which submitted it
+    pub(crate) fn complete(self:&Arc<Self>, result:KResult<()>) {
+        *self.status.lock() = Some(result);
+        let cpu = self.cpu.load(Ordering::Relaxed);
+        if cpu != NO_CPU && cpu != current_id() {
+            defer_completion(cpu, self.clone());
+        } else {
+            self.finish();
+        }
+    }
+
+    /// Runs the completion function and wakes up the waiters
+    pub(crate) fn finish(&self) {
+        let end_io = self.end_io.lock().take();
+        if let Some(end_io) = end_io {
+            end_io(self, self.status().unwrap());
+        }
+        self.waiters.wake_all();
+    }
+
+    /// Returns the outcome of the transfer, if completed
+    pub(crate) fn status(&self) -> Option<KResult<()>> {
+        *self.status.lock()
+    }
+
+    /// Blocks until the transfer completes, returning its outcome
+    ///
+    /// The requests plugged by the thread go out first, and the
+    /// completions deferred to this processor are run, since the request
+    /// may be among them.
+    pub(crate) fn wait(&self) -> KResult<()> {
+        flush_plug();
+        run_completions();
+        self.waiters.wait_until(|| self.status().is_some());
+        self.status().unwrap()
+    }
+}
+
+/// A device storing data in sectors
+pub(crate) trait BlockDevice : Send + Sync {
+    /// Returns the size of the device, in sectors
+    fn sector_count(&self) -> u64;
+
+    /// Queues `request`, which is completed through `BlockRequest::complete()`
+    fn submit(&self, request:Arc<BlockRequest>);
+
+    /// Returns the memory holding `count` sectors from `sector`, for the
+    /// devices backed by memory, which can be read there with no transfer
+    fn direct_access(&self, _sector:u64, _count:u64) -> Option<&'static [u8]> {
+        None
+    }
+}
+
+#[allow(non_upper_case_globals)]
+static block_devices : SpinLock<Vec<(&'static str, Arc<dyn BlockDevice>)>> = SpinLock::new(Vec::new());
+
+/// Makes the disk driven by `driver` reachable through `name`, behind a queue
+pub(crate) fn register_block_device(name:&'static str, driver:Arc<dyn BlockDriver>) -> KResult<()> {
+    let device : Arc<dyn BlockDevice> = BlockQueue::new(driver);
+    let mut devices = block_devices.lock();
+    if devices.len() == MAX_BLOCK_DEVICES {
+        return Err(ENOSPC);
+    }
+    if devices.iter().any(|(other, _)| *other == name) {
+        return Err(EEXIST);
+    }
+    devices.push((name, device));
+    Ok(())
+}
+
+/// Returns the device registered as `name`
+pub(crate) fn block_device(name:&str) -> Option<Arc<dyn BlockDevice>> {
+    block_devices.lock().iter().find(|(other, _)| *other == name).map(|(_, device)| device.clone())
+}
+
+/// Submits a request and waits for its completion
+pub(crate) fn submit_wait(device:&dyn BlockDevice, op:BlockOp, sector:u64, pages:Vec<usize>) -> KResult<()> {
+    let request = BlockRequest::new(op, sector, pages);
+    device.submit(request.clone());
+    request.wait()
+}
+
+/// Probes the disks
+pub(crate) fn init() {
+    ata::init();
+    ramdisk::init();
+}
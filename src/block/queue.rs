@@ -0,0 +1,237 @@
+use crate::block::*;
+use crate::cpu::*;
+use crate::sync::*;
+use crate::task::*;
+
+use alloc::boxed::Box;
+use alloc::sync::{Arc, Weak};
+use alloc::vec::Vec;
+
+/// A driver of a disk, fed with requests by the block layer
+///
+/// The driver exposes one or more hardware queues, each of which takes
+/// requests independently; the block layer maps every processor to one
+/// of them. The requests reaching the driver are already merged, up to
+/// `max_sectors()`, and sorted.
+pub(crate) trait BlockDriver : Send + Sync {
+    /// Returns the size of the disk, in sectors
+    fn sector_count(&self) -> u64;
+
+    /// Returns the number of hardware queues
+    fn queue_count(&self) -> usize {
+        1
+    }
+
+    /// Returns the size of the largest request the driver takes, in sectors
+    fn max_sectors(&self) -> u64 {
+        u64::MAX
+    }
+
+    /// Starts `request` on the hardware queue `queue`, completing it
+    /// through `BlockRequest::complete()`
+    fn queue_request(&self, queue:usize, request:Arc<BlockRequest>);
+
+    /// See `BlockDevice::direct_access()`
+    fn direct_access(&self, _sector:u64, _count:u64) -> Option<&'static [u8]> {
+        None
+    }
+}
+
+/// The requests a thread holds back, to submit them together
+///
+/// While a thread is plugged its requests gather here instead of going
+/// to the devices, so that the block layer sees a whole batch at once
+/// and merges what it can. The plug is flushed when the outermost
+/// `finish_plug()` runs, and when the thread waits for a request. A
+/// plugged thread must not wait for anything else depending on the
+/// requests it holds.
+pub(crate) struct BlockPlug {
+    depth    : usize,
+    requests : Vec<(Arc<BlockQueue>, Arc<BlockRequest>)>,
+}
+
+impl BlockPlug {
+    pub(crate) const fn new() -> Self {
+        BlockPlug {
+            depth    : 0,
+            requests : Vec::new(),
+        }
+    }
+}
+
+/// Starts holding back the requests of the current thread, plugs nest
+pub(crate) fn start_plug() {
+    current_thread().plug.depth += 1;
+}
+
+/// Ends a plug, submitting the requests held if it was the outermost one
+pub(crate) fn finish_plug() {
+    let plug = &mut current_thread().plug;
+    plug.depth -= 1;
+    if plug.depth == 0 {
+        flush_plug();
+    }
+}
+
+/// Submits the requests held by the current thread, a batch per device
+pub(crate) fn flush_plug() {
+    let mut requests = core::mem::take(&mut current_thread().plug.requests);
+    while let Some((queue, _)) = requests.first() {
+        let queue = queue.clone();
+        let (batch, rest) : (Vec<_>, Vec<_>) = requests.into_iter().partition(|(other, _)| Arc::ptr_eq(other, &queue));
+        queue.insert(batch.into_iter().map(|(_, request)| request));
+        queue.dispatch(current_id());
+        requests = rest;
+    }
+}
+
+#[allow(non_upper_case_globals)]
+static completions : [SpinLock<Vec<Arc<BlockRequest>>>; MAX_CPUS] = [const { SpinLock::new(Vec::new()) }; MAX_CPUS];
+
+/// Hands `request`, completed on another processor, to the processor `cpu`
+/// which submitted it
+pub(crate) fn defer_completion(cpu:usize, request:Arc<BlockRequest>) {
+    completions[cpu].lock().push(request);
+}
+
+/// Finishes the requests completed elsewhere on behalf of this processor
+///
+/// Called on the way into the block layer, and before waiting for a request.
+pub(crate) fn run_completions() {
+    let done = core::mem::take(&mut *completions[current_id()].lock());
+    for request in done {
+        request.finish();
+    }
+}
+
+/// Consecutive requests of a kind, going out as one
+struct Batch {
+    op     : BlockOp,
+    sector : u64,
+    count  : u64,
+    parts  : Vec<Arc<BlockRequest>>,
+}
+
+impl Batch {
+    /// Appends `request`, if it follows the batch, fits, and the frames
+    /// meet at a page boundary, so that the batch keeps a single offset
+    fn append(&mut self, request:&Arc<BlockRequest>, max:u64) -> bool {
+        let last = self.parts.last().unwrap();
+        let fits = self.count + request.sectors() <= max;
+        let follows = self.op == request.op && self.sector + self.count == request.sector;
+        if !fits || !follows || !last.ends_whole() || request.offset() != 0 {
+            return false;
+        }
+        self.count += request.sectors();
+        self.parts.push(request.clone());
+        true
+    }
+
+    /// Turns the batch into a single request, which completes every part
+    fn into_request(self) -> Arc<BlockRequest> {
+        if self.parts.len() == 1 {
+            return self.parts.into_iter().next().unwrap();
+        }
+        let pages = self.parts.iter().flat_map(|part| part.pages.iter().copied()).collect();
+        let request = BlockRequest::with_offset(self.op, self.sector, pages, self.parts[0].offset(), self.count);
+        let parts = self.parts;
+        request.set_end_io(Box::new(move |_, result| {
+            for part in parts {
+                part.complete(result);
+            }
+        }));
+        request
+    }
+}
+
+/// The multi-queue front of a disk
+///
+/// Each processor has its own software queue, where the requests it
+/// submits wait to be dispatched with no lock shared with the other
+/// processors. Dispatching drains the queue in sector order, merges the
+/// consecutive requests into large ones, and hands them to the hardware
+/// queue of the processor. The requests are completed on the processor
+/// which submitted them: a driver completing one elsewhere defers it.
+///
+/// This is the `BlockDevice` registered for every driver, so that all of
+/// them get batching and merging for free.
+pub(crate) struct BlockQueue {
+    driver   : Arc<dyn BlockDriver>,
+    this     : Weak<BlockQueue>,
+    software : [SpinLock<Vec<Arc<BlockRequest>>>; MAX_CPUS],
+}
+
+impl BlockQueue {
+    pub(crate) fn new(driver:Arc<dyn BlockDriver>) -> Arc<Self> {
+        Arc::new_cyclic(|this| BlockQueue {
+            driver,
+            this     : this.clone(),
+            software : [const { SpinLock::new(Vec::new()) }; MAX_CPUS],
+        })
+    }
+
+    /// Returns the hardware queue serving the processor `cpu`
+    fn hardware_queue(&self, cpu:usize) -> usize {
+        cpu % core::cmp::max(self.driver.queue_count(), 1)
+    }
+
+    /// Adds `requests` to the software queue of the current processor
+    fn insert(&self, requests:impl Iterator<Item = Arc<BlockRequest>>) {
+        self.software[current_id()].lock().extend(requests);
+    }
+
+    /// Sends the software queue of the processor `cpu` to its hardware queue
+    fn dispatch(&self, cpu:usize) {
+        let mut requests = core::mem::take(&mut *self.software[cpu].lock());
+        if requests.is_empty() {
+            return;
+        }
+        requests.sort_by_key(|request| request.sector);
+        let max = self.driver.max_sectors();
+        let mut batches : Vec<Batch> = Vec::new();
+        for request in requests {
+            if let Some(batch) = batches.last_mut() {
+                if batch.append(&request, max) {
+                    continue;
+                }
+            }
+            batches.push(Batch {
+                op     : request.op,
+                sector : request.sector,
+                count  : request.sectors(),
+                parts  : Vec::from([request]),
+            });
+        }
+        let queue = self.hardware_queue(cpu);
+        for batch in batches {
+            self.driver.queue_request(queue, batch.into_request());
+        }
+    }
+}
+
+impl BlockDevice for BlockQueue {
+    fn sector_count(&self) -> u64 {
+        self.driver.sector_count()
+    }
+
+    /// Queues `request` on the current processor, holding it back if the
+    /// thread is plugged
+    fn submit(&self, request:Arc<BlockRequest>) {
+        run_completions();
+        let cpu = current_id();
+        request.set_cpu(cpu);
+        let plug = &mut current_thread().plug;
+        if plug.depth > 0 {
+            if let Some(this) = self.this.upgrade() {
+                plug.requests.push((this, request));
+                return;
+            }
+        }
+        self.insert(core::iter::once(request));
+        self.dispatch(cpu);
+    }
+
+    fn direct_access(&self, sector:u64, count:u64) -> Option<&'static [u8]> {
+        self.driver.direct_access(sector, count)
+    }
+}
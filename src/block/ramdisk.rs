@@ -0,0 +1,94 @@
+use crate::block::*;
+use crate::mm::*;
+use crate::syscall::errno::*;
+
+use alloc::sync::Arc;
+use core::ptr;
+
+// the boot information block filled by the loader (see 'loader.asm')
+const BOOT_INFO           : usize = 0x1F000;
+const BOOT_INFO_SIGNATURE : u32 = 0x544F4F42;   // 'BOOT'
+
+/// The boot information block
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct BootInfo {
+    signature       : u32,
+    disk_base       : u32,
+    disk_sectors    : u32,
+    partition_start : u32,
+}
+
+/// A disk image sitting in physical memory
+///
+/// The loader reads the boot disk at a fixed address and leaves it there,
+/// below the kernel image, in memory that the frame allocator never hands
+/// out. Transfers copy from and to that memory through the direct map, and
+/// `direct_access()` exposes it to readers that can use it in place.
+pub(crate) struct RamDisk {
+    base    : usize,
+    sectors : u64,
+}
+
+impl RamDisk {
+    /// Returns the address of `sector` in the direct map
+    fn sector_addr(&self, sector:u64) -> usize {
+        phys_to_virt(self.base) + sector as usize * SECTOR_SIZE
+    }
+}
+
+impl BlockDriver for RamDisk {
+    fn sector_count(&self) -> u64 {
+        self.sectors
+    }
+
+    fn queue_request(&self, _queue:usize, request:Arc<BlockRequest>) {
+        if request.sector + request.sectors() > self.sectors {
+            request.complete(Err(EIO));
+            return;
+        }
+        let mut disk = self.sector_addr(request.sector) as *mut u8;
+        for (paddr, size) in request.segments() {
+            let memory = phys_to_virt(paddr) as *mut u8;
+            unsafe {
+                match request.op {
+                    BlockOp::Read  => ptr::copy_nonoverlapping(disk, memory, size),
+                    BlockOp::Write => ptr::copy_nonoverlapping(memory, disk, size),
+                }
+                disk = disk.add(size);
+            }
+        }
+        request.complete(Ok(()));
+    }
+
+    fn direct_access(&self, sector:u64, count:u64) -> Option<&'static [u8]> {
+        if sector + count > self.sectors {
+            return None;
+        }
+        Some(unsafe { core::slice::from_raw_parts(self.sector_addr(sector) as *const u8, count as usize * SECTOR_SIZE) })
+    }
+}
+
+/// Registers the disk image left by the loader as 'ram0', and its kernel
+/// partition as 'ram0p1'
+///
+/// The loader reads the kernel image after the disk, over its last
+/// sectors, so the disk is cut short where the kernel begins.
+pub(crate) fn init() {
+    let info = unsafe { ptr::read(phys_to_virt(BOOT_INFO) as *const BootInfo) };
+    if info.signature != BOOT_INFO_SIGNATURE {
+        return;
+    }
+    let base = info.disk_base as usize;
+    let end = core::cmp::min(base + info.disk_sectors as usize * SECTOR_SIZE, kernel_start_phys());
+    if end <= base || end > DIRECT_MAP_SIZE {
+        return;
+    }
+    let sectors = ((end - base) / SECTOR_SIZE) as u64;
+    let _ = register_block_device("ram0", Arc::new(RamDisk { base, sectors }));
+    let start = info.partition_start as u64;
+    if start < sectors {
+        let partition = RamDisk { base : base + start as usize * SECTOR_SIZE, sectors : sectors - start };
+        let _ = register_block_device("ram0p1", Arc::new(partition));
+    }
+}
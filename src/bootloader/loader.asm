@@ -299,6 +299,12 @@ protected_mode_start:
     mov ss, ax
     mov esp, 0x7c00
 
+boot_info:                                      ; tell the kernel where the disk image is (see 'block/ramdisk.rs')
+    mov dword [0x1F000], 0x544F4F42             ; 'BOOT', the signature of the boot information block
+    mov dword [0x1F004], 0x1000000              ; the physical address of the disk image, where it was read above
+    mov dword [0x1F008], 2048*100+62            ; the number of sectors read
+    mov dword [0x1F00C], 63                     ; the first sector of the kernel partition (see the Makefile)
+
 paging:                                         ; finds a free memory area and initializes the paging structure which is used to translate from virtual address to pysical address (we will use 1 GB pages)
     cld
     mov edi, 0x70000                            ; addresses from 0x80000 to 0x90000 might be used by the BIOS, so use addresses between 0x70000 and 0x80000
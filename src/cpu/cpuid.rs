@@ -0,0 +1,85 @@
+use core::arch::x86_64::__cpuid_count;
+
+/// The optional processor features the kernel is aware of
+#[derive(Clone, Copy)]
+pub(crate) struct CpuFeatures {
+    pub(crate) pcid          : bool,
+    pub(crate) invpcid       : bool,
+    pub(crate) fsgsbase      : bool,
+    pub(crate) smep          : bool,
+    pub(crate) smap          : bool,
+    pub(crate) erms          : bool,
+    pub(crate) fsrm          : bool,
+    pub(crate) nx            : bool,
+    pub(crate) rdtscp        : bool,
+    pub(crate) rdpid         : bool,
+    pub(crate) invariant_tsc : bool,
+}
+
+impl CpuFeatures {
+    const NONE : CpuFeatures = CpuFeatures {
+        pcid          : false,
+        invpcid       : false,
+        fsgsbase      : false,
+        smep          : false,
+        smap          : false,
+        erms          : false,
+        fsrm          : false,
+        nx            : false,
+        rdtscp        : false,
+        rdpid         : false,
+        invariant_tsc : false,
+    };
+}
+
+#[allow(non_upper_case_globals)]
+static mut cpu_features : CpuFeatures = CpuFeatures::NONE;
+
+/// Executes CPUID for the given `leaf` and `subleaf`, returning EAX, EBX, ECX and EDX
+pub(crate) fn cpuid(leaf:u32, subleaf:u32) -> (u32, u32, u32, u32) {
+    let result = unsafe { __cpuid_count(leaf, subleaf) };
+    (result.eax, result.ebx, result.ecx, result.edx)
+}
+
+/// Queries CPUID and caches the supported features
+///
+/// Leaves which are not implemented by the processor are treated as if
+/// they reported no feature at all.
+pub(crate) fn detect_features() {
+    let mut features = CpuFeatures::NONE;
+
+    let (max_leaf, _, _, _) = cpuid(0, 0);
+    let (_, _, ecx, _) = cpuid(1, 0);
+    features.pcid = ecx & (1<<17) != 0;
+
+    if max_leaf >= 7 {
+        let (_, ebx, ecx, edx) = cpuid(7, 0);
+        features.fsgsbase = ebx & (1<<0) != 0;
+        features.smep = ebx & (1<<7) != 0;
+        features.erms = ebx & (1<<9) != 0;
+        features.invpcid = ebx & (1<<10) != 0;
+        features.smap = ebx & (1<<20) != 0;
+        features.rdpid = ecx & (1<<22) != 0;
+        features.fsrm = edx & (1<<4) != 0;
+    }
+
+    let (max_extended_leaf, _, _, _) = cpuid(0x80000000, 0);
+    if max_extended_leaf >= 0x80000001 {
+        let (_, _, _, edx) = cpuid(0x80000001, 0);
+        features.nx = edx & (1<<20) != 0;
+        features.rdtscp = edx & (1<<27) != 0;
+    }
+    if max_extended_leaf >= 0x80000007 {
+        let (_, _, _, edx) = cpuid(0x80000007, 0);
+        features.invariant_tsc = edx & (1<<8) != 0;
+    }
+
+    unsafe {
+        cpu_features = features;
+    }
+}
+
+/// Returns the features detected by `detect_features()`
+pub(crate) fn features() -> CpuFeatures {
+    unsafe { cpu_features }
+}
@@ -0,0 +1,106 @@
+use crate::cpu::*;
+use crate::mm::fault::*;
+use crate::task;
+use crate::tty::*;
+
+// exception vectors
+pub(crate) const VECTOR_DOUBLE_FAULT : u64 = 8;
+pub(crate) const VECTOR_PAGE_FAULT   : u64 = 14;
+
+// the size of the stack of the double fault handler
+const DOUBLE_FAULT_STACK_SIZE : usize = 16384;
+
+#[repr(C, align(16))]
+struct DoubleFaultStack([u8; DOUBLE_FAULT_STACK_SIZE]);
+
+#[allow(non_upper_case_globals)]
+static mut double_fault_stack : DoubleFaultStack = DoubleFaultStack([0; DOUBLE_FAULT_STACK_SIZE]);
+
+/// Returns the address right above the stack of the double fault handler
+pub(crate) fn double_fault_stack_top() -> usize {
+    &raw const double_fault_stack as usize + DOUBLE_FAULT_STACK_SIZE
+}
+
+/// The state saved by `exception_common` (see 'kernel.asm')
+#[repr(C)]
+pub(crate) struct ExceptionFrame {
+    pub(crate) r15        : u64,
+    pub(crate) r14        : u64,
+    pub(crate) r13        : u64,
+    pub(crate) r12        : u64,
+    pub(crate) r11        : u64,
+    pub(crate) r10        : u64,
+    pub(crate) r9         : u64,
+    pub(crate) r8         : u64,
+    pub(crate) rbp        : u64,
+    pub(crate) rdi        : u64,
+    pub(crate) rsi        : u64,
+    pub(crate) rdx        : u64,
+    pub(crate) rcx        : u64,
+    pub(crate) rbx        : u64,
+    pub(crate) rax        : u64,
+    pub(crate) vector     : u64,
+    pub(crate) error_code : u64,
+    pub(crate) rip        : u64,
+    pub(crate) cs         : u64,
+    pub(crate) rflags     : u64,
+    pub(crate) rsp        : u64,
+    pub(crate) ss         : u64,
+}
+
+/// An entry of the exception table: a fault at `insn` resumes at `fixup`
+///
+/// Entries are emitted in the '.ex_table' section next to the instructions
+/// allowed to fault, namely the accesses to user memory (see 'uaccess.rs').
+#[repr(C)]
+struct ExceptionTableEntry {
+    insn  : u64,
+    fixup : u64,
+}
+
+extern "C" {
+    // the bounds of the exception table (see 'link.ld')
+    static ex_table_start : ExceptionTableEntry;
+    static ex_table_end   : ExceptionTableEntry;
+}
+
+/// Returns the fixup registered for the instruction at `rip`, if any
+pub(crate) fn search_exception_table(rip:u64) -> Option<u64> {
+    let table = unsafe {
+        let start = &raw const ex_table_start;
+        let count = (&raw const ex_table_end).offset_from(start) as usize;
+        core::slice::from_raw_parts(start, count)
+    };
+    table.iter().find(|entry| entry.insn == rip).map(|entry| entry.fixup)
+}
+
+/// Handles an exception, called by `exception_common`
+///
+/// Page faults on user memory are resolved when possible, whether they
+/// come from user mode or from a kernel access. Otherwise kernel faults
+/// on user memory resume at the fixup of the faulting instruction. A
+/// user thread causing an exception is terminated, since there are no
+/// signals, any other kernel exception is fatal. A kernel stack overflow
+/// faults on the guard page below the stack, where the page fault cannot
+/// be delivered, and ends up as a double fault.
+#[no_mangle]
+extern "C" fn exception_handler(frame:&mut ExceptionFrame) {
+    let from_user = frame.cs & 3 != 0;
+    if frame.vector == VECTOR_DOUBLE_FAULT && task::is_stack_overflow(read_cr2() as usize) {
+        panic!("kernel stack overflow");
+    }
+    if frame.vector == VECTOR_PAGE_FAULT && handle_page_fault(read_cr2() as usize, frame.error_code) {
+        return;
+    }
+    if frame.vector == VECTOR_PAGE_FAULT && !from_user {
+        if let Some(fixup) = search_exception_table(frame.rip) {
+            frame.rip = fixup;
+            return;
+        }
+    }
+    if from_user {
+        print("Thread terminated by an exception");
+        task::exit();
+    }
+    panic!("unhandled kernel exception");
+}
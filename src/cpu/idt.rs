@@ -0,0 +1,88 @@
+use crate::cpu::*;
+use crate::cpu::exception::*;
+
+use core::arch::asm;
+use core::mem::size_of;
+
+// the number of exception vectors, the first ones of the table
+pub(crate) const EXCEPTION_COUNT : usize = 32;
+
+// the kernel code segment (see 'kernel.asm')
+const KERNEL_CODE_SELECTOR : u16 = 0x08;
+
+// the Interrupt Stack Table entry of the double fault handler
+const DOUBLE_FAULT_IST : u8 = 1;
+
+// present, DPL 0, 64-bit interrupt gate: interrupts are disabled on entry
+const GATE_INTERRUPT : u8 = 0x8E;
+
+/// A gate descriptor of the Interrupt Descriptor Table
+#[repr(C, packed)]
+#[derive(Clone, Copy)]
+struct IdtEntry {
+    offset_low  : u16,
+    selector    : u16,
+    ist         : u8,
+    attributes  : u8,
+    offset_mid  : u16,
+    offset_high : u32,
+    reserved    : u32,
+}
+
+impl IdtEntry {
+    const MISSING : IdtEntry = IdtEntry {
+        offset_low  : 0,
+        selector    : 0,
+        ist         : 0,
+        attributes  : 0,
+        offset_mid  : 0,
+        offset_high : 0,
+        reserved    : 0,
+    };
+
+    fn new(handler:u64, attributes:u8) -> Self {
+        IdtEntry {
+            offset_low  : handler as u16,
+            selector    : KERNEL_CODE_SELECTOR,
+            ist         : 0,
+            attributes,
+            offset_mid  : (handler >> 16) as u16,
+            offset_high : (handler >> 32) as u32,
+            reserved    : 0,
+        }
+    }
+}
+
+#[repr(C, packed)]
+struct IdtPointer {
+    limit : u16,
+    base  : u64,
+}
+
+#[allow(non_upper_case_globals)]
+static mut idt : [IdtEntry; 256] = [IdtEntry::MISSING; 256];
+
+extern "C" {
+    // the entry points of the exceptions (see 'kernel.asm')
+    static exception_stubs : [u64; EXCEPTION_COUNT];
+}
+
+/// Installs the exception handlers and loads the table
+///
+/// The vectors above the exceptions are left empty, there is no interrupt
+/// handling yet. Double faults switch to a stack of their own, since the
+/// one in use when they happen may be the reason of the fault.
+pub(crate) fn init() {
+    unsafe {
+        for vector in 0..EXCEPTION_COUNT {
+            idt[vector] = IdtEntry::new(exception_stubs[vector], GATE_INTERRUPT);
+        }
+        idt[VECTOR_DOUBLE_FAULT as usize].ist = DOUBLE_FAULT_IST;
+        set_interrupt_stack(DOUBLE_FAULT_IST as usize, double_fault_stack_top());
+        let pointer = IdtPointer {
+            limit : (size_of::<[IdtEntry; 256]>() - 1) as u16,
+            base  : &raw const idt as u64,
+        };
+        asm!("lidt [{}]", in(reg) &pointer, options(readonly, nostack, preserves_flags));
+    }
+}
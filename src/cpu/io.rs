@@ -0,0 +1,33 @@
+use core::arch::asm;
+
+/// Reads a Byte from the I/O `port`
+pub(crate) fn inb(port:u16) -> u8 {
+    let value : u8;
+    unsafe {
+        asm!("in al, dx", in("dx") port, out("al") value, options(nomem, nostack, preserves_flags));
+    }
+    value
+}
+
+/// Writes the Byte `value` to the I/O `port`
+pub(crate) fn outb(port:u16, value:u8) {
+    unsafe {
+        asm!("out dx, al", in("dx") port, in("al") value, options(nomem, nostack, preserves_flags));
+    }
+}
+
+/// Reads a Word from the I/O `port`
+pub(crate) fn inw(port:u16) -> u16 {
+    let value : u16;
+    unsafe {
+        asm!("in ax, dx", in("dx") port, out("ax") value, options(nomem, nostack, preserves_flags));
+    }
+    value
+}
+
+/// Writes the Word `value` to the I/O `port`
+pub(crate) fn outw(port:u16, value:u16) {
+    unsafe {
+        asm!("out dx, ax", in("dx") port, in("ax") value, options(nomem, nostack, preserves_flags));
+    }
+}
@@ -0,0 +1,44 @@
+pub(crate) mod cpuid;
+pub(crate) mod exception;
+pub(crate) mod idt;
+pub(crate) mod io;
+pub(crate) mod percpu;
+pub(crate) mod registers;
+
+pub(crate) use cpuid::*;
+pub(crate) use io::*;
+pub(crate) use percpu::*;
+pub(crate) use registers::*;
+
+/// Detects the processor features and enables the optional ones the kernel uses
+pub(crate) fn init() {
+    init_percpu(0);
+    idt::init();
+    detect_features();
+    let features = features();
+    // faults on read-only user pages must reach the kernel too, for copy_to_user
+    write_cr0(read_cr0() | CR0_WP);
+    if features.smep {
+        write_cr4(read_cr4() | CR4_SMEP);
+    }
+    if features.smap {
+        // user memory is only reachable between user_access_begin() and user_access_end()
+        enable_smap();
+    }
+    if features.pcid {
+        // CR3 must not carry a PCID yet, which is the case for the loader tables
+        write_cr4(read_cr4() | CR4_PCIDE);
+    }
+    if features.nx {
+        // lets user mappings which are not executable be marked so (see 'space.rs')
+        write_msr(MSR_EFER, read_msr(MSR_EFER) | EFER_NXE);
+    }
+    if features.fsgsbase {
+        // lets the context switch move the user FS and GS bases without going through MSRs
+        enable_fsgsbase();
+    }
+    if features.rdtscp || features.rdpid {
+        // RDTSCP and RDPID report TSC_AUX, which holds the node (always 0) and the processor index
+        write_msr(MSR_TSC_AUX, current_id() as u64);
+    }
+}
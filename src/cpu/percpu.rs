@@ -0,0 +1,73 @@
+use crate::cpu::registers::*;
+
+use core::arch::asm;
+
+// the maximum number of processors the kernel can drive
+pub(crate) const MAX_CPUS : usize = 8;
+
+/// The data private to each processor
+///
+/// While in kernel mode GS points to the area of the executing processor.
+/// The layout must match the offsets used in 'kernel.asm'.
+#[repr(C)]
+pub(crate) struct PerCpu {
+    pub(crate) this         : usize,    // GS:0
+    pub(crate) kernel_stack : usize,    // GS:8, top of the stack of the running thread
+    pub(crate) user_stack   : usize,    // GS:16, scratch slot for the system call entry
+    pub(crate) id           : usize,    // GS:24
+}
+
+#[allow(non_upper_case_globals)]
+static mut percpu_areas : [PerCpu; MAX_CPUS] = [const { PerCpu { this : 0, kernel_stack : 0, user_stack : 0, id : 0 } }; MAX_CPUS];
+
+extern "C" {
+    // the Task State Segment (see 'kernel.asm')
+    static mut TSS : [u8; 104];
+}
+
+/// Points GS to the per-CPU area of the processor `id`
+///
+/// The user GS base is kept in KERNEL_GS_BASE and exchanged by SWAPGS on
+/// every transition between user and kernel mode.
+pub(crate) fn init_percpu(id:usize) {
+    unsafe {
+        let area = &mut percpu_areas[id];
+        area.this = area as *mut PerCpu as usize;
+        area.id = id;
+        write_msr(MSR_GS_BASE, area.this as u64);
+        write_msr(MSR_KERNEL_GS_BASE, 0);
+    }
+}
+
+/// Returns the per-CPU area of the executing processor
+pub(crate) fn percpu() -> &'static mut PerCpu {
+    let this : usize;
+    unsafe {
+        asm!("mov {}, gs:[0]", out(reg) this, options(nostack, preserves_flags, readonly));
+        &mut *(this as *mut PerCpu)
+    }
+}
+
+/// Returns the index of the executing processor
+pub(crate) fn current_id() -> usize {
+    percpu().id
+}
+
+/// Sets the stack used when entering the kernel from user mode, both by
+/// system calls and by interrupts
+pub(crate) fn set_kernel_stack(top:usize) {
+    percpu().kernel_stack = top;
+    unsafe {
+        // RSP0 is at offset 4 of the TSS
+        core::ptr::write_unaligned((&raw mut TSS as *mut u8).add(4) as *mut u64, top as u64);
+    }
+}
+
+/// Sets the stack switched to by the interrupts using the entry `index`
+/// (1 to 7) of the Interrupt Stack Table
+pub(crate) fn set_interrupt_stack(index:usize, top:usize) {
+    unsafe {
+        // IST1 is at offset 36 of the TSS
+        core::ptr::write_unaligned((&raw mut TSS as *mut u8).add(36 + 8 * (index - 1)) as *mut u64, top as u64);
+    }
+}
@@ -0,0 +1,215 @@
+use core::arch::asm;
+
+// CR0 bits
+pub(crate) const CR0_WP : u64 = 1 << 16;
+
+// CR4 bits
+pub(crate) const CR4_PCIDE    : u64 = 1 << 17;
+pub(crate) const CR4_FSGSBASE : u64 = 1 << 16;
+pub(crate) const CR4_SMEP     : u64 = 1 << 20;
+pub(crate) const CR4_SMAP     : u64 = 1 << 21;
+
+// Model Specific Registers
+pub(crate) const MSR_EFER           : u32 = 0xC0000080;
+pub(crate) const MSR_STAR           : u32 = 0xC0000081;
+pub(crate) const MSR_LSTAR          : u32 = 0xC0000082;
+pub(crate) const MSR_SFMASK         : u32 = 0xC0000084;
+pub(crate) const MSR_FS_BASE        : u32 = 0xC0000100;
+pub(crate) const MSR_GS_BASE        : u32 = 0xC0000101;
+pub(crate) const MSR_KERNEL_GS_BASE : u32 = 0xC0000102;
+pub(crate) const MSR_TSC_AUX        : u32 = 0xC0000103;
+
+// EFER bits
+pub(crate) const EFER_SCE : u64 = 1 << 0;
+pub(crate) const EFER_NXE : u64 = 1 << 11;
+
+// RFLAGS bits
+pub(crate) const RFLAGS_IF : u64 = 1 << 9;
+pub(crate) const RFLAGS_DF : u64 = 1 << 10;
+pub(crate) const RFLAGS_AC : u64 = 1 << 18;
+
+// CR3 bits
+pub(crate) const CR3_NOFLUSH : u64 = 1 << 63;
+
+/// Returns the content of CR0
+pub(crate) fn read_cr0() -> u64 {
+    let value : u64;
+    unsafe {
+        asm!("mov {}, cr0", out(reg) value, options(nomem, nostack, preserves_flags));
+    }
+    value
+}
+
+/// Loads `value` into CR0
+pub(crate) fn write_cr0(value:u64) {
+    unsafe {
+        asm!("mov cr0, {}", in(reg) value, options(nostack, preserves_flags));
+    }
+}
+
+/// Returns the address whose access caused the last page fault
+pub(crate) fn read_cr2() -> u64 {
+    let value : u64;
+    unsafe {
+        asm!("mov {}, cr2", out(reg) value, options(nomem, nostack, preserves_flags));
+    }
+    value
+}
+
+/// Loads `value` into CR3, switching the active page tables
+pub(crate) fn write_cr3(value:u64) {
+    unsafe {
+        asm!("mov cr3, {}", in(reg) value, options(nostack, preserves_flags));
+    }
+}
+
+/// Returns the content of CR4
+pub(crate) fn read_cr4() -> u64 {
+    let value : u64;
+    unsafe {
+        asm!("mov {}, cr4", out(reg) value, options(nomem, nostack, preserves_flags));
+    }
+    value
+}
+
+/// Loads `value` into CR4
+pub(crate) fn write_cr4(value:u64) {
+    unsafe {
+        asm!("mov cr4, {}", in(reg) value, options(nostack, preserves_flags));
+    }
+}
+
+/// Returns the content of the Model Specific Register `msr`
+pub(crate) fn read_msr(msr:u32) -> u64 {
+    let (low, high) : (u32, u32);
+    unsafe {
+        asm!("rdmsr", in("ecx") msr, out("eax") low, out("edx") high, options(nomem, nostack, preserves_flags));
+    }
+    ((high as u64) << 32) | low as u64
+}
+
+/// Writes `value` into the Model Specific Register `msr`
+pub(crate) fn write_msr(msr:u32, value:u64) {
+    unsafe {
+        asm!("wrmsr", in("ecx") msr, in("eax") value as u32, in("edx") (value >> 32) as u32, options(nostack, preserves_flags));
+    }
+}
+
+/// Invalidates the TLB entry of the page containing `addr`, for the current PCID
+pub(crate) fn invlpg(addr:usize) {
+    unsafe {
+        asm!("invlpg [{}]", in(reg) addr, options(nostack, preserves_flags));
+    }
+}
+
+/// Returns the Time Stamp Counter, after all the previous instructions completed
+pub(crate) fn rdtsc_ordered() -> u64 {
+    let (low, high) : (u32, u32);
+    unsafe {
+        asm!("lfence", "rdtsc", out("eax") low, out("edx") high, options(nomem, nostack, preserves_flags));
+    }
+    ((high as u64) << 32) | low as u64
+}
+
+// whether the FS/GS base instructions are enabled, see 'enable_fsgsbase()'
+#[allow(non_upper_case_globals)]
+static mut fsgsbase : bool = false;
+
+/// Enables RDFSBASE, WRFSBASE, RDGSBASE and WRGSBASE, in both kernel and user mode
+///
+/// The processor must support them.
+pub(crate) fn enable_fsgsbase() {
+    write_cr4(read_cr4() | CR4_FSGSBASE);
+    unsafe {
+        fsgsbase = true;
+    }
+}
+
+/// Returns the FS base
+pub(crate) fn read_fs_base() -> u64 {
+    if unsafe { fsgsbase } {
+        let value : u64;
+        unsafe {
+            asm!("rdfsbase {}", out(reg) value, options(nomem, nostack, preserves_flags));
+        }
+        value
+    } else {
+        read_msr(MSR_FS_BASE)
+    }
+}
+
+/// Sets the FS base
+pub(crate) fn write_fs_base(value:u64) {
+    if unsafe { fsgsbase } {
+        unsafe {
+            asm!("wrfsbase {}", in(reg) value, options(nostack, preserves_flags));
+        }
+    } else {
+        write_msr(MSR_FS_BASE, value);
+    }
+}
+
+/// Returns the GS base of user mode
+///
+/// While in kernel mode GS points to the per-CPU area and the user base is
+/// parked in KERNEL_GS_BASE, from where SWAPGS brings it back. Interrupts
+/// must be disabled.
+pub(crate) fn read_user_gs_base() -> u64 {
+    if unsafe { fsgsbase } {
+        let value : u64;
+        unsafe {
+            asm!("swapgs", "rdgsbase {}", "swapgs", out(reg) value, options(nomem, nostack, preserves_flags));
+        }
+        value
+    } else {
+        read_msr(MSR_KERNEL_GS_BASE)
+    }
+}
+
+/// Sets the GS base of user mode
+///
+/// Interrupts must be disabled.
+pub(crate) fn write_user_gs_base(value:u64) {
+    if unsafe { fsgsbase } {
+        unsafe {
+            asm!("swapgs", "wrgsbase {}", "swapgs", in(reg) value, options(nostack, preserves_flags));
+        }
+    } else {
+        write_msr(MSR_KERNEL_GS_BASE, value);
+    }
+}
+
+// whether Supervisor Mode Access Prevention is enabled, see 'enable_smap()'
+#[allow(non_upper_case_globals)]
+static mut smap : bool = false;
+
+/// Prevents the kernel from accessing user pages, except between
+/// `user_access_begin()` and `user_access_end()`
+///
+/// The processor must support it.
+pub(crate) fn enable_smap() {
+    write_cr4(read_cr4() | CR4_SMAP);
+    unsafe {
+        smap = true;
+    }
+}
+
+/// Allows the kernel to access user pages
+#[inline(always)]
+pub(crate) fn user_access_begin() {
+    if unsafe { smap } {
+        unsafe {
+            asm!("stac", options(nomem, nostack));
+        }
+    }
+}
+
+/// Forbids the kernel to access user pages again
+#[inline(always)]
+pub(crate) fn user_access_end() {
+    if unsafe { smap } {
+        unsafe {
+            asm!("clac", options(nomem, nostack));
+        }
+    }
+}
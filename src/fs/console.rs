@@ -0,0 +1,18 @@
+use crate::fs::file::*;
+use crate::syscall::errno::*;
+use crate::tty;
+
+/// The text mode screen, as a write-only file
+pub(crate) struct Console;
+
+impl FileOps for Console {
+    fn read(&self, _file:&File, _buf:&mut [u8], _offset:u64) -> KResult<usize> {
+        // there is no keyboard driver, reads always find the end of the input
+        Ok(0)
+    }
+
+    fn write(&self, _file:&File, buf:&[u8], _offset:u64) -> KResult<usize> {
+        tty::write(buf);
+        Ok(buf.len())
+    }
+}
@@ -0,0 +1,313 @@
+use crate::fs::file::*;
+use crate::mm::uaccess::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+use crate::time;
+
+use alloc::collections::{BTreeMap, VecDeque};
+use alloc::sync::{Arc, Weak};
+use alloc::vec::Vec;
+use core::mem::size_of;
+use core::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering};
+
+// events, the same values as the poll ones
+pub(crate) const EPOLLIN  : u32 = POLLIN;
+pub(crate) const EPOLLERR : u32 = POLLERR;
+pub(crate) const EPOLLHUP : u32 = POLLHUP;
+
+// modes
+pub(crate) const EPOLLONESHOT : u32 = 1 << 30;
+pub(crate) const EPOLLET      : u32 = 1 << 31;
+
+// the event bits of an interest mask
+const EPOLL_EVENTS : u32 = !(EPOLLONESHOT | EPOLLET);
+
+// epoll_ctl operations
+pub(crate) const EPOLL_CTL_ADD : usize = 1;
+pub(crate) const EPOLL_CTL_DEL : usize = 2;
+pub(crate) const EPOLL_CTL_MOD : usize = 3;
+
+// the maximum number of events returned by a single wait
+const MAX_EVENTS : usize = 1024;
+
+/// An event as exchanged with user space
+#[repr(C, packed)]
+#[derive(Clone, Copy)]
+pub(crate) struct EpollEvent {
+    pub(crate) events : u32,
+    pub(crate) data   : u64,
+}
+
+/// A file registered in an epoll instance
+///
+/// The item is registered as a callback in the wait queue of the file, and
+/// queues itself on the ready list when the file reports events it is
+/// interested in. It holds no reference to the file: as in Linux, the
+/// registration goes away with the last close of the file.
+struct EpollItem {
+    fd       : usize,
+    file     : Weak<File>,
+    interest : AtomicU32,
+    data     : AtomicU64,
+    queued   : AtomicBool,
+    epoll    : Weak<Epoll>,
+}
+
+impl WakeCallback for EpollItem {
+    fn wake(self:Arc<Self>, events:u32) {
+        let interest = self.interest.load(Ordering::Relaxed) & EPOLL_EVENTS;
+        if interest == 0 || events & (interest | EPOLLERR | EPOLLHUP) == 0 {
+            return;
+        }
+        if let Some(epoll) = self.epoll.upgrade() {
+            epoll.enqueue(self);
+        }
+    }
+}
+
+impl FileWatcher for EpollItem {
+    fn file_released(&self, file:&File) {
+        if let Some(epoll) = self.epoll.upgrade() {
+            epoll.forget(self, file);
+        }
+    }
+}
+
+impl EpollItem {
+    fn callback(self:&Arc<Self>) -> Arc<dyn WakeCallback> {
+        self.clone()
+    }
+
+    fn watcher(self:&Arc<Self>) -> Arc<dyn FileWatcher> {
+        self.clone()
+    }
+
+    /// Returns the events of the file matching the interest, none once the
+    /// file is gone
+    fn ready_events(&self, interest:u32) -> u32 {
+        match self.file.upgrade() {
+            Some(file) => file.poll() & (interest | EPOLLERR | EPOLLHUP),
+            None       => 0,
+        }
+    }
+}
+
+/// A set of files whose readiness is followed through wake up callbacks
+///
+/// Waiting only visits the ready list, so its cost depends on the number of
+/// ready files and not on the number of registered ones.
+pub(crate) struct Epoll {
+    this    : Weak<Epoll>,
+    items   : SpinLock<BTreeMap<usize, Arc<EpollItem>>>,
+    ready   : SpinLock<VecDeque<Arc<EpollItem>>>,
+    waiters : WaitQueue,
+}
+
+impl Epoll {
+    fn new() -> Arc<Epoll> {
+        Arc::new_cyclic(|this| Epoll {
+            this    : this.clone(),
+            items   : SpinLock::new(BTreeMap::new()),
+            ready   : SpinLock::new(VecDeque::new()),
+            waiters : WaitQueue::new(),
+        })
+    }
+
+    /// Appends `item` to the ready list, unless already there
+    fn enqueue(&self, item:Arc<EpollItem>) {
+        if item.queued.swap(true, Ordering::AcqRel) {
+            return;
+        }
+        self.ready.lock().push_back(item);
+        self.waiters.notify(EPOLLIN);
+    }
+
+    /// Queues `item` if its file is ready already
+    fn check(&self, item:&Arc<EpollItem>) {
+        let interest = item.interest.load(Ordering::Relaxed) & EPOLL_EVENTS;
+        if interest != 0 && item.ready_events(interest) != 0 {
+            self.enqueue(item.clone());
+        }
+    }
+
+    fn add(&self, fd:usize, file:&Arc<File>, event:EpollEvent) -> KResult<()> {
+        let mut items = self.items.lock();
+        if items.contains_key(&fd) {
+            return Err(EEXIST);
+        }
+        let item = Arc::new(EpollItem {
+            fd,
+            file     : Arc::downgrade(file),
+            interest : AtomicU32::new(event.events),
+            data     : AtomicU64::new(event.data),
+            queued   : AtomicBool::new(false),
+            epoll    : self.this.clone(),
+        });
+        items.insert(fd, item.clone());
+        drop(items);
+        file.add_watcher(item.watcher());
+        if let Some(queue) = file.ops.wait_queue(file) {
+            queue.add_callback(item.callback());
+        }
+        self.check(&item);
+        Ok(())
+    }
+
+    fn modify(&self, fd:usize, event:EpollEvent) -> KResult<()> {
+        let item = self.items.lock().get(&fd).cloned().ok_or(ENOENT)?;
+        item.data.store(event.data, Ordering::Relaxed);
+        item.interest.store(event.events, Ordering::Relaxed);
+        self.check(&item);
+        Ok(())
+    }
+
+    fn remove(&self, fd:usize) -> KResult<()> {
+        let item = self.items.lock().remove(&fd).ok_or(ENOENT)?;
+        self.detach(&item);
+        Ok(())
+    }
+
+    /// Stops following the events of the file of `item`
+    fn detach(&self, item:&Arc<EpollItem>) {
+        // an item still on the ready list is dropped when reached
+        item.interest.store(0, Ordering::Relaxed);
+        if let Some(file) = item.file.upgrade() {
+            file.remove_watcher(&item.watcher());
+            if let Some(queue) = file.ops.wait_queue(&file) {
+                queue.remove_callback(&item.callback());
+            }
+        }
+    }
+
+    /// Drops `item`, whose file `file` is going away
+    fn forget(&self, item:&EpollItem, file:&File) {
+        let mut items = self.items.lock();
+        let Some(own) = items.get(&item.fd).filter(|own| core::ptr::eq(&***own, item)).cloned() else {
+            return;
+        };
+        items.remove(&item.fd);
+        drop(items);
+        own.interest.store(0, Ordering::Relaxed);
+        if let Some(queue) = file.ops.wait_queue(file) {
+            queue.remove_callback(&own.callback());
+        }
+    }
+
+    /// Moves up to `max` ready events into `events`
+    ///
+    /// Level-triggered items are queued again as long as their file is
+    /// ready, edge-triggered ones only on the next wake up, one-shot ones
+    /// are disabled until modified.
+    fn collect(&self, events:&mut Vec<EpollEvent>, max:usize) {
+        let mut requeue = Vec::new();
+        let mut ready = self.ready.lock();
+        while events.len() < max {
+            let item = match ready.pop_front() {
+                Some(item) => item,
+                None       => break,
+            };
+            item.queued.store(false, Ordering::Release);
+            let interest = item.interest.load(Ordering::Relaxed);
+            if interest & EPOLL_EVENTS == 0 {
+                continue;
+            }
+            let revents = item.ready_events(interest) & EPOLL_EVENTS;
+            if revents == 0 {
+                continue;
+            }
+            events.push(EpollEvent { events : revents, data : item.data.load(Ordering::Relaxed) });
+            if interest & EPOLLONESHOT != 0 {
+                item.interest.store(interest & !EPOLL_EVENTS, Ordering::Relaxed);
+            } else if interest & EPOLLET == 0 {
+                requeue.push(item);
+            }
+        }
+        for item in requeue {
+            if !item.queued.swap(true, Ordering::AcqRel) {
+                ready.push_back(item);
+            }
+        }
+    }
+
+    fn has_ready(&self) -> bool {
+        !self.ready.lock().is_empty()
+    }
+}
+
+impl FileOps for Epoll {
+    fn poll(&self, _file:&File) -> u32 {
+        if self.has_ready() { EPOLLIN } else { 0 }
+    }
+
+    fn wait_queue(&self, _file:&File) -> Option<&WaitQueue> {
+        Some(&self.waiters)
+    }
+
+    fn release(&self, _file:&File) {
+        let items = core::mem::take(&mut *self.items.lock());
+        for item in items.values() {
+            self.detach(item);
+        }
+        self.ready.lock().clear();
+    }
+}
+
+/// Creates an epoll instance, returning its descriptor
+pub(crate) fn sys_epoll_create1(flags:u32) -> KResult<usize> {
+    if flags & !O_CLOEXEC != 0 {
+        return Err(EINVAL);
+    }
+    install_file(File::new(Epoll::new(), 0))
+}
+
+/// Adds, modifies or removes the registration of `fd` in the instance `epfd`
+pub(crate) fn sys_epoll_ctl(epfd:usize, op:usize, fd:usize, event_addr:usize) -> KResult<usize> {
+    let epoll_file = get_file(epfd)?;
+    let epoll = epoll_file.downcast::<Epoll>().ok_or(EINVAL)?;
+    let file = get_file(fd)?;
+    if Arc::ptr_eq(&epoll_file, &file) {
+        return Err(EINVAL);
+    }
+    match op {
+        EPOLL_CTL_ADD => epoll.add(fd, &file, read_user::<EpollEvent>(event_addr)?)?,
+        EPOLL_CTL_MOD => epoll.modify(fd, read_user::<EpollEvent>(event_addr)?)?,
+        EPOLL_CTL_DEL => epoll.remove(fd)?,
+        _             => return Err(EINVAL),
+    }
+    Ok(0)
+}
+
+/// Waits for events on the instance `epfd`, storing up to `max_events`
+/// of them at `events_addr` and returning their number
+///
+/// A negative `timeout` waits forever, a null one does not wait. Without a
+/// timer interrupt, a bounded wait keeps yielding until the deadline.
+pub(crate) fn sys_epoll_wait(epfd:usize, events_addr:usize, max_events:usize, timeout:i32) -> KResult<usize> {
+    if max_events == 0 || max_events > MAX_EVENTS {
+        return Err(EINVAL);
+    }
+    let file = get_file(epfd)?;
+    let epoll = file.downcast::<Epoll>().ok_or(EINVAL)?;
+    let deadline = time::monotonic_ns() + timeout.max(0) as u64 * 1_000_000;
+
+    let mut events = Vec::new();
+    loop {
+        epoll.collect(&mut events, max_events);
+        if !events.is_empty() || timeout == 0 {
+            break;
+        }
+        if timeout < 0 {
+            epoll.waiters.wait_until(|| epoll.has_ready());
+        } else if time::monotonic_ns() >= deadline {
+            break;
+        } else {
+            yield_now();
+        }
+    }
+
+    for (i, event) in events.iter().enumerate() {
+        write_user(events_addr + i * size_of::<EpollEvent>(), event)?;
+    }
+    Ok(events.len())
+}
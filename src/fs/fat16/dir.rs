@@ -0,0 +1,437 @@
+use crate::fs::fat16::*;
+use crate::syscall::errno::*;
+
+use alloc::format;
+use alloc::string::String;
+use alloc::sync::Arc;
+use alloc::vec;
+use alloc::vec::Vec;
+
+// directory entry attributes
+pub(crate) const ATTR_READ_ONLY : u8 = 0x01;
+pub(crate) const ATTR_VOLUME_ID : u8 = 0x08;
+pub(crate) const ATTR_DIRECTORY : u8 = 0x10;
+pub(crate) const ATTR_ARCHIVE   : u8 = 0x20;
+pub(crate) const ATTR_LONG_NAME : u8 = 0x0F;
+
+// the first Byte of the name of a directory entry
+const ENTRY_END     : u8 = 0x00;
+const ENTRY_DELETED : u8 = 0xE5;
+const ENTRY_E5      : u8 = 0x05;    // a name really starting with 0xE5
+
+// offsets of the fields of a directory entry
+pub(crate) const DIR_NAME       : usize = 0;
+pub(crate) const DIR_ATTR       : usize = 11;
+pub(crate) const DIR_CLUSTER    : usize = 26;
+pub(crate) const DIR_SIZE       : usize = 28;
+pub(crate) const DIR_ENTRY_SIZE : usize = 32;
+
+// offsets of the fields of a long name entry, which holds 13 UTF-16 characters
+const LFN_ORDER    : usize = 0;
+const LFN_CHECKSUM : usize = 13;
+const LFN_LAST     : u8 = 0x40;
+const LFN_CHARS    : usize = 13;
+const LFN_OFFSETS  : [usize; LFN_CHARS] = [1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30];
+
+// the characters allowed in short names besides letters and digits, and
+// the ones never allowed in a name
+const SHORT_NAME_CHARS   : &[u8] = b"$%'-_@~`!(){}^#&";
+const INVALID_NAME_CHARS : &[u8] = b"\"*/:<>?\\|";
+
+/// What a directory records about one of its children
+pub(crate) struct DirEntryInfo {
+    pub(crate) name     : String,
+    pub(crate) short    : [u8; 11],
+    pub(crate) attr     : u8,
+    pub(crate) cluster  : u16,
+    pub(crate) size     : u32,
+    pub(crate) location : u64,
+}
+
+impl DirEntryInfo {
+    /// Returns the short name in the usual 'NAME.EXT' form
+    fn short_name(&self) -> String {
+        let base = core::str::from_utf8(&self.short[..8]).unwrap_or("").trim_end();
+        let ext = core::str::from_utf8(&self.short[8..]).unwrap_or("").trim_end();
+        let mut name = String::from(base);
+        if !ext.is_empty() {
+            name.push('.');
+            name.push_str(ext);
+        }
+        name
+    }
+}
+
+/// A hashed index of the names of a directory
+///
+/// Names are case insensitive, both the long and the short name of an
+/// entry lead to it.
+pub(crate) struct DirIndex {
+    entries : Vec<DirEntryInfo>,
+    buckets : Vec<Vec<u32>>,
+}
+
+/// Hashes `name` ignoring the case, with FNV-1a
+fn name_hash(name:&str) -> usize {
+    let mut hash : u32 = 0x811C_9DC5;
+    for byte in name.bytes() {
+        hash = (hash ^ byte.to_ascii_uppercase() as u32).wrapping_mul(0x0100_0193);
+    }
+    hash as usize
+}
+
+impl DirIndex {
+    fn new(entries:Vec<DirEntryInfo>) -> Self {
+        let buckets = core::cmp::max(16, (2 * entries.len()).next_power_of_two());
+        let mut index = DirIndex { entries, buckets : vec![Vec::new(); buckets] };
+        for i in 0..index.entries.len() {
+            let short = index.entries[i].short_name();
+            index.insert(&short, i);
+            if !index.entries[i].name.eq_ignore_ascii_case(&short) {
+                let name = index.entries[i].name.clone();
+                index.insert(&name, i);
+            }
+        }
+        index
+    }
+
+    fn insert(&mut self, name:&str, entry:usize) {
+        let bucket = name_hash(name) & (self.buckets.len() - 1);
+        self.buckets[bucket].push(entry as u32);
+    }
+
+    /// Returns the entry called `name`
+    pub(crate) fn lookup(&self, name:&str) -> Option<&DirEntryInfo> {
+        let bucket = name_hash(name) & (self.buckets.len() - 1);
+        self.buckets[bucket].iter()
+            .map(|&entry| &self.entries[entry as usize])
+            .find(|entry| entry.name.eq_ignore_ascii_case(name) || entry.short_name().eq_ignore_ascii_case(name))
+    }
+
+    /// Returns the entries in the order they are stored in
+    pub(crate) fn entries(&self) -> &[DirEntryInfo] {
+        &self.entries
+    }
+}
+
+/// Returns the checksum of a short name, recorded by its long name entries
+fn short_name_checksum(short:&[u8]) -> u8 {
+    short.iter().fold(0_u8, |sum, &byte| sum.rotate_right(1).wrapping_add(byte))
+}
+
+/// Collects the long name spread over a sequence of long name entries
+struct LongName {
+    chars    : [u16; 20 * LFN_CHARS],
+    checksum : u8,
+    /// The order of the next entry expected, 0 when no name is pending
+    expected : u8,
+}
+
+impl LongName {
+    fn reset(&mut self) {
+        self.chars[0] = 0xFFFF;
+        self.expected = 0;
+    }
+
+    /// Adds a long name entry, which come from the last part of the name to the first
+    fn push(&mut self, entry:&[u8]) {
+        let order = entry[LFN_ORDER];
+        let part = (order & !LFN_LAST) as usize;
+        if part == 0 || part > 20 {
+            self.reset();
+            return;
+        }
+        if order & LFN_LAST != 0 {
+            self.chars = [0xFFFF; 20 * LFN_CHARS];
+            self.checksum = entry[LFN_CHECKSUM];
+        } else if part as u8 != self.expected || entry[LFN_CHECKSUM] != self.checksum {
+            self.reset();
+            return;
+        }
+        for (i, &offset) in LFN_OFFSETS.iter().enumerate() {
+            self.chars[(part - 1) * LFN_CHARS + i] = u16::from_le_bytes([entry[offset], entry[offset + 1]]);
+        }
+        self.expected = part as u8 - 1;
+    }
+
+    /// Returns the name, if all its entries were seen and belong to `short`
+    fn take(&mut self, short:&[u8]) -> Option<String> {
+        let complete = self.expected == 0 && self.chars[0] != 0xFFFF && self.checksum == short_name_checksum(short);
+        self.chars[0] = 0xFFFF;
+        if !complete {
+            return None;
+        }
+        let length = self.chars.iter().position(|&c| c == 0 || c == 0xFFFF).unwrap_or(self.chars.len());
+        Some(char::decode_utf16(self.chars[..length].iter().copied())
+            .map(|c| c.unwrap_or(char::REPLACEMENT_CHARACTER))
+            .collect())
+    }
+}
+
+fn is_short_name_char(byte:u8) -> bool {
+    byte.is_ascii_uppercase() || byte.is_ascii_digit() || SHORT_NAME_CHARS.contains(&byte)
+}
+
+/// Returns the short name stored for `name`, if it is already a valid
+/// upper case 8.3 name, which needs no long name entries
+fn exact_short_name(name:&str) -> Option<[u8; 11]> {
+    let (base, ext) = match name.rfind('.') {
+        Some(dot) => (&name[..dot], &name[dot + 1..]),
+        None      => (name, ""),
+    };
+    if base.is_empty() || base.len() > 8 || ext.len() > 3 || (name.contains('.') && ext.is_empty())
+    || !base.bytes().chain(ext.bytes()).all(is_short_name_char) {
+        return None;
+    }
+    let mut short = [b' '; 11];
+    short[..base.len()].copy_from_slice(base.as_bytes());
+    short[8..8 + ext.len()].copy_from_slice(ext.as_bytes());
+    Some(short)
+}
+
+/// Builds the part of a generated short name coming from `part` of the long
+/// name, upper case and with the characters not allowed replaced
+fn short_name_part(part:&str, length:usize) -> Vec<u8> {
+    part.bytes()
+        .filter(|&byte| byte != b' ' && byte != b'.')
+        .map(|byte| {
+            let byte = byte.to_ascii_uppercase();
+            if is_short_name_char(byte) { byte } else { b'_' }
+        })
+        .take(length)
+        .collect()
+}
+
+/// Generates a short name for the long `name` which is not used by any
+/// entry of `index`, in the 'BASIS~N.EXT' form
+fn generate_short_name(name:&str, index:&DirIndex) -> KResult<[u8; 11]> {
+    let trimmed = name.trim_start_matches('.');
+    let (base, ext) = match trimmed.rfind('.') {
+        Some(dot) => (&trimmed[..dot], &trimmed[dot + 1..]),
+        None      => (trimmed, ""),
+    };
+    let mut basis = short_name_part(base, 8);
+    if basis.is_empty() {
+        basis.push(b'_');
+    }
+    let ext = short_name_part(ext, 3);
+    for number in 1..1_000_000 {
+        let tail = format!("~{}", number);
+        let length = core::cmp::min(basis.len(), 8 - tail.len());
+        let mut short = [b' '; 11];
+        short[..length].copy_from_slice(&basis[..length]);
+        short[length..length + tail.len()].copy_from_slice(tail.as_bytes());
+        short[8..8 + ext.len()].copy_from_slice(&ext);
+        if !index.entries().iter().any(|entry| entry.short == short) {
+            return Ok(short);
+        }
+    }
+    Err(EEXIST)
+}
+
+/// Checks whether `name` can be given to a new entry
+fn check_name(name:&str) -> KResult<()> {
+    if name.len() > MAX_NAME {
+        return Err(ENAMETOOLONG);
+    }
+    if name.is_empty() || name == "." || name == ".."
+    || name.bytes().any(|byte| byte < 0x20 || INVALID_NAME_CHARS.contains(&byte)) {
+        return Err(EINVAL);
+    }
+    Ok(())
+}
+
+/// Builds the entries of a new file called `name` with the short name
+/// `short`: the long name entries, last part first, then the short entry
+fn build_entries(name:&str, short:&[u8; 11], long:bool) -> Vec<u8> {
+    let chars : Vec<u16> = if long { name.encode_utf16().collect() } else { Vec::new() };
+    let parts = (chars.len() + LFN_CHARS - 1) / LFN_CHARS;
+    let checksum = short_name_checksum(short);
+    let mut entries = vec![0_u8; (parts + 1) * DIR_ENTRY_SIZE];
+    for part in 0..parts {
+        let entry = &mut entries[(parts - 1 - part) * DIR_ENTRY_SIZE..(parts - part) * DIR_ENTRY_SIZE];
+        entry[LFN_ORDER] = part as u8 + 1 | if part + 1 == parts { LFN_LAST } else { 0 };
+        entry[DIR_ATTR] = ATTR_LONG_NAME;
+        entry[LFN_CHECKSUM] = checksum;
+        for (i, &offset) in LFN_OFFSETS.iter().enumerate() {
+            // the name is terminated by a null character, then padded
+            let position = part * LFN_CHARS + i;
+            let c = match position.cmp(&chars.len()) {
+                core::cmp::Ordering::Less    => chars[position],
+                core::cmp::Ordering::Equal   => 0x0000,
+                core::cmp::Ordering::Greater => 0xFFFF,
+            };
+            entry[offset..offset + 2].copy_from_slice(&c.to_le_bytes());
+        }
+    }
+    let entry = &mut entries[parts * DIR_ENTRY_SIZE..];
+    entry[DIR_NAME..DIR_NAME + 11].copy_from_slice(short);
+    if entry[DIR_NAME] == ENTRY_DELETED {
+        entry[DIR_NAME] = ENTRY_E5;
+    }
+    entry[DIR_ATTR] = ATTR_ARCHIVE;
+    entries
+}
+
+impl Fat16Fs {
+    /// Parses the entries of the directory `inode`
+    fn scan_dir(&self, inode:&Fat16Inode) -> KResult<Vec<DirEntryInfo>> {
+        let mut entries = Vec::new();
+        let mut long_name = LongName { chars : [0xFFFF; 20 * LFN_CHARS], checksum : 0, expected : 0 };
+        for extent in self.extents(inode).iter() {
+            let mut raw = vec![0_u8; extent.len as usize];
+            read_device(&*self.device, extent.addr, &mut raw)?;
+            for (i, entry) in raw.chunks_exact(DIR_ENTRY_SIZE).enumerate() {
+                match entry[DIR_NAME] {
+                    ENTRY_END     => return Ok(entries),
+                    ENTRY_DELETED => {
+                        long_name.reset();
+                        continue;
+                    },
+                    _ => {},
+                }
+                let attr = entry[DIR_ATTR];
+                if attr & ATTR_LONG_NAME == ATTR_LONG_NAME {
+                    long_name.push(entry);
+                    continue;
+                }
+                if attr & ATTR_VOLUME_ID != 0 {
+                    long_name.reset();
+                    continue;
+                }
+                let mut short = [0_u8; 11];
+                short.copy_from_slice(&entry[DIR_NAME..DIR_NAME + 11]);
+                if short[0] == ENTRY_E5 {
+                    short[0] = ENTRY_DELETED;
+                }
+                let mut info = DirEntryInfo {
+                    name     : String::new(),
+                    short,
+                    attr,
+                    cluster  : le16(entry, DIR_CLUSTER),
+                    size     : le32(entry, DIR_SIZE),
+                    location : extent.addr + (i * DIR_ENTRY_SIZE) as u64,
+                };
+                info.name = long_name.take(&entry[DIR_NAME..DIR_NAME + 11]).unwrap_or_else(|| info.short_name());
+                entries.push(info);
+            }
+        }
+        Ok(entries)
+    }
+
+    /// Returns the name index of the directory `inode`, building it on first use
+    pub(crate) fn dir_index(&self, inode:&Fat16Inode) -> KResult<Arc<DirIndex>> {
+        if !inode.is_dir() {
+            return Err(ENOTDIR);
+        }
+        if let Some(index) = &*inode.index.lock() {
+            return Ok(index.clone());
+        }
+        let index = Arc::new(DirIndex::new(self.scan_dir(inode)?));
+        Ok(inode.index.lock().get_or_insert(index).clone())
+    }
+
+    /// Returns the offset in the directory `inode` of the first `count`
+    /// consecutive free entries
+    ///
+    /// The entries past the end marker are all free.
+    fn find_free_entries(&self, inode:&Fat16Inode, count:usize) -> KResult<Option<u64>> {
+        let mut run = 0;
+        for extent in self.extents(inode).iter() {
+            let mut raw = vec![0_u8; extent.len as usize];
+            read_device(&*self.device, extent.addr, &mut raw)?;
+            for (i, entry) in raw.chunks_exact(DIR_ENTRY_SIZE).enumerate() {
+                match entry[DIR_NAME] {
+                    ENTRY_END | ENTRY_DELETED => run += 1,
+                    _                         => run = 0,
+                }
+                if run == count {
+                    return Ok(Some(extent.offset + ((i + 1 - count) * DIR_ENTRY_SIZE) as u64));
+                }
+            }
+        }
+        Ok(None)
+    }
+
+    /// Appends a cluster filled with zeroes to the directory `inode`
+    ///
+    /// The root directory has a fixed size and cannot grow.
+    fn extend_dir(&self, inode:&Fat16Inode) -> KResult<()> {
+        let extents = self.extents(inode);
+        let (cluster, tail) = {
+            let state = inode.state.lock();
+            match extents.last() {
+                Some(extent) if state.cluster != 0 => {
+                    let tail = self.addr_cluster(extent.addr + extent.len - 1);
+                    (tail + 1, tail)
+                },
+                _ => return Err(ENOSPC),
+            }
+        };
+        let first = self.fat.lock().alloc_clusters(cluster, 1, tail)?;
+        let zeroes = vec![0_u8; self.cluster_size as usize];
+        if let Err(errno) = write_device(&*self.device, self.cluster_addr(first), &zeroes) {
+            let mut fat = self.fat.lock();
+            fat.set(tail, FAT_EOC);
+            fat.free_chain(first);
+            return Err(errno);
+        }
+        inode.state.lock().extents = None;
+        self.flush_fat()
+    }
+
+    /// Creates the empty regular file `name` in the directory `dir`
+    ///
+    /// A name which is not a valid upper case 8.3 name is stored in long
+    /// name entries, followed by a generated short name. The directory is
+    /// extended by a cluster when it has no room for the entries.
+    pub(crate) fn create(&self, dir:&Fat16Inode, name:&str) -> KResult<Arc<Fat16Inode>> {
+        check_name(name)?;
+        let index = self.dir_index(dir)?;
+        if index.lookup(name).is_some() {
+            return Err(EEXIST);
+        }
+        let (short, long) = match exact_short_name(name) {
+            Some(short) => (short, false),
+            None        => (generate_short_name(name, &index)?, true),
+        };
+        let entries = build_entries(name, &short, long);
+        let count = entries.len() / DIR_ENTRY_SIZE;
+        let offset = match self.find_free_entries(dir, count)? {
+            Some(offset) => offset,
+            None         => {
+                self.extend_dir(dir)?;
+                self.find_free_entries(dir, count)?.ok_or(ENOSPC)?
+            },
+        };
+        // the entries may be split over several extents
+        let extents = self.extents(dir);
+        let mut done = 0;
+        while done < entries.len() {
+            let position = offset + done as u64;
+            let extent = extents.get(find_extent(&extents, position)).ok_or(EIO)?;
+            let chunk = core::cmp::min((entries.len() - done) as u64, extent.offset + extent.len - position) as usize;
+            write_device(&*self.device, extent.addr + position - extent.offset, &entries[done..done + chunk])?;
+            done += chunk;
+        }
+        *dir.index.lock() = None;
+        let position = offset + ((count - 1) * DIR_ENTRY_SIZE) as u64;
+        let extent = &extents[find_extent(&extents, position)];
+        Ok(self.inode(&DirEntryInfo {
+            name     : String::from(name),
+            short,
+            attr     : ATTR_ARCHIVE,
+            cluster  : 0,
+            size     : 0,
+            location : extent.addr + position - extent.offset,
+        }))
+    }
+
+    /// Stores the first cluster and the size of `inode` in its directory entry
+    pub(crate) fn write_entry(&self, inode:&Fat16Inode, cluster:u16, size:u32) -> KResult<()> {
+        let mut fields = [0_u8; 6];
+        fields[..2].copy_from_slice(&cluster.to_le_bytes());
+        fields[2..].copy_from_slice(&size.to_le_bytes());
+        write_device(&*self.device, inode.location + DIR_CLUSTER as u64, &fields)
+    }
+}
@@ -0,0 +1,292 @@
+use crate::block::*;
+use crate::fs::fat16::*;
+use crate::mm::*;
+use crate::mm::frame::*;
+use crate::syscall::errno::*;
+
+use alloc::sync::Arc;
+use alloc::vec;
+use alloc::vec::Vec;
+
+// FAT entries: the values past the last cluster of the volume, bad
+// cluster marks included, are not clusters
+pub(crate) const FAT_FREE : u16 = 0x0000;
+pub(crate) const FAT_EOC  : u16 = 0xFFFF;
+
+// the FAT entries held by a sector
+const ENTRIES_PER_SECTOR : usize = SECTOR_SIZE / 2;
+
+/// Returns the first index from `from` below `limit` whose bit in `bits`
+/// is `set`, or `limit` if none
+///
+/// The bitmap is scanned a word at a time.
+pub(crate) fn find_bit(bits:&[u64], from:usize, limit:usize, set:bool) -> usize {
+    let mut index = from;
+    while index < limit {
+        let word = if set { bits[index / 64] } else { !bits[index / 64] };
+        let word = word >> (index % 64);
+        if word != 0 {
+            return core::cmp::min(index + word.trailing_zeros() as usize, limit);
+        }
+        index = (index / 64 + 1) * 64;
+    }
+    limit
+}
+
+/// The cached FAT of a volume
+///
+/// Besides the entries, a bitmap with a bit set for every free cluster
+/// lets the allocator find runs of free clusters without walking the
+/// FAT, and another one records the FAT sectors changed since the last
+/// flush.
+pub(crate) struct FatTable {
+    /// The entries of every sector of the FAT holding some cluster
+    entries    : Vec<u16>,
+    /// The number of clusters, plus the two reserved entries
+    clusters   : usize,
+    free       : Vec<u64>,
+    free_count : usize,
+    dirty      : Vec<u64>,
+    /// Where the next search for free clusters begins
+    hint       : usize,
+}
+
+impl FatTable {
+    /// Builds the table from the `entries` read from the device, the
+    /// first `clusters` of which are in use
+    pub(crate) fn new(entries:Vec<u16>, clusters:usize) -> Self {
+        let mut free = vec![0_u64; (clusters + 63) / 64];
+        for cluster in FIRST_CLUSTER..clusters {
+            if entries[cluster] == FAT_FREE {
+                free[cluster / 64] |= 1 << (cluster % 64);
+            }
+        }
+        let free_count = free.iter().map(|word| word.count_ones() as usize).sum();
+        let sectors = entries.len() / ENTRIES_PER_SECTOR;
+        FatTable {
+            entries,
+            clusters,
+            free,
+            free_count,
+            dirty : vec![0; (sectors + 63) / 64],
+            hint  : FIRST_CLUSTER,
+        }
+    }
+
+    pub(crate) fn get(&self, cluster:usize) -> u16 {
+        self.entries[cluster]
+    }
+
+    /// Sets the entry of `cluster` to `value`, keeping the bitmaps in sync
+    pub(crate) fn set(&mut self, cluster:usize, value:u16) {
+        let bit = 1 << (cluster % 64);
+        match (self.entries[cluster] == FAT_FREE, value == FAT_FREE) {
+            (true, false) => {
+                self.free[cluster / 64] &= !bit;
+                self.free_count -= 1;
+            },
+            (false, true) => {
+                self.free[cluster / 64] |= bit;
+                self.free_count += 1;
+            },
+            _ => {},
+        }
+        self.entries[cluster] = value;
+        let sector = cluster / ENTRIES_PER_SECTOR;
+        self.dirty[sector / 64] |= 1 << (sector % 64);
+    }
+
+    /// Returns the length of the run of free clusters starting at `cluster`, up to `max`
+    fn free_run(&self, cluster:usize, max:usize) -> usize {
+        if cluster < FIRST_CLUSTER || cluster >= self.clusters {
+            return 0;
+        }
+        let end = find_bit(&self.free, cluster, core::cmp::min(cluster + max, self.clusters), false);
+        end - cluster
+    }
+
+    /// Finds room for `count` clusters, returning the start and length of the
+    /// first free run large enough from the hint on, or of the longest run
+    fn find_run(&self, count:usize) -> (usize, usize) {
+        let mut best = (0, 0);
+        let hint = core::cmp::max(self.hint, FIRST_CLUSTER);
+        for (from, limit) in [(hint, self.clusters), (FIRST_CLUSTER, hint)] {
+            let mut cluster = from;
+            while cluster < limit {
+                let start = find_bit(&self.free, cluster, limit, true);
+                if start == limit {
+                    break;
+                }
+                let end = find_bit(&self.free, start, core::cmp::min(start + count, limit), false);
+                if end - start == count {
+                    return (start, count);
+                }
+                if end - start > best.1 {
+                    best = (start, end - start);
+                }
+                cluster = end;
+            }
+        }
+        best
+    }
+
+    /// Allocates `count` clusters, appending them to the chain ending at
+    /// `tail`, or starting a new chain if null, and returns the first one
+    ///
+    /// The clusters are taken from `goal` on when free, so that a file
+    /// grows in place, else from the first free run that fits them all.
+    /// Only when no such run exists the clusters are split over the
+    /// longest runs.
+    pub(crate) fn alloc_clusters(&mut self, mut goal:usize, count:usize, tail:usize) -> KResult<usize> {
+        if count == 0 || count > self.free_count {
+            return Err(ENOSPC);
+        }
+        let mut first = 0;
+        let mut prev = tail;
+        let mut left = count;
+        while left > 0 {
+            let (start, len) = match self.free_run(goal, left) {
+                0   => self.find_run(left),
+                len => (goal, len),
+            };
+            for cluster in start..start + len {
+                self.set(cluster, FAT_EOC);
+                if prev != 0 {
+                    self.set(prev, cluster as u16);
+                }
+                if first == 0 {
+                    first = cluster;
+                }
+                prev = cluster;
+            }
+            left -= len;
+            goal = start + len;
+            self.hint = goal;
+        }
+        Ok(first)
+    }
+
+    /// Frees the chain starting at `first`
+    pub(crate) fn free_chain(&mut self, first:usize) {
+        let mut cluster = first;
+        let mut steps = 0;
+        while cluster >= FIRST_CLUSTER && cluster < self.clusters && steps < self.clusters {
+            let next = self.get(cluster) as usize;
+            self.set(cluster, FAT_FREE);
+            self.hint = core::cmp::min(self.hint, cluster);
+            cluster = next;
+            steps += 1;
+        }
+    }
+
+    /// Returns the runs of dirty FAT sectors, with their content, marking
+    /// them clean
+    fn take_dirty(&mut self) -> Vec<(u64, Vec<u8>)> {
+        let sectors = self.entries.len() / ENTRIES_PER_SECTOR;
+        let mut runs = Vec::new();
+        let mut sector = 0;
+        loop {
+            let start = find_bit(&self.dirty, sector, sectors, true);
+            if start == sectors {
+                break;
+            }
+            let end = find_bit(&self.dirty, start, sectors, false);
+            let data = self.entries[start * ENTRIES_PER_SECTOR..end * ENTRIES_PER_SECTOR].iter()
+                .flat_map(|entry| entry.to_le_bytes())
+                .collect();
+            for dirty in start..end {
+                self.dirty[dirty / 64] &= !(1 << (dirty % 64));
+            }
+            runs.push((start as u64, data));
+            sector = end;
+        }
+        runs
+    }
+
+    fn mark_dirty(&mut self, start:u64, count:u64) {
+        for sector in start as usize..(start + count) as usize {
+            self.dirty[sector / 64] |= 1 << (sector % 64);
+        }
+    }
+}
+
+impl Fat16Fs {
+    /// Follows the chain starting at `first` in the cached FAT, merging the
+    /// consecutive clusters into extents
+    ///
+    /// A chain looping on itself is cut after visiting every cluster once.
+    pub(crate) fn walk_chain(&self, first:usize) -> Vec<Extent> {
+        let fat = self.fat.lock();
+        let mut extents : Vec<Extent> = Vec::new();
+        let mut cluster = first;
+        let mut offset = 0;
+        let mut steps = 0;
+        while self.is_cluster(cluster) && steps < self.fat_entries {
+            let start = cluster;
+            let mut next = fat.get(cluster) as usize;
+            while next == cluster + 1 && self.is_cluster(next) && steps < self.fat_entries {
+                cluster = next;
+                next = fat.get(cluster) as usize;
+                steps += 1;
+            }
+            let len = (cluster + 1 - start) as u64 * self.cluster_size;
+            extents.push(Extent { offset, addr : self.cluster_addr(start), len });
+            offset += len;
+            cluster = next;
+            steps += 1;
+        }
+        extents
+    }
+
+    /// Writes the FAT sectors changed since the last flush to every copy of the FAT
+    ///
+    /// Consecutive dirty sectors go in a single request per copy, and all
+    /// the requests are in flight together.
+    pub(crate) fn flush_fat(&self) -> KResult<()> {
+        let runs = self.fat.lock().take_dirty();
+        let mut pending = Vec::new();
+        let mut result = Ok(());
+        start_plug();
+        for (start, data) in runs.iter() {
+            let count = (data.len() / SECTOR_SIZE) as u64;
+            let mut frames = Vec::new();
+            for chunk in data.chunks(PAGE_SIZE) {
+                match alloc_frame() {
+                    Some(frame) => {
+                        unsafe {
+                            core::ptr::copy_nonoverlapping(chunk.as_ptr(), phys_to_virt(frame) as *mut u8, chunk.len());
+                        }
+                        frames.push(frame);
+                    },
+                    None => break,
+                }
+            }
+            if frames.len() * PAGE_SIZE < data.len() {
+                frames.into_iter().for_each(free_frame);
+                self.fat.lock().mark_dirty(*start, count);
+                result = Err(ENOMEM);
+                continue;
+            }
+            let requests : Vec<Arc<BlockRequest>> = (0..self.fat_count).map(|copy| {
+                let sector = self.fat_start + copy * self.sectors_per_fat + start;
+                let request = BlockRequest::with_sectors(BlockOp::Write, sector, frames.clone(), count);
+                self.device.submit(request.clone());
+                request
+            }).collect();
+            pending.push((*start, count, frames, requests));
+        }
+        finish_plug();
+        for (start, count, frames, requests) in pending {
+            let mut failed = false;
+            for request in requests {
+                failed |= request.wait().is_err();
+            }
+            frames.into_iter().for_each(free_frame);
+            if failed {
+                self.fat.lock().mark_dirty(start, count);
+                result = Err(EIO);
+            }
+        }
+        result
+    }
+}
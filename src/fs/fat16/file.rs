@@ -0,0 +1,699 @@
+use crate::block::*;
+use crate::fs::fat16::*;
+use crate::fs::file::*;
+use crate::mm::*;
+use crate::mm::filemap::*;
+use crate::mm::frame::*;
+use crate::mm::readahead::*;
+use crate::mm::space::*;
+use crate::mm::writeback::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+
+use alloc::boxed::Box;
+use alloc::sync::Arc;
+use alloc::vec;
+use alloc::vec::Vec;
+use core::ptr;
+
+// the largest size recorded by a directory entry
+const MAX_FILE_SIZE : u64 = u32::MAX as u64;
+
+/// The mutable part of an inode
+pub(crate) struct InodeState {
+    pub(crate) cluster : u16,
+    pub(crate) size    : u64,
+    /// The cluster chain, walked once from the cached FAT
+    pub(crate) extents : Option<Arc<Vec<Extent>>>,
+    /// The size of the data stored on the device, the Bytes after it are
+    /// not initialized, and the size recorded by the entry
+    stored             : u64,
+    /// Whether the first cluster or the size changed since the entry was
+    /// written, or the data is not all stored yet
+    entry_dirty        : bool,
+    /// Whether a writeback of the inode is running
+    writeback          : bool,
+}
+
+/// A file or directory of the volume
+///
+/// Inodes are cached by `location`, the device address of their
+/// directory entry. Directories get a name index on first access.
+///
+/// The content of files goes through the page cache. The data written
+/// stays in dirty pages until the writeback, which is also when its
+/// clusters are allocated: a file written in one go gets a single run of
+/// clusters. The writeback runs in the flusher of the volume, or when
+/// the file is synced or closed.
+pub(crate) struct Fat16Inode {
+    pub(crate) location : u64,
+    pub(crate) attr     : u8,
+    pub(crate) state    : SpinLock<InodeState>,
+    pub(crate) index    : SpinLock<Option<Arc<DirIndex>>>,
+    pub(crate) cache    : PageCache,
+    writeback_done      : WaitQueue,
+}
+
+impl Fat16Inode {
+    pub(crate) fn new(location:u64, attr:u8, cluster:u16, size:u64, backing:&Arc<BackingDev>) -> Self {
+        Fat16Inode {
+            location,
+            attr,
+            state          : SpinLock::new(InodeState {
+                cluster,
+                size,
+                extents     : None,
+                stored      : size,
+                entry_dirty : false,
+                writeback   : false,
+            }),
+            index          : SpinLock::new(None),
+            cache          : PageCache::with_backing(backing.clone()),
+            writeback_done : WaitQueue::new(),
+        }
+    }
+
+    pub(crate) fn is_dir(&self) -> bool {
+        self.attr & ATTR_DIRECTORY != 0
+    }
+
+    /// Blocks until no other writeback of the inode runs, then starts one
+    fn begin_writeback(&self) {
+        loop {
+            self.writeback_done.wait_until(|| !self.state.lock().writeback);
+            let mut state = self.state.lock();
+            if !state.writeback {
+                state.writeback = true;
+                return;
+            }
+        }
+    }
+
+    fn end_writeback(&self) {
+        self.state.lock().writeback = false;
+        self.writeback_done.wake_all();
+    }
+}
+
+/// A segment of a page to be written, `sectors` long from `skip` Bytes
+/// into the page, going to the Byte `addr` of the device
+struct Segment {
+    frame   : usize,
+    skip    : usize,
+    sectors : u64,
+    addr    : u64,
+}
+
+impl Fat16Fs {
+    /// Returns the extents of `inode`, computing them on first use
+    pub(crate) fn extents(&self, inode:&Fat16Inode) -> Arc<Vec<Extent>> {
+        let cluster = {
+            let state = inode.state.lock();
+            if let Some(extents) = &state.extents {
+                return extents.clone();
+            }
+            state.cluster
+        };
+        let extents = Arc::new(self.walk_chain(cluster as usize));
+        inode.state.lock().extents.get_or_insert(extents).clone()
+    }
+
+    /// Returns the size of `inode`, directories span their whole chain
+    pub(crate) fn size(&self, inode:&Fat16Inode) -> u64 {
+        if inode.is_dir() {
+            self.extents(inode).last().map_or(0, |extent| extent.offset + extent.len)
+        } else {
+            inode.state.lock().size
+        }
+    }
+
+    /// Fills `frame` with the stored content of the page `index` of `inode`
+    ///
+    /// The Bytes past the stored size, or past the allocated clusters,
+    /// read as zeroes.
+    fn read_page(&self, inode:&Fat16Inode, index:u64, frame:usize) -> KResult<()> {
+        let page = unsafe { core::slice::from_raw_parts_mut(phys_to_virt(frame) as *mut u8, PAGE_SIZE) };
+        let stored = inode.state.lock().stored;
+        let extents = self.extents(inode);
+        let offset = index * PAGE_SIZE as u64;
+        let mut done = 0;
+        while done < PAGE_SIZE {
+            let position = offset + done as u64;
+            let extent = extents.get(find_extent(&extents, position)).filter(|_| position < stored);
+            let chunk = match extent {
+                Some(extent) => {
+                    let chunk = core::cmp::min((PAGE_SIZE - done) as u64, core::cmp::min(extent.offset + extent.len, stored) - position) as usize;
+                    read_device(&*self.device, extent.addr + position - extent.offset, &mut page[done..done + chunk])?;
+                    chunk
+                },
+                None => {
+                    page[done..].fill(0);
+                    PAGE_SIZE - done
+                },
+            };
+            done += chunk;
+        }
+        Ok(())
+    }
+
+    /// Returns the page `index` of `inode` from the page cache, referenced,
+    /// reading it on a miss
+    fn get_page(&self, inode:&Fat16Inode, index:u64) -> KResult<usize> {
+        inode.cache.find_or_read_page(index, |frame| self.read_page(inode, index, frame))
+    }
+
+    /// Starts reading the pages of `window` missing from the cache of `inode`
+    ///
+    /// The pages enter the cache locked. Those lying in a single extent,
+    /// and stored whole, go out in requests as large as the runs of
+    /// clusters allow, and are unlocked when the requests complete. The
+    /// others, at the end of the stored data, are read right away. The
+    /// readahead stops short when memory runs low.
+    fn read_ahead(&self, inode:&Arc<Fat16Inode>, window:ReadaheadWindow) {
+        let (size, stored) = {
+            let state = inode.state.lock();
+            (state.size, state.stored)
+        };
+        let end = core::cmp::min(window.start + window.count, (size + PAGE_SIZE as u64 - 1) / PAGE_SIZE as u64);
+        let extents = self.extents(inode);
+        let mut requests = Vec::new();
+        let mut current : Option<(u64, Vec<usize>, Vec<u64>)> = None;
+        for index in window.start..end {
+            if inode.cache.is_cached(index) {
+                continue;
+            }
+            let frame = match alloc_frame() {
+                Some(frame) => frame,
+                None        => break,
+            };
+            if !inode.cache.add_locked_page(index, frame, window.marker == Some(index)) {
+                continue;
+            }
+            let position = index * PAGE_SIZE as u64;
+            let extent = extents.get(find_extent(&extents, position))
+                .filter(|extent| position + PAGE_SIZE as u64 <= core::cmp::min(extent.offset + extent.len, stored));
+            let sector = match extent {
+                Some(extent) => (extent.addr + position - extent.offset) / SECTOR_SIZE as u64,
+                None         => {
+                    inode.cache.unlock_page(index, self.read_page(inode, index, frame));
+                    continue;
+                },
+            };
+            if let Some((start, frames, indexes)) = &mut current {
+                if *start + (frames.len() * SECTORS_PER_PAGE) as u64 == sector {
+                    frames.push(frame);
+                    indexes.push(index);
+                    continue;
+                }
+            }
+            requests.extend(current.take());
+            current = Some((sector, vec![frame], vec![index]));
+        }
+        requests.extend(current);
+        start_plug();
+        for (sector, frames, indexes) in requests {
+            let request = BlockRequest::new(BlockOp::Read, sector, frames);
+            let owner = inode.clone();
+            request.set_end_io(Box::new(move |_, result| {
+                for index in indexes {
+                    owner.cache.unlock_page(index, result);
+                }
+            }));
+            self.device.submit(request);
+        }
+        finish_plug();
+    }
+
+    /// Returns the page `index` of `inode`, referenced, for a read going on
+    /// for `pages` pages, reading ahead as `readahead` suggests
+    fn get_page_ahead(&self, inode:&Arc<Fat16Inode>, readahead:&mut Readahead, index:u64, pages:u64) -> KResult<usize> {
+        let cache = &inode.cache;
+        if !cache.is_cached(index) {
+            let window = readahead.on_miss(index, pages, |page| cache.is_cached(page));
+            self.read_ahead(inode, window);
+        } else if cache.test_clear_readahead(index) {
+            if let Some(window) = readahead.on_marker(index, pages, |page| cache.is_cached(page)) {
+                self.read_ahead(inode, window);
+            }
+        }
+        readahead.record(index);
+        match cache.find_uptodate_page(index) {
+            Some(frame) => Ok(frame),
+            None        => self.get_page(inode, index),
+        }
+    }
+
+    /// Reads the content of `inode` from `offset` into `buf`, returning how much was read
+    ///
+    /// The pages are read ahead following `readahead`, the state of the
+    /// open file.
+    pub(crate) fn read(&self, inode:&Arc<Fat16Inode>, readahead:&SpinLock<Readahead>, buf:&mut [u8], offset:u64) -> KResult<usize> {
+        let size = self.size(inode);
+        if offset >= size {
+            return Ok(0);
+        }
+        let count = core::cmp::min(buf.len() as u64, size - offset) as usize;
+        let last = (offset + count as u64 - 1) / PAGE_SIZE as u64;
+        // the state is not kept locked while waiting for the pages
+        let mut state = *readahead.lock();
+        let mut done = 0;
+        while done < count {
+            let position = offset + done as u64;
+            let index = position / PAGE_SIZE as u64;
+            let skip = (position % PAGE_SIZE as u64) as usize;
+            let chunk = core::cmp::min(count - done, PAGE_SIZE - skip);
+            let frame = match self.get_page_ahead(inode, &mut state, index, last + 1 - index) {
+                Ok(frame)          => frame,
+                Err(_) if done > 0 => break,
+                Err(errno)         => return Err(errno),
+            };
+            unsafe {
+                ptr::copy_nonoverlapping((phys_to_virt(frame) + skip) as *const u8, buf[done..].as_mut_ptr(), chunk);
+            }
+            put_frame(frame);
+            done += chunk;
+        }
+        *readahead.lock() = state;
+        Ok(done)
+    }
+
+    /// Writes `buf` into `inode` from `offset`, returning how much was written
+    ///
+    /// The data goes to dirty pages of the page cache, which reach the
+    /// device with the next writeback. The file is queued for the flusher
+    /// on its first dirty page, and the writer is throttled when dirty
+    /// memory runs high.
+    pub(crate) fn write(&self, inode:&Arc<Fat16Inode>, buf:&[u8], offset:u64) -> KResult<usize> {
+        if offset >= MAX_FILE_SIZE {
+            return Err(EFBIG);
+        }
+        let count = core::cmp::min(buf.len() as u64, MAX_FILE_SIZE - offset) as usize;
+        let mut done = 0;
+        while done < count {
+            let position = offset + done as u64;
+            let index = position / PAGE_SIZE as u64;
+            let skip = (position % PAGE_SIZE as u64) as usize;
+            let chunk = core::cmp::min(count - done, PAGE_SIZE - skip);
+            // a page entirely overwritten needs not be read
+            let frame = match inode.cache.find_uptodate_page(index) {
+                Some(frame)                => Ok(frame),
+                None if chunk == PAGE_SIZE => alloc_frame().ok_or(ENOMEM).map(|frame| inode.cache.add_page(index, frame)),
+                None                       => self.get_page(inode, index),
+            };
+            let frame = match frame {
+                Ok(frame)          => frame,
+                Err(_) if done > 0 => break,
+                Err(errno)         => return Err(errno),
+            };
+            unsafe {
+                ptr::copy_nonoverlapping(buf[done..].as_ptr(), (phys_to_virt(frame) + skip) as *mut u8, chunk);
+            }
+            inode.cache.set_page_dirty(index);
+            put_frame(frame);
+            done += chunk;
+            let mut state = inode.state.lock();
+            if position + chunk as u64 > state.size {
+                state.size = position + chunk as u64;
+                state.entry_dirty = true;
+            }
+        }
+        if inode.cache.dirty_count() > 0 && inode.cache.mark_queued() {
+            match self.this.upgrade() {
+                Some(fs) => self.backing.queue_file(Arc::new(Fat16Writeback { fs, inode : inode.clone() })),
+                None     => inode.cache.clear_queued(),
+            }
+        }
+        self.backing.balance_dirty_pages();
+        Ok(done)
+    }
+
+    /// Allocates the clusters missing to hold `size` Bytes of `inode`
+    ///
+    /// They are taken right after the last cluster of the file when free.
+    fn allocate(&self, inode:&Fat16Inode, size:u64) -> KResult<()> {
+        let extents = self.extents(inode);
+        let allocated = extents.last().map_or(0, |extent| extent.offset + extent.len);
+        if allocated >= size {
+            return Ok(());
+        }
+        let count = ((size - allocated + self.cluster_size - 1) / self.cluster_size) as usize;
+        let (goal, tail) = match extents.last() {
+            Some(extent) => {
+                let tail = self.addr_cluster(extent.addr + extent.len - 1);
+                (tail + 1, tail)
+            },
+            None => (0, 0),
+        };
+        let first = self.fat.lock().alloc_clusters(goal, count, tail)?;
+        let mut state = inode.state.lock();
+        if state.cluster == 0 {
+            state.cluster = first as u16;
+            state.entry_dirty = true;
+        }
+        state.extents = None;
+        drop(state);
+        self.extents(inode);
+        Ok(())
+    }
+
+    /// Splits the cached page `index` into the segments going to each extent
+    fn page_segments(&self, extents:&[Extent], index:u64, frame:usize, size:u64, segments:&mut Vec<Segment>) -> KResult<()> {
+        let start = index * PAGE_SIZE as u64;
+        let end = core::cmp::min(start + PAGE_SIZE as u64, size);
+        let mut position = start;
+        while position < end {
+            let extent = extents.get(find_extent(extents, position)).ok_or(EIO)?;
+            let length = core::cmp::min(end, extent.offset + extent.len) - position;
+            segments.push(Segment {
+                frame,
+                skip    : (position - start) as usize,
+                sectors : (length + SECTOR_SIZE as u64 - 1) / SECTOR_SIZE as u64,
+                addr    : extent.addr + position - extent.offset,
+            });
+            position += length;
+        }
+        Ok(())
+    }
+
+    /// Turns `segments` into requests, merging the segments contiguous on
+    /// the device
+    ///
+    /// The segments which do not begin a page are copied to a bounce
+    /// frame, recorded in `bounces`, since requests start at the beginning
+    /// of their frames.
+    fn build_requests(&self, segments:&[Segment], bounces:&mut Vec<usize>) -> KResult<Vec<Arc<BlockRequest>>> {
+        let mut requests = Vec::new();
+        let mut current : Option<(u64, Vec<usize>, u64)> = None;
+        for segment in segments {
+            let frame = if segment.skip == 0 {
+                segment.frame
+            } else {
+                let bounce = alloc_frame().ok_or(ENOMEM)?;
+                bounces.push(bounce);
+                unsafe {
+                    ptr::copy_nonoverlapping((phys_to_virt(segment.frame) + segment.skip) as *const u8, phys_to_virt(bounce) as *mut u8, segment.sectors as usize * SECTOR_SIZE);
+                }
+                bounce
+            };
+            let sector = segment.addr / SECTOR_SIZE as u64;
+            if let Some((start, frames, count)) = &mut current {
+                if *count == (frames.len() * SECTORS_PER_PAGE) as u64 && *start + *count == sector {
+                    frames.push(frame);
+                    *count += segment.sectors;
+                    continue;
+                }
+            }
+            if let Some((start, frames, count)) = current.take() {
+                requests.push(BlockRequest::with_sectors(BlockOp::Write, start, frames, count));
+            }
+            current = Some((sector, vec![frame], segment.sectors));
+        }
+        if let Some((start, frames, count)) = current {
+            requests.push(BlockRequest::with_sectors(BlockOp::Write, start, frames, count));
+        }
+        Ok(requests)
+    }
+
+    /// Stores the pages written to `inode` on the device, with its entry
+    ///
+    /// The clusters of the data are allocated here, all at once, then the
+    /// pages go out in requests as large as the runs of clusters allow.
+    /// The data is stored before the FAT, and the FAT before the entry,
+    /// so that an entry never refers to clusters not written.
+    pub(crate) fn writeback(&self, inode:&Fat16Inode) -> KResult<()> {
+        self.writeback_pages(inode, usize::MAX).map(|_| ())
+    }
+
+    /// Stores up to `max` of the pages written to `inode`, in file order,
+    /// returning how many went out
+    ///
+    /// The entry records the size of the data stored so far, the rest
+    /// goes with a later writeback.
+    pub(crate) fn writeback_pages(&self, inode:&Fat16Inode, max:usize) -> KResult<usize> {
+        if inode.is_dir() {
+            return Ok(0);
+        }
+        inode.begin_writeback();
+        let result = self.run_writeback(inode, max);
+        inode.end_writeback();
+        result
+    }
+
+    fn run_writeback(&self, inode:&Fat16Inode, max:usize) -> KResult<usize> {
+        let (size, stored) = {
+            let state = inode.state.lock();
+            if !state.entry_dirty && inode.cache.dirty_count() == 0 {
+                return Ok(0);
+            }
+            (state.size, state.stored)
+        };
+        // the pages between the stored size and the new one go out whole,
+        // the parts not written reaching the device as zeroes
+        let first = stored / PAGE_SIZE as u64;
+        let last = (size + PAGE_SIZE as u64 - 1) / PAGE_SIZE as u64;
+        for index in first..last {
+            if !inode.cache.is_dirty(index) {
+                put_frame(self.get_page(inode, index)?);
+                inode.cache.set_page_dirty(index);
+            }
+        }
+        self.allocate(inode, size)?;
+        let extents = self.extents(inode);
+        let mut taken = inode.cache.dirty_pages(0, max);
+        taken.retain(|&(index, frame)| {
+            let keep = index * (PAGE_SIZE as u64) < size && inode.cache.start_writeback(index);
+            if !keep {
+                put_frame(frame);
+            }
+            keep
+        });
+        let mut segments = Vec::new();
+        let mut bounces = Vec::new();
+        let result = taken.iter()
+            .try_for_each(|&(index, frame)| self.page_segments(&extents, index, frame, size, &mut segments))
+            .and_then(|_| self.build_requests(&segments, &mut bounces))
+            .and_then(|requests| {
+                start_plug();
+                for request in requests.iter() {
+                    self.device.submit(request.clone());
+                }
+                finish_plug();
+                requests.iter().fold(Ok(()), |result, request| result.and(request.wait()))
+            });
+        bounces.into_iter().for_each(free_frame);
+        let written = taken.len();
+        for (index, frame) in taken {
+            inode.cache.end_writeback(index, result);
+            put_frame(frame);
+        }
+        if result.is_ok() {
+            // the data is stored up to the first page still dirty
+            let mut state = inode.state.lock();
+            let end = match inode.cache.first_dirty(state.stored / PAGE_SIZE as u64) {
+                Some(index) => core::cmp::min(index * PAGE_SIZE as u64, size),
+                None        => size,
+            };
+            state.stored = core::cmp::max(state.stored, end);
+        }
+        result?;
+        self.flush_fat()?;
+        let (cluster, stored) = {
+            let mut state = inode.state.lock();
+            if !state.entry_dirty {
+                return Ok(written);
+            }
+            state.entry_dirty = state.stored < state.size;
+            (state.cluster, core::cmp::min(state.stored, state.size))
+        };
+        if let Err(errno) = self.write_entry(inode, cluster, stored as u32) {
+            inode.state.lock().entry_dirty = true;
+            return Err(errno);
+        }
+        Ok(written)
+    }
+
+    /// Transfers `size` Bytes between `inode` at `offset` and the user
+    /// memory at `addr`, bypassing the page cache, returning how much was
+    /// transferred
+    ///
+    /// The offset, the size and the buffer must be aligned to sectors. The
+    /// user pages are pinned and the data goes between them and the
+    /// clusters with a request per extent, whose scatter-gather list is
+    /// made of the pinned frames. The dirty cached pages are written back
+    /// first, and the cached pages overwritten are dropped after, so that
+    /// the cache never disagrees with the device. A write past the end of
+    /// the file fills the gap with zeroes through the cache.
+    pub(crate) fn direct_io(&self, inode:&Fat16Inode, op:BlockOp, addr:usize, size:usize, offset:u64) -> KResult<usize> {
+        if offset % SECTOR_SIZE as u64 != 0 || addr % SECTOR_SIZE != 0 || size % SECTOR_SIZE != 0 {
+            return Err(EINVAL);
+        }
+        let process = current_process().ok_or(EFAULT)?;
+        if op == BlockOp::Write {
+            if offset >= MAX_FILE_SIZE {
+                return Err(EFBIG);
+            }
+            let mut state = inode.state.lock();
+            if offset > state.size {
+                state.size = offset;
+                state.entry_dirty = true;
+            }
+        }
+        self.writeback(inode)?;
+        let count = match op {
+            BlockOp::Read => {
+                let file_size = self.size(inode);
+                if offset >= file_size {
+                    return Ok(0);
+                }
+                core::cmp::min(size as u64, file_size - offset) as usize
+            },
+            BlockOp::Write => {
+                let room = (MAX_FILE_SIZE - offset) / SECTOR_SIZE as u64 * SECTOR_SIZE as u64;
+                core::cmp::min(size as u64, room) as usize
+            },
+        };
+        if count == 0 {
+            return Ok(0);
+        }
+        // the tail of the last sector read is past the end of the file
+        let length = (count + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+        let pages = process.space.pin_pages(addr, length, op == BlockOp::Read)?;
+        inode.begin_writeback();
+        let result = self.run_direct_io(inode, op, &pages, addr % PAGE_SIZE, offset, length);
+        inode.end_writeback();
+        if result.is_ok() && length > count {
+            let tail = addr % PAGE_SIZE + count;
+            unsafe {
+                ptr::write_bytes((phys_to_virt(pages[tail / PAGE_SIZE]) + tail % PAGE_SIZE) as *mut u8, 0, length - count);
+            }
+        }
+        unpin_pages(&pages);
+        result?;
+        if op == BlockOp::Write {
+            let end = offset + count as u64;
+            {
+                let mut state = inode.state.lock();
+                state.stored = core::cmp::max(state.stored, end);
+                if end > state.size {
+                    state.size = end;
+                    state.entry_dirty = true;
+                }
+            }
+            inode.cache.invalidate_range(offset / PAGE_SIZE as u64, (end + PAGE_SIZE as u64 - 1) / PAGE_SIZE as u64);
+            self.writeback(inode)?;
+        }
+        Ok(count)
+    }
+
+    /// Moves `length` Bytes between `inode` at `offset` and the pinned
+    /// `pages`, from `skip` Bytes into the first one
+    ///
+    /// Writes allocate the clusters missing first. The requests are all
+    /// in flight together.
+    fn run_direct_io(&self, inode:&Fat16Inode, op:BlockOp, pages:&[usize], skip:usize, offset:u64, length:usize) -> KResult<()> {
+        if op == BlockOp::Write {
+            self.allocate(inode, offset + length as u64)?;
+        }
+        let extents = self.extents(inode);
+        let mut requests = Vec::new();
+        let mut done = 0;
+        while done < length {
+            let position = offset + done as u64;
+            let extent = extents.get(find_extent(&extents, position)).ok_or(EIO)?;
+            let chunk = core::cmp::min((length - done) as u64, extent.offset + extent.len - position) as usize;
+            let start = skip + done;
+            let frames = pages[start / PAGE_SIZE..(start + chunk + PAGE_SIZE - 1) / PAGE_SIZE].to_vec();
+            let sector = (extent.addr + position - extent.offset) / SECTOR_SIZE as u64;
+            requests.push(BlockRequest::with_offset(op, sector, frames, start % PAGE_SIZE, (chunk / SECTOR_SIZE) as u64));
+            done += chunk;
+        }
+        start_plug();
+        for request in requests.iter() {
+            self.device.submit(request.clone());
+        }
+        finish_plug();
+        requests.iter().fold(Ok(()), |result, request| result.and(request.wait()))
+    }
+
+    /// Drops the content of `inode`, freeing its clusters
+    pub(crate) fn truncate(&self, inode:&Fat16Inode) -> KResult<()> {
+        inode.begin_writeback();
+        let cluster = {
+            inode.cache.truncate_pages(0);
+            let mut state = inode.state.lock();
+            let cluster = state.cluster;
+            state.cluster = 0;
+            state.size = 0;
+            state.stored = 0;
+            state.extents = Some(Arc::new(Vec::new()));
+            state.entry_dirty = true;
+            cluster
+        };
+        self.fat.lock().free_chain(cluster as usize);
+        inode.end_writeback();
+        self.writeback(inode)
+    }
+}
+
+/// A file of a FAT16 volume queued for the flusher
+struct Fat16Writeback {
+    fs    : Arc<Fat16Fs>,
+    inode : Arc<Fat16Inode>,
+}
+
+impl Writeback for Fat16Writeback {
+    fn write_pages(&self, max:usize) -> KResult<usize> {
+        self.fs.writeback_pages(&self.inode, max)
+    }
+
+    fn dirty_count(&self) -> usize {
+        self.inode.cache.dirty_count()
+    }
+
+    fn dequeued(&self) {
+        self.inode.cache.clear_queued();
+    }
+}
+
+/// A file or directory of a FAT16 volume, opened
+pub(crate) struct Fat16File {
+    pub(crate) fs        : Arc<Fat16Fs>,
+    pub(crate) inode     : Arc<Fat16Inode>,
+    pub(crate) readahead : SpinLock<Readahead>,
+}
+
+impl FileOps for Fat16File {
+    fn read(&self, file:&File, buf:&mut [u8], offset:u64) -> KResult<usize> {
+        if file.flags & O_ACCMODE == O_WRONLY {
+            return Err(EBADF);
+        }
+        if self.inode.is_dir() {
+            return Err(EISDIR);
+        }
+        self.fs.read(&self.inode, &self.readahead, buf, offset)
+    }
+
+    fn write(&self, file:&File, buf:&[u8], offset:u64) -> KResult<usize> {
+        if file.flags & O_ACCMODE == O_RDONLY {
+            return Err(EBADF);
+        }
+        self.fs.write(&self.inode, buf, offset)
+    }
+
+    fn direct_io(&self, file:&File, op:BlockOp, addr:usize, size:usize, offset:u64) -> KResult<usize> {
+        let mode = file.flags & O_ACCMODE;
+        if (op == BlockOp::Write && mode == O_RDONLY) || (op == BlockOp::Read && mode == O_WRONLY) {
+            return Err(EBADF);
+        }
+        self.fs.direct_io(&self.inode, op, addr, size, offset)
+    }
+
+    fn fsync(&self, _file:&File) -> KResult<()> {
+        self.fs.writeback(&self.inode)
+    }
+
+    fn release(&self, _file:&File) {
+        let _ = self.fs.writeback(&self.inode);
+    }
+}
@@ -0,0 +1,347 @@
+pub(crate) mod dir;
+pub(crate) mod fat;
+pub(crate) mod file;
+
+pub(crate) use dir::*;
+pub(crate) use fat::*;
+pub(crate) use file::*;
+
+use crate::block::*;
+use crate::fs::file::*;
+use crate::fs::vfs::*;
+use crate::mm::*;
+use crate::mm::frame::*;
+use crate::mm::readahead::*;
+use crate::mm::writeback::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+
+use alloc::collections::BTreeMap;
+use alloc::sync::{Arc, Weak};
+use alloc::vec;
+use alloc::vec::Vec;
+
+// the partition mounted at boot (see 'ramdisk.rs')
+const BOOT_PARTITION : &str = "ram0p1";
+
+// offsets of the fields of the BIOS Parameter Block
+const BPB_BYTES_PER_SECTOR    : usize = 11;
+const BPB_SECTORS_PER_CLUSTER : usize = 13;
+const BPB_RESERVED_SECTORS    : usize = 14;
+const BPB_FAT_COUNT           : usize = 16;
+const BPB_ROOT_ENTRIES        : usize = 17;
+const BPB_SECTOR_COUNT        : usize = 19;
+const BPB_SECTORS_PER_FAT     : usize = 22;
+const BPB_LARGE_SECTOR_COUNT  : usize = 32;
+const BPB_SIGNATURE           : usize = 510;
+
+pub(crate) const MAX_NAME : usize = 255;
+
+// the first cluster of the data region
+pub(crate) const FIRST_CLUSTER : usize = 2;
+
+// the cluster counts defining a FAT16 volume
+const MIN_CLUSTERS : usize = 4085;
+const MAX_CLUSTERS : usize = 65525;
+
+// the inode key of the root directory, which has no directory entry
+const ROOT_LOCATION : u64 = 0;
+
+/// A run of consecutive clusters of a file
+///
+/// `len` Bytes of the file starting at `offset` are stored on the device
+/// from the Byte `addr`.
+#[derive(Clone, Copy)]
+pub(crate) struct Extent {
+    pub(crate) offset : u64,
+    pub(crate) addr   : u64,
+    pub(crate) len    : u64,
+}
+
+/// Returns the index of the extent holding the Byte `offset` of the file,
+/// or the number of extents past the end
+pub(crate) fn find_extent(extents:&[Extent], offset:u64) -> usize {
+    extents.partition_point(|extent| extent.offset + extent.len <= offset)
+}
+
+/// A mounted FAT16 volume
+///
+/// The whole FAT is read at mount time and kept in memory, so following a
+/// cluster chain never touches the device. Each inode turns its chain into
+/// a list of extents the first time it is read. The dirty pages of the
+/// files are written back by the flusher of the volume.
+pub(crate) struct Fat16Fs {
+    this                : Weak<Fat16Fs>,
+    device              : Arc<dyn BlockDevice>,
+    backing             : Arc<BackingDev>,
+    sectors_per_cluster : u64,
+    cluster_size        : u64,
+    fat_start           : u64,
+    sectors_per_fat     : u64,
+    fat_count           : u64,
+    data_start          : u64,
+    /// The number of FAT entries, two more than the clusters
+    fat_entries         : usize,
+    fat                 : SpinLock<FatTable>,
+    inodes              : SpinLock<BTreeMap<u64, Arc<Fat16Inode>>>,
+    root                : Arc<Fat16Inode>,
+}
+
+fn le16(bytes:&[u8], offset:usize) -> u16 {
+    u16::from_le_bytes([bytes[offset], bytes[offset + 1]])
+}
+
+fn le32(bytes:&[u8], offset:usize) -> u32 {
+    u32::from_le_bytes(bytes[offset..offset + 4].try_into().unwrap())
+}
+
+/// Reads `buf.len()` Bytes of `device` from the Byte `addr`
+///
+/// Memory backed devices are read in place, the others a page at a time
+/// through a bounce frame.
+pub(crate) fn read_device(device:&dyn BlockDevice, addr:u64, buf:&mut [u8]) -> KResult<()> {
+    let first = addr / SECTOR_SIZE as u64;
+    let skip = (addr % SECTOR_SIZE as u64) as usize;
+    let count = ((skip + buf.len() + SECTOR_SIZE - 1) / SECTOR_SIZE) as u64;
+    if let Some(memory) = device.direct_access(first, count) {
+        buf.copy_from_slice(&memory[skip..skip + buf.len()]);
+        return Ok(());
+    }
+    let frame = alloc_frame().ok_or(ENOMEM)?;
+    let mut done = 0;
+    while done < buf.len() {
+        let position = addr + done as u64;
+        let sector = position / SECTOR_SIZE as u64;
+        let skip = (position % SECTOR_SIZE as u64) as usize;
+        let chunk = core::cmp::min(buf.len() - done, PAGE_SIZE - skip);
+        let sectors = ((skip + chunk + SECTOR_SIZE - 1) / SECTOR_SIZE) as u64;
+        let request = BlockRequest::with_sectors(BlockOp::Read, sector, vec![frame], sectors);
+        device.submit(request.clone());
+        if let Err(errno) = request.wait() {
+            free_frame(frame);
+            return Err(errno);
+        }
+        let page = unsafe { core::slice::from_raw_parts(phys_to_virt(frame) as *const u8, PAGE_SIZE) };
+        buf[done..done + chunk].copy_from_slice(&page[skip..skip + chunk]);
+        done += chunk;
+    }
+    free_frame(frame);
+    Ok(())
+}
+
+/// Writes `data` to `device` from the Byte `addr`
+///
+/// Meant for metadata: the sectors only partly covered are read first,
+/// and the whole range goes through bounce frames.
+pub(crate) fn write_device(device:&dyn BlockDevice, addr:u64, data:&[u8]) -> KResult<()> {
+    let first = addr / SECTOR_SIZE as u64;
+    let skip = (addr % SECTOR_SIZE as u64) as usize;
+    let sectors = ((skip + data.len() + SECTOR_SIZE - 1) / SECTOR_SIZE) as u64;
+    let size = sectors as usize * SECTOR_SIZE;
+    let mut frames = Vec::new();
+    for _ in 0..(size + PAGE_SIZE - 1) / PAGE_SIZE {
+        match alloc_frame() {
+            Some(frame) => frames.push(frame),
+            None        => {
+                frames.into_iter().for_each(free_frame);
+                return Err(ENOMEM);
+            },
+        }
+    }
+    let result = (|| {
+        if skip != 0 || data.len() % SECTOR_SIZE != 0 {
+            let request = BlockRequest::with_sectors(BlockOp::Read, first, frames.clone(), sectors);
+            device.submit(request.clone());
+            request.wait()?;
+        }
+        for (i, chunk) in data.chunks(PAGE_SIZE).enumerate() {
+            // the data is shifted by `skip` inside the frames
+            for (j, &byte) in chunk.iter().enumerate() {
+                let position = skip + i * PAGE_SIZE + j;
+                unsafe {
+                    *((phys_to_virt(frames[position / PAGE_SIZE]) + position % PAGE_SIZE) as *mut u8) = byte;
+                }
+            }
+        }
+        let request = BlockRequest::with_sectors(BlockOp::Write, first, frames.clone(), sectors);
+        device.submit(request.clone());
+        request.wait()
+    })();
+    frames.into_iter().for_each(free_frame);
+    result
+}
+
+impl Fat16Fs {
+    /// Mounts the FAT16 volume on `device`
+    pub(crate) fn mount(device:Arc<dyn BlockDevice>) -> KResult<Arc<Fat16Fs>> {
+        let mut bpb = [0_u8; SECTOR_SIZE];
+        read_device(&*device, 0, &mut bpb)?;
+        let sectors_per_cluster = bpb[BPB_SECTORS_PER_CLUSTER] as u64;
+        let reserved = le16(&bpb, BPB_RESERVED_SECTORS) as u64;
+        let fat_count = bpb[BPB_FAT_COUNT] as u64;
+        let root_entries = le16(&bpb, BPB_ROOT_ENTRIES) as u64;
+        let sectors_per_fat = le16(&bpb, BPB_SECTORS_PER_FAT) as u64;
+        let sectors = match le16(&bpb, BPB_SECTOR_COUNT) {
+            0     => le32(&bpb, BPB_LARGE_SECTOR_COUNT) as u64,
+            count => count as u64,
+        };
+        if le16(&bpb, BPB_SIGNATURE) != 0xAA55
+        || le16(&bpb, BPB_BYTES_PER_SECTOR) as usize != SECTOR_SIZE
+        || !sectors_per_cluster.is_power_of_two()
+        || fat_count == 0 || reserved == 0 {
+            return Err(EINVAL);
+        }
+        let fat_start = reserved;
+        let root_start = fat_start + fat_count * sectors_per_fat;
+        let root_sectors = (root_entries * DIR_ENTRY_SIZE as u64 + SECTOR_SIZE as u64 - 1) / SECTOR_SIZE as u64;
+        let data_start = root_start + root_sectors;
+        let clusters = (sectors.saturating_sub(data_start) / sectors_per_cluster) as usize;
+        if clusters < MIN_CLUSTERS || clusters >= MAX_CLUSTERS || sectors_per_fat * (SECTOR_SIZE as u64 / 2) < (clusters + FIRST_CLUSTER) as u64 {
+            return Err(EINVAL);
+        }
+        let fat_entries = clusters + FIRST_CLUSTER;
+        // whole sectors are cached, so that they can be written back as they are
+        let fat_sectors = (fat_entries * 2 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        let mut raw = vec![0_u8; fat_sectors * SECTOR_SIZE];
+        read_device(&*device, fat_start * SECTOR_SIZE as u64, &mut raw)?;
+        let fat = raw.chunks_exact(2).map(|entry| u16::from_le_bytes([entry[0], entry[1]])).collect();
+        let root_extent = Extent { offset : 0, addr : root_start * SECTOR_SIZE as u64, len : root_entries * DIR_ENTRY_SIZE as u64 };
+        let backing = BackingDev::new()?;
+        let root = Arc::new(Fat16Inode::new(ROOT_LOCATION, ATTR_DIRECTORY, 0, root_extent.len, &backing));
+        root.state.lock().extents = Some(Arc::new(vec![root_extent]));
+        Ok(Arc::new_cyclic(|this| Fat16Fs {
+            this         : this.clone(),
+            device,
+            backing,
+            sectors_per_cluster,
+            cluster_size : sectors_per_cluster * SECTOR_SIZE as u64,
+            fat_start,
+            sectors_per_fat,
+            fat_count,
+            data_start,
+            fat_entries,
+            fat          : SpinLock::new(FatTable::new(fat, fat_entries)),
+            inodes       : SpinLock::new(BTreeMap::new()),
+            root,
+        }))
+    }
+
+    /// Returns the device address of the first Byte of `cluster`
+    fn cluster_addr(&self, cluster:usize) -> u64 {
+        (self.data_start + (cluster - FIRST_CLUSTER) as u64 * self.sectors_per_cluster) * SECTOR_SIZE as u64
+    }
+
+    /// Returns the cluster holding the device address `addr`, in the data region
+    fn addr_cluster(&self, addr:u64) -> usize {
+        ((addr / SECTOR_SIZE as u64 - self.data_start) / self.sectors_per_cluster) as usize + FIRST_CLUSTER
+    }
+
+    fn is_cluster(&self, cluster:usize) -> bool {
+        cluster >= FIRST_CLUSTER && cluster < self.fat_entries
+    }
+
+    /// Returns the inode of the entry `info`
+    fn inode(&self, info:&DirEntryInfo) -> Arc<Fat16Inode> {
+        // '..' entries refer to the root directory with cluster 0
+        if info.attr & ATTR_DIRECTORY != 0 && info.cluster == 0 {
+            return self.root.clone();
+        }
+        self.inodes.lock().entry(info.location)
+            .or_insert_with(|| Arc::new(Fat16Inode::new(info.location, info.attr, info.cluster, info.size as u64, &self.backing)))
+            .clone()
+    }
+
+    pub(crate) fn root(&self) -> Arc<Fat16Inode> {
+        self.root.clone()
+    }
+
+    /// Returns the child `name` of the directory `dir`
+    pub(crate) fn lookup(&self, dir:&Fat16Inode, name:&str) -> KResult<Arc<Fat16Inode>> {
+        if name.len() > MAX_NAME {
+            return Err(ENAMETOOLONG);
+        }
+        let index = self.dir_index(dir)?;
+        let info = index.lookup(name).ok_or(ENOENT)?;
+        Ok(self.inode(info))
+    }
+}
+
+/// A file or directory of a FAT16 volume, as the VFS sees it
+struct Fat16Node {
+    fs    : Arc<Fat16Fs>,
+    inode : Arc<Fat16Inode>,
+}
+
+impl Fat16Fs {
+    fn node(&self, inode:Arc<Fat16Inode>) -> Arc<dyn Inode> {
+        Arc::new(Fat16Node { fs : self.this.upgrade().unwrap(), inode })
+    }
+}
+
+impl Inode for Fat16Node {
+    /// The location of the directory entry, unique in the volume
+    fn ino(&self) -> u64 {
+        self.inode.location
+    }
+
+    fn is_dir(&self) -> bool {
+        self.inode.is_dir()
+    }
+
+    fn lookup(&self, name:&str) -> KResult<Arc<dyn Inode>> {
+        if !self.inode.is_dir() {
+            return Err(ENOTDIR);
+        }
+        Ok(self.fs.node(self.fs.lookup(&self.inode, name)?))
+    }
+
+    fn create(&self, name:&str) -> KResult<Arc<dyn Inode>> {
+        Ok(self.fs.node(self.fs.create(&self.inode, name)?))
+    }
+
+    fn truncate(&self) -> KResult<()> {
+        self.fs.truncate(&self.inode)
+    }
+
+    fn open(&self, flags:u32) -> KResult<Arc<dyn FileOps>> {
+        if flags & O_ACCMODE != O_RDONLY && self.inode.attr & ATTR_READ_ONLY != 0 {
+            return Err(EACCES);
+        }
+        Ok(Arc::new(Fat16File {
+            fs        : self.fs.clone(),
+            inode     : self.inode.clone(),
+            readahead : SpinLock::new(Readahead::new()),
+        }))
+    }
+}
+
+impl FileSystem for Fat16Fs {
+    fn root_inode(&self) -> Arc<dyn Inode> {
+        self.node(self.root())
+    }
+
+    fn case_insensitive(&self) -> bool {
+        true
+    }
+
+    /// Writes back every file, then the FAT
+    fn sync(&self) -> KResult<()> {
+        let inodes : Vec<Arc<Fat16Inode>> = self.inodes.lock().values().cloned().collect();
+        let mut result = Ok(());
+        for inode in inodes {
+            if let Err(errno) = self.writeback(&inode) {
+                result = Err(errno);
+            }
+        }
+        self.flush_fat().and(result)
+    }
+}
+
+/// Mounts the boot partition at the root of the tree, if present
+pub(crate) fn init() {
+    if let Some(device) = block_device(BOOT_PARTITION) {
+        if let Ok(fs) = Fat16Fs::mount(device) {
+            let _ = mount("/", fs);
+        }
+    }
+}
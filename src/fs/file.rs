@@ -0,0 +1,291 @@
+use crate::block::*;
+use crate::mm::uaccess::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+
+use alloc::sync::Arc;
+use alloc::vec::Vec;
+use core::any::Any;
+
+// poll events
+pub(crate) const POLLIN  : u32 = 0x001;
+pub(crate) const POLLOUT : u32 = 0x004;
+pub(crate) const POLLERR : u32 = 0x008;
+pub(crate) const POLLHUP : u32 = 0x010;
+
+// file flags
+pub(crate) const O_RDONLY    : u32 = 0o0;
+pub(crate) const O_WRONLY    : u32 = 0o1;
+pub(crate) const O_RDWR      : u32 = 0o2;
+pub(crate) const O_ACCMODE   : u32 = 0o3;
+pub(crate) const O_CREAT     : u32 = 0o100;
+pub(crate) const O_EXCL      : u32 = 0o200;
+pub(crate) const O_TRUNC     : u32 = 0o1000;
+pub(crate) const O_NONBLOCK  : u32 = 0o4000;
+pub(crate) const O_DIRECT    : u32 = 0o40000;
+pub(crate) const O_DIRECTORY : u32 = 0o200000;
+pub(crate) const O_CLOEXEC   : u32 = 0o2000000;
+
+// the maximum number of files a process can keep open
+pub(crate) const MAX_FILES : usize = 64;
+
+// transfers through the system calls are bounced through a kernel buffer of this size
+const BOUNCE_SIZE : usize = 512;
+
+/// The operations supported by an open file
+///
+/// `offset` is the position of the transfer for seekable files, it is
+/// ignored by the others.
+pub(crate) trait FileOps : Any + Send + Sync {
+    fn read(&self, _file:&File, _buf:&mut [u8], _offset:u64) -> KResult<usize> {
+        Err(EINVAL)
+    }
+
+    fn write(&self, _file:&File, _buf:&[u8], _offset:u64) -> KResult<usize> {
+        Err(EINVAL)
+    }
+
+    /// Returns the events currently ready
+    fn poll(&self, _file:&File) -> u32 {
+        POLLIN | POLLOUT
+    }
+
+    /// Returns the queue notified when the ready events change
+    ///
+    /// Files without one never change their readiness.
+    fn wait_queue(&self, _file:&File) -> Option<&WaitQueue> {
+        None
+    }
+
+    /// Transfers `size` Bytes between the file at `offset` and the user
+    /// memory at `addr`, straight to or from the device, for the files
+    /// opened with O_DIRECT
+    ///
+    /// `op` is the operation on the file. Files which can do no better
+    /// than going through their cache do not support it.
+    fn direct_io(&self, _file:&File, _op:BlockOp, _addr:usize, _size:usize, _offset:u64) -> KResult<usize> {
+        Err(EINVAL)
+    }
+
+    /// Stores the data written to the file so far on its device
+    fn fsync(&self, _file:&File) -> KResult<()> {
+        Ok(())
+    }
+
+    /// Called when the last reference to the open file goes away
+    fn release(&self, _file:&File) {}
+}
+
+/// An object following an open file with no reference to it, told when
+/// the file goes away
+pub(crate) trait FileWatcher : Send + Sync {
+    fn file_released(&self, file:&File);
+}
+
+/// An open file, shared by all the descriptors referring to it
+pub(crate) struct File {
+    pub(crate) ops   : Arc<dyn FileOps>,
+    pub(crate) flags : u32,
+    position         : SpinLock<u64>,
+    watchers         : SpinLock<Vec<Arc<dyn FileWatcher>>>,
+}
+
+impl File {
+    pub(crate) fn new(ops:Arc<dyn FileOps>, flags:u32) -> Arc<File> {
+        Arc::new(File {
+            ops,
+            flags,
+            position : SpinLock::new(0),
+            watchers : SpinLock::new(Vec::new()),
+        })
+    }
+
+    /// Registers `watcher` to be told when the last reference to the file goes
+    pub(crate) fn add_watcher(&self, watcher:Arc<dyn FileWatcher>) {
+        self.watchers.lock().push(watcher);
+    }
+
+    /// Unregisters `watcher`
+    pub(crate) fn remove_watcher(&self, watcher:&Arc<dyn FileWatcher>) {
+        self.watchers.lock().retain(|other| !Arc::ptr_eq(other, watcher));
+    }
+
+    /// Returns the implementation of the file if it is of type `T`
+    pub(crate) fn downcast<T:FileOps>(&self) -> Option<&T> {
+        let ops : &dyn Any = &*self.ops;
+        ops.downcast_ref::<T>()
+    }
+
+    /// Reads at the current position, advancing it
+    ///
+    /// The position is not locked during the transfer, which may block.
+    pub(crate) fn read(&self, buf:&mut [u8]) -> KResult<usize> {
+        let position = *self.position.lock();
+        let count = self.ops.read(self, buf, position)?;
+        *self.position.lock() += count as u64;
+        Ok(count)
+    }
+
+    /// Writes at the current position, advancing it
+    ///
+    /// The position is not locked during the transfer, which may block.
+    pub(crate) fn write(&self, buf:&[u8]) -> KResult<usize> {
+        let position = *self.position.lock();
+        let count = self.ops.write(self, buf, position)?;
+        *self.position.lock() += count as u64;
+        Ok(count)
+    }
+
+    /// Reads at `offset`, leaving the current position untouched
+    pub(crate) fn read_at(&self, buf:&mut [u8], offset:u64) -> KResult<usize> {
+        self.ops.read(self, buf, offset)
+    }
+
+    /// Writes at `offset`, leaving the current position untouched
+    pub(crate) fn write_at(&self, buf:&[u8], offset:u64) -> KResult<usize> {
+        self.ops.write(self, buf, offset)
+    }
+
+    /// Runs a direct transfer with the user memory at `addr`, at `offset`
+    /// or at the current position if negative, advancing it in that case
+    pub(crate) fn direct_io(&self, op:BlockOp, addr:usize, size:usize, offset:i64) -> KResult<usize> {
+        if offset >= 0 {
+            return self.ops.direct_io(self, op, addr, size, offset as u64);
+        }
+        let position = *self.position.lock();
+        let count = self.ops.direct_io(self, op, addr, size, position)?;
+        *self.position.lock() += count as u64;
+        Ok(count)
+    }
+
+    pub(crate) fn poll(&self) -> u32 {
+        self.ops.poll(self)
+    }
+}
+
+impl Drop for File {
+    fn drop(&mut self) {
+        for watcher in core::mem::take(&mut *self.watchers.lock()) {
+            watcher.file_released(self);
+        }
+        self.ops.release(self);
+    }
+}
+
+/// The descriptors of a process
+pub(crate) struct FileTable {
+    files : [Option<Arc<File>>; MAX_FILES],
+}
+
+impl FileTable {
+    pub(crate) const fn new() -> Self {
+        FileTable {
+            files : [const { None }; MAX_FILES],
+        }
+    }
+
+    /// Stores `file` in the lowest free descriptor, returning it
+    pub(crate) fn install(&mut self, file:Arc<File>) -> KResult<usize> {
+        let fd = self.files.iter().position(|slot| slot.is_none()).ok_or(EMFILE)?;
+        self.files[fd] = Some(file);
+        Ok(fd)
+    }
+
+    /// Returns the file referred to by `fd`
+    pub(crate) fn get(&self, fd:usize) -> KResult<Arc<File>> {
+        self.files.get(fd).and_then(|slot| slot.clone()).ok_or(EBADF)
+    }
+
+    /// Releases the descriptor `fd`, returning the file it referred to
+    pub(crate) fn remove(&mut self, fd:usize) -> KResult<Arc<File>> {
+        self.files.get_mut(fd).and_then(|slot| slot.take()).ok_or(EBADF)
+    }
+}
+
+/// Returns the file referred to by the descriptor `fd` of the current process
+pub(crate) fn get_file(fd:usize) -> KResult<Arc<File>> {
+    current_process().ok_or(EBADF)?.files.lock().get(fd)
+}
+
+/// Installs `file` in the descriptors of the current process
+pub(crate) fn install_file(file:Arc<File>) -> KResult<usize> {
+    current_process().ok_or(EMFILE)?.files.lock().install(file)
+}
+
+/// Reads from `file` into the user buffer at `addr`
+///
+/// A negative `offset` means the current position of the file. Once some
+/// data was transferred, the read does not block waiting for more. Files
+/// opened with O_DIRECT transfer straight to the buffer.
+pub(crate) fn read_to_user(file:&File, addr:usize, size:usize, offset:i64) -> KResult<usize> {
+    if file.flags & O_DIRECT != 0 {
+        return file.direct_io(BlockOp::Read, addr, size, offset);
+    }
+    let mut bounce = [0_u8; BOUNCE_SIZE];
+    let mut done = 0;
+    while done < size {
+        if done > 0 && file.poll() & POLLIN == 0 {
+            break;
+        }
+        let chunk = core::cmp::min(size - done, BOUNCE_SIZE);
+        let count = if offset < 0 {
+            file.read(&mut bounce[..chunk])?
+        } else {
+            file.read_at(&mut bounce[..chunk], offset as u64 + done as u64)?
+        };
+        copy_to_user(addr + done, &bounce[..count])?;
+        done += count;
+        if count < chunk {
+            break;
+        }
+    }
+    Ok(done)
+}
+
+/// Writes the user buffer at `addr` into `file`
+///
+/// A negative `offset` means the current position of the file. Files
+/// opened with O_DIRECT transfer straight from the buffer.
+pub(crate) fn write_from_user(file:&File, addr:usize, size:usize, offset:i64) -> KResult<usize> {
+    if file.flags & O_DIRECT != 0 {
+        return file.direct_io(BlockOp::Write, addr, size, offset);
+    }
+    let mut bounce = [0_u8; BOUNCE_SIZE];
+    let mut done = 0;
+    while done < size {
+        let chunk = core::cmp::min(size - done, BOUNCE_SIZE);
+        copy_from_user(&mut bounce[..chunk], addr + done)?;
+        let count = if offset < 0 {
+            file.write(&bounce[..chunk])?
+        } else {
+            file.write_at(&bounce[..chunk], offset as u64 + done as u64)?
+        };
+        done += count;
+        if count < chunk {
+            break;
+        }
+    }
+    Ok(done)
+}
+
+pub(crate) fn sys_read(fd:usize, addr:usize, size:usize) -> KResult<usize> {
+    read_to_user(&*get_file(fd)?, addr, size, -1)
+}
+
+pub(crate) fn sys_write(fd:usize, addr:usize, size:usize) -> KResult<usize> {
+    write_from_user(&*get_file(fd)?, addr, size, -1)
+}
+
+pub(crate) fn sys_fsync(fd:usize) -> KResult<usize> {
+    let file = get_file(fd)?;
+    file.ops.fsync(&file)?;
+    Ok(0)
+}
+
+pub(crate) fn sys_close(fd:usize) -> KResult<usize> {
+    let file = current_process().ok_or(EBADF)?.files.lock().remove(fd)?;
+    // the last reference is released outside of the descriptor table lock
+    drop(file);
+    Ok(0)
+}
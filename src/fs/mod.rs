@@ -0,0 +1,7 @@
+pub(crate) mod console;
+pub(crate) mod epoll;
+pub(crate) mod fat16;
+pub(crate) mod file;
+pub(crate) mod pipe;
+pub(crate) mod tmpfs;
+pub(crate) mod vfs;
@@ -0,0 +1,587 @@
+use crate::fs::file::*;
+use crate::mm::*;
+use crate::mm::frame::*;
+use crate::mm::uaccess::*;
+use crate::mm::vma::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+
+use alloc::sync::Arc;
+use core::slice;
+
+// the capacity of a pipe, in page buffers
+pub(crate) const PIPE_BUFFERS : usize = 16;
+
+// pipe buffer flags
+pub(crate) const PIPE_BUF_CAN_MERGE : u32 = 1 << 0;
+
+// splice flags
+pub(crate) const SPLICE_F_MOVE     : u32 = 0x1;
+pub(crate) const SPLICE_F_NONBLOCK : u32 = 0x2;
+pub(crate) const SPLICE_F_MORE     : u32 = 0x4;
+pub(crate) const SPLICE_F_GIFT     : u32 = 0x8;
+
+// the maximum number of segments accepted by vmsplice
+pub(crate) const UIO_MAXIOV : usize = 1024;
+
+/// A reference to `len` Bytes at `offset` in the frame at `page`
+///
+/// Every buffer in a pipe holds a reference to its frame. Writes append to
+/// the last buffer only if it can be merged, that is when the pipe owns its
+/// page, pages spliced in from elsewhere are never written.
+#[derive(Clone, Copy)]
+pub(crate) struct PipeBuffer {
+    pub(crate) page   : usize,
+    pub(crate) offset : usize,
+    pub(crate) len    : usize,
+    pub(crate) flags  : u32,
+}
+
+impl PipeBuffer {
+    const EMPTY : PipeBuffer = PipeBuffer { page : 0, offset : 0, len : 0, flags : 0 };
+
+    /// Returns the referenced Bytes, through the direct map
+    fn data(&self) -> &[u8] {
+        unsafe {
+            slice::from_raw_parts(phys_to_virt(self.page + self.offset) as *const u8, self.len)
+        }
+    }
+}
+
+/// A segment of user memory, as passed to vmsplice
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct IoVec {
+    base : usize,
+    len  : usize,
+}
+
+struct PipeRing {
+    buffers : [PipeBuffer; PIPE_BUFFERS],
+    head    : usize,
+    count   : usize,
+    readers : usize,
+    writers : usize,
+}
+
+impl PipeRing {
+    fn is_full(&self) -> bool {
+        self.count == PIPE_BUFFERS
+    }
+
+    fn last(&mut self) -> Option<&mut PipeBuffer> {
+        if self.count == 0 {
+            return None;
+        }
+        Some(&mut self.buffers[(self.head + self.count - 1) % PIPE_BUFFERS])
+    }
+}
+
+/// A unidirectional channel between a read end and a write end
+///
+/// The data is kept as a ring of references to pages, so that splicing can
+/// move them between pipes, files and user memory without copying.
+pub(crate) struct Pipe {
+    ring    : SpinLock<PipeRing>,
+    readers : WaitQueue,
+    writers : WaitQueue,
+}
+
+/// One of the ends of a pipe, as an open file
+pub(crate) struct PipeEnd {
+    pipe  : Arc<Pipe>,
+    write : bool,
+}
+
+impl Pipe {
+    /// Creates a pipe, returning its read and write ends
+    pub(crate) fn new(flags:u32) -> (Arc<File>, Arc<File>) {
+        let pipe = Arc::new(Pipe {
+            ring    : SpinLock::new(PipeRing {
+                buffers : [PipeBuffer::EMPTY; PIPE_BUFFERS],
+                head    : 0,
+                count   : 0,
+                readers : 1,
+                writers : 1,
+            }),
+            readers : WaitQueue::new(),
+            writers : WaitQueue::new(),
+        });
+        let reader = File::new(Arc::new(PipeEnd { pipe : pipe.clone(), write : false }), flags);
+        let writer = File::new(Arc::new(PipeEnd { pipe, write : true }), flags);
+        (reader, writer)
+    }
+
+    /// Waits until a buffer can be pushed
+    ///
+    /// Fails with `EPIPE` once all the read ends are closed.
+    fn wait_room(&self, nonblock:bool) -> KResult<()> {
+        loop {
+            let ring = self.ring.lock();
+            if ring.readers == 0 {
+                return Err(EPIPE);
+            }
+            if !ring.is_full() {
+                return Ok(());
+            }
+            drop(ring);
+            if nonblock {
+                return Err(EAGAIN);
+            }
+            self.writers.sleep();
+        }
+    }
+
+    /// Waits until some data is available
+    ///
+    /// Returns false once the pipe is empty and all the write ends are closed.
+    fn wait_data(&self, nonblock:bool) -> KResult<bool> {
+        loop {
+            let ring = self.ring.lock();
+            if ring.count > 0 {
+                return Ok(true);
+            }
+            if ring.writers == 0 {
+                return Ok(false);
+            }
+            drop(ring);
+            if nonblock {
+                return Err(EAGAIN);
+            }
+            self.readers.sleep();
+        }
+    }
+
+    /// Appends `buffer` to the ring, taking over its reference
+    ///
+    /// The caller must have made sure with `wait_room` that there is room.
+    fn push(&self, buffer:PipeBuffer) {
+        let mut ring = self.ring.lock();
+        let tail = (ring.head + ring.count) % PIPE_BUFFERS;
+        ring.buffers[tail] = buffer;
+        ring.count += 1;
+        drop(ring);
+        self.readers.notify(POLLIN);
+    }
+
+    /// Returns the first buffer with a new reference to its page
+    ///
+    /// The copy cannot be merged, its page may still be shared with the pipe.
+    fn peek(&self) -> Option<PipeBuffer> {
+        let ring = self.ring.lock();
+        if ring.count == 0 {
+            return None;
+        }
+        let mut buffer = ring.buffers[ring.head];
+        get_frame(buffer.page);
+        buffer.flags &= !PIPE_BUF_CAN_MERGE;
+        Some(buffer)
+    }
+
+    /// Drops the first `count` Bytes of the first buffer, releasing it once empty
+    fn consume(&self, count:usize) {
+        let mut ring = self.ring.lock();
+        let head = ring.head;
+        let buffer = &mut ring.buffers[head];
+        buffer.offset += count;
+        buffer.len -= count;
+        if buffer.len == 0 {
+            put_frame(buffer.page);
+            ring.head = (head + 1) % PIPE_BUFFERS;
+            ring.count -= 1;
+        }
+        drop(ring);
+        self.writers.notify(POLLOUT);
+    }
+}
+
+impl Drop for Pipe {
+    fn drop(&mut self) {
+        let ring = self.ring.lock();
+        for i in 0..ring.count {
+            put_frame(ring.buffers[(ring.head + i) % PIPE_BUFFERS].page);
+        }
+    }
+}
+
+impl FileOps for PipeEnd {
+    /// Reads the available bytes, waiting for some if the pipe is empty
+    ///
+    /// Returns 0 once the pipe is empty and all the write ends are closed.
+    fn read(&self, file:&File, buf:&mut [u8], _offset:u64) -> KResult<usize> {
+        if self.write {
+            return Err(EBADF);
+        }
+        if !self.pipe.wait_data(file.flags & O_NONBLOCK != 0)? {
+            return Ok(0);
+        }
+        let mut done = 0;
+        while done < buf.len() {
+            let buffer = match self.pipe.peek() {
+                Some(buffer) => buffer,
+                None         => break,
+            };
+            let count = core::cmp::min(buffer.len, buf.len() - done);
+            buf[done..done + count].copy_from_slice(&buffer.data()[..count]);
+            put_frame(buffer.page);
+            self.pipe.consume(count);
+            done += count;
+        }
+        Ok(done)
+    }
+
+    /// Writes all the bytes, waiting for room while the pipe is full
+    ///
+    /// The bytes are appended to the last page when it belongs to the pipe,
+    /// otherwise they go to a new one. Non-blocking writes stop at the first
+    /// full pipe.
+    fn write(&self, file:&File, buf:&[u8], _offset:u64) -> KResult<usize> {
+        if !self.write {
+            return Err(EBADF);
+        }
+        let mut done = 0;
+        while done < buf.len() {
+            let mut ring = self.pipe.ring.lock();
+            if ring.readers == 0 {
+                return Err(EPIPE);
+            }
+            if let Some(last) = ring.last() {
+                let end = last.offset + last.len;
+                if last.flags & PIPE_BUF_CAN_MERGE != 0 && end < PAGE_SIZE {
+                    let count = core::cmp::min(buf.len() - done, PAGE_SIZE - end);
+                    let dst = phys_to_virt(last.page + end) as *mut u8;
+                    unsafe {
+                        slice::from_raw_parts_mut(dst, count).copy_from_slice(&buf[done..done + count]);
+                    }
+                    last.len += count;
+                    done += count;
+                    drop(ring);
+                    self.pipe.readers.notify(POLLIN);
+                    continue;
+                }
+            }
+            let full = ring.is_full();
+            drop(ring);
+            if full {
+                if file.flags & O_NONBLOCK != 0 {
+                    return if done > 0 { Ok(done) } else { Err(EAGAIN) };
+                }
+                self.pipe.writers.sleep();
+                continue;
+            }
+            let page = match alloc_frame() {
+                Some(page) => page,
+                None       => return if done > 0 { Ok(done) } else { Err(ENOMEM) },
+            };
+            let count = core::cmp::min(buf.len() - done, PAGE_SIZE);
+            unsafe {
+                slice::from_raw_parts_mut(phys_to_virt(page) as *mut u8, count).copy_from_slice(&buf[done..done + count]);
+            }
+            self.pipe.push(PipeBuffer { page, offset : 0, len : count, flags : PIPE_BUF_CAN_MERGE });
+            done += count;
+        }
+        Ok(done)
+    }
+
+    fn poll(&self, _file:&File) -> u32 {
+        let ring = self.pipe.ring.lock();
+        if self.write {
+            if ring.readers == 0 {
+                POLLOUT | POLLERR
+            } else if !ring.is_full() {
+                POLLOUT
+            } else {
+                0
+            }
+        } else {
+            let mut events = if ring.count > 0 { POLLIN } else { 0 };
+            if ring.writers == 0 {
+                events |= POLLHUP;
+            }
+            events
+        }
+    }
+
+    fn wait_queue(&self, _file:&File) -> Option<&WaitQueue> {
+        Some(if self.write { &self.pipe.writers } else { &self.pipe.readers })
+    }
+
+    fn release(&self, _file:&File) {
+        let mut ring = self.pipe.ring.lock();
+        if self.write {
+            ring.writers -= 1;
+            drop(ring);
+            self.pipe.readers.notify(POLLHUP);
+        } else {
+            ring.readers -= 1;
+            drop(ring);
+            self.pipe.writers.notify(POLLERR);
+        }
+    }
+}
+
+/// Creates a pipe, storing the descriptors of its read and write ends at `addr`
+pub(crate) fn sys_pipe2(addr:usize, flags:u32) -> KResult<usize> {
+    if flags & !(O_NONBLOCK | O_CLOEXEC) != 0 {
+        return Err(EINVAL);
+    }
+    let (reader, writer) = Pipe::new(flags & O_NONBLOCK);
+    let process = current_process().ok_or(EMFILE)?;
+    let mut files = process.files.lock();
+    let read_fd = files.install(reader)?;
+    let write_fd = match files.install(writer) {
+        Ok(fd)     => fd,
+        Err(errno) => {
+            let _ = files.remove(read_fd);
+            return Err(errno);
+        },
+    };
+    drop(files);
+    if let Err(errno) = write_user(addr, &[read_fd as i32, write_fd as i32]) {
+        let mut files = process.files.lock();
+        let _ = files.remove(read_fd);
+        let _ = files.remove(write_fd);
+        return Err(errno);
+    }
+    Ok(0)
+}
+
+/// Returns the pipe behind `file` if it is the requested end of one
+fn pipe_end(file:&File, write:bool) -> KResult<Option<&Arc<Pipe>>> {
+    match file.downcast::<PipeEnd>() {
+        Some(end) if end.write == write => Ok(Some(&end.pipe)),
+        Some(_)                         => Err(EBADF),
+        None                            => Ok(None),
+    }
+}
+
+/// Reads the file offset at the user address `addr`, if any
+fn splice_offset(addr:usize, pipe:bool) -> KResult<i64> {
+    if addr == 0 {
+        return Ok(-1);
+    }
+    if pipe {
+        return Err(ESPIPE);
+    }
+    let offset = read_user::<i64>(addr)?;
+    if offset < 0 {
+        return Err(EINVAL);
+    }
+    Ok(offset)
+}
+
+/// Moves the references to the pages of `src` into `dst`
+fn splice_pipe_to_pipe(src:&Pipe, dst:&Pipe, size:usize, nonblock:bool) -> KResult<usize> {
+    let mut done = 0;
+    while done < size {
+        match src.wait_data(nonblock || done > 0) {
+            Ok(true)           => {},
+            Ok(false)          => break,
+            Err(_) if done > 0 => break,
+            Err(errno)         => return Err(errno),
+        }
+        match dst.wait_room(nonblock || done > 0) {
+            Ok(())             => {},
+            Err(EPIPE)         => return if done > 0 { Ok(done) } else { Err(EPIPE) },
+            Err(_) if done > 0 => break,
+            Err(errno)         => return Err(errno),
+        }
+        let mut buffer = match src.peek() {
+            Some(buffer) => buffer,
+            None         => continue,
+        };
+        buffer.len = core::cmp::min(buffer.len, size - done);
+        src.consume(buffer.len);
+        done += buffer.len;
+        dst.push(buffer);
+    }
+    Ok(done)
+}
+
+/// Writes the pages of `src` to `dst`, straight from the direct map
+fn splice_pipe_to_file(src:&Pipe, dst:&File, size:usize, mut offset:i64, nonblock:bool) -> KResult<(usize, i64)> {
+    let mut done = 0;
+    while done < size {
+        match src.wait_data(nonblock || done > 0) {
+            Ok(true)           => {},
+            Ok(false)          => break,
+            Err(_) if done > 0 => break,
+            Err(errno)         => return Err(errno),
+        }
+        let buffer = match src.peek() {
+            Some(buffer) => buffer,
+            None         => continue,
+        };
+        let chunk = core::cmp::min(buffer.len, size - done);
+        let result = if offset < 0 {
+            dst.write(&buffer.data()[..chunk])
+        } else {
+            dst.write_at(&buffer.data()[..chunk], offset as u64)
+        };
+        put_frame(buffer.page);
+        let count = match result {
+            Ok(count)          => count,
+            Err(_) if done > 0 => break,
+            Err(errno)         => return Err(errno),
+        };
+        src.consume(count);
+        done += count;
+        if offset >= 0 {
+            offset += count as i64;
+        }
+        if count < chunk {
+            break;
+        }
+    }
+    Ok((done, offset))
+}
+
+/// Reads `src` into new pages and pushes them into `dst`
+fn splice_file_to_pipe(src:&File, dst:&Pipe, size:usize, mut offset:i64, nonblock:bool) -> KResult<(usize, i64)> {
+    let mut done = 0;
+    while done < size {
+        match dst.wait_room(nonblock || done > 0) {
+            Ok(())             => {},
+            Err(_) if done > 0 => break,
+            Err(errno)         => return Err(errno),
+        }
+        let page = alloc_frame().ok_or(ENOMEM)?;
+        let chunk = core::cmp::min(size - done, PAGE_SIZE);
+        let buf = unsafe { slice::from_raw_parts_mut(phys_to_virt(page) as *mut u8, chunk) };
+        let result = if offset < 0 {
+            src.read(buf)
+        } else {
+            src.read_at(buf, offset as u64)
+        };
+        let count = match result {
+            Ok(count) if count > 0 => count,
+            Ok(_)                  => { free_frame(page); break },
+            Err(_) if done > 0     => { free_frame(page); break },
+            Err(errno)             => { free_frame(page); return Err(errno) },
+        };
+        dst.push(PipeBuffer { page, offset : 0, len : count, flags : PIPE_BUF_CAN_MERGE });
+        done += count;
+        if offset >= 0 {
+            offset += count as i64;
+        }
+        if count < chunk {
+            break;
+        }
+    }
+    Ok((done, offset))
+}
+
+/// Moves up to `size` Bytes from `fd_in` to `fd_out`, one of which must be a pipe
+///
+/// Pages move between pipes by reference. Between a pipe and a file the
+/// only copy is the one done by the file, to or from the pipe pages. The
+/// offsets at `off_in` and `off_out`, if given, are used and updated in
+/// place of the positions of the files, they are not allowed for pipes.
+pub(crate) fn sys_splice(fd_in:usize, off_in:usize, fd_out:usize, off_out:usize, size:usize, flags:u32) -> KResult<usize> {
+    if flags & !(SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE | SPLICE_F_GIFT) != 0 {
+        return Err(EINVAL);
+    }
+    let file_in = get_file(fd_in)?;
+    let file_out = get_file(fd_out)?;
+    let pipe_in = pipe_end(&file_in, false)?;
+    let pipe_out = pipe_end(&file_out, true)?;
+    let offset_in = splice_offset(off_in, pipe_in.is_some())?;
+    let offset_out = splice_offset(off_out, pipe_out.is_some())?;
+    let nonblock = flags & SPLICE_F_NONBLOCK != 0;
+    match (pipe_in, pipe_out) {
+        (Some(src), Some(dst)) => {
+            if Arc::ptr_eq(src, dst) {
+                return Err(EINVAL);
+            }
+            splice_pipe_to_pipe(src, dst, size, nonblock || file_in.flags & O_NONBLOCK != 0)
+        },
+        (Some(src), None) => {
+            let (done, offset) = splice_pipe_to_file(src, &file_out, size, offset_out, nonblock || file_in.flags & O_NONBLOCK != 0)?;
+            if off_out != 0 {
+                write_user(off_out, &offset)?;
+            }
+            Ok(done)
+        },
+        (None, Some(dst)) => {
+            let (done, offset) = splice_file_to_pipe(&file_in, dst, size, offset_in, nonblock || file_out.flags & O_NONBLOCK != 0)?;
+            if off_in != 0 {
+                write_user(off_in, &offset)?;
+            }
+            Ok(done)
+        },
+        (None, None) => Err(EINVAL),
+    }
+}
+
+/// Pushes `size` Bytes of user memory at `addr`, within a single page, into `pipe`
+///
+/// Anonymous memory is referenced in place. With `gift` a whole private
+/// page is taken away from the address space instead, the next access to
+/// it finds a zeroed page. Any other memory is copied into a new page.
+fn vmsplice_page(pipe:&Pipe, addr:usize, size:usize, gift:bool) -> KResult<()> {
+    let process = current_process().ok_or(EFAULT)?;
+    let anonymous = match process.space.vmas.find(addr) {
+        Some(vma) => vma.flags & VMA_ANONYMOUS != 0,
+        None      => return Err(EFAULT),
+    };
+    if anonymous {
+        let paddr = process.space.fault_in(addr)?;
+        let offset = addr - page_align_down(addr);
+        if gift && size == PAGE_SIZE && offset == 0
+        && process.space.vmas.find(addr).map_or(false, |vma| vma.flags & VMA_SHARED == 0) {
+            if let Some(paddr) = process.space.take_page(addr) {
+                pipe.push(PipeBuffer { page : paddr, offset : 0, len : size, flags : PIPE_BUF_CAN_MERGE });
+                return Ok(());
+            }
+        }
+        get_frame(paddr);
+        pipe.push(PipeBuffer { page : paddr, offset, len : size, flags : 0 });
+        return Ok(());
+    }
+    let page = alloc_frame().ok_or(ENOMEM)?;
+    let buf = unsafe { slice::from_raw_parts_mut(phys_to_virt(page) as *mut u8, size) };
+    if let Err(errno) = copy_from_user(buf, addr) {
+        free_frame(page);
+        return Err(errno);
+    }
+    pipe.push(PipeBuffer { page, offset : 0, len : size, flags : PIPE_BUF_CAN_MERGE });
+    Ok(())
+}
+
+/// Maps the `count` user segments described at `iov` into the pipe `fd`
+///
+/// The pages are pushed page by page, see `vmsplice_page`.
+pub(crate) fn sys_vmsplice(fd:usize, iov:usize, count:usize, flags:u32) -> KResult<usize> {
+    if count > UIO_MAXIOV || flags & !(SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE | SPLICE_F_GIFT) != 0 {
+        return Err(EINVAL);
+    }
+    let file = get_file(fd)?;
+    let pipe = pipe_end(&file, true)?.ok_or(EBADF)?;
+    let nonblock = flags & SPLICE_F_NONBLOCK != 0 || file.flags & O_NONBLOCK != 0;
+    let mut done = 0;
+    for i in 0..count {
+        let segment = read_user::<IoVec>(iov + i * core::mem::size_of::<IoVec>())?;
+        if !access_ok(segment.base, segment.len) {
+            return if done > 0 { Ok(done) } else { Err(EFAULT) };
+        }
+        let mut addr = segment.base;
+        let end = segment.base + segment.len;
+        while addr < end {
+            match pipe.wait_room(nonblock || done > 0) {
+                Ok(())             => {},
+                Err(_) if done > 0 => return Ok(done),
+                Err(errno)         => return Err(errno),
+            }
+            let chunk = core::cmp::min(end, page_align_down(addr) + PAGE_SIZE) - addr;
+            match vmsplice_page(pipe, addr, chunk, flags & SPLICE_F_GIFT != 0) {
+                Ok(())             => {},
+                Err(_) if done > 0 => return Ok(done),
+                Err(errno)         => return Err(errno),
+            }
+            addr += chunk;
+            done += chunk;
+        }
+    }
+    Ok(done)
+}
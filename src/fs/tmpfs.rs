@@ -0,0 +1,327 @@
+use crate::fs::file::*;
+use crate::fs::vfs::*;
+use crate::mm::*;
+use crate::mm::filemap::*;
+use crate::mm::frame::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+
+use alloc::collections::BTreeMap;
+use alloc::string::String;
+use alloc::sync::{Arc, Weak};
+use alloc::vec;
+use alloc::vec::Vec;
+use core::ptr;
+use core::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+
+// where the tmpfs is mounted at boot, when there is a root volume
+const TMPFS_MOUNT : &str = "/tmp";
+
+// the share of memory a tmpfs may hold, in percents, as in Linux
+const TMPFS_SIZE_RATIO : usize = 50;
+
+// the frames of a huge page, 2 MiB
+const HUGE_ORDER : usize = 9;
+const HUGE_PAGES : u64   = 1 << HUGE_ORDER;
+
+// the largest file, so that offsets never overflow
+const MAX_FILE_SIZE : u64 = i64::MAX as u64;
+
+/// The state shared by the inodes of a tmpfs
+struct TmpSuper {
+    next_ino  : AtomicU64,
+    /// The pages held by the files, in memory or swapped out
+    pages     : AtomicUsize,
+    max_pages : usize,
+    /// Whether the large files get huge pages
+    huge      : bool,
+}
+
+impl TmpSuper {
+    /// Charges `count` pages to the filesystem, failing when it is full
+    fn reserve(&self, count:usize) -> KResult<()> {
+        let mut pages = self.pages.load(Ordering::Relaxed);
+        loop {
+            if pages + count > self.max_pages {
+                return Err(ENOSPC);
+            }
+            match self.pages.compare_exchange_weak(pages, pages + count, Ordering::Relaxed, Ordering::Relaxed) {
+                Ok(_)      => return Ok(()),
+                Err(other) => pages = other,
+            }
+        }
+    }
+
+    fn unreserve(&self, count:usize) {
+        self.pages.fetch_sub(count, Ordering::Relaxed);
+    }
+}
+
+/// Allocates a huge page, zeroed, as single frames
+///
+/// The frames are cached, and may be swapped out, one by one: only their
+/// allocation and their placement in memory are shared.
+fn alloc_huge_frames() -> Option<Vec<usize>> {
+    let paddr = alloc_frames(HUGE_ORDER)?;
+    unsafe {
+        ptr::write_bytes(phys_to_virt(paddr) as *mut u8, 0, PAGE_SIZE << HUGE_ORDER);
+    }
+    split_frames(paddr, HUGE_ORDER);
+    Some((0..HUGE_PAGES as usize).map(|i| paddr + i * PAGE_SIZE).collect())
+}
+
+/// A file or directory of a tmpfs
+///
+/// A directory is a map of the names of its entries to their inodes. The
+/// content of a regular file lives in its page cache only, which is swap
+/// backed: under pressure reclaim moves the pages to swap, and they are
+/// read back on the next access. A page never written is a hole, read as
+/// zeroes and taking no memory.
+pub(crate) struct TmpInode {
+    ino   : u64,
+    this  : Weak<TmpInode>,
+    sb    : Arc<TmpSuper>,
+    /// The entries, for a directory
+    dir   : Option<SpinLock<BTreeMap<String, Arc<TmpInode>>>>,
+    size  : AtomicU64,
+    cache : PageCache,
+}
+
+impl TmpInode {
+    fn new(sb:&Arc<TmpSuper>, dir:bool) -> Arc<Self> {
+        Arc::new_cyclic(|this| TmpInode {
+            ino   : sb.next_ino.fetch_add(1, Ordering::Relaxed),
+            this  : this.clone(),
+            sb    : sb.clone(),
+            dir   : if dir { Some(SpinLock::new(BTreeMap::new())) } else { None },
+            size  : AtomicU64::new(0),
+            cache : PageCache::swap_backed(),
+        })
+    }
+
+    /// Returns the pages held by the file, in memory or swapped out
+    fn held_pages(&self) -> usize {
+        self.cache.page_count() + self.cache.swapped_count()
+    }
+
+    /// Returns the frame of the page `index`, referenced, filling the hole
+    /// there with zeroes if needed
+    ///
+    /// `end` is the size the file is about to reach. A hole is filled a
+    /// huge page at a time when the whole aligned 2 MiB around the page is
+    /// a hole and lies within `end`, as with `huge=within_size` in Linux,
+    /// so that its pages are physically contiguous and come at the cost of
+    /// a single allocation, and no memory is held past the end of the
+    /// file. Single pages are used otherwise, or when no huge page is free.
+    fn get_page(&self, index:u64, end:u64) -> KResult<usize> {
+        loop {
+            if let Some(frame) = self.cache.find_or_swap_in(index)? {
+                return Ok(frame);
+            }
+            let start = index & !(HUGE_PAGES - 1);
+            let huge = self.sb.huge && (start + HUGE_PAGES) * PAGE_SIZE as u64 <= end
+                && self.cache.is_range_empty(start, start + HUGE_PAGES)
+                && self.sb.reserve(HUGE_PAGES as usize).is_ok();
+            let (first, frames) = match huge.then(alloc_huge_frames).flatten() {
+                Some(frames) => (start, frames),
+                None         => {
+                    if huge {
+                        self.sb.unreserve(HUGE_PAGES as usize);
+                    }
+                    self.sb.reserve(1)?;
+                    match alloc_zeroed_frame() {
+                        Some(frame) => (index, vec![frame]),
+                        None        => {
+                            self.sb.unreserve(1);
+                            return Err(ENOMEM);
+                        },
+                    }
+                },
+            };
+            let added = self.cache.add_new_pages(first, &frames);
+            self.sb.unreserve(frames.len() - added);
+        }
+    }
+
+    /// Reads from `offset` into `buf`, returning how much was read
+    fn read(&self, buf:&mut [u8], offset:u64) -> KResult<usize> {
+        let size = self.size.load(Ordering::Acquire);
+        if offset >= size {
+            return Ok(0);
+        }
+        let count = core::cmp::min(buf.len() as u64, size - offset) as usize;
+        let mut done = 0;
+        while done < count {
+            let position = offset + done as u64;
+            let index = position / PAGE_SIZE as u64;
+            let skip = (position % PAGE_SIZE as u64) as usize;
+            let chunk = core::cmp::min(count - done, PAGE_SIZE - skip);
+            match self.cache.find_or_swap_in(index) {
+                Ok(Some(frame))    => {
+                    unsafe {
+                        ptr::copy_nonoverlapping((phys_to_virt(frame) + skip) as *const u8, buf[done..].as_mut_ptr(), chunk);
+                    }
+                    put_frame(frame);
+                },
+                Ok(None)           => buf[done..done + chunk].fill(0),
+                Err(_) if done > 0 => break,
+                Err(errno)         => return Err(errno),
+            }
+            done += chunk;
+        }
+        Ok(done)
+    }
+
+    /// Writes `buf` from `offset`, returning how much was written
+    fn write(&self, buf:&[u8], offset:u64) -> KResult<usize> {
+        if offset >= MAX_FILE_SIZE {
+            return Err(EFBIG);
+        }
+        let count = core::cmp::min(buf.len() as u64, MAX_FILE_SIZE - offset) as usize;
+        let end = core::cmp::max(self.size.load(Ordering::Acquire), offset + count as u64);
+        let mut done = 0;
+        while done < count {
+            let position = offset + done as u64;
+            let index = position / PAGE_SIZE as u64;
+            let skip = (position % PAGE_SIZE as u64) as usize;
+            let chunk = core::cmp::min(count - done, PAGE_SIZE - skip);
+            let frame = match self.get_page(index, end) {
+                Ok(frame)          => frame,
+                Err(_) if done > 0 => break,
+                Err(errno)         => return Err(errno),
+            };
+            unsafe {
+                ptr::copy_nonoverlapping(buf[done..].as_ptr(), (phys_to_virt(frame) + skip) as *mut u8, chunk);
+            }
+            put_frame(frame);
+            done += chunk;
+            self.size.fetch_max(position + chunk as u64, Ordering::AcqRel);
+        }
+        Ok(done)
+    }
+}
+
+impl Drop for TmpInode {
+    fn drop(&mut self) {
+        self.sb.unreserve(self.held_pages());
+    }
+}
+
+impl Inode for TmpInode {
+    fn ino(&self) -> u64 {
+        self.ino
+    }
+
+    fn is_dir(&self) -> bool {
+        self.dir.is_some()
+    }
+
+    fn lookup(&self, name:&str) -> KResult<Arc<dyn Inode>> {
+        let dir = self.dir.as_ref().ok_or(ENOTDIR)?;
+        match dir.lock().get(name) {
+            Some(inode) => Ok(inode.clone()),
+            None        => Err(ENOENT),
+        }
+    }
+
+    fn create(&self, name:&str) -> KResult<Arc<dyn Inode>> {
+        let dir = self.dir.as_ref().ok_or(ENOTDIR)?;
+        let mut entries = dir.lock();
+        if entries.contains_key(name) {
+            return Err(EEXIST);
+        }
+        let inode = TmpInode::new(&self.sb, false);
+        entries.insert(String::from(name), inode.clone());
+        Ok(inode)
+    }
+
+    fn unlink(&self, name:&str) -> KResult<()> {
+        let dir = self.dir.as_ref().ok_or(ENOTDIR)?;
+        let mut entries = dir.lock();
+        match entries.get(name) {
+            Some(inode) if inode.is_dir() => return Err(EISDIR),
+            Some(_)                       => {},
+            None                          => return Err(ENOENT),
+        }
+        // the content goes with the last reference, outside of the lock
+        let inode = entries.remove(name);
+        drop(entries);
+        drop(inode);
+        Ok(())
+    }
+
+    /// The pages must not be in use, as when opening the file
+    fn truncate(&self) -> KResult<()> {
+        if self.is_dir() {
+            return Err(EISDIR);
+        }
+        self.size.store(0, Ordering::Release);
+        let held = self.held_pages();
+        self.cache.truncate_pages(0);
+        self.sb.unreserve(held - self.held_pages());
+        Ok(())
+    }
+
+    fn open(&self, _flags:u32) -> KResult<Arc<dyn FileOps>> {
+        let inode = self.this.upgrade().ok_or(ENOENT)?;
+        Ok(Arc::new(TmpFile { inode }))
+    }
+}
+
+/// A file or directory of a tmpfs, opened
+pub(crate) struct TmpFile {
+    inode : Arc<TmpInode>,
+}
+
+impl FileOps for TmpFile {
+    fn read(&self, file:&File, buf:&mut [u8], offset:u64) -> KResult<usize> {
+        if file.flags & O_ACCMODE == O_WRONLY {
+            return Err(EBADF);
+        }
+        if self.inode.is_dir() {
+            return Err(EISDIR);
+        }
+        self.inode.read(buf, offset)
+    }
+
+    fn write(&self, file:&File, buf:&[u8], offset:u64) -> KResult<usize> {
+        if file.flags & O_ACCMODE == O_RDONLY {
+            return Err(EBADF);
+        }
+        self.inode.write(buf, offset)
+    }
+}
+
+/// A filesystem in memory, built on the page cache
+///
+/// Metadata never leaves memory and data only goes to swap, the block
+/// layer is never involved. A tmpfs holds up to half of the memory.
+pub(crate) struct TmpFs {
+    root : Arc<TmpInode>,
+}
+
+impl TmpFs {
+    /// Creates an empty tmpfs, giving huge pages to its large files if `huge`
+    pub(crate) fn new(huge:bool) -> Arc<Self> {
+        let sb = Arc::new(TmpSuper {
+            next_ino  : AtomicU64::new(1),
+            pages     : AtomicUsize::new(0),
+            max_pages : managed_frame_count() * TMPFS_SIZE_RATIO / 100,
+            huge,
+        });
+        Arc::new(TmpFs { root : TmpInode::new(&sb, true) })
+    }
+}
+
+impl FileSystem for TmpFs {
+    fn root_inode(&self) -> Arc<dyn Inode> {
+        self.root.clone()
+    }
+}
+
+/// Mounts a tmpfs on '/tmp', or at the root of the tree if there is no
+/// root volume
+pub(crate) fn init() {
+    let path = if root_mount().is_some() { TMPFS_MOUNT } else { "/" };
+    let _ = mount(path, TmpFs::new(true));
+}
@@ -0,0 +1,346 @@
+use crate::fs::vfs::*;
+use crate::sync::*;
+
+use alloc::string::String;
+use alloc::sync::Arc;
+use alloc::vec::Vec;
+use core::mem::ManuallyDrop;
+use core::ptr::null_mut;
+use core::sync::atomic::{AtomicBool, AtomicPtr, AtomicU64, AtomicUsize, Ordering};
+
+// the chains of the dentry table, a power of two
+const DCACHE_BUCKETS : usize = 4096;
+
+// the dentries hashed beyond which the unused ones are pruned, and the
+// number pruning brings them back to
+const DCACHE_MAX    : usize = 16384;
+const DCACHE_TARGET : usize = 12288;
+
+/// A name in a directory, with the inode it refers to
+///
+/// A dentry with no inode is negative: it caches the absence of the name,
+/// so that looking a missing file up again does not reach the filesystem.
+/// A negative dentry only holds until an entry is created in its
+/// directory, it is stale afterwards.
+///
+/// Dentries never change once hashed, a dentry going stale is replaced by
+/// a new one. Every dentry refers to its parent, so the directories of
+/// the dentries cached stay cached.
+pub(crate) struct Dentry {
+    name     : String,
+    hash     : u64,
+    parent   : Option<Arc<Dentry>>,
+    sb       : Arc<SuperBlock>,
+    inode    : Option<Arc<dyn Inode>>,
+    /// The value of `children` of the parent when the dentry was created
+    version  : u64,
+    /// Bumped by every entry created in the directory
+    children : AtomicU64,
+    /// The mount over the dentry, if any
+    mounted  : AtomicPtr<Mount>,
+    hashed   : AtomicBool,
+    /// The next dentry of the chain
+    next     : AtomicPtr<Dentry>,
+}
+
+impl Dentry {
+    /// Creates the root dentry of `sb`, which is never hashed
+    pub(crate) fn new_root(sb:&Arc<SuperBlock>) -> Arc<Dentry> {
+        Arc::new(Dentry {
+            name     : String::from("/"),
+            hash     : 0,
+            parent   : None,
+            sb       : sb.clone(),
+            inode    : Some(sb.iget(sb.fs.root_inode())),
+            version  : 0,
+            children : AtomicU64::new(0),
+            mounted  : AtomicPtr::new(null_mut()),
+            hashed   : AtomicBool::new(false),
+            next     : AtomicPtr::new(null_mut()),
+        })
+    }
+
+    pub(crate) fn name(&self) -> &str {
+        &self.name
+    }
+
+    /// Returns the parent directory, none for the root of the filesystem
+    pub(crate) fn parent(&self) -> Option<&Arc<Dentry>> {
+        self.parent.as_ref()
+    }
+
+    /// Returns the inode, none for a negative dentry
+    pub(crate) fn inode(&self) -> Option<&Arc<dyn Inode>> {
+        self.inode.as_ref()
+    }
+
+    pub(crate) fn is_negative(&self) -> bool {
+        self.inode.is_none()
+    }
+
+    pub(crate) fn is_dir(&self) -> bool {
+        self.inode.as_ref().map_or(false, |inode| inode.is_dir())
+    }
+
+    /// Tells whether the dentry is negative and an entry was created in
+    /// its directory since
+    pub(crate) fn is_stale(&self) -> bool {
+        self.inode.is_none() && self.parent.as_ref().map_or(false, |parent| parent.children_version() != self.version)
+    }
+
+    /// Returns the version of the entries of the directory, to be read
+    /// before looking a name up in the filesystem
+    pub(crate) fn children_version(&self) -> u64 {
+        self.children.load(Ordering::Acquire)
+    }
+
+    /// Makes the negative dentries of the directory stale, once an entry
+    /// was created in it
+    pub(crate) fn children_changed(&self) {
+        self.children.fetch_add(1, Ordering::AcqRel);
+    }
+
+    /// Returns the mount over the dentry, if any
+    pub(crate) fn mounted(&self) -> Option<&'static Mount> {
+        unsafe { self.mounted.load(Ordering::Acquire).as_ref() }
+    }
+
+    /// Sets the mount over the dentry, failing if there is one already
+    pub(crate) fn set_mounted(&self, mount:&'static Mount) -> bool {
+        let mount = mount as *const Mount as *mut Mount;
+        self.mounted.compare_exchange(null_mut(), mount, Ordering::AcqRel, Ordering::Acquire).is_ok()
+    }
+
+    fn is_child_of(&self, parent:&Dentry) -> bool {
+        self.parent.as_ref().map_or(false, |own| core::ptr::eq(&**own, parent))
+    }
+}
+
+impl Drop for Dentry {
+    fn drop(&mut self) {
+        if let Some(inode) = self.inode.take() {
+            self.sb.iput(inode);
+        }
+    }
+}
+
+// the chains of the table, their dentries are referred to by the table
+#[allow(non_upper_case_globals)]
+static buckets : [AtomicPtr<Dentry>; DCACHE_BUCKETS] = [const { AtomicPtr::new(null_mut()) }; DCACHE_BUCKETS];
+
+// serializes the changes to the table, guarding the number of dentries hashed
+#[allow(non_upper_case_globals)]
+static table_lock : SpinLock<usize> = SpinLock::new(0);
+
+// the lockless walks in progress
+#[allow(non_upper_case_globals)]
+static walkers : AtomicUsize = AtomicUsize::new(0);
+
+// the dentries unhashed, waiting for the walks which may have reached them
+#[allow(non_upper_case_globals)]
+static retired : SpinLock<Vec<usize>> = SpinLock::new(Vec::new());
+
+/// A lockless walk of the dentry table in progress
+///
+/// Walkers follow the chains with no lock and take no reference on the
+/// dentries they go through. Writers publish a dentry only once it is
+/// complete, and unhashing a dentry leaves its link to the next one in
+/// place, so that a walker standing on it goes on along the chain. The
+/// dentries unhashed are freed only once no walk is in progress, which
+/// keeps those a walker reached valid until its guard is dropped.
+pub(crate) struct WalkGuard {
+    _private : (),
+}
+
+/// Starts a lockless walk, which lasts as long as the guard returned
+pub(crate) fn walk_begin() -> WalkGuard {
+    walkers.fetch_add(1, Ordering::SeqCst);
+    WalkGuard { _private : () }
+}
+
+impl Drop for WalkGuard {
+    fn drop(&mut self) {
+        if walkers.fetch_sub(1, Ordering::SeqCst) == 1 {
+            reclaim();
+        }
+    }
+}
+
+/// Frees the dentries unhashed, unless a walk which may have reached them
+/// is in progress
+fn reclaim() {
+    let dead = core::mem::take(&mut *retired.lock());
+    if dead.is_empty() {
+        return;
+    }
+    // the walks starting now cannot reach the dentries taken
+    if walkers.load(Ordering::SeqCst) != 0 {
+        retired.lock().extend(dead);
+        return;
+    }
+    for dentry in dead {
+        unsafe {
+            drop(Arc::from_raw(dentry as *const Dentry));
+        }
+    }
+}
+
+/// Returns a reference to `dentry`, which must be hashed, retired, or
+/// referred to by the caller
+pub(crate) fn grab(dentry:&Dentry) -> Arc<Dentry> {
+    unsafe {
+        Arc::increment_strong_count(dentry);
+        Arc::from_raw(dentry)
+    }
+}
+
+/// Hashes the name `name` in the directory `parent`, with FNV-1a
+fn name_hash(parent:&Dentry, name:&str) -> u64 {
+    let mut hash : u64 = 0xCBF2_9CE4_8422_2325;
+    for byte in (parent as *const Dentry as usize).to_le_bytes() {
+        hash = (hash ^ byte as u64).wrapping_mul(0x0000_0100_0000_01B3);
+    }
+    for byte in name.bytes() {
+        let byte = if parent.sb.case_insensitive { byte.to_ascii_uppercase() } else { byte };
+        hash = (hash ^ byte as u64).wrapping_mul(0x0000_0100_0000_01B3);
+    }
+    hash
+}
+
+fn bucket(hash:u64) -> &'static AtomicPtr<Dentry> {
+    &buckets[hash as usize & (DCACHE_BUCKETS - 1)]
+}
+
+/// Looks the child `name` of `parent` up in the table, with no lock and no
+/// reference taken
+///
+/// The dentry returned, positive or negative, is valid as long as `guard`.
+pub(crate) fn d_lookup_rcu<'a>(_guard:&'a WalkGuard, parent:&Dentry, name:&str) -> Option<&'a Dentry> {
+    let hash = name_hash(parent, name);
+    let mut node = bucket(hash).load(Ordering::Acquire);
+    while let Some(dentry) = unsafe { node.as_ref() } {
+        if dentry.hash == hash && dentry.is_child_of(parent)
+        && dentry.hashed.load(Ordering::Acquire) && parent.sb.names_match(&dentry.name, name) {
+            return Some(dentry);
+        }
+        node = dentry.next.load(Ordering::Acquire);
+    }
+    None
+}
+
+/// Looks the child `name` of `parent` up in the table
+pub(crate) fn d_lookup(parent:&Dentry, name:&str) -> Option<Arc<Dentry>> {
+    let guard = walk_begin();
+    d_lookup_rcu(&guard, parent, name).map(grab)
+}
+
+/// Unhashes `dentry`, linked from `link`, retiring the reference of the table
+fn unhash(link:&AtomicPtr<Dentry>, dentry:&Dentry) {
+    link.store(dentry.next.load(Ordering::Relaxed), Ordering::Release);
+    dentry.hashed.store(false, Ordering::Release);
+    retired.lock().push(dentry as *const Dentry as usize);
+}
+
+/// Unhashes `dentry`, if hashed, so that the next lookup of its name
+/// reaches the filesystem
+pub(crate) fn d_drop(dentry:&Dentry) {
+    let mut count = table_lock.lock();
+    let mut link = bucket(dentry.hash);
+    loop {
+        let node = link.load(Ordering::Relaxed);
+        let Some(other) = (unsafe { node.as_ref() }) else {
+            break;
+        };
+        if core::ptr::eq(other, dentry) {
+            unhash(link, other);
+            *count -= 1;
+            break;
+        }
+        link = &other.next;
+    }
+    drop(count);
+    reclaim();
+}
+
+/// Caches the child `name` of `parent`, referring to `inode`, or negative
+///
+/// `version` is the version of the entries of `parent` read before the
+/// name was looked up in the filesystem. When another thread cached the
+/// name meanwhile its dentry is kept and returned, unless it is negative
+/// and either stale or losing to a positive one.
+pub(crate) fn d_add(parent:&Arc<Dentry>, name:&str, inode:Option<Arc<dyn Inode>>, version:u64) -> Arc<Dentry> {
+    let hash = name_hash(parent, name);
+    let dentry = Arc::new(Dentry {
+        name     : String::from(name),
+        hash,
+        parent   : Some(parent.clone()),
+        sb       : parent.sb.clone(),
+        inode    : inode.map(|inode| parent.sb.iget(inode)),
+        version,
+        children : AtomicU64::new(0),
+        mounted  : AtomicPtr::new(null_mut()),
+        hashed   : AtomicBool::new(true),
+        next     : AtomicPtr::new(null_mut()),
+    });
+    let head = bucket(hash);
+    let mut count = table_lock.lock();
+    let mut link = head;
+    loop {
+        let node = link.load(Ordering::Relaxed);
+        let Some(other) = (unsafe { node.as_ref() }) else {
+            break;
+        };
+        if other.hash == hash && other.is_child_of(parent) && parent.sb.names_match(&other.name, name) {
+            if !other.is_negative() || !(other.is_stale() || dentry.inode.is_some()) {
+                let other = grab(other);
+                drop(count);
+                return other;
+            }
+            unhash(link, other);
+            *count -= 1;
+            break;
+        }
+        link = &other.next;
+    }
+    dentry.next.store(head.load(Ordering::Relaxed), Ordering::Relaxed);
+    head.store(Arc::into_raw(dentry.clone()) as *mut Dentry, Ordering::Release);
+    *count += 1;
+    let prune = *count > DCACHE_MAX;
+    drop(count);
+    if prune {
+        shrink(DCACHE_TARGET);
+    } else {
+        reclaim();
+    }
+    dentry
+}
+
+/// Unhashes the dentries referred to by nothing but the table, until
+/// `target` are left
+///
+/// A directory is still referred to by the dentries of its entries, so it
+/// goes only once they are gone.
+pub(crate) fn shrink(target:usize) {
+    let mut count = table_lock.lock();
+    for head in buckets.iter() {
+        if *count <= target {
+            break;
+        }
+        let mut link = head;
+        loop {
+            let node = link.load(Ordering::Relaxed);
+            let Some(dentry) = (unsafe { node.as_ref() }) else {
+                break;
+            };
+            let owner = ManuallyDrop::new(unsafe { Arc::from_raw(node) });
+            if *count > target && Arc::strong_count(&owner) == 1 && dentry.mounted().is_none() {
+                unhash(link, dentry);
+                *count -= 1;
+                continue;
+            }
+            link = &dentry.next;
+        }
+    }
+    drop(count);
+    reclaim();
+}
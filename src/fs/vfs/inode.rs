@@ -0,0 +1,113 @@
+use crate::fs::file::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+
+use alloc::collections::BTreeMap;
+use alloc::sync::{Arc, Weak};
+use core::any::Any;
+
+/// A file or directory of a filesystem, as the VFS sees it
+///
+/// The VFS never passes "." and ".." to the filesystems, it walks the
+/// tree of the dentries instead.
+pub(crate) trait Inode : Any + Send + Sync {
+    /// Returns the number identifying the inode in its filesystem
+    fn ino(&self) -> u64;
+
+    fn is_dir(&self) -> bool;
+
+    /// Returns the child `name` of the directory, ENOENT if it is missing
+    fn lookup(&self, _name:&str) -> KResult<Arc<dyn Inode>> {
+        Err(ENOTDIR)
+    }
+
+    /// Creates the empty regular file `name` in the directory, EEXIST if
+    /// the name is taken
+    fn create(&self, _name:&str) -> KResult<Arc<dyn Inode>> {
+        Err(EACCES)
+    }
+
+    /// Removes the entry `name` of the directory, which is not one,
+    /// ENOENT if it is missing
+    ///
+    /// The inode goes once the last file opened on it is closed.
+    fn unlink(&self, _name:&str) -> KResult<()> {
+        Err(EACCES)
+    }
+
+    /// Drops the content of the regular file
+    fn truncate(&self) -> KResult<()> {
+        Err(EINVAL)
+    }
+
+    /// Opens the inode, the VFS having checked `flags` against its type
+    fn open(&self, flags:u32) -> KResult<Arc<dyn FileOps>>;
+}
+
+/// A mounted filesystem
+pub(crate) trait FileSystem : Send + Sync {
+    fn root_inode(&self) -> Arc<dyn Inode>;
+
+    /// Tells whether names differing only by the case of ASCII letters
+    /// are the same
+    fn case_insensitive(&self) -> bool {
+        false
+    }
+
+    /// Writes the cached data and metadata back to the device
+    fn sync(&self) -> KResult<()> {
+        Ok(())
+    }
+}
+
+/// A filesystem mounted, with the cache of its inodes in use
+///
+/// The cache makes every inode reached by several names, or looked up
+/// again while still referred to by a dentry, a single object. It holds
+/// no reference: the inodes live as long as the dentries referring to
+/// them.
+pub(crate) struct SuperBlock {
+    pub(crate) fs               : Arc<dyn FileSystem>,
+    pub(crate) case_insensitive : bool,
+    inodes                      : SpinLock<BTreeMap<u64, Weak<dyn Inode>>>,
+}
+
+impl SuperBlock {
+    pub(crate) fn new(fs:Arc<dyn FileSystem>) -> Arc<Self> {
+        Arc::new(SuperBlock {
+            case_insensitive : fs.case_insensitive(),
+            fs,
+            inodes           : SpinLock::new(BTreeMap::new()),
+        })
+    }
+
+    /// Returns the cached instance of `inode`, caching `inode` if there is none
+    pub(crate) fn iget(&self, inode:Arc<dyn Inode>) -> Arc<dyn Inode> {
+        let mut inodes = self.inodes.lock();
+        if let Some(cached) = inodes.get(&inode.ino()).and_then(Weak::upgrade) {
+            return cached;
+        }
+        inodes.insert(inode.ino(), Arc::downgrade(&inode));
+        inode
+    }
+
+    /// Drops `inode` from the cache if this is its last reference
+    pub(crate) fn iput(&self, inode:Arc<dyn Inode>) {
+        let mut inodes = self.inodes.lock();
+        if Arc::strong_count(&inode) > 1 {
+            return;
+        }
+        if inodes.get(&inode.ino()).map_or(false, |cached| Weak::ptr_eq(cached, &Arc::downgrade(&inode))) {
+            inodes.remove(&inode.ino());
+        }
+    }
+
+    /// Tells whether the names `a` and `b` are the same in the filesystem
+    pub(crate) fn names_match(&self, a:&str, b:&str) -> bool {
+        if self.case_insensitive {
+            a.eq_ignore_ascii_case(b)
+        } else {
+            a == b
+        }
+    }
+}
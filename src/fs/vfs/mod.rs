@@ -0,0 +1,83 @@
+pub(crate) mod dcache;
+pub(crate) mod inode;
+pub(crate) mod mount;
+pub(crate) mod namei;
+
+pub(crate) use dcache::*;
+pub(crate) use inode::*;
+pub(crate) use mount::*;
+pub(crate) use namei::*;
+
+use crate::fs::file::*;
+use crate::mm::uaccess::*;
+use crate::syscall::errno::*;
+
+use alloc::sync::Arc;
+use alloc::vec;
+
+pub(crate) const NAME_MAX : usize = 255;
+pub(crate) const PATH_MAX : usize = 4096;
+
+/// Opens the file at `path`
+///
+/// With O_CREAT a missing regular file is created, O_TRUNC drops the
+/// content of a file opened for writing.
+pub(crate) fn open(path:&str, flags:u32) -> KResult<Arc<File>> {
+    let target = match lookup_path(path) {
+        Ok(_) if flags & (O_CREAT | O_EXCL) == O_CREAT | O_EXCL => return Err(EEXIST),
+        Ok(target)                                              => target,
+        Err(ENOENT) if flags & O_CREAT != 0                     => create_path(path, flags & O_EXCL != 0)?,
+        Err(errno) => return Err(errno),
+    };
+    let inode = target.dentry.inode().ok_or(ENOENT)?;
+    let writing = flags & O_ACCMODE != O_RDONLY;
+    if inode.is_dir() && (writing || flags & O_TRUNC != 0) {
+        return Err(EISDIR);
+    }
+    if flags & O_DIRECTORY != 0 && !inode.is_dir() {
+        return Err(ENOTDIR);
+    }
+    if flags & O_DIRECT != 0 && inode.is_dir() {
+        return Err(EINVAL);
+    }
+    let ops = inode.open(flags)?;
+    if writing && flags & O_TRUNC != 0 {
+        inode.truncate()?;
+    }
+    Ok(File::new(ops, flags))
+}
+
+/// Opens the file at the user path `path`, returning its descriptor
+///
+/// Processes have no working directory, relative paths are resolved from
+/// the root of the tree.
+pub(crate) fn sys_open(path:usize, flags:u32, _mode:u32) -> KResult<usize> {
+    let mut buffer = vec![0_u8; PATH_MAX];
+    let path = path_from_user(&mut buffer, path)?;
+    install_file(open(path, flags)?)
+}
+
+/// Removes the entry at the user path `path`
+pub(crate) fn sys_unlink(path:usize) -> KResult<usize> {
+    let mut buffer = vec![0_u8; PATH_MAX];
+    let path = path_from_user(&mut buffer, path)?;
+    unlink_path(path)?;
+    Ok(0)
+}
+
+/// Writes back every mounted filesystem
+///
+/// As on Linux, the errors are not reported.
+pub(crate) fn sys_sync() -> KResult<usize> {
+    let _ = sync_all();
+    Ok(0)
+}
+
+/// Copies the user path `path` into `buffer`, which is `PATH_MAX` long
+fn path_from_user(buffer:&mut [u8], path:usize) -> KResult<&str> {
+    let length = strncpy_from_user(buffer, path)?;
+    if length == PATH_MAX {
+        return Err(ENAMETOOLONG);
+    }
+    core::str::from_utf8(&buffer[..length]).map_err(|_| ENOENT)
+}
@@ -0,0 +1,86 @@
+use crate::fs::vfs::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+
+use alloc::boxed::Box;
+use alloc::sync::Arc;
+use alloc::vec::Vec;
+use core::ptr::null_mut;
+use core::sync::atomic::{AtomicPtr, Ordering};
+
+/// A filesystem mounted in the tree
+///
+/// Mounts are never taken down, so they are referred to with static
+/// references, which the lockless walks follow freely.
+pub(crate) struct Mount {
+    pub(crate) sb     : Arc<SuperBlock>,
+    pub(crate) root   : Arc<Dentry>,
+    /// The mount and the directory this mount covers, none for the root
+    pub(crate) parent : Option<(&'static Mount, Arc<Dentry>)>,
+}
+
+#[allow(non_upper_case_globals)]
+static tree_root : AtomicPtr<Mount> = AtomicPtr::new(null_mut());
+
+// every mount, in the order they were made
+#[allow(non_upper_case_globals)]
+static mounts : SpinLock<Vec<&'static Mount>> = SpinLock::new(Vec::new());
+
+/// Returns the mount at the root of the tree, if any
+pub(crate) fn root_mount() -> Option<&'static Mount> {
+    unsafe { tree_root.load(Ordering::Acquire).as_ref() }
+}
+
+/// Mounts `fs` over the directory `path`, or at the root of the tree if
+/// nothing is mounted yet
+///
+/// A filesystem mounted over a mount point hides the one mounted there
+/// before.
+pub(crate) fn mount(path:&str, fs:Arc<dyn FileSystem>) -> KResult<()> {
+    let parent = match root_mount() {
+        Some(_) => {
+            let point = lookup_path(path)?;
+            if !point.dentry.is_dir() {
+                return Err(ENOTDIR);
+            }
+            Some((point.mount, point.dentry))
+        },
+        None    => None,
+    };
+    let sb = SuperBlock::new(fs);
+    let mount : &'static Mount = Box::leak(Box::new(Mount {
+        root : Dentry::new_root(&sb),
+        sb,
+        parent,
+    }));
+    let installed = match &mount.parent {
+        Some((_, point)) => point.set_mounted(mount),
+        None             => {
+            let mount = mount as *const Mount as *mut Mount;
+            tree_root.compare_exchange(null_mut(), mount, Ordering::AcqRel, Ordering::Acquire).is_ok()
+        },
+    };
+    if !installed {
+        unsafe {
+            drop(Box::from_raw(mount as *const Mount as *mut Mount));
+        }
+        return Err(EBUSY);
+    }
+    mounts.lock().push(mount);
+    Ok(())
+}
+
+/// Writes back every mounted filesystem
+///
+/// The filesystems are all synced even when some fail, the first error
+/// is returned.
+pub(crate) fn sync_all() -> KResult<()> {
+    let all : Vec<&'static Mount> = mounts.lock().clone();
+    let mut result = Ok(());
+    for mount in all {
+        if let Err(errno) = mount.sb.fs.sync() {
+            result = result.and(Err(errno));
+        }
+    }
+    result
+}
@@ -0,0 +1,183 @@
+use crate::fs::vfs::*;
+use crate::syscall::errno::*;
+
+use alloc::sync::Arc;
+
+/// A place in the tree of the mounted filesystems
+#[derive(Clone)]
+pub(crate) struct Path {
+    pub(crate) mount  : &'static Mount,
+    pub(crate) dentry : Arc<Dentry>,
+}
+
+/// Returns the components of `path` to walk, "." left out
+fn components(path:&str) -> impl Iterator<Item = &str> {
+    path.split('/').filter(|name| !name.is_empty() && *name != ".")
+}
+
+/// Splits `path` into its parent directory and its last component
+pub(crate) fn split_path(path:&str) -> (&str, &str) {
+    let path = path.trim_end_matches('/');
+    match path.rfind('/') {
+        Some(slash) => (&path[..slash], &path[slash + 1..]),
+        None        => ("", path),
+    }
+}
+
+/// Goes down the mounts over `dentry`, to the root of the topmost one
+fn cross_mounts<'a>(mut mount:&'static Mount, mut dentry:&'a Dentry) -> (&'static Mount, &'a Dentry) {
+    while let Some(over) = dentry.mounted() {
+        mount = over;
+        dentry = &over.root;
+    }
+    (mount, dentry)
+}
+
+/// Returns the parent of `dentry`, which is in `mount`
+///
+/// The parent of the root of a mount is the one of the directory it
+/// covers, the root of the tree is its own parent.
+fn parent_of<'a>(mut mount:&'static Mount, mut dentry:&'a Dentry) -> (&'static Mount, &'a Dentry) {
+    loop {
+        if let Some(parent) = dentry.parent() {
+            return cross_mounts(mount, parent);
+        }
+        match &mount.parent {
+            Some((up, point)) => {
+                mount = up;
+                dentry = point;
+            },
+            None              => return (mount, dentry),
+        }
+    }
+}
+
+/// Resolves `path` with no lock taken, and no reference but the one
+/// returned
+///
+/// Gives up, returning none, at the first component missing from the
+/// dentry cache. The lack of a file, or of a directory, found in the
+/// cache is final.
+fn walk_rcu(path:&str) -> KResult<Option<Path>> {
+    let root = root_mount().ok_or(ENOENT)?;
+    let guard = walk_begin();
+    let (mut mount, mut dentry) = cross_mounts(root, &*root.root);
+    for name in components(path) {
+        if !dentry.is_dir() {
+            return Err(ENOTDIR);
+        }
+        (mount, dentry) = if name == ".." {
+            parent_of(mount, dentry)
+        } else {
+            match d_lookup_rcu(&guard, dentry, name) {
+                Some(child) if child.is_stale()    => return Ok(None),
+                Some(child) if child.is_negative() => return Err(ENOENT),
+                Some(child)                        => cross_mounts(mount, child),
+                None                               => return Ok(None),
+            }
+        };
+    }
+    Ok(Some(Path { mount, dentry : grab(dentry) }))
+}
+
+/// Looks the child `name` of `parent` up in its filesystem, caching what
+/// is found, or that nothing is
+fn lookup_slow(parent:&Arc<Dentry>, name:&str) -> KResult<Arc<Dentry>> {
+    if name.len() > NAME_MAX {
+        return Err(ENAMETOOLONG);
+    }
+    let dir = parent.inode().ok_or(ENOENT)?;
+    let version = parent.children_version();
+    match dir.lookup(name) {
+        Ok(inode)   => Ok(d_add(parent, name, Some(inode), version)),
+        Err(ENOENT) => Ok(d_add(parent, name, None, version)),
+        Err(errno)  => Err(errno),
+    }
+}
+
+/// Resolves `path` taking a reference on every component, and looking
+/// those missing from the dentry cache up in their filesystems
+fn walk_ref(path:&str) -> KResult<Path> {
+    let root = root_mount().ok_or(ENOENT)?;
+    let (mount, dentry) = cross_mounts(root, &*root.root);
+    let mut current = Path { mount, dentry : grab(dentry) };
+    for name in components(path) {
+        if !current.dentry.is_dir() {
+            return Err(ENOTDIR);
+        }
+        let next = if name == ".." {
+            let (mount, dentry) = parent_of(current.mount, &current.dentry);
+            Path { mount, dentry : grab(dentry) }
+        } else {
+            let child = match d_lookup(&current.dentry, name) {
+                Some(child) if !child.is_stale() => child,
+                _                                => lookup_slow(&current.dentry, name)?,
+            };
+            if child.is_negative() {
+                return Err(ENOENT);
+            }
+            let (mount, dentry) = cross_mounts(current.mount, &child);
+            Path { mount, dentry : grab(dentry) }
+        };
+        current = next;
+    }
+    Ok(current)
+}
+
+/// Resolves the `path`, relative to the root of the tree
+///
+/// The walk first goes through the dentry cache with no lock, a few hash
+/// probes per component, and only when a component is missing starts
+/// over, looking the components missing up in the filesystems.
+pub(crate) fn lookup_path(path:&str) -> KResult<Path> {
+    match walk_rcu(path)? {
+        Some(found) => Ok(found),
+        None        => walk_ref(path),
+    }
+}
+
+/// Removes the entry at `path`, which must not be a directory
+///
+/// The dentry of the entry is dropped from the cache, files opened on it
+/// keep their inode.
+pub(crate) fn unlink_path(path:&str) -> KResult<()> {
+    let (_, name) = split_path(path);
+    if name.is_empty() || name == "." || name == ".." {
+        return Err(EISDIR);
+    }
+    let target = lookup_path(path)?;
+    if target.dentry.is_dir() {
+        return Err(EISDIR);
+    }
+    let dir = target.dentry.parent().and_then(|parent| parent.inode()).ok_or(ENOENT)?;
+    dir.unlink(target.dentry.name())?;
+    d_drop(&target.dentry);
+    Ok(())
+}
+
+/// Creates the regular file at `path`, whose directory must exist
+///
+/// When the file exists already, it is returned unless `exclusive`.
+pub(crate) fn create_path(path:&str, exclusive:bool) -> KResult<Path> {
+    let (dir, name) = split_path(path);
+    if name.is_empty() || name == "." || name == ".." {
+        return Err(EISDIR);
+    }
+    if name.len() > NAME_MAX {
+        return Err(ENAMETOOLONG);
+    }
+    let parent = lookup_path(dir)?;
+    let inode = parent.dentry.inode().ok_or(ENOENT)?;
+    if !inode.is_dir() {
+        return Err(ENOTDIR);
+    }
+    match inode.create(name) {
+        Ok(inode) => {
+            parent.dentry.children_changed();
+            let version = parent.dentry.children_version();
+            Ok(Path { mount : parent.mount, dentry : d_add(&parent.dentry, name, Some(inode), version) })
+        },
+        Err(EEXIST) if !exclusive => lookup_path(path),
+        Err(errno)                => Err(errno),
+    }
+}
@@ -0,0 +1 @@
+pub(crate) mod uring;
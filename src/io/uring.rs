@@ -0,0 +1,534 @@
+use crate::fs::file::*;
+use crate::mm::*;
+use crate::mm::frame::*;
+use crate::mm::slab::size_to_order;
+use crate::mm::uaccess::*;
+use crate::mm::vma::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+use crate::time;
+
+use alloc::sync::{Arc, Weak};
+use alloc::vec::Vec;
+use core::mem::size_of;
+use core::ptr;
+use core::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering};
+
+// operations, the same codes as Linux
+pub(crate) const IORING_OP_NOP         : u8 = 0;
+pub(crate) const IORING_OP_POLL_ADD    : u8 = 6;
+pub(crate) const IORING_OP_POLL_REMOVE : u8 = 7;
+pub(crate) const IORING_OP_TIMEOUT     : u8 = 11;
+pub(crate) const IORING_OP_READ        : u8 = 22;
+pub(crate) const IORING_OP_WRITE       : u8 = 23;
+
+// setup flags
+pub(crate) const IORING_SETUP_SQPOLL : u32 = 1 << 1;
+
+// enter flags
+pub(crate) const IORING_ENTER_GETEVENTS : u32 = 1 << 0;
+pub(crate) const IORING_ENTER_SQ_WAKEUP : u32 = 1 << 1;
+
+// submission queue flags, set by the kernel
+pub(crate) const IORING_SQ_NEED_WAKEUP : u32 = 1 << 0;
+
+// the maximum number of submission entries, completion queues are twice as large
+const MAX_ENTRIES : u32 = 256;
+
+// the header is followed by the submission entries, then by the completion ones
+const HEADER_SIZE : usize = 64;
+
+// how long the polling thread spins on an empty queue before sleeping, if not specified
+const DEFAULT_SQ_THREAD_IDLE_MS : u32 = 1000;
+
+/// A submission queue entry
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub(crate) struct Sqe {
+    pub(crate) opcode    : u8,
+    pub(crate) flags     : u8,
+    pub(crate) ioprio    : u16,
+    pub(crate) fd        : i32,
+    pub(crate) off       : u64,
+    pub(crate) addr      : u64,
+    pub(crate) len       : u32,
+    pub(crate) op_flags  : u32,
+    pub(crate) user_data : u64,
+    pub(crate) pad       : [u64; 3],
+}
+
+/// A completion queue entry
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub(crate) struct Cqe {
+    pub(crate) user_data : u64,
+    pub(crate) res       : i32,
+    pub(crate) flags     : u32,
+}
+
+/// The indexes shared with the process, at the beginning of the ring memory
+///
+/// The process produces at `sq_tail` and consumes at `cq_head`, the kernel
+/// consumes at `sq_head` and produces at `cq_tail`. The process may write
+/// anything here: the kernel keeps its own indexes, which it only
+/// publishes, and bounds the distances to the indexes of the process.
+#[repr(C)]
+struct RingHeader {
+    sq_head     : AtomicU32,
+    sq_tail     : AtomicU32,
+    sq_mask     : u32,
+    sq_entries  : u32,
+    sq_flags    : AtomicU32,
+    cq_head     : AtomicU32,
+    cq_tail     : AtomicU32,
+    cq_mask     : u32,
+    cq_entries  : u32,
+    cq_overflow : AtomicU32,
+}
+
+/// The parameters of `io_uring_setup`, the kernel fills in the output fields
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub(crate) struct IoUringParams {
+    pub(crate) sq_entries     : u32,
+    pub(crate) cq_entries     : u32,
+    pub(crate) flags          : u32,
+    pub(crate) sq_thread_idle : u32,
+    pub(crate) ring_addr      : u64,
+    pub(crate) ring_size      : u64,
+    pub(crate) sqes_offset    : u32,
+    pub(crate) cqes_offset    : u32,
+}
+
+/// An operation which could not complete at submission time
+enum PendingKind {
+    Poll { file:Arc<File>, events:u32, waker:Arc<dyn WakeCallback> },
+    Timeout { deadline:u64, target:u64 },
+}
+
+struct PendingOp {
+    user_data : u64,
+    kind      : PendingKind,
+}
+
+impl PendingOp {
+    /// Stops following the events of the file polled, if any
+    fn detach(&self) {
+        if let PendingKind::Poll { file, waker, .. } = &self.kind {
+            if let Some(queue) = file.ops.wait_queue(file) {
+                queue.remove_callback(waker);
+            }
+        }
+    }
+}
+
+/// Wakes up the threads waiting for completions on a ring, when a file
+/// it polls reports events
+struct PollWaker {
+    ring : Weak<IoRing>,
+}
+
+impl WakeCallback for PollWaker {
+    fn wake(self:Arc<Self>, _events:u32) {
+        if let Some(ring) = self.ring.upgrade() {
+            ring.cq_waiters.wake_all();
+        }
+    }
+}
+
+/// The kernel side of a submission/completion ring pair
+///
+/// The ring memory is allocated by the kernel and mapped into the process,
+/// the kernel reaches it through the direct map, hence from any context.
+pub(crate) struct IoRing {
+    this        : Weak<IoRing>,
+    region      : usize,
+    order       : usize,
+    user_addr   : usize,
+    sq_entries  : u32,
+    cq_entries  : u32,
+    /// The next submission to consume, the one in the header is a copy
+    sq_head     : AtomicU32,
+    /// The next completion to post, the one in the header is a copy
+    cq_tail     : AtomicU32,
+    owner       : Weak<Process>,
+    pending     : SpinLock<Vec<PendingOp>>,
+    cq_lock     : SpinLock<()>,
+    completions : AtomicU64,
+    sq_poll     : bool,
+    sq_idle_ns  : u64,
+    sq_waiters  : WaitQueue,
+    cq_waiters  : WaitQueue,
+    closed      : AtomicBool,
+}
+
+impl IoRing {
+    fn header(&self) -> &RingHeader {
+        unsafe { &*(self.region as *const RingHeader) }
+    }
+
+    fn sqe(&self, index:u32) -> Sqe {
+        let slot = self.region + HEADER_SIZE + (index & (self.sq_entries - 1)) as usize * size_of::<Sqe>();
+        unsafe { ptr::read_volatile(slot as *const Sqe) }
+    }
+
+    fn cqes_offset(&self) -> usize {
+        HEADER_SIZE + self.sq_entries as usize * size_of::<Sqe>()
+    }
+
+    /// Returns the number of submissions not consumed yet, at most a queue
+    fn sq_pending(&self) -> u32 {
+        let pending = self.header().sq_tail.load(Ordering::Acquire).wrapping_sub(self.sq_head.load(Ordering::Relaxed));
+        core::cmp::min(pending, self.sq_entries)
+    }
+
+    /// Returns the number of completions not consumed yet by the process,
+    /// at most a queue
+    fn cq_ready(&self) -> u32 {
+        let ready = self.cq_tail.load(Ordering::Relaxed).wrapping_sub(self.header().cq_head.load(Ordering::Acquire));
+        core::cmp::min(ready, self.cq_entries)
+    }
+
+    /// Posts a completion, counting it as overflow if the queue is full
+    fn complete(&self, user_data:u64, res:i32) {
+        self.post(user_data, res);
+        self.cq_waiters.notify(POLLIN);
+    }
+
+    fn post(&self, user_data:u64, res:i32) {
+        let _guard = self.cq_lock.lock();
+        let header = self.header();
+        let tail = self.cq_tail.load(Ordering::Relaxed);
+        if tail.wrapping_sub(header.cq_head.load(Ordering::Acquire)) >= self.cq_entries {
+            header.cq_overflow.fetch_add(1, Ordering::Relaxed);
+            return;
+        }
+        let slot = self.region + self.cqes_offset() + (tail & (self.cq_entries - 1)) as usize * size_of::<Cqe>();
+        unsafe {
+            ptr::write_volatile(slot as *mut Cqe, Cqe { user_data, res, flags : 0 });
+        }
+        self.cq_tail.store(tail.wrapping_add(1), Ordering::Relaxed);
+        header.cq_tail.store(tail.wrapping_add(1), Ordering::Release);
+        self.completions.fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Consumes up to `count` submissions, returning how many were consumed
+    fn submit(&self, count:u32) -> u32 {
+        let head = self.sq_head.load(Ordering::Relaxed);
+        let count = core::cmp::min(count, self.sq_pending());
+        for i in 0..count {
+            let sqe = self.sqe(head.wrapping_add(i));
+            if let Some(res) = self.issue(&sqe) {
+                self.complete(sqe.user_data, res);
+            }
+        }
+        self.sq_head.store(head.wrapping_add(count), Ordering::Relaxed);
+        self.header().sq_head.store(head.wrapping_add(count), Ordering::Release);
+        count
+    }
+
+    /// Starts the operation described by `sqe`
+    ///
+    /// Returns the result if the operation completed, or `None` if it was
+    /// queued as pending.
+    fn issue(&self, sqe:&Sqe) -> Option<i32> {
+        let result = match sqe.opcode {
+            IORING_OP_NOP         => Ok(0),
+            IORING_OP_READ        => get_file(sqe.fd as usize).and_then(|file| {
+                read_to_user(&file, sqe.addr as usize, sqe.len as usize, sqe.off as i64)
+            }),
+            IORING_OP_WRITE       => get_file(sqe.fd as usize).and_then(|file| {
+                write_from_user(&file, sqe.addr as usize, sqe.len as usize, sqe.off as i64)
+            }),
+            IORING_OP_POLL_ADD    => return self.poll_add(sqe),
+            IORING_OP_POLL_REMOVE => self.poll_remove(sqe.addr),
+            IORING_OP_TIMEOUT     => return self.timeout(sqe),
+            _                     => Err(EINVAL),
+        };
+        Some(match result {
+            Ok(count)  => count as i32,
+            Err(errno) => -(errno as i32),
+        })
+    }
+
+    fn poll_add(&self, sqe:&Sqe) -> Option<i32> {
+        let file = match get_file(sqe.fd as usize) {
+            Ok(file)   => file,
+            Err(errno) => return Some(-(errno as i32)),
+        };
+        let events = sqe.op_flags | POLLERR | POLLHUP;
+        let ready = file.poll() & events;
+        if ready != 0 {
+            return Some(ready as i32);
+        }
+        let waker : Arc<dyn WakeCallback> = Arc::new(PollWaker { ring : self.this.clone() });
+        if let Some(queue) = file.ops.wait_queue(&file) {
+            queue.add_callback(waker.clone());
+        }
+        self.pending.lock().push(PendingOp {
+            user_data : sqe.user_data,
+            kind      : PendingKind::Poll { file, events, waker },
+        });
+        None
+    }
+
+    fn poll_remove(&self, user_data:u64) -> KResult<usize> {
+        let mut pending = self.pending.lock();
+        let index = pending.iter().position(|op| {
+            op.user_data == user_data && matches!(op.kind, PendingKind::Poll { .. })
+        }).ok_or(ENOENT)?;
+        let op = pending.remove(index);
+        drop(pending);
+        op.detach();
+        self.complete(user_data, -(ECANCELED as i32));
+        Ok(0)
+    }
+
+    /// Queues a timeout, which completes with -ETIME when the relative time
+    /// at `addr` elapses, or with 0 once `off` other completions are posted
+    fn timeout(&self, sqe:&Sqe) -> Option<i32> {
+        let delay = match read_user::<time::Timespec>(sqe.addr as usize).map(|ts| ts.to_ns()) {
+            Ok(Some(delay)) => delay,
+            Ok(None)        => return Some(-(EINVAL as i32)),
+            Err(errno)      => return Some(-(errno as i32)),
+        };
+        let target = match sqe.off {
+            0     => u64::MAX,
+            count => self.completions.load(Ordering::Relaxed) + count,
+        };
+        self.pending.lock().push(PendingOp {
+            user_data : sqe.user_data,
+            kind      : PendingKind::Timeout { deadline : time::monotonic_ns() + delay, target },
+        });
+        None
+    }
+
+    /// Completes the pending operations whose condition is met
+    fn reap(&self) {
+        let now = time::monotonic_ns();
+        let completions = self.completions.load(Ordering::Relaxed);
+        let mut ready = Vec::new();
+        self.pending.lock().retain(|op| {
+            let res = match &op.kind {
+                PendingKind::Poll { file, events, .. } => match file.poll() & events {
+                    0      => return true,
+                    events => events as i32,
+                },
+                PendingKind::Timeout { deadline, target } => {
+                    if now >= *deadline {
+                        -(ETIME as i32)
+                    } else if completions >= *target {
+                        0
+                    } else {
+                        return true;
+                    }
+                },
+            };
+            op.detach();
+            ready.push((op.user_data, res));
+            false
+        });
+        for (user_data, res) in ready {
+            self.complete(user_data, res);
+        }
+    }
+
+    /// Tells whether a completion may come with no thread reaping the
+    /// pending operations
+    ///
+    /// Polls are reaped by the threads their files wake up, and anything
+    /// pending by the polling thread, if any. Timeouts of a ring without
+    /// one have to be checked, there is no timer interrupt.
+    fn can_sleep(&self) -> bool {
+        self.sq_poll || !self.pending.lock().iter().any(|op| matches!(op.kind, PendingKind::Timeout { .. }))
+    }
+
+    /// Tells whether no completion is to come
+    fn is_idle(&self) -> bool {
+        self.pending.lock().is_empty() && (!self.sq_poll || self.sq_pending() == 0)
+    }
+}
+
+impl FileOps for IoRing {
+    fn poll(&self, _file:&File) -> u32 {
+        if self.cq_ready() > 0 { POLLIN } else { 0 }
+    }
+
+    fn wait_queue(&self, _file:&File) -> Option<&WaitQueue> {
+        Some(&self.cq_waiters)
+    }
+
+    fn release(&self, _file:&File) {
+        self.closed.store(true, Ordering::Release);
+        self.sq_waiters.wake_all();
+        for op in core::mem::take(&mut *self.pending.lock()) {
+            op.detach();
+        }
+        if let Some(process) = self.owner.upgrade() {
+            process.space.unmap_range(self.user_addr);
+        }
+    }
+}
+
+impl Drop for IoRing {
+    fn drop(&mut self) {
+        free_frames(virt_to_phys(self.region), self.order);
+    }
+}
+
+/// The body of the kernel thread consuming the submissions of an
+/// `IORING_SETUP_SQPOLL` ring
+///
+/// It keeps polling while there is work, and goes to sleep, raising
+/// `IORING_SQ_NEED_WAKEUP`, after being idle for a while. The thread
+/// belongs to the ring owner, so it resolves descriptors and user buffers
+/// in the owner's context.
+fn sq_thread_main(arg:usize) {
+    let ring = unsafe { Arc::from_raw(arg as *const IoRing) };
+    let mut idle_since = time::monotonic_ns();
+    while !ring.closed.load(Ordering::Acquire) {
+        let submitted = ring.submit(u32::MAX);
+        ring.reap();
+        let now = time::monotonic_ns();
+        if submitted > 0 {
+            idle_since = now;
+        } else if now - idle_since > ring.sq_idle_ns && ring.pending.lock().is_empty() {
+            let header = ring.header();
+            header.sq_flags.fetch_or(IORING_SQ_NEED_WAKEUP, Ordering::SeqCst);
+            // submissions queued before the flag became visible would be missed
+            if ring.sq_pending() == 0 && !ring.closed.load(Ordering::Acquire) {
+                ring.sq_waiters.sleep();
+            }
+            header.sq_flags.fetch_and(!IORING_SQ_NEED_WAKEUP, Ordering::SeqCst);
+            idle_since = time::monotonic_ns();
+        }
+        yield_now();
+    }
+}
+
+/// Creates a ring pair with room for `entries` submissions, returning its descriptor
+///
+/// The ring memory is mapped into the caller, its address and layout are
+/// reported in the parameters at `params_addr`.
+pub(crate) fn sys_io_uring_setup(entries:u32, params_addr:usize) -> KResult<usize> {
+    let mut params : IoUringParams = read_user(params_addr)?;
+    if entries == 0 || entries > MAX_ENTRIES || params.flags & !IORING_SETUP_SQPOLL != 0 {
+        return Err(EINVAL);
+    }
+    let process = current_process().ok_or(EINVAL)?;
+
+    let sq_entries = entries.next_power_of_two();
+    let cq_entries = sq_entries * 2;
+    let sqes_offset = HEADER_SIZE;
+    let cqes_offset = sqes_offset + sq_entries as usize * size_of::<Sqe>();
+    let size = cqes_offset + cq_entries as usize * size_of::<Cqe>();
+    let order = size_to_order(size);
+
+    let paddr = alloc_frames(order).ok_or(ENOMEM)?;
+    let region = phys_to_virt(paddr);
+    unsafe {
+        ptr::write_bytes(region as *mut u8, 0, PAGE_SIZE << order);
+    }
+    let user_addr = match process.space.map_frames(paddr, 1 << order, VMA_READ | VMA_WRITE | VMA_SHARED) {
+        Ok(user_addr) => user_addr,
+        Err(errno)    => {
+            free_frames(paddr, order);
+            return Err(errno);
+        },
+    };
+
+    let sq_poll = params.flags & IORING_SETUP_SQPOLL != 0;
+    let idle_ms = match params.sq_thread_idle {
+        0  => DEFAULT_SQ_THREAD_IDLE_MS,
+        ms => ms,
+    };
+    let ring = Arc::new_cyclic(|this| IoRing {
+        this        : this.clone(),
+        region,
+        order,
+        user_addr,
+        sq_entries,
+        cq_entries,
+        sq_head     : AtomicU32::new(0),
+        cq_tail     : AtomicU32::new(0),
+        owner       : Arc::downgrade(&process),
+        pending     : SpinLock::new(Vec::new()),
+        cq_lock     : SpinLock::new(()),
+        completions : AtomicU64::new(0),
+        sq_poll,
+        sq_idle_ns  : idle_ms as u64 * 1_000_000,
+        sq_waiters  : WaitQueue::new(),
+        cq_waiters  : WaitQueue::new(),
+        closed      : AtomicBool::new(false),
+    });
+    unsafe {
+        let header = region as *mut RingHeader;
+        (*header).sq_mask = sq_entries - 1;
+        (*header).sq_entries = sq_entries;
+        (*header).cq_mask = cq_entries - 1;
+        (*header).cq_entries = cq_entries;
+    }
+
+    let file = File::new(ring.clone(), 0);
+    let fd = install_file(file)?;
+    if sq_poll {
+        let arg = Arc::into_raw(ring.clone()) as usize;
+        if let Err(errno) = spawn(sq_thread_main, arg, Some(process.clone())) {
+            unsafe {
+                drop(Arc::from_raw(arg as *const IoRing));
+            }
+            let _ = sys_close(fd);
+            return Err(errno);
+        }
+    }
+
+    params.sq_entries = sq_entries;
+    params.cq_entries = cq_entries;
+    params.sq_thread_idle = idle_ms;
+    params.ring_addr = user_addr as u64;
+    params.ring_size = (PAGE_SIZE << order) as u64;
+    params.sqes_offset = sqes_offset as u32;
+    params.cqes_offset = cqes_offset as u32;
+    write_user(params_addr, &params)?;
+    Ok(fd)
+}
+
+/// Submits up to `to_submit` entries and, with `IORING_ENTER_GETEVENTS`,
+/// waits until at least `min_complete` completions are available
+///
+/// The wait is cut short once nothing is left to complete, and sleeps
+/// until the next completion unless pending timeouts must be checked.
+///
+/// Returns the number of submissions consumed. With a polling thread the
+/// submissions are consumed by it, and `IORING_ENTER_SQ_WAKEUP` wakes it
+/// up if it went to sleep.
+pub(crate) fn sys_io_uring_enter(fd:usize, to_submit:u32, min_complete:u32, flags:u32) -> KResult<usize> {
+    let file = get_file(fd)?;
+    let ring = file.downcast::<IoRing>().ok_or(EBADF)?;
+
+    let submitted = if ring.sq_poll {
+        if flags & IORING_ENTER_SQ_WAKEUP != 0 {
+            ring.sq_waiters.wake_all();
+        }
+        to_submit
+    } else {
+        ring.submit(to_submit)
+    };
+
+    if flags & IORING_ENTER_GETEVENTS != 0 {
+        let min_complete = core::cmp::min(min_complete, ring.cq_entries);
+        loop {
+            ring.reap();
+            if ring.cq_ready() >= min_complete || ring.is_idle() {
+                break;
+            }
+            if ring.can_sleep() {
+                ring.cq_waiters.sleep();
+            } else {
+                yield_now();
+            }
+        }
+    }
+    Ok(submitted as usize)
+}
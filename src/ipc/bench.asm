@@ -0,0 +1,84 @@
+; IPC benchmark
+;
+; This code is mapped into two processes by 'bench.rs', right after a data page shared with the
+; kernel. The server answers the calls on its endpoint in a loop. The client times a series of
+; round trips through the endpoint, then a series of null system calls for comparison, stores
+; the results and exits.
+
+[BITS 64]
+
+DEFAULT REL
+
+%define DATA                        ($$ - 4096)         ; the data page precedes the code
+%define DATA_CAP                    DATA + 0
+%define DATA_ITERATIONS             DATA + 8
+%define DATA_CALL_CYCLES            DATA + 16
+%define DATA_NULL_CYCLES            DATA + 24
+%define DATA_DONE                   DATA + 32
+
+SYS_EXIT:           equ 60
+SYS_IPC_CALL:       equ 502
+SYS_IPC_RECV:       equ 503
+SYS_IPC_REPLY_WAIT: equ 504
+SYS_NULL:           equ 0xFFFF                  ; not a system call, answered with ENOSYS right away
+
+%macro TIMESTAMP 0                              ; RAX = TSC, once the previous instructions completed
+    lfence
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+%endmacro
+
+jump_table:                                     ; each entry is 8 Bytes
+    jmp near server
+    align 8
+    jmp near client
+    align 8
+
+
+server:                                         ; answers every call with its first word incremented
+    mov rdi, [DATA_CAP]
+    mov eax, SYS_IPC_RECV
+    syscall
+.loop:
+    inc rsi
+    mov rdi, [DATA_CAP]
+    mov eax, SYS_IPC_REPLY_WAIT                 ; a single system call replies and takes the next request
+    syscall
+    jmp .loop
+
+
+client:
+    mov rdi, [DATA_CAP]                         ; a first round trip warms up the caches and the TLB
+    xor esi, esi
+    mov eax, SYS_IPC_CALL
+    syscall
+
+    mov r12, [DATA_ITERATIONS]                  ; R12 and R13 are preserved by system calls
+    TIMESTAMP
+    mov r13, rax
+.call:
+    mov rdi, [DATA_CAP]
+    mov eax, SYS_IPC_CALL
+    syscall
+    dec r12
+    jnz .call
+    TIMESTAMP
+    sub rax, r13
+    mov [DATA_CALL_CYCLES], rax
+
+    mov r12, [DATA_ITERATIONS]
+    TIMESTAMP
+    mov r13, rax
+.null:
+    mov eax, SYS_NULL
+    syscall
+    dec r12
+    jnz .null
+    TIMESTAMP
+    sub rax, r13
+    mov [DATA_NULL_CYCLES], rax
+
+    mov qword [DATA_DONE], 1
+    mov eax, SYS_EXIT
+    syscall
@@ -0,0 +1,103 @@
+use crate::ipc::*;
+use crate::mm::*;
+use crate::mm::frame::*;
+use crate::mm::vma::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+use crate::tty::*;
+
+use alloc::sync::Arc;
+use core::ptr;
+
+// where the benchmark program is mapped, the data page precedes the code (see 'bench.asm')
+const BENCH_DATA   : usize = USER_SPACE_START;
+const BENCH_TEXT   : usize = BENCH_DATA + PAGE_SIZE;
+const BENCH_STACK  : usize = 0x800000;
+const SERVER_ENTRY : usize = BENCH_TEXT;
+const CLIENT_ENTRY : usize = BENCH_TEXT + 8;
+
+// the number of timed round trips
+const ITERATIONS : u64 = 100000;
+
+/// The data page shared with the benchmark program
+#[repr(C)]
+struct BenchData {
+    cap         : u64,
+    iterations  : u64,
+    call_cycles : u64,
+    null_cycles : u64,
+    done        : u64,
+}
+
+extern "C" {
+    // the benchmark program (see 'kernel.asm')
+    static ipc_bench_start : u8;
+    static ipc_bench_end   : u8;
+}
+
+/// Runs the program entry point of a benchmark thread
+fn enter_program(entry:usize) {
+    unsafe {
+        enter_user(entry, BENCH_STACK + PAGE_SIZE);
+    }
+}
+
+/// Creates a process running the benchmark program from `entry`, holding
+/// a capability to `endpoint`
+///
+/// Returns the data page of the process.
+fn launch(endpoint:&Arc<Endpoint>, entry:usize) -> KResult<&'static BenchData> {
+    let process = Process::new()?;
+    let cap = process.caps.lock().install(Capability {
+        endpoint : endpoint.clone(),
+        rights   : CAP_ALL,
+        badge    : 0,
+    })?;
+
+    let (text_start, text_end) = (&raw const ipc_bench_start as usize, &raw const ipc_bench_end as usize);
+    let data = alloc_zeroed_frame().ok_or(ENOMEM)?;
+    let Some(stack) = alloc_zeroed_frame() else {
+        free_frame(data);
+        return Err(ENOMEM);
+    };
+    let bench = unsafe { &mut *(phys_to_virt(data) as *mut BenchData) };
+    bench.cap = cap as u64;
+    bench.iterations = ITERATIONS;
+
+    let result = process.space.map_frames_at(BENCH_DATA, data, 1, VMA_READ | VMA_WRITE)
+        .and_then(|_| process.space.map_frames_at(BENCH_TEXT, virt_to_phys(text_start), (text_end - text_start) / PAGE_SIZE, VMA_READ | VMA_EXEC))
+        .and_then(|_| process.space.map_frames_at(BENCH_STACK, stack, 1, VMA_READ | VMA_WRITE))
+        .and_then(|_| spawn(enter_program, entry, Some(process.clone())));
+    if let Err(error) = result {
+        // the frames are not anonymous, tearing down the process leaves them
+        drop(process);
+        free_frame(data);
+        free_frame(stack);
+        return Err(error);
+    }
+    Ok(bench)
+}
+
+/// Measures the cost of a synchronous IPC round trip between two
+/// processes, next to the cost of a null system call, and prints both
+///
+/// The programs are left behind: the client exits and the server stays
+/// blocked on the endpoint.
+pub(crate) fn run() {
+    let endpoint = Endpoint::new();
+    let client = match launch(&endpoint, SERVER_ENTRY).and_then(|_| launch(&endpoint, CLIENT_ENTRY)) {
+        Ok(client) => client,
+        Err(_)     => {
+            print("\nIPC benchmark: cannot start the programs");
+            return;
+        },
+    };
+    while unsafe { ptr::read_volatile(&client.done) } == 0 {
+        yield_now();
+    }
+    print_fmt(format_args!(
+        "\nIPC round trip: {} cycles, null system call: {} cycles",
+        client.call_cycles / ITERATIONS,
+        client.null_cycles / ITERATIONS,
+    ));
+}
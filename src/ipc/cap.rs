@@ -0,0 +1,85 @@
+use crate::ipc::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+
+use alloc::sync::Arc;
+
+// capability rights
+pub(crate) const CAP_SEND    : u32 = 1 << 0;
+pub(crate) const CAP_RECEIVE : u32 = 1 << 1;
+pub(crate) const CAP_ALL     : u32 = CAP_SEND | CAP_RECEIVE;
+
+// the maximum number of capabilities a process can hold
+pub(crate) const MAX_CAPS : usize = 64;
+
+/// The right to use an endpoint
+///
+/// The badge is delivered to the receiver along with every message sent
+/// through the capability, letting a server tell its clients apart.
+#[derive(Clone)]
+pub(crate) struct Capability {
+    pub(crate) endpoint : Arc<Endpoint>,
+    pub(crate) rights   : u32,
+    pub(crate) badge    : u64,
+}
+
+/// The capabilities of a process, indexed by small integers
+pub(crate) struct CapTable {
+    caps : [Option<Capability>; MAX_CAPS],
+}
+
+impl CapTable {
+    pub(crate) const fn new() -> Self {
+        CapTable {
+            caps : [const { None }; MAX_CAPS],
+        }
+    }
+
+    /// Stores `cap` in the lowest free slot, returning its index
+    pub(crate) fn install(&mut self, cap:Capability) -> KResult<usize> {
+        let index = self.caps.iter().position(|slot| slot.is_none()).ok_or(ENOSPC)?;
+        self.caps[index] = Some(cap);
+        Ok(index)
+    }
+
+    /// Returns the capability at `index` if it grants all the `rights`
+    pub(crate) fn get(&self, index:usize, rights:u32) -> KResult<Capability> {
+        let cap = self.caps.get(index).and_then(|slot| slot.as_ref()).ok_or(EBADF)?;
+        if cap.rights & rights != rights {
+            return Err(EPERM);
+        }
+        Ok(cap.clone())
+    }
+}
+
+/// Returns the capability `index` of the current process, if it grants all the `rights`
+pub(crate) fn get_cap(index:usize, rights:u32) -> KResult<Capability> {
+    current_process().ok_or(EBADF)?.caps.lock().get(index, rights)
+}
+
+/// Creates an endpoint, returning a capability with all the rights on it
+pub(crate) fn sys_ipc_endpoint() -> KResult<usize> {
+    let cap = Capability {
+        endpoint : Endpoint::new(),
+        rights   : CAP_ALL,
+        badge    : 0,
+    };
+    current_process().ok_or(EPERM)?.caps.lock().install(cap)
+}
+
+/// Derives from the capability `index` a new one carrying `badge`, with
+/// at most its `rights`, returning the index of the new capability
+///
+/// Only unbadged capabilities can be minted, otherwise a client could
+/// impersonate another one by re-badging the capability it was given.
+pub(crate) fn sys_ipc_mint(index:usize, badge:u64, rights:u32) -> KResult<usize> {
+    let process = current_process().ok_or(EBADF)?;
+    let mut caps = process.caps.lock();
+    let mut cap = caps.get(index, rights)?;
+    if cap.badge != 0 {
+        return Err(EPERM);
+    }
+    cap.rights = rights;
+    cap.badge = badge;
+    caps.install(cap)
+}
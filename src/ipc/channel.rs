@@ -0,0 +1,199 @@
+use crate::fs::file::*;
+use crate::mm::*;
+use crate::mm::frame::*;
+use crate::mm::slab::size_to_order;
+use crate::mm::uaccess::*;
+use crate::mm::vma::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+
+use alloc::collections::BTreeMap;
+use alloc::sync::{Arc, Weak};
+use core::sync::atomic::{AtomicU32, AtomicU64};
+
+// channel kinds
+pub(crate) const CHANNEL_SPSC : u32 = 0;
+pub(crate) const CHANNEL_MPSC : u32 = 1;
+
+// identifies an initialized channel header
+pub(crate) const CHANNEL_MAGIC : u32 = 0x4348414E;
+
+// limits of the channel geometry
+const MAX_SLOTS     : u32 = 1 << 16;
+const MAX_SLOT_SIZE : u32 = 1 << 16;
+const MAX_SIZE      : usize = PAGE_SIZE << 8;
+
+// the slots start after the header, on their own cache line
+const HEADER_SIZE : usize = 192;
+
+/// The header at the beginning of a channel, shared by all its users
+///
+/// The producer and consumer indexes live on separate cache lines. Each
+/// slot starts with a sequence number followed by `slot_size` Bytes of
+/// payload, `slot_stride` Bytes apart:
+/// - a producer owns the slot of position `p` when its sequence equals `p`,
+///   it claims it by advancing `tail` (a compare-and-swap for MPSC, a plain
+///   store for SPSC), fills it, then publishes it storing `p + 1`
+/// - the consumer owns the slot of position `c` when its sequence equals
+///   `c + 1`, it reads it, then releases it storing `c + slots`, and
+///   advances `head`
+///
+/// Neither side enters the kernel while the other keeps up. Before sleeping
+/// on an empty ring the consumer sets `consumer_waiting` and waits on it
+/// with FUTEX_WAIT, a producer publishing a slot swaps it back to 0 and
+/// calls FUTEX_WAKE if it was set. Producers facing a full ring do the same
+/// with `producers_waiting`, which counts them and is woken by the consumer.
+#[repr(C)]
+pub(crate) struct ChannelHeader {
+    magic             : u32,
+    kind              : u32,
+    slots             : u32,
+    slot_size         : u32,
+    slot_stride       : u32,
+    data_offset       : u32,
+    _pad0             : [u8; 40],
+    tail              : AtomicU64,
+    producers_waiting : AtomicU32,
+    _pad1             : [u8; 52],
+    head              : AtomicU64,
+    consumer_waiting  : AtomicU32,
+    _pad2             : [u8; 52],
+}
+
+const _ : () = assert!(core::mem::size_of::<ChannelHeader>() == HEADER_SIZE);
+
+/// The parameters of `channel_open`, the kernel fills in the output fields
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub(crate) struct ChannelParams {
+    pub(crate) kind        : u32,
+    pub(crate) slots       : u32,
+    pub(crate) slot_size   : u32,
+    pub(crate) data_offset : u32,
+    pub(crate) ring_addr   : u64,
+    pub(crate) ring_size   : u64,
+}
+
+/// The memory of a channel, shared by the processes that opened it
+pub(crate) struct Channel {
+    key    : u64,
+    region : usize,
+    order  : usize,
+    kind   : u32,
+}
+
+/// A channel mapped into a process, as an open file
+///
+/// The mapping only holds the channel to keep its frames alive until the
+/// file is released, the process reaches them through its page tables.
+struct ChannelMapping {
+    _channel : Arc<Channel>,
+    owner    : Weak<Process>,
+    addr     : usize,
+}
+
+// the channels that exist, by key
+#[allow(non_upper_case_globals)]
+static channels : SpinLock<BTreeMap<u64, Weak<Channel>>> = SpinLock::new(BTreeMap::new());
+
+impl Channel {
+    /// Creates a channel with `slots` slots of `slot_size` Bytes
+    fn new(key:u64, kind:u32, slots:u32, slot_size:u32) -> KResult<Arc<Channel>> {
+        if (kind != CHANNEL_SPSC && kind != CHANNEL_MPSC)
+        || slots == 0 || slots > MAX_SLOTS || !slots.is_power_of_two()
+        || slot_size == 0 || slot_size > MAX_SLOT_SIZE {
+            return Err(EINVAL);
+        }
+        let stride = (8 + slot_size as usize + 7) & !7;
+        let size = HEADER_SIZE + slots as usize * stride;
+        if size > MAX_SIZE {
+            return Err(EINVAL);
+        }
+        let order = size_to_order(size);
+        let region = phys_to_virt(alloc_frames(order).ok_or(ENOMEM)?);
+        unsafe {
+            core::ptr::write_bytes(region as *mut u8, 0, PAGE_SIZE << order);
+            let header = &mut *(region as *mut ChannelHeader);
+            header.magic = CHANNEL_MAGIC;
+            header.kind = kind;
+            header.slots = slots;
+            header.slot_size = slot_size;
+            header.slot_stride = stride as u32;
+            header.data_offset = HEADER_SIZE as u32;
+            for slot in 0..slots as usize {
+                *((region + HEADER_SIZE + slot * stride) as *mut u64) = slot as u64;
+            }
+        }
+        Ok(Arc::new(Channel { key, region, order, kind }))
+    }
+
+    fn header(&self) -> &ChannelHeader {
+        unsafe { &*(self.region as *const ChannelHeader) }
+    }
+}
+
+impl Drop for Channel {
+    fn drop(&mut self) {
+        // the key may have been taken by a new channel already
+        let mut registry = channels.lock();
+        if registry.get(&self.key).is_some_and(|weak| weak.strong_count() == 0) {
+            registry.remove(&self.key);
+        }
+        drop(registry);
+        free_frames(virt_to_phys(self.region), self.order);
+    }
+}
+
+impl FileOps for ChannelMapping {
+    fn release(&self, _file:&File) {
+        if let Some(process) = self.owner.upgrade() {
+            process.space.unmap_range(self.addr);
+        }
+    }
+}
+
+/// Opens the channel `key`, creating it with the geometry in the
+/// parameters at `params_addr` if it does not exist, and maps it into the
+/// caller
+///
+/// The geometry of an existing channel is reported in the parameters,
+/// along with the address and size of the mapping. Closing the returned
+/// descriptor unmaps the channel, which goes away with its last mapping.
+pub(crate) fn sys_channel_open(key:u64, params_addr:usize) -> KResult<usize> {
+    let mut params : ChannelParams = read_user(params_addr)?;
+    let process = current_process().ok_or(EPERM)?;
+
+    let mut registry = channels.lock();
+    let channel = match registry.get(&key).and_then(|weak| weak.upgrade()) {
+        Some(channel) => channel,
+        None          => {
+            let channel = Channel::new(key, params.kind, params.slots, params.slot_size)?;
+            registry.insert(key, Arc::downgrade(&channel));
+            channel
+        },
+    };
+    drop(registry);
+
+    let pages = 1 << channel.order;
+    let addr = process.space.map_frames(virt_to_phys(channel.region), pages, VMA_READ | VMA_WRITE | VMA_SHARED)?;
+    let header = channel.header();
+    params.kind = channel.kind;
+    params.slots = header.slots;
+    params.slot_size = header.slot_size;
+    params.data_offset = header.data_offset;
+    params.ring_addr = addr as u64;
+    params.ring_size = (pages * PAGE_SIZE) as u64;
+
+    let mapping = Arc::new(ChannelMapping {
+        _channel : channel,
+        owner    : Arc::downgrade(&process),
+        addr,
+    });
+    let fd = install_file(File::new(mapping, 0))?;
+    if let Err(errno) = write_user(params_addr, &params) {
+        let _ = sys_close(fd);
+        return Err(errno);
+    }
+    Ok(fd)
+}
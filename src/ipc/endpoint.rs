@@ -0,0 +1,160 @@
+use crate::ipc::*;
+use crate::sync::*;
+use crate::syscall::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+
+use alloc::sync::Arc;
+
+// the number of words carried by a message, in RSI, RDX, R10 and R8
+pub(crate) const MESSAGE_WORDS : usize = 4;
+
+/// The IPC state of a thread
+///
+/// `frame` is the system call frame of the thread while it waits, where
+/// messages are delivered. `caller` is the thread waiting for a reply
+/// from this one. `message` and `badge` hold what a sender queued on an
+/// endpoint is sending.
+pub(crate) struct IpcState {
+    frame   : usize,
+    caller  : usize,
+    message : [u64; MESSAGE_WORDS],
+    badge   : u64,
+}
+
+impl IpcState {
+    pub(crate) const fn new() -> Self {
+        IpcState {
+            frame   : 0,
+            caller  : NO_THREAD,
+            message : [0; MESSAGE_WORDS],
+            badge   : 0,
+        }
+    }
+}
+
+struct EndpointQueues {
+    senders   : ThreadQueue,
+    receivers : ThreadQueue,
+}
+
+/// A rendezvous point for synchronous messages
+///
+/// Threads block on an endpoint until a partner shows up: callers wait
+/// for a receiver, receivers wait for a caller. Whoever arrives second
+/// transfers the message and hands the processor over to the other side.
+pub(crate) struct Endpoint {
+    queues : SpinLock<EndpointQueues>,
+}
+
+impl Endpoint {
+    pub(crate) fn new() -> Arc<Endpoint> {
+        Arc::new(Endpoint {
+            queues : SpinLock::new(EndpointQueues {
+                senders   : ThreadQueue::new(),
+                receivers : ThreadQueue::new(),
+            }),
+        })
+    }
+}
+
+fn read_message(frame:&SyscallFrame) -> [u64; MESSAGE_WORDS] {
+    [frame.rsi, frame.rdx, frame.r10, frame.r8]
+}
+
+/// Writes `message` into the registers the waiting thread `id` returns with
+fn deliver(id:usize, message:&[u64; MESSAGE_WORDS]) -> &'static mut SyscallFrame {
+    let frame = unsafe { &mut *(thread(id).ipc.frame as *mut SyscallFrame) };
+    frame.rsi = message[0];
+    frame.rdx = message[1];
+    frame.r10 = message[2];
+    frame.r8 = message[3];
+    frame
+}
+
+/// Sends the message in the registers to the endpoint of the capability
+/// in RDI and waits for the reply, which overwrites the message registers
+///
+/// If a receiver is waiting the processor goes straight to it.
+pub(crate) fn sys_ipc_call(frame:&mut SyscallFrame) -> KResult<usize> {
+    let cap = get_cap(frame.rdi as usize, CAP_SEND)?;
+    let message = read_message(frame);
+    let me = current_thread_id();
+    thread(me).ipc.frame = frame as *mut SyscallFrame as usize;
+
+    let receiver = cap.endpoint.queues.lock().receivers.pop();
+    match receiver {
+        Some(receiver) => {
+            deliver(receiver, &message).rdi = cap.badge;
+            thread(receiver).ipc.caller = me;
+            thread(receiver).state = ThreadState::Runnable;
+            thread(me).state = ThreadState::Blocked;
+            drop(cap);
+            switch_to(receiver);
+        },
+        None => {
+            thread(me).ipc.message = message;
+            thread(me).ipc.badge = cap.badge;
+            cap.endpoint.queues.lock().senders.push(me);
+            drop(cap);
+            block();
+        },
+    }
+    Ok(0)
+}
+
+/// Takes the next message queued on `endpoint`, or waits for one
+///
+/// When `reply_to` is a thread, the processor goes straight to it if
+/// there is no message to take.
+fn wait(endpoint:&Endpoint, frame:&mut SyscallFrame, reply_to:usize) {
+    let me = current_thread_id();
+    let mut queues = endpoint.queues.lock();
+    if let Some(sender) = queues.senders.pop() {
+        drop(queues);
+        let ipc = &thread(sender).ipc;
+        frame.rdi = ipc.badge;
+        [frame.rsi, frame.rdx, frame.r10, frame.r8] = ipc.message;
+        thread(me).ipc.caller = sender;
+        if reply_to != NO_THREAD {
+            wake(reply_to);
+        }
+        return;
+    }
+    thread(me).ipc.frame = frame as *mut SyscallFrame as usize;
+    queues.receivers.push(me);
+    drop(queues);
+    if reply_to != NO_THREAD {
+        thread(reply_to).state = ThreadState::Runnable;
+        thread(me).state = ThreadState::Blocked;
+        switch_to(reply_to);
+    } else {
+        block();
+    }
+}
+
+/// Waits for a message on the endpoint of the capability in RDI
+///
+/// The message is returned in the message registers, with the badge of
+/// the capability it was sent through in RDI.
+pub(crate) fn sys_ipc_recv(frame:&mut SyscallFrame) -> KResult<usize> {
+    let cap = get_cap(frame.rdi as usize, CAP_RECEIVE)?;
+    wait(&cap.endpoint, frame, NO_THREAD);
+    Ok(0)
+}
+
+/// Replies with the message in the registers to the last caller, then
+/// waits for the next message like `sys_ipc_recv()`
+///
+/// A server loop costs one system call per request, and when no other
+/// request is queued the processor goes straight back to the caller.
+pub(crate) fn sys_ipc_reply_wait(frame:&mut SyscallFrame) -> KResult<usize> {
+    let cap = get_cap(frame.rdi as usize, CAP_RECEIVE)?;
+    let me = current_thread_id();
+    let caller = core::mem::replace(&mut thread(me).ipc.caller, NO_THREAD);
+    if caller != NO_THREAD {
+        deliver(caller, &read_message(frame));
+    }
+    wait(&cap.endpoint, frame, caller);
+    Ok(0)
+}
@@ -0,0 +1,106 @@
+use crate::mm::*;
+use crate::mm::space::*;
+use crate::mm::uaccess::*;
+use crate::mm::vma::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+
+use alloc::vec::Vec;
+
+// futex operations, the same values as Linux
+pub(crate) const FUTEX_WAIT : usize = 0;
+pub(crate) const FUTEX_WAKE : usize = 1;
+
+// the futex is private to the process, keyed by its virtual address
+pub(crate) const FUTEX_PRIVATE_FLAG : usize = 128;
+
+// the number of hash buckets of the waiters
+const FUTEX_BUCKETS : usize = 64;
+
+/// The key of a futex word: the address space and the virtual address of
+/// an anonymous page, none and the physical address of a kernel frame
+type FutexKey = (usize, usize);
+
+struct FutexWaiter {
+    key    : FutexKey,
+    thread : usize,
+}
+
+#[allow(non_upper_case_globals)]
+static futex_buckets : [SpinLock<Vec<FutexWaiter>>; FUTEX_BUCKETS] = [const { SpinLock::new(Vec::new()) }; FUTEX_BUCKETS];
+
+/// Returns the key of the futex word at the user address `addr`
+///
+/// The page is faulted in first, so that a word never touched or swapped
+/// out is found. Anonymous pages, shared or not, may go to swap and come
+/// back in another frame, so their futexes, as the private ones, are keyed
+/// by their virtual address in the address space. The other mappings,
+/// the channels and the rings, are frames of the kernel which never move:
+/// they are keyed by their physical address, so that processes sharing
+/// them agree on the key whatever the address they mapped them at.
+fn futex_key(addr:usize, private:bool) -> KResult<FutexKey> {
+    if addr % 4 != 0 || !access_ok(addr, 4) {
+        return Err(EINVAL);
+    }
+    let process = current_process().ok_or(EFAULT)?;
+    let space = &process.space;
+    let vma = space.vmas.find(addr).ok_or(EFAULT)?;
+    let frame = space.fault_in(addr)?;
+    if private || vma.flags & VMA_ANONYMOUS != 0 {
+        Ok((space as *const AddressSpace as usize, addr))
+    } else {
+        Ok((0, frame + addr % PAGE_SIZE))
+    }
+}
+
+fn bucket(key:FutexKey) -> &'static SpinLock<Vec<FutexWaiter>> {
+    &futex_buckets[((key.0 >> 4) ^ (key.1 >> 2)) % FUTEX_BUCKETS]
+}
+
+/// Blocks until woken up, if the word at `addr` still holds `value`
+fn futex_wait(addr:usize, value:u32, private:bool) -> KResult<usize> {
+    let key = futex_key(addr, private)?;
+    let mut waiters = bucket(key).lock();
+    // the check and the queueing happen under the bucket lock, and the
+    // kernel is not preempted: no waker runs until the thread is blocked,
+    // so one changing the word first is either seen here or finds the
+    // waiter. With more processors the thread would have to be marked
+    // blocked under the lock
+    if read_user::<u32>(addr)? != value {
+        return Err(EAGAIN);
+    }
+    waiters.push(FutexWaiter { key, thread : current_thread_id() });
+    drop(waiters);
+    block();
+    Ok(0)
+}
+
+/// Wakes up to `count` threads waiting on the word at `addr`, returning their number
+fn futex_wake(addr:usize, count:usize, private:bool) -> KResult<usize> {
+    let key = futex_key(addr, private)?;
+    let mut waiters = bucket(key).lock();
+    let mut woken = 0;
+    waiters.retain(|waiter| {
+        if woken == count || waiter.key != key {
+            return true;
+        }
+        wake(waiter.thread);
+        woken += 1;
+        false
+    });
+    Ok(woken)
+}
+
+/// Waits on, or wakes the waiters of, the 32 bits word at `addr`
+///
+/// Timeouts are not supported, waits last until a wake up.
+pub(crate) fn sys_futex(addr:usize, op:usize, value:u32, timeout:usize) -> KResult<usize> {
+    let private = op & FUTEX_PRIVATE_FLAG != 0;
+    match op & !FUTEX_PRIVATE_FLAG {
+        FUTEX_WAIT if timeout != 0 => Err(EINVAL),
+        FUTEX_WAIT                 => futex_wait(addr, value, private),
+        FUTEX_WAKE                 => futex_wake(addr, value as usize, private),
+        _                          => Err(ENOSYS),
+    }
+}
@@ -0,0 +1,11 @@
+#[cfg(feature = "bench")]
+pub(crate) mod bench;
+pub(crate) mod cap;
+pub(crate) mod channel;
+pub(crate) mod endpoint;
+pub(crate) mod futex;
+
+pub(crate) use cap::*;
+pub(crate) use channel::*;
+pub(crate) use endpoint::*;
+pub(crate) use futex::*;
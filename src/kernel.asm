@@ -1,7 +1,17 @@
 section .text
 
 extern kernel_main
+extern bss_start
+extern bss_end
+extern syscall_handler
+extern thread_main
+extern exception_handler
 global start
+global syscall_entry
+global switch_context
+global thread_start
+global enter_user
+global exception_stubs
 
 start:
     mov rax, GDT64Ptr                           ; cannot directly reference the GDT pointer with a 32-bits pointer
@@ -18,8 +28,8 @@ set_tss:
     shr rax, 8                                  ; move bits from 32 to 63
     mov [rdi+8], eax
 
-    mov ax, 0x20
-    ltr ax                                      ; load task register (5th entry of the GDT)
+    mov ax, 0x28
+    ltr ax                                      ; load task register (6th entry of the GDT)
 
 remap_pic:                                      ; Programmable Interrupt Controller
     mov al, 00010001b                           ; b0=1: need 4th init step, b1=0: cascade, b3=0: edge, b4=1: init
@@ -56,6 +66,15 @@ kernel_entry:
     mov ss, ax                                  ; zero the SS register to handle interrupts without causing exceptions
 
     mov rsp, 0xFFFF800007400000                 ; adjust the kernel stack pointer address
+
+clear_bss:                                      ; the .bss section is not part of the binary image, so zero it before running any code relying on it
+    cld
+    mov rdi, bss_start
+    mov rcx, bss_end
+    sub rcx, rdi
+    xor eax, eax
+    rep stosb
+
     call kernel_main
 
     sti                                         ; interrupts were disabled while switching to long mode
@@ -65,15 +84,190 @@ end:
     jmp end
 
 
+syscall_entry:                                  ; SYSCALL jumps here with the user RIP in RCX and the user RFLAGS in R11, interrupts are masked by SFMASK
+    swapgs                                      ; GS now points to the per-CPU area (see 'percpu.rs')
+    mov [gs:16], rsp                            ; save the user stack pointer
+    mov rsp, [gs:8]                             ; and switch to the kernel stack of the current thread
+
+    push qword [gs:16]                          ; build the SyscallFrame (see 'syscall/mod.rs'), from the last field to the first one
+    push r11
+    push rcx
+    push rax                                    ; the system call number
+    push rdi                                    ; the arguments
+    push rsi
+    push rdx
+    push r10
+    push r8
+    push r9
+
+    mov rdi, rsp                                ; the frame is the only argument of the handler, the stack is still 16 Bytes aligned
+    call syscall_handler                        ; the result is returned in RAX
+
+    pop r9
+    pop r8
+    pop r10
+    pop rdx
+    pop rsi
+    pop rdi
+    add rsp, 8                                  ; skip the system call number, RAX holds the result
+    pop rcx
+    pop r11
+    pop rsp                                     ; back to the user stack
+
+    swapgs
+    o64 sysret
+
+
+switch_context:                                 ; arguments are stored in RDI (where to save the current stack pointer), RSI (the stack pointer to switch to)
+    push rbx                                    ; only the callee-saved registers need to be preserved, the caller of this function takes care of the others
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rdi], rsp
+    mov rsp, rsi
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    ret                                         ; returns into the thread being resumed, or into thread_start for a new one
+
+
+%macro EXCEPTION 1                              ; for the exceptions without an error code, push a null one to keep a single frame layout
+exception_%1:
+    push 0
+    push %1
+    jmp exception_common
+%endmacro
+
+%macro EXCEPTION_ERROR 1                        ; for the exceptions whose error code is pushed by the processor
+exception_%1:
+    push %1
+    jmp exception_common
+%endmacro
+
+EXCEPTION 0                                     ; divide error
+EXCEPTION 1                                     ; debug
+EXCEPTION 2                                     ; non-maskable interrupt
+EXCEPTION 3                                     ; breakpoint
+EXCEPTION 4                                     ; overflow
+EXCEPTION 5                                     ; bound range exceeded
+EXCEPTION 6                                     ; invalid opcode
+EXCEPTION 7                                     ; device not available
+EXCEPTION_ERROR 8                               ; double fault
+EXCEPTION 9                                     ; coprocessor segment overrun
+EXCEPTION_ERROR 10                              ; invalid TSS
+EXCEPTION_ERROR 11                              ; segment not present
+EXCEPTION_ERROR 12                              ; stack-segment fault
+EXCEPTION_ERROR 13                              ; general protection
+EXCEPTION_ERROR 14                              ; page fault
+EXCEPTION 15                                    ; reserved
+EXCEPTION 16                                    ; x87 floating-point
+EXCEPTION_ERROR 17                              ; alignment check
+EXCEPTION 18                                    ; machine check
+EXCEPTION 19                                    ; SIMD floating-point
+EXCEPTION 20                                    ; virtualization
+EXCEPTION_ERROR 21                              ; control protection
+EXCEPTION 22                                    ; reserved
+EXCEPTION 23
+EXCEPTION 24
+EXCEPTION 25
+EXCEPTION 26
+EXCEPTION 27
+EXCEPTION 28                                    ; hypervisor injection
+EXCEPTION_ERROR 29                              ; VMM communication
+EXCEPTION_ERROR 30                              ; security
+EXCEPTION 31                                    ; reserved
+
+exception_common:                               ; the stack holds the vector, the error code and the frame pushed by the processor
+    test qword [rsp+24], 3                      ; check the privilege level of the interrupted code segment
+    jz .from_kernel
+    swapgs                                      ; coming from user mode, GS must point to the per-CPU area
+.from_kernel:
+    push rax                                    ; build the ExceptionFrame (see 'cpu/exception.rs'), from the last field to the first one
+    push rbx
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push rbp
+    push r8
+    push r9
+    push r10
+    push r11
+    push r12
+    push r13
+    push r14
+    push r15
+
+    mov rdi, rsp                                ; the frame is the only argument of the handler, the stack is 16 Bytes aligned
+    cld
+    call exception_handler                      ; the handler may change the saved instruction pointer, to resume at a fixup
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rbp
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rbx
+    pop rax
+
+    test qword [rsp+24], 3
+    jz .to_kernel
+    swapgs
+.to_kernel:
+    add rsp, 16                                 ; drop the vector and the error code
+    iretq
+
+
+thread_start:                                   ; the first code run by a new thread, R12 holds its entry point and R13 its argument (see 'thread.rs')
+    mov rdi, r12
+    mov rsi, r13
+    call thread_main                            ; never returns
+
+
+enter_user:                                     ; arguments are stored in RDI (user instruction pointer), RSI (user stack pointer)
+    mov rcx, rdi
+    mov r11, 0x002                              ; RFLAGS: interrupts stay disabled, no interrupt descriptor table exists yet
+    mov rsp, rsi
+    xor eax, eax                                ; don't leak kernel data through the registers
+    xor ebx, ebx
+    xor edx, edx
+    xor esi, esi
+    xor edi, edi
+    xor ebp, ebp
+    xor r8, r8
+    xor r9, r9
+    xor r10, r10
+    xor r12, r12
+    xor r13, r13
+    xor r14, r14
+    xor r15, r15
+    swapgs
+    o64 sysret
+
+
 section .data
 
 global TSS
 
-GDT64:                                          ; same as per loader.asm
+GDT64:                                          ; the order of the segments is the one required by SYSCALL and SYSRET (see 'syscall/mod.rs')
     dq 0
-    dq 0x0020980000000000
-    dq 0x0020f80000000000                       ; the code segment descriptors for ring 3
-    dq 0x0000f20000000000
+    dq 0x0020980000000000                       ; the code segment descriptor for ring 0, same as per loader.asm
+    dq 0x0000920000000000                       ; the data segment descriptor for ring 0
+    dq 0x0000f20000000000                       ; the data segment descriptor for ring 3
+    dq 0x0020f80000000000                       ; the code segment descriptor for ring 3
 TSSDesc:                                        ; the TSS descriptor
     dw TSSLen-1
     dw 0                                        ; set the base address to 0 for the moment, the actual address will be assigned in the code
@@ -94,3 +288,27 @@ TSS:                                            ; Task State Descriptor
     dd TSSLen                                   ; address of IO permission bitmap. assign the size of TSS since unused
 
 TSSLen: equ $-TSS
+
+
+section .rodata align=4096
+
+global vdso_start
+global vdso_end
+global ipc_bench_start
+global ipc_bench_end
+
+vdso_start:                                     ; the vDSO is mapped into user space, so it must not share its pages with anything else
+    incbin "build/vdso.bin"
+    align 4096, db 0
+vdso_end:
+
+ipc_bench_start:                                ; the IPC benchmark program (see 'ipc/bench.rs'), mapped into user space as well
+    incbin "build/ipc_bench.bin"
+    align 4096, db 0
+ipc_bench_end:
+
+exception_stubs:                                ; the entry points of the exceptions, installed in the IDT (see 'cpu/idt.rs')
+    dq exception_0, exception_1, exception_2, exception_3, exception_4, exception_5, exception_6, exception_7
+    dq exception_8, exception_9, exception_10, exception_11, exception_12, exception_13, exception_14, exception_15
+    dq exception_16, exception_17, exception_18, exception_19, exception_20, exception_21, exception_22, exception_23
+    dq exception_24, exception_25, exception_26, exception_27, exception_28, exception_29, exception_30, exception_31
@@ -1,9 +1,32 @@
+use crate::block;
+use crate::cpu;
+use crate::fs;
+use crate::mm;
+use crate::syscall;
+use crate::task;
+use crate::time;
 use crate::tty::*;
+use crate::tty::serial;
 
 pub(crate) fn start() {
+    cpu::init();
+    serial::init();
+    mm::init();
+    time::init();
+    task::init();
+    block::init();
+    fs::fat16::init();
+    fs::tmpfs::init();
+    mm::swapfile::init();
+    mm::reclaim::init();
+    syscall::init();
     clear();
     print("Welcome in the kernel");
-    loop {}
+    #[cfg(feature = "bench")]
+    crate::ipc::bench::run();
+    loop {
+        task::yield_now();
+    }
 }
 
 
@@ -1,8 +1,20 @@
 #![no_std]
 #![no_main]
 
+extern crate alloc;
+
 mod kernel;
 
+pub(crate) mod block;
+pub(crate) mod cpu;
+pub(crate) mod fs;
+pub(crate) mod io;
+pub(crate) mod ipc;
+pub(crate) mod mm;
+pub(crate) mod sync;
+pub(crate) mod syscall;
+pub(crate) mod task;
+pub(crate) mod time;
 pub(crate) mod tty;
 
 #[no_mangle]
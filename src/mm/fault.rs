@@ -0,0 +1,29 @@
+use crate::mm::*;
+use crate::mm::uaccess::*;
+use crate::mm::vma::*;
+use crate::task::*;
+
+// page fault error code bits
+pub(crate) const PF_PRESENT : u64 = 1 << 0;
+pub(crate) const PF_WRITE   : u64 = 1 << 1;
+
+/// Resolves a page fault on the user address `addr` of the current process
+///
+/// Only faults on anonymous pages can be resolved, by backing them with a
+/// zeroed frame on the first touch or by bringing them back from swap.
+/// Returns whether the access can be retried.
+pub(crate) fn handle_page_fault(addr:usize, error_code:u64) -> bool {
+    if !access_ok(addr, 1) || error_code & PF_PRESENT != 0 {
+        return false;
+    }
+    let process = match current_process() {
+        Some(process) => process,
+        None          => return false,
+    };
+    match process.space.vmas.find(addr) {
+        Some(vma) if error_code & PF_WRITE == 0 || vma.flags & VMA_WRITE != 0 => {
+            process.space.fault_in(page_align_down(addr)).is_ok()
+        },
+        _ => false,
+    }
+}
@@ -0,0 +1,452 @@
+use crate::mm::frame::*;
+use crate::mm::radix::*;
+use crate::mm::reclaim::*;
+use crate::mm::swap::*;
+use crate::mm::writeback::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+
+use alloc::collections::BTreeMap;
+use alloc::sync::Arc;
+use alloc::vec::Vec;
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+
+// the tags of the pages of a cache
+pub(crate) const PAGE_DIRTY     : usize = 0;
+pub(crate) const PAGE_WRITEBACK : usize = 1;
+pub(crate) const PAGE_LOCKED    : usize = 2;
+pub(crate) const PAGE_READAHEAD : usize = 3;
+
+// the pages taken at a time when walking a whole cache
+const GANG_SIZE : usize = 64;
+
+/// The cached pages of a file
+///
+/// Pages are indexed by their position in the file in a radix tree, so
+/// that lookups are lockless, and tagged while dirty or under writeback,
+/// so that writing a file back never scans its clean pages. The cache
+/// holds a reference to each of its frames, which sit on the LRU lists:
+/// reclaim drops the clean pages not used lately.
+///
+/// The pages read ahead enter the cache locked, before their content
+/// arrives, and are unlocked when the read completes: the users of a
+/// locked page wait for it. The first page of the part of a readahead
+/// window left for later carries the readahead tag, so that the reader
+/// reaching it starts the next window.
+///
+/// The dirty pages are accounted to the writeback state of the device
+/// holding the file, if any, whose flusher writes them back.
+///
+/// The cache of a file with no device is swap backed: it is where the
+/// content lives, and reclaim moves its pages to swap rather than
+/// dropping them, remembering the swap entry of each page moved.
+///
+/// The descriptors of the frames point back to the cache, which must not
+/// move once it holds pages.
+pub(crate) struct PageCache {
+    pages       : RadixTree,
+    count       : AtomicUsize,
+    dirty       : AtomicUsize,
+    /// Where the users of locked pages wait
+    locked_wait : WaitQueue,
+    backing     : Option<Arc<BackingDev>>,
+    /// Whether the file is in the list of the flusher
+    queued      : AtomicBool,
+    /// The pages swapped out, for a swap backed cache
+    swapped     : Option<SpinLock<BTreeMap<u64, SwapEntry>>>,
+}
+
+impl PageCache {
+    /// Creates the cache of a file stored on a device with `backing`
+    pub(crate) fn with_backing(backing:Arc<BackingDev>) -> Self {
+        PageCache {
+            pages       : RadixTree::new(),
+            count       : AtomicUsize::new(0),
+            dirty       : AtomicUsize::new(0),
+            locked_wait : WaitQueue::new(),
+            backing     : Some(backing),
+            queued      : AtomicBool::new(false),
+            swapped     : None,
+        }
+    }
+
+    /// Creates the cache of a file with no device, whose pages go to swap
+    pub(crate) const fn swap_backed() -> Self {
+        PageCache {
+            pages       : RadixTree::new(),
+            count       : AtomicUsize::new(0),
+            dirty       : AtomicUsize::new(0),
+            locked_wait : WaitQueue::new(),
+            backing     : None,
+            queued      : AtomicBool::new(false),
+            swapped     : Some(SpinLock::new(BTreeMap::new())),
+        }
+    }
+
+    /// Marks the file as queued for the flusher, returning whether it was not
+    pub(crate) fn mark_queued(&self) -> bool {
+        !self.queued.swap(true, Ordering::Relaxed)
+    }
+
+    pub(crate) fn clear_queued(&self) {
+        self.queued.store(false, Ordering::Relaxed);
+    }
+
+    fn account_dirtied(&self) {
+        self.dirty.fetch_add(1, Ordering::Relaxed);
+        if let Some(backing) = &self.backing {
+            backing.account_dirtied(1);
+        }
+    }
+
+    fn account_cleaned(&self) {
+        self.dirty.fetch_sub(1, Ordering::Relaxed);
+        if let Some(backing) = &self.backing {
+            backing.account_cleaned(1);
+        }
+    }
+
+    /// Returns the number of pages cached
+    pub(crate) fn page_count(&self) -> usize {
+        self.count.load(Ordering::Relaxed)
+    }
+
+    /// Returns the number of dirty pages
+    pub(crate) fn dirty_count(&self) -> usize {
+        self.dirty.load(Ordering::Relaxed)
+    }
+
+    /// Returns the frame of the page `index`, with a reference taken for the caller
+    pub(crate) fn find_page(&self, index:u64) -> Option<usize> {
+        let frame = self.pages.lookup_get(index, try_get_frame, put_frame)?;
+        mark_page_accessed(frame);
+        Some(frame)
+    }
+
+    /// Adds `frame`, whose reference is handed over by the caller, as the page `index`
+    ///
+    /// Returns the frame now cached as the page, with a reference for the
+    /// caller: if another one was added first, `frame` is released and the
+    /// other frame returned instead.
+    pub(crate) fn add_page(&self, index:u64, frame:usize) -> usize {
+        loop {
+            get_frame(frame);
+            if self.pages.insert(index, frame).is_ok() {
+                self.count.fetch_add(1, Ordering::Relaxed);
+                lru_add_cache(frame, self, index);
+                return frame;
+            }
+            put_frame(frame);
+            if let Some(cached) = self.find_page(index) {
+                put_frame(frame);
+                return cached;
+            }
+        }
+    }
+
+    /// Returns the frame of the page `index` like `find_page()`, once its
+    /// content is there
+    ///
+    /// A locked page is waited for. If its read failed, the page is gone
+    /// from the cache when unlocked, and `None` is returned.
+    pub(crate) fn find_uptodate_page(&self, index:u64) -> Option<usize> {
+        let frame = self.find_page(index)?;
+        if !self.is_locked(index) {
+            return Some(frame);
+        }
+        self.locked_wait.wait_until(|| !self.is_locked(index));
+        if self.pages.lookup(index) == Some(frame) {
+            return Some(frame);
+        }
+        put_frame(frame);
+        None
+    }
+
+    /// Checks whether the page `index` is cached, without taking it
+    pub(crate) fn is_cached(&self, index:u64) -> bool {
+        self.pages.lookup(index).is_some()
+    }
+
+    /// Adds `frame`, whose reference is handed over by the caller, as the
+    /// locked page `index`, with the readahead tag if `marker`
+    ///
+    /// Returns false, releasing `frame`, if the page is cached already.
+    /// Otherwise the cache takes the reference, and the caller fills the
+    /// frame then calls `unlock_page()`.
+    pub(crate) fn add_locked_page(&self, index:u64, frame:usize, marker:bool) -> bool {
+        let tags : &[usize] = if marker { &[PAGE_LOCKED, PAGE_READAHEAD] } else { &[PAGE_LOCKED] };
+        if self.pages.insert_tagged(index, frame, tags).is_err() {
+            free_frame(frame);
+            return false;
+        }
+        self.count.fetch_add(1, Ordering::Relaxed);
+        lru_add_cache(frame, self, index);
+        true
+    }
+
+    pub(crate) fn is_locked(&self, index:u64) -> bool {
+        self.pages.get_tag(index, PAGE_LOCKED)
+    }
+
+    /// Unlocks the page `index` once its read ended, dropping it if the read failed
+    pub(crate) fn unlock_page(&self, index:u64, result:KResult<()>) {
+        if result.is_err() {
+            self.remove_page(index, |_, tags| tags[PAGE_LOCKED]);
+        } else {
+            self.pages.clear_tag(index, PAGE_LOCKED);
+        }
+        self.locked_wait.wake_all();
+    }
+
+    /// Clears the readahead tag of the page `index`, returning whether it had it
+    pub(crate) fn test_clear_readahead(&self, index:u64) -> bool {
+        self.pages.clear_tag(index, PAGE_READAHEAD)
+    }
+
+    /// Returns the frame of the page `index`, referenced, reading it with
+    /// `fill` if not cached yet
+    pub(crate) fn find_or_read_page(&self, index:u64, fill:impl FnOnce(usize) -> KResult<()>) -> KResult<usize> {
+        if let Some(frame) = self.find_uptodate_page(index) {
+            return Ok(frame);
+        }
+        let frame = alloc_frame().ok_or(ENOMEM)?;
+        if let Err(errno) = fill(frame) {
+            free_frame(frame);
+            return Err(errno);
+        }
+        Ok(self.add_page(index, frame))
+    }
+
+    /// Marks the page `index` dirty
+    pub(crate) fn set_page_dirty(&self, index:u64) {
+        if self.pages.set_tag(index, PAGE_DIRTY) {
+            self.account_dirtied();
+        }
+    }
+
+    pub(crate) fn is_dirty(&self, index:u64) -> bool {
+        self.pages.get_tag(index, PAGE_DIRTY)
+    }
+
+    /// Returns up to `max` dirty pages from the page `start` on, in file
+    /// order, with a reference taken on their frames
+    pub(crate) fn dirty_pages(&self, start:u64, max:usize) -> Vec<(u64, usize)> {
+        let mut pages = self.pages.gang_lookup_tag(start, max, Some(PAGE_DIRTY));
+        pages.retain(|&(_, frame)| try_get_frame(frame));
+        pages
+    }
+
+    /// Returns the first dirty page from the page `start` on
+    pub(crate) fn first_dirty(&self, start:u64) -> Option<u64> {
+        self.pages.gang_lookup_tag(start, 1, Some(PAGE_DIRTY)).first().map(|&(index, _)| index)
+    }
+
+    /// Moves the page `index` from dirty to under writeback, returning
+    /// whether it was dirty
+    pub(crate) fn start_writeback(&self, index:u64) -> bool {
+        if !self.pages.clear_tag(index, PAGE_DIRTY) {
+            return false;
+        }
+        self.account_cleaned();
+        self.pages.set_tag(index, PAGE_WRITEBACK);
+        true
+    }
+
+    /// Ends the writeback of the page `index`, which is dirty again if it failed
+    pub(crate) fn end_writeback(&self, index:u64, result:KResult<()>) {
+        self.pages.clear_tag(index, PAGE_WRITEBACK);
+        if result.is_err() {
+            self.set_page_dirty(index);
+        } else if let Some(backing) = &self.backing {
+            backing.account_written(1);
+        }
+    }
+
+    /// Takes the page `index` out of the cache if `check` accepts its frame
+    /// and tags, handing the reference of the cache over to the caller
+    fn take_page(&self, index:u64, check:impl FnOnce(usize, [bool; RADIX_TAGS]) -> bool) -> Option<usize> {
+        let mut dirty = false;
+        let frame = self.pages.remove_if(index, |frame, tags| {
+            dirty = tags[PAGE_DIRTY];
+            check(frame, tags)
+        })?;
+        self.count.fetch_sub(1, Ordering::Relaxed);
+        if dirty {
+            self.account_cleaned();
+        }
+        lru_remove(frame);
+        Some(frame)
+    }
+
+    /// Drops the page `index` from the cache if `check` accepts its frame
+    /// and tags, returning whether it was dropped
+    fn remove_page(&self, index:u64, check:impl FnOnce(usize, [bool; RADIX_TAGS]) -> bool) -> bool {
+        match self.take_page(index, check) {
+            Some(frame) => {
+                put_frame(frame);
+                true
+            },
+            None => false,
+        }
+    }
+
+    /// Drops the pages from `start` on, dirty or not, swapped out included
+    ///
+    /// The pages must not be under writeback, nor locked.
+    pub(crate) fn truncate_pages(&self, start:u64) {
+        loop {
+            let pages = self.pages.gang_lookup(start, GANG_SIZE);
+            if pages.is_empty() {
+                break;
+            }
+            for (index, _) in pages {
+                self.remove_page(index, |_, _| true);
+            }
+        }
+        if let Some(swapped) = &self.swapped {
+            let gone = swapped.lock().split_off(&start);
+            for entry in gone.into_values() {
+                swap_free(entry);
+            }
+        }
+    }
+
+    /// Drops the clean pages from `start` to `end`, excluded, once the
+    /// device was written behind the cache
+    ///
+    /// The pages dirty, under writeback or locked stay.
+    pub(crate) fn invalidate_range(&self, start:u64, end:u64) {
+        let mut index = start;
+        while index < end {
+            let pages = self.pages.gang_lookup(index, GANG_SIZE);
+            let last = match pages.last() {
+                Some(&(last, _)) => last,
+                None             => return,
+            };
+            for &(page, _) in pages.iter().take_while(|&&(page, _)| page < end) {
+                self.remove_page(page, |_, tags| !tags[PAGE_DIRTY] && !tags[PAGE_WRITEBACK] && !tags[PAGE_LOCKED]);
+            }
+            index = last + 1;
+        }
+    }
+
+    /// Drops the page `index` if it is still backed by `frame`, clean,
+    /// unlocked, and not used by anyone else, called by reclaim
+    ///
+    /// A page read ahead and never used goes as any other, readahead tag
+    /// included. The page of a swap backed cache goes to swap, and stays
+    /// if there is no room there.
+    pub(crate) fn evict(&self, index:u64, frame:usize) -> bool {
+        let idle = move |cached:usize, tags:[bool; RADIX_TAGS]| {
+            let busy = tags[PAGE_DIRTY] || tags[PAGE_WRITEBACK] || tags[PAGE_LOCKED];
+            cached == frame && !busy && frame_refcount(frame) == 1
+        };
+        let Some(swapped) = &self.swapped else {
+            return self.remove_page(index, idle);
+        };
+        // the page is either cached or swapped out whenever the lock is
+        // free, the swap backends do not sleep storing it
+        let mut map = swapped.lock();
+        let Some(frame) = self.take_page(index, idle) else {
+            return false;
+        };
+        match swap_store(frame) {
+            Ok(entry) => {
+                map.insert(index, entry);
+                drop(map);
+                put_frame(frame);
+                true
+            },
+            Err(_) => {
+                let _ = self.pages.insert(index, frame);
+                self.count.fetch_add(1, Ordering::Relaxed);
+                lru_add_cache(frame, self, index);
+                false
+            },
+        }
+    }
+
+    /// Returns the number of pages swapped out
+    pub(crate) fn swapped_count(&self) -> usize {
+        self.swapped.as_ref().map_or(0, |swapped| swapped.lock().len())
+    }
+
+    /// Checks whether no page from `start` to `end`, excluded, is cached
+    /// or swapped out
+    pub(crate) fn is_range_empty(&self, start:u64, end:u64) -> bool {
+        let cached = self.pages.gang_lookup(start, 1).first().map_or(false, |&(index, _)| index < end);
+        let swapped = self.swapped.as_ref().map_or(false, |swapped| swapped.lock().range(start..end).next().is_some());
+        !cached && !swapped
+    }
+
+    /// Returns the frame of the page `index` of a swap backed cache, with a
+    /// reference taken for the caller, reading it back from swap if needed
+    ///
+    /// Returns none for a hole, a page never written. The page read back
+    /// is cached locked while the read is in progress.
+    pub(crate) fn find_or_swap_in(&self, index:u64) -> KResult<Option<usize>> {
+        let swapped = self.swapped.as_ref().ok_or(EINVAL)?;
+        loop {
+            if let Some(frame) = self.find_uptodate_page(index) {
+                return Ok(Some(frame));
+            }
+            {
+                let map = swapped.lock();
+                if !map.contains_key(&index) {
+                    // evicted and brought back meanwhile
+                    if self.is_cached(index) {
+                        continue;
+                    }
+                    return Ok(None);
+                }
+            }
+            let frame = alloc_frame().ok_or(ENOMEM)?;
+            let mut map = swapped.lock();
+            let Some(entry) = map.remove(&index) else {
+                drop(map);
+                free_frame(frame);
+                continue;
+            };
+            if !self.add_locked_page(index, frame, false) {
+                map.insert(index, entry);
+                continue;
+            }
+            drop(map);
+            let result = swap_load(entry, frame);
+            if result.is_err() {
+                swapped.lock().insert(index, entry);
+            }
+            self.unlock_page(index, result);
+            result?;
+        }
+    }
+
+    /// Adds `frames`, whose references are handed over by the caller, as
+    /// the pages from `start` on, returning how many were added
+    ///
+    /// The pages cached or swapped out already stay as they are, the
+    /// frames meant for them are released.
+    pub(crate) fn add_new_pages(&self, start:u64, frames:&[usize]) -> usize {
+        let map = self.swapped.as_ref().map(|swapped| swapped.lock());
+        let mut added = 0;
+        for (i, &frame) in frames.iter().enumerate() {
+            let index = start + i as u64;
+            let swapped = map.as_ref().map_or(false, |map| map.contains_key(&index));
+            if swapped || self.pages.insert(index, frame).is_err() {
+                free_frame(frame);
+                continue;
+            }
+            self.count.fetch_add(1, Ordering::Relaxed);
+            lru_add_cache(frame, self, index);
+            added += 1;
+        }
+        added
+    }
+}
+
+impl Drop for PageCache {
+    fn drop(&mut self) {
+        self.truncate_pages(0);
+    }
+}
@@ -0,0 +1,402 @@
+use crate::mm::*;
+use crate::mm::profile::*;
+use crate::sync::*;
+
+use core::ptr;
+
+// blocks of up to 2^MAX_ORDER contiguous frames (4 MiB) are tracked
+pub(crate) const MAX_ORDER : usize = 10;
+
+// frame flags
+pub(crate) const FRAME_FREE     : u32 = 0x01;   // head of a free block, its order is valid
+pub(crate) const FRAME_RESERVED : u32 = 0x02;   // not managed by the allocator
+pub(crate) const FRAME_LRU      : u32 = 0x04;   // on one of the LRU lists, `mapping` and `index` are valid
+pub(crate) const FRAME_ACTIVE   : u32 = 0x08;   // on the active LRU list
+pub(crate) const FRAME_CACHE    : u32 = 0x10;   // in a page cache, which `mapping` points to
+pub(crate) const FRAME_REF      : u32 = 0x20;   // a page cache page looked up since the last LRU scan
+
+// null link between frames
+pub(crate) const NO_FRAME : u32 = u32::MAX;
+
+// the memory map filled by the loader (see 'loader.asm'): a 32 bits counter followed by the entries
+const E820_MAP     : usize = 0x20000;
+const E820_ENTRIES : usize = 0x20008;
+const E820_USABLE  : u32 = 1;
+
+/// An entry of the BIOS memory map
+#[repr(C, packed)]
+#[derive(Clone, Copy)]
+struct E820Entry {
+    base   : u64,
+    length : u64,
+    kind   : u32,
+}
+
+/// The descriptor of a physical frame
+///
+/// One descriptor exists for every frame of the direct map, they are
+/// indexed by frame number. `prev` and `next` link free blocks together,
+/// or the frames of an LRU list once allocated. Frames on the LRU lists
+/// record who maps them in `mapping` and where in `index`: an address
+/// space and a virtual address, or a page cache and a page index.
+pub(crate) struct Frame {
+    pub(crate) flags    : u32,
+    pub(crate) order    : u8,
+    pub(crate) refcount : u32,
+    pub(crate) prev     : u32,
+    pub(crate) next     : u32,
+    pub(crate) mapping  : usize,
+    pub(crate) index    : usize,
+}
+
+/// A list of free blocks of the same order
+#[derive(Clone, Copy)]
+struct FreeArea {
+    head  : u32,
+    count : usize,
+}
+
+/// The free memory levels driving reclaim
+///
+/// Below `Low` the background reclaimer is woken up, and works until
+/// `High` is reached again. Below `Min` user allocations reclaim on their
+/// own, the frames left are kept for the kernel.
+#[derive(Clone, Copy)]
+pub(crate) enum Watermark {
+    Min,
+    Low,
+    High,
+}
+
+/// A binary buddy allocator over the descriptors in `mem_map`
+struct BuddyAllocator {
+    free_areas   : [FreeArea; MAX_ORDER+1],
+    free_frames  : usize,
+    total_frames : usize,
+    watermarks   : [usize; 3],
+}
+
+#[allow(non_upper_case_globals)]
+static mut mem_map : *mut Frame = ptr::null_mut();
+
+#[allow(non_upper_case_globals)]
+static mut mem_map_len : usize = 0;
+
+#[allow(non_upper_case_globals)]
+static frame_allocator : SpinLock<BuddyAllocator> = SpinLock::new(BuddyAllocator::new());
+
+/// Returns the frame number of the physical address `paddr`
+pub(crate) const fn pfn(paddr:usize) -> usize {
+    paddr >> PAGE_SHIFT
+}
+
+/// Returns the physical address of the frame number `pfn`
+pub(crate) const fn pfn_to_phys(pfn:usize) -> usize {
+    pfn << PAGE_SHIFT
+}
+
+/// Returns the descriptor of the frame number `pfn`
+pub(crate) fn frame(pfn:usize) -> &'static mut Frame {
+    unsafe {
+        assert!(pfn < mem_map_len);
+        &mut *mem_map.add(pfn)
+    }
+}
+
+/// Returns the number of frames described by the memory map
+pub(crate) fn frame_count() -> usize {
+    unsafe { mem_map_len }
+}
+
+impl BuddyAllocator {
+    const fn new() -> Self {
+        BuddyAllocator {
+            free_areas   : [FreeArea { head : NO_FRAME, count : 0 }; MAX_ORDER+1],
+            free_frames  : 0,
+            total_frames : 0,
+            watermarks   : [0; 3],
+        }
+    }
+
+    fn push(&mut self, pfn:usize, order:usize) {
+        let head = self.free_areas[order].head;
+        let block = frame(pfn);
+        block.flags |= FRAME_FREE;
+        block.order = order as u8;
+        block.prev = NO_FRAME;
+        block.next = head;
+        if head != NO_FRAME {
+            frame(head as usize).prev = pfn as u32;
+        }
+        self.free_areas[order].head = pfn as u32;
+        self.free_areas[order].count += 1;
+    }
+
+    fn unlink(&mut self, pfn:usize, order:usize) {
+        let block = frame(pfn);
+        let (prev, next) = (block.prev, block.next);
+        block.flags &= !FRAME_FREE;
+        if prev != NO_FRAME {
+            frame(prev as usize).next = next;
+        } else {
+            self.free_areas[order].head = next;
+        }
+        if next != NO_FRAME {
+            frame(next as usize).prev = prev;
+        }
+        self.free_areas[order].count -= 1;
+    }
+
+    /// Takes a block of 2^`order` frames, splitting a larger one if needed
+    fn alloc(&mut self, order:usize) -> Option<usize> {
+        let mut current = order;
+        while self.free_areas[current].head == NO_FRAME {
+            current += 1;
+            if current > MAX_ORDER {
+                return None;
+            }
+        }
+        let pfn = self.free_areas[current].head as usize;
+        self.unlink(pfn, current);
+        // give back the upper halves that are not needed
+        while current > order {
+            current -= 1;
+            self.push(pfn + (1 << current), current);
+        }
+        let block = frame(pfn);
+        block.order = order as u8;
+        block.refcount = 1;
+        self.free_frames -= 1 << order;
+        Some(pfn)
+    }
+
+    /// Gives back a block of 2^`order` frames, merging it with its free buddies
+    fn free(&mut self, mut pfn:usize, mut order:usize) {
+        self.free_frames += 1 << order;
+        frame(pfn).refcount = 0;
+        while order < MAX_ORDER {
+            let buddy = pfn ^ (1 << order);
+            if buddy >= frame_count() {
+                break;
+            }
+            let buddy_frame = frame(buddy);
+            if buddy_frame.flags & FRAME_FREE == 0 || buddy_frame.order as usize != order {
+                break;
+            }
+            self.unlink(buddy, order);
+            pfn &= buddy;
+            order += 1;
+        }
+        self.push(pfn, order);
+    }
+
+    /// Sizes the watermarks after the managed memory
+    ///
+    /// As in Linux, the minimum grows with the square root of the memory:
+    /// 4 * sqrt(KiB) KiB, between 128 KiB and 64 MiB.
+    fn set_watermarks(&mut self) {
+        let kib = self.total_frames * (PAGE_SIZE / 1024);
+        let mut root = 0;
+        while (root + 1) * (root + 1) <= kib {
+            root += 1;
+        }
+        let min = (4 * root).clamp(128, 65536) / (PAGE_SIZE / 1024);
+        self.watermarks = [min, min + min / 4, min + min / 2];
+    }
+
+    /// Hands the frames from `start` (included) to `end` (excluded) to the
+    /// allocator, as the largest naturally aligned blocks possible
+    fn add_range(&mut self, mut start:usize, end:usize) {
+        for pfn in start..end {
+            frame(pfn).flags &= !FRAME_RESERVED;
+        }
+        while start < end {
+            let mut order = MAX_ORDER;
+            while (start & ((1 << order) - 1)) != 0 || start + (1 << order) > end {
+                order -= 1;
+            }
+            self.total_frames += 1 << order;
+            self.free(start, order);
+            start += 1 << order;
+        }
+    }
+}
+
+/// Reads the `index`-th entry of the BIOS memory map
+fn e820_entry(index:usize) -> E820Entry {
+    unsafe { ptr::read_unaligned(phys_to_virt(E820_ENTRIES + index * 20) as *const E820Entry) }
+}
+
+/// Returns the number of entries in the BIOS memory map
+fn e820_count() -> usize {
+    unsafe { ptr::read_unaligned(phys_to_virt(E820_MAP) as *const u32) as usize }
+}
+
+/// Builds the frame descriptors and frees all the usable memory above the kernel
+///
+/// Only memory covered by the direct map is considered. The descriptors
+/// array is carved out of the first usable region after the kernel image.
+pub(crate) fn init() {
+    let first_free = page_align_up(kernel_end_phys());
+
+    let mut memory_end = 0;
+    for i in 0..e820_count() {
+        let entry = e820_entry(i);
+        if entry.kind == E820_USABLE {
+            let end = core::cmp::min((entry.base + entry.length) as usize, DIRECT_MAP_SIZE);
+            memory_end = core::cmp::max(memory_end, page_align_down(end));
+        }
+    }
+
+    unsafe {
+        mem_map_len = pfn(memory_end);
+        mem_map = phys_to_virt(first_free) as *mut Frame;
+        for pfn in 0..mem_map_len {
+            ptr::write(mem_map.add(pfn), Frame {
+                flags    : FRAME_RESERVED,
+                order    : 0,
+                refcount : 0,
+                prev     : NO_FRAME,
+                next     : NO_FRAME,
+                mapping  : 0,
+                index    : 0,
+            });
+        }
+    }
+    let managed_start = page_align_up(first_free + frame_count() * core::mem::size_of::<Frame>());
+
+    let mut allocator = frame_allocator.lock();
+    for i in 0..e820_count() {
+        let entry = e820_entry(i);
+        if entry.kind != E820_USABLE {
+            continue;
+        }
+        let start = core::cmp::max(page_align_up(entry.base as usize), managed_start);
+        let end = core::cmp::min(page_align_down((entry.base + entry.length) as usize), memory_end);
+        if start < end {
+            allocator.add_range(pfn(start), pfn(end));
+        }
+    }
+    allocator.set_watermarks();
+}
+
+/// Allocates 2^`order` physically contiguous frames, returning the physical address of the first one
+///
+/// The background reclaimer is woken up when free memory falls below the
+/// low watermark.
+pub(crate) fn alloc_frames(order:usize) -> Option<usize> {
+    if order > MAX_ORDER {
+        return None;
+    }
+    let mut allocator = frame_allocator.lock();
+    let paddr = allocator.alloc(order).map(pfn_to_phys);
+    let low = allocator.free_frames < allocator.watermarks[Watermark::Low as usize];
+    drop(allocator);
+    if low {
+        reclaim::wakeup_kswapd();
+    }
+    if let Some(paddr) = paddr {
+        profile_alloc(AllocKind::Page, paddr, PAGE_SIZE << order);
+    }
+    paddr
+}
+
+/// Frees the 2^`order` frames starting at the physical address `paddr`
+pub(crate) fn free_frames(paddr:usize, order:usize) {
+    frame_allocator.lock().free(pfn(paddr), order);
+    profile_free(paddr);
+}
+
+/// Turns the 2^`order` frames starting at `paddr`, allocated as a block,
+/// into as many single frames, each with its own reference
+///
+/// The frames are then freed one by one, the allocator merging them back.
+pub(crate) fn split_frames(paddr:usize, order:usize) {
+    let _allocator = frame_allocator.lock();
+    for pfn in pfn(paddr)..pfn(paddr) + (1 << order) {
+        let descriptor = frame(pfn);
+        descriptor.order = 0;
+        descriptor.refcount = 1;
+    }
+}
+
+/// Allocates a single frame
+pub(crate) fn alloc_frame() -> Option<usize> {
+    alloc_frames(0)
+}
+
+/// Allocates a single frame and fills it with zeroes
+pub(crate) fn alloc_zeroed_frame() -> Option<usize> {
+    let paddr = alloc_frame()?;
+    unsafe {
+        ptr::write_bytes(phys_to_virt(paddr) as *mut u8, 0, PAGE_SIZE);
+    }
+    Some(paddr)
+}
+
+/// Frees a single frame
+pub(crate) fn free_frame(paddr:usize) {
+    free_frames(paddr, 0);
+}
+
+/// Takes another reference to the single frame at `paddr`
+///
+/// Only frames allocated on their own are reference counted, the ones
+/// belonging to larger blocks are freed with their block.
+pub(crate) fn get_frame(paddr:usize) {
+    let _allocator = frame_allocator.lock();
+    frame(pfn(paddr)).refcount += 1;
+}
+
+/// Takes another reference to the single frame at `paddr`, unless it is free
+///
+/// Lets lockless lookups pin a frame they found without knowing whether
+/// it was freed in the meantime: they validate the lookup afterwards.
+pub(crate) fn try_get_frame(paddr:usize) -> bool {
+    let _allocator = frame_allocator.lock();
+    let descriptor = frame(pfn(paddr));
+    if descriptor.refcount == 0 {
+        return false;
+    }
+    descriptor.refcount += 1;
+    true
+}
+
+/// Returns the number of references to the single frame at `paddr`
+pub(crate) fn frame_refcount(paddr:usize) -> u32 {
+    let _allocator = frame_allocator.lock();
+    frame(pfn(paddr)).refcount
+}
+
+/// Drops a reference to the single frame at `paddr`, freeing it with the last one
+pub(crate) fn put_frame(paddr:usize) {
+    let mut allocator = frame_allocator.lock();
+    let descriptor = frame(pfn(paddr));
+    descriptor.refcount -= 1;
+    if descriptor.refcount == 0 {
+        allocator.free(pfn(paddr), 0);
+        drop(allocator);
+        profile_free(paddr);
+    }
+}
+
+/// Returns the number of frames currently free
+pub(crate) fn free_frame_count() -> usize {
+    frame_allocator.lock().free_frames
+}
+
+/// Returns the number of free frames below which `mark` is crossed
+pub(crate) fn watermark(mark:Watermark) -> usize {
+    frame_allocator.lock().watermarks[mark as usize]
+}
+
+/// Checks whether free memory is below `mark`
+pub(crate) fn below_watermark(mark:Watermark) -> bool {
+    let allocator = frame_allocator.lock();
+    allocator.free_frames < allocator.watermarks[mark as usize]
+}
+
+/// Returns the number of frames managed by the allocator
+pub(crate) fn managed_frame_count() -> usize {
+    frame_allocator.lock().total_frames
+}
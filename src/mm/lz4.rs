@@ -0,0 +1,162 @@
+// the LZ4 block format: sequences of literals followed by a back reference
+const MIN_MATCH     : usize = 4;
+const MAX_OFFSET    : usize = 65535;
+// the last match must start at least MFLIMIT Bytes before the end of the
+// block, and the last LAST_LITERALS Bytes are always literals
+const MFLIMIT       : usize = 12;
+const LAST_LITERALS : usize = 5;
+
+// the number of entries of the hash table of the compressor
+pub(crate) const HASH_LOG  : usize = 12;
+pub(crate) const HASH_SIZE : usize = 1 << HASH_LOG;
+
+/// The hash table of the compressor, reused across calls
+///
+/// Positions are 16 bits wide, hence inputs are limited to 64 KiB.
+pub(crate) type HashTable = [u16; HASH_SIZE];
+
+fn read_u32(src:&[u8], pos:usize) -> u32 {
+    u32::from_le_bytes([src[pos], src[pos + 1], src[pos + 2], src[pos + 3]])
+}
+
+fn hash(sequence:u32) -> usize {
+    (sequence.wrapping_mul(2654435761) >> (32 - HASH_LOG)) as usize
+}
+
+/// Appends the extra Bytes of a length that did not fit in its token nibble
+fn write_length(dst:&mut [u8], out:&mut usize, mut length:usize) -> Option<()> {
+    while length >= 255 {
+        *dst.get_mut(*out)? = 255;
+        *out += 1;
+        length -= 255;
+    }
+    *dst.get_mut(*out)? = length as u8;
+    *out += 1;
+    Some(())
+}
+
+/// Appends a sequence: `literals` followed by a match of `length` Bytes at `offset`
+///
+/// A `length` of 0 marks the last sequence, made of literals only.
+fn write_sequence(dst:&mut [u8], out:&mut usize, literals:&[u8], offset:usize, length:usize) -> Option<()> {
+    let token = *out;
+    *dst.get_mut(token)? = 0;
+    *out += 1;
+    if literals.len() >= 15 {
+        dst[token] = 15 << 4;
+        write_length(dst, out, literals.len() - 15)?;
+    } else {
+        dst[token] = (literals.len() as u8) << 4;
+    }
+    dst.get_mut(*out..*out + literals.len())?.copy_from_slice(literals);
+    *out += literals.len();
+    if length == 0 {
+        return Some(());
+    }
+    dst.get_mut(*out..*out + 2)?.copy_from_slice(&(offset as u16).to_le_bytes());
+    *out += 2;
+    let length = length - MIN_MATCH;
+    if length >= 15 {
+        dst[token] |= 15;
+        write_length(dst, out, length - 15)?;
+    } else {
+        dst[token] |= length as u8;
+    }
+    Some(())
+}
+
+/// Compresses `src` into `dst`, returning the compressed size
+///
+/// Fails if the result does not fit in `dst`, which is how callers detect
+/// data not worth compressing. `table` is scratch space.
+pub(crate) fn compress(src:&[u8], dst:&mut [u8], table:&mut HashTable) -> Option<usize> {
+    if src.len() > 1 << 16 {
+        return None;
+    }
+    table.fill(0);
+    let mut out = 0;
+    let mut anchor = 0;
+    if src.len() > MFLIMIT {
+        let limit = src.len() - MFLIMIT;
+        let match_limit = src.len() - LAST_LITERALS;
+        let mut pos = 0;
+        while pos < limit {
+            let sequence = read_u32(src, pos);
+            let slot = hash(sequence);
+            let mut candidate = table[slot] as usize;
+            table[slot] = pos as u16;
+            if candidate >= pos || pos - candidate > MAX_OFFSET || read_u32(src, candidate) != sequence {
+                pos += 1;
+                continue;
+            }
+            let mut length = MIN_MATCH;
+            while pos + length < match_limit && src[candidate + length] == src[pos + length] {
+                length += 1;
+            }
+            while pos > anchor && candidate > 0 && src[pos - 1] == src[candidate - 1] {
+                pos -= 1;
+                candidate -= 1;
+                length += 1;
+            }
+            write_sequence(dst, &mut out, &src[anchor..pos], pos - candidate, length)?;
+            pos += length;
+            anchor = pos;
+        }
+    }
+    write_sequence(dst, &mut out, &src[anchor..], 0, 0)?;
+    Some(out)
+}
+
+/// Reads the extra Bytes of a length whose token nibble was saturated
+fn read_length(src:&[u8], pos:&mut usize) -> Option<usize> {
+    let mut length = 0_usize;
+    loop {
+        let byte = *src.get(*pos)?;
+        *pos += 1;
+        length = length.checked_add(byte as usize)?;
+        if byte != 255 {
+            return Some(length);
+        }
+    }
+}
+
+/// Decompresses the block `src` into `dst`, returning the decompressed size
+///
+/// Malformed blocks are rejected, never read or write out of bounds.
+pub(crate) fn decompress(src:&[u8], dst:&mut [u8]) -> Option<usize> {
+    let mut pos = 0;
+    let mut out = 0_usize;
+    loop {
+        let token = *src.get(pos)?;
+        pos += 1;
+        let mut literals = (token >> 4) as usize;
+        if literals == 15 {
+            literals += read_length(src, &mut pos)?;
+        }
+        let literals_end = pos.checked_add(literals)?;
+        dst.get_mut(out..out.checked_add(literals)?)?.copy_from_slice(src.get(pos..literals_end)?);
+        pos = literals_end;
+        out += literals;
+        if pos == src.len() {
+            return Some(out);
+        }
+        let offset = u16::from_le_bytes([*src.get(pos)?, *src.get(pos + 1)?]) as usize;
+        pos += 2;
+        if offset == 0 || offset > out {
+            return None;
+        }
+        let mut length = (token & 15) as usize;
+        if length == 15 {
+            length += read_length(src, &mut pos)?;
+        }
+        length += MIN_MATCH;
+        if out.checked_add(length)? > dst.len() {
+            return None;
+        }
+        // the match may overlap the output it is copying, byte by byte
+        for i in out..out + length {
+            dst[i] = dst[i - offset];
+        }
+        out += length;
+    }
+}
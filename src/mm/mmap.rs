@@ -0,0 +1,50 @@
+use crate::mm::*;
+use crate::mm::vma::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+
+// protection flags, the same bits as the VMA ones
+pub(crate) const PROT_READ  : usize = 0x1;
+pub(crate) const PROT_WRITE : usize = 0x2;
+pub(crate) const PROT_EXEC  : usize = 0x4;
+
+// mapping flags
+pub(crate) const MAP_SHARED    : usize = 0x01;
+pub(crate) const MAP_PRIVATE   : usize = 0x02;
+pub(crate) const MAP_FIXED     : usize = 0x10;
+pub(crate) const MAP_ANONYMOUS : usize = 0x20;
+
+/// Creates an anonymous mapping of `size` Bytes, returning its address
+///
+/// The pages are backed by zeroed frames on first touch. Only anonymous
+/// mappings placed by the kernel are supported, either shared or private.
+pub(crate) fn sys_mmap(_addr:usize, size:usize, prot:usize, flags:usize, _fd:usize, _offset:usize) -> KResult<usize> {
+    let sharing = flags & (MAP_SHARED | MAP_PRIVATE);
+    if size == 0 || flags & MAP_ANONYMOUS == 0 || flags & MAP_FIXED != 0
+    || (sharing != MAP_SHARED && sharing != MAP_PRIVATE)
+    || prot & !(PROT_READ | PROT_WRITE | PROT_EXEC) != 0 {
+        return Err(EINVAL);
+    }
+    let mut vma_flags = prot as u32 | VMA_ANONYMOUS;
+    if flags & MAP_SHARED != 0 {
+        vma_flags |= VMA_SHARED;
+    }
+    let process = current_process().ok_or(EINVAL)?;
+    let vma = process.space.vmas.insert_anywhere(page_align_up(size), vma_flags).map_err(|_| ENOMEM)?;
+    Ok(vma.start)
+}
+
+/// Removes the mapping at `addr`
+///
+/// Mappings can only be removed as a whole, and only those made by
+/// `sys_mmap()`: the others belong to the kernel objects which mapped
+/// them, as rings and channels, which remove them when released.
+pub(crate) fn sys_munmap(addr:usize, size:usize) -> KResult<usize> {
+    let process = current_process().ok_or(EINVAL)?;
+    let vma = process.space.vmas.find(addr).ok_or(EINVAL)?;
+    if vma.start != addr || vma.size() != page_align_up(size) || vma.flags & VMA_ANONYMOUS == 0 {
+        return Err(EINVAL);
+    }
+    process.space.unmap_range(addr);
+    Ok(0)
+}
@@ -0,0 +1,76 @@
+pub(crate) mod fault;
+pub(crate) mod filemap;
+pub(crate) mod frame;
+pub(crate) mod lz4;
+pub(crate) mod mmap;
+pub(crate) mod paging;
+pub(crate) mod pcid;
+pub(crate) mod profile;
+pub(crate) mod radix;
+pub(crate) mod readahead;
+pub(crate) mod reclaim;
+pub(crate) mod slab;
+pub(crate) mod space;
+pub(crate) mod swap;
+pub(crate) mod swapfile;
+pub(crate) mod uaccess;
+pub(crate) mod vma;
+pub(crate) mod vmalloc;
+pub(crate) mod writeback;
+pub(crate) mod zram;
+
+pub(crate) const PAGE_SIZE  : usize = 4096;
+pub(crate) const PAGE_SHIFT : usize = 12;
+
+// the whole physical memory below DIRECT_MAP_SIZE is mapped at PHYS_OFFSET (see 'loader.asm')
+pub(crate) const PHYS_OFFSET      : usize = 0xFFFF_8000_0000_0000;
+pub(crate) const DIRECT_MAP_SIZE  : usize = 0x4000_0000;
+
+// the lower half of the canonical address space belongs to user processes,
+// the first pages are left unmapped to catch null pointer dereferences
+pub(crate) const USER_SPACE_START : usize = 0x0000_0000_0040_0000;
+pub(crate) const USER_SPACE_END   : usize = 0x0000_8000_0000_0000;
+
+/// Rounds `addr` down to the beginning of its page
+pub(crate) const fn page_align_down(addr:usize) -> usize {
+    addr & !(PAGE_SIZE - 1)
+}
+
+/// Rounds `addr` up to the beginning of the next page, unless already aligned
+pub(crate) const fn page_align_up(addr:usize) -> usize {
+    (addr + PAGE_SIZE - 1) & !(PAGE_SIZE - 1)
+}
+
+/// Returns the virtual address of the physical address `paddr` in the direct map
+pub(crate) const fn phys_to_virt(paddr:usize) -> usize {
+    paddr + PHYS_OFFSET
+}
+
+/// Returns the physical address of the direct map address `vaddr`
+pub(crate) const fn virt_to_phys(vaddr:usize) -> usize {
+    vaddr - PHYS_OFFSET
+}
+
+extern "C" {
+    // defined by the linker script
+    static text_start : u8;
+    static kernel_end : u8;
+}
+
+/// Returns the physical address of the first Byte of the kernel image
+pub(crate) fn kernel_start_phys() -> usize {
+    virt_to_phys(unsafe { &text_start as *const u8 as usize })
+}
+
+/// Returns the physical address of the first Byte after the kernel image
+pub(crate) fn kernel_end_phys() -> usize {
+    virt_to_phys(unsafe { &kernel_end as *const u8 as usize })
+}
+
+/// Initializes the frame allocator, the kernel page table, the vmalloc range and the compressed swap
+pub(crate) fn init() {
+    frame::init();
+    paging::init();
+    vmalloc::init();
+    zram::init();
+}
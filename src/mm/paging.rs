@@ -0,0 +1,209 @@
+use crate::cpu::*;
+use crate::mm::*;
+use crate::mm::frame::*;
+
+// page table entry flags
+pub(crate) const PTE_PRESENT  : u64 = 1 << 0;
+pub(crate) const PTE_WRITABLE : u64 = 1 << 1;
+pub(crate) const PTE_USER     : u64 = 1 << 2;
+pub(crate) const PTE_ACCESSED : u64 = 1 << 5;
+pub(crate) const PTE_DIRTY    : u64 = 1 << 6;
+pub(crate) const PTE_HUGE     : u64 = 1 << 7;
+pub(crate) const PTE_GLOBAL   : u64 = 1 << 8;
+// only meaningful when not present: the entry holds a swap entry (see 'swap.rs')
+pub(crate) const PTE_SWAP     : u64 = 1 << 9;
+// a reserved bit unless EFER.NXE is set, see 'no_exec()'
+pub(crate) const PTE_NX       : u64 = 1 << 63;
+
+pub(crate) const PTE_ADDR_MASK : u64 = 0x000F_FFFF_FFFF_F000;
+
+const ENTRIES : usize = 512;
+
+// the first entry of the PML4 belonging to the kernel (PHYS_OFFSET)
+const KERNEL_PML4_START : usize = 256;
+
+// the PML4 built by the loader (see 'loader.asm')
+const BOOT_PML4 : usize = 0x70000;
+
+#[allow(non_upper_case_globals)]
+static mut kernel_root : usize = BOOT_PML4;
+
+/// Errors reported when modifying a page table
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub(crate) enum MapError {
+    /// A frame for an intermediate table could not be allocated
+    OutOfMemory,
+    /// The page is already mapped
+    AlreadyMapped,
+    /// The address is covered by a huge page
+    HugePage,
+}
+
+/// Returns the flag making a page not executable, none if the processor
+/// cannot enforce it
+pub(crate) fn no_exec() -> u64 {
+    if features().nx { PTE_NX } else { 0 }
+}
+
+/// Returns the index inside the table of level `level` (4 being the PML4) for `vaddr`
+const fn table_index(vaddr:usize, level:usize) -> usize {
+    (vaddr >> (PAGE_SHIFT + 9 * (level - 1))) & (ENTRIES - 1)
+}
+
+/// Returns the entries of the table stored at the physical address `paddr`
+fn table(paddr:usize) -> &'static mut [u64; ENTRIES] {
+    unsafe { &mut *(phys_to_virt(paddr) as *mut [u64; ENTRIES]) }
+}
+
+/// A four levels page table hierarchy, identified by the physical address of its PML4
+///
+/// The upper half of every hierarchy shares the kernel tables, only the
+/// lower half is private.
+pub(crate) struct PageTable {
+    root : usize,
+}
+
+impl PageTable {
+    /// Creates a hierarchy with an empty user half
+    pub(crate) fn new() -> Option<Self> {
+        let root = alloc_zeroed_frame()?;
+        let kernel = table(unsafe { kernel_root });
+        let pml4 = table(root);
+        pml4[KERNEL_PML4_START..].copy_from_slice(&kernel[KERNEL_PML4_START..]);
+        Some(PageTable { root })
+    }
+
+    /// Returns the kernel-only hierarchy
+    ///
+    /// Mappings added to the kernel half are seen by every hierarchy only
+    /// below the PML4 entries that existed when it was created, see
+    /// `populate_kernel_pml4()`.
+    pub(crate) fn kernel() -> Self {
+        PageTable { root : unsafe { kernel_root } }
+    }
+
+    /// Returns the physical address of the PML4, to be loaded into CR3
+    pub(crate) fn root(&self) -> usize {
+        self.root
+    }
+
+    /// Returns the last level entry of `vaddr`, allocating the missing
+    /// intermediate tables if `create` is set
+    fn walk(&self, vaddr:usize, create:bool) -> Result<Option<&'static mut u64>, MapError> {
+        let mut paddr = self.root;
+        for level in (2..=4).rev() {
+            let entry = &mut table(paddr)[table_index(vaddr, level)];
+            if *entry & PTE_PRESENT == 0 {
+                if !create {
+                    return Ok(None);
+                }
+                let next = alloc_zeroed_frame().ok_or(MapError::OutOfMemory)?;
+                // permissions are enforced by the last level only
+                *entry = next as u64 | PTE_PRESENT | PTE_WRITABLE | PTE_USER;
+            } else if *entry & PTE_HUGE != 0 {
+                return Err(MapError::HugePage);
+            }
+            paddr = (*entry & PTE_ADDR_MASK) as usize;
+        }
+        Ok(Some(&mut table(paddr)[table_index(vaddr, 1)]))
+    }
+
+    /// Returns the last level entry of `vaddr`, if the tables leading to it exist
+    pub(crate) fn entry(&self, vaddr:usize) -> Option<&'static mut u64> {
+        self.walk(vaddr, false).ok().flatten()
+    }
+
+    /// Maps the page at `vaddr` to the frame at `paddr`
+    pub(crate) fn map(&self, vaddr:usize, paddr:usize, flags:u64) -> Result<(), MapError> {
+        let entry = self.walk(vaddr, true)?.ok_or(MapError::OutOfMemory)?;
+        if *entry & PTE_PRESENT != 0 {
+            return Err(MapError::AlreadyMapped);
+        }
+        *entry = (paddr as u64 & PTE_ADDR_MASK) | flags | PTE_PRESENT;
+        Ok(())
+    }
+
+    /// Removes the mapping of the page at `vaddr`, returning the frame it pointed to
+    ///
+    /// The caller is responsible for flushing the TLB.
+    pub(crate) fn unmap(&self, vaddr:usize) -> Option<usize> {
+        let entry = self.entry(vaddr)?;
+        if *entry & PTE_PRESENT == 0 {
+            return None;
+        }
+        let paddr = (*entry & PTE_ADDR_MASK) as usize;
+        *entry = 0;
+        Some(paddr)
+    }
+
+    /// Returns the physical address `vaddr` is mapped to
+    pub(crate) fn translate(&self, vaddr:usize) -> Option<usize> {
+        let entry = self.entry(vaddr)?;
+        if *entry & PTE_PRESENT == 0 {
+            return None;
+        }
+        Some((*entry & PTE_ADDR_MASK) as usize + (vaddr & (PAGE_SIZE - 1)))
+    }
+
+    /// Frees the user half tables, leaving the mapped frames untouched
+    ///
+    /// The table must not be used afterwards.
+    pub(crate) fn destroy(&self) {
+        fn free_level(paddr:usize, level:usize) {
+            if level > 1 {
+                for entry in table(paddr).iter() {
+                    if *entry & PTE_PRESENT != 0 && *entry & PTE_HUGE == 0 {
+                        free_level((*entry & PTE_ADDR_MASK) as usize, level - 1);
+                    }
+                }
+            }
+            free_frame(paddr);
+        }
+        for entry in table(self.root)[..KERNEL_PML4_START].iter() {
+            if *entry & PTE_PRESENT != 0 {
+                free_level((*entry & PTE_ADDR_MASK) as usize, 3);
+            }
+        }
+        free_frame(self.root);
+    }
+}
+
+/// Returns the physical address of the kernel-only PML4
+pub(crate) fn kernel_page_table() -> usize {
+    unsafe { kernel_root }
+}
+
+/// Creates the kernel PML4 entry covering `vaddr`, if missing
+///
+/// Must be called before any other hierarchy is created, which then
+/// shares all the mappings later added below that entry.
+pub(crate) fn populate_kernel_pml4(vaddr:usize) -> bool {
+    let entry = &mut table(unsafe { kernel_root })[table_index(vaddr, 4)];
+    if *entry & PTE_PRESENT == 0 {
+        match alloc_zeroed_frame() {
+            Some(pdpt) => *entry = pdpt as u64 | PTE_PRESENT | PTE_WRITABLE,
+            None       => return false,
+        }
+    }
+    true
+}
+
+/// Replaces the loader tables with a kernel-only PML4
+///
+/// The loader identity maps the first GiB for its own use, the kernel
+/// only needs the higher half, so dropping the identity mapping makes
+/// stray accesses to low addresses fault. The loader PDPT is still used
+/// for the direct map, hence it must never be freed.
+pub(crate) fn init() {
+    let root = match alloc_zeroed_frame() {
+        Some(root) => root,
+        None       => return,
+    };
+    let boot = table(BOOT_PML4);
+    let pml4 = table(root);
+    pml4[KERNEL_PML4_START..].copy_from_slice(&boot[KERNEL_PML4_START..]);
+    unsafe {
+        kernel_root = root;
+    }
+    write_cr3(root as u64);
+}
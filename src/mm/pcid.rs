@@ -0,0 +1,150 @@
+use crate::cpu::*;
+use crate::mm::paging::*;
+
+// the number of PCIDs each processor hands out to address spaces, PCID 0
+// is kept for the kernel-only context
+const PCID_SLOTS : usize = 6;
+
+// the context identifier of the kernel-only page table
+const KERNEL_CONTEXT : u64 = 0;
+
+// marks a PCID not assigned to any address space
+const NO_CONTEXT : u64 = u64::MAX;
+
+/// The address space a PCID is currently assigned to, and the TLB
+/// generation of that address space the cached translations reflect
+#[derive(Clone, Copy)]
+struct PcidSlot {
+    context_id     : u64,
+    tlb_generation : u64,
+}
+
+/// The PCIDs assignment of a single processor
+///
+/// Address spaces are looked up by context identifier: a hit with an
+/// up-to-date generation lets CR3 be loaded without flushing, a hit with
+/// an old generation flushes only that PCID, and a miss recycles the
+/// least recently assigned PCID.
+struct PcidCache {
+    slots       : [PcidSlot; PCID_SLOTS],
+    next_victim : usize,
+    active      : u64,
+    switches    : u64,
+    flushes     : u64,
+}
+
+impl PcidCache {
+    const fn new() -> Self {
+        PcidCache {
+            slots       : [PcidSlot { context_id : NO_CONTEXT, tlb_generation : 0 }; PCID_SLOTS],
+            next_victim : 0,
+            active      : KERNEL_CONTEXT,
+            switches    : 0,
+            flushes     : 0,
+        }
+    }
+
+    fn lookup(&self, context_id:u64) -> Option<usize> {
+        self.slots.iter().position(|slot| slot.context_id == context_id)
+    }
+
+    fn recycle(&mut self) -> usize {
+        let slot = self.next_victim;
+        self.next_victim = (self.next_victim + 1) % PCID_SLOTS;
+        slot
+    }
+}
+
+/// The number of address space switches and how many of them flushed the TLB
+#[derive(Clone, Copy)]
+pub(crate) struct PcidStats {
+    pub(crate) switches : u64,
+    pub(crate) flushes  : u64,
+}
+
+#[allow(non_upper_case_globals)]
+static mut pcid_caches : [PcidCache; MAX_CPUS] = [const { PcidCache::new() }; MAX_CPUS];
+
+fn current_cache() -> &'static mut PcidCache {
+    unsafe { &mut pcid_caches[current_id()] }
+}
+
+/// Loads the page table at `root` on the current processor
+///
+/// When PCIDs are not supported every switch flushes the TLB.
+pub(crate) fn switch_to(root:usize, context_id:u64, tlb_generation:u64) {
+    let cache = current_cache();
+    cache.switches += 1;
+    cache.active = context_id;
+
+    if !features().pcid {
+        cache.flushes += 1;
+        write_cr3(root as u64);
+        return;
+    }
+
+    let (slot, flush) = match cache.lookup(context_id) {
+        Some(slot) => (slot, cache.slots[slot].tlb_generation != tlb_generation),
+        None       => (cache.recycle(), true),
+    };
+    cache.slots[slot] = PcidSlot { context_id, tlb_generation };
+
+    let mut cr3 = root as u64 | (slot as u64 + 1);
+    if flush {
+        cache.flushes += 1;
+    } else {
+        cr3 |= CR3_NOFLUSH;
+    }
+    write_cr3(cr3);
+}
+
+/// Switches the current processor to the kernel-only page table
+///
+/// Kernel translations are never stale under PCID 0: they are global, and
+/// the changes to the kernel half invalidate them with `invlpg`, which
+/// drops global translations whatever the PCID.
+pub(crate) fn switch_to_kernel() {
+    let cache = current_cache();
+    cache.switches += 1;
+    cache.active = KERNEL_CONTEXT;
+    let mut cr3 = kernel_page_table() as u64;
+    if features().pcid {
+        cr3 |= CR3_NOFLUSH;
+    }
+    write_cr3(cr3);
+}
+
+/// Gives back the PCID of the current processor assigned to `context_id`,
+/// whose address space is going away
+pub(crate) fn release(context_id:u64) {
+    let cache = current_cache();
+    if let Some(slot) = cache.lookup(context_id) {
+        cache.slots[slot].context_id = NO_CONTEXT;
+    }
+}
+
+/// Records that the active PCID already reflects `tlb_generation`, after a
+/// targeted flush made by the caller
+pub(crate) fn sync_generation(context_id:u64, tlb_generation:u64) {
+    let cache = current_cache();
+    if let Some(slot) = cache.lookup(context_id) {
+        let slot = &mut cache.slots[slot];
+        if slot.tlb_generation < tlb_generation {
+            slot.tlb_generation = tlb_generation;
+        }
+    }
+}
+
+/// Returns the context identifier of the address space loaded on the current processor
+pub(crate) fn active_context() -> u64 {
+    current_cache().active
+}
+
+/// Returns the switch statistics of the current processor
+pub(crate) fn stats() -> PcidStats {
+    let cache = current_cache();
+    PcidStats {
+        switches : cache.switches,
+        flushes  : cache.flushes,
+    }
+}
@@ -0,0 +1,375 @@
+use crate::mm::frame::*;
+use crate::mm::pcid;
+use crate::mm::zram;
+use crate::sync::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+use crate::tty::*;
+
+use core::arch::asm;
+use core::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+
+/// The allocators instrumented by the profiler, each one profiled apart
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub(crate) enum AllocKind {
+    Slab,
+    Page,
+    Vmalloc,
+}
+
+// the deepest stack trace recorded
+const MAX_DEPTH : usize = 8;
+
+// the number of distinct call sites and of sampled objects tracked at
+// once, both must be powers of 2
+const MAX_SITES : usize = 512;
+const MAX_LIVE  : usize = 4096;
+
+// operations of the profiler system call
+pub(crate) const PROFILE_SET_RATE : usize = 0;
+pub(crate) const PROFILE_DUMP     : usize = 1;
+pub(crate) const PROFILE_STACKS   : usize = 2;
+pub(crate) const PROFILE_MEMORY   : usize = 3;
+
+/// A call site: the stack trace leading to the allocations and their totals
+///
+/// Return addresses are compressed to 32 bits offsets from the beginning
+/// of the kernel text. Totals only count the sampled allocations.
+#[derive(Clone, Copy)]
+struct Site {
+    kind        : u8,
+    depth       : u8,
+    frames      : [u32; MAX_DEPTH],
+    alloc_count : u64,
+    alloc_bytes : u64,
+    live_count  : u64,
+    live_bytes  : u64,
+}
+
+/// A sampled object not freed yet, keyed by its address (0 when unused)
+#[derive(Clone, Copy)]
+struct LiveObject {
+    addr : usize,
+    site : u16,
+    size : u32,
+}
+
+struct Profiler {
+    sites   : [Site; MAX_SITES],
+    live    : [LiveObject; MAX_LIVE],
+    /// Samples lost because a table was full
+    dropped : u64,
+}
+
+const EMPTY_SITE : Site = Site { kind : 0, depth : 0, frames : [0; MAX_DEPTH], alloc_count : 0, alloc_bytes : 0, live_count : 0, live_bytes : 0 };
+const EMPTY_LIVE : LiveObject = LiveObject { addr : 0, site : 0, size : 0 };
+
+#[allow(non_upper_case_globals)]
+static profiler : SpinLock<Profiler> = SpinLock::new(Profiler { sites : [EMPTY_SITE; MAX_SITES], live : [EMPTY_LIVE; MAX_LIVE], dropped : 0 });
+
+// one allocation every `sample_rate` is sampled on average, 0 disables the profiler
+#[allow(non_upper_case_globals)]
+static sample_rate : AtomicUsize = AtomicUsize::new(0);
+
+// allocations left before the next sample
+#[allow(non_upper_case_globals)]
+static countdown : AtomicUsize = AtomicUsize::new(0);
+
+// the number of sampled objects still allocated, frees are only looked up when not 0
+#[allow(non_upper_case_globals)]
+static live_samples : AtomicUsize = AtomicUsize::new(0);
+
+// set while recording, the tables are never allocated from, but the
+// allocators may be entered again by whoever the profiler interrupts
+#[allow(non_upper_case_globals)]
+static recording : AtomicBool = AtomicBool::new(false);
+
+#[allow(non_upper_case_globals)]
+static random_state : AtomicU64 = AtomicU64::new(0x9E37_79B9_7F4A_7C15);
+
+extern "C" {
+    // defined by the linker script
+    static text_start : u8;
+    static text_end : u8;
+}
+
+fn text_range() -> (usize, usize) {
+    unsafe { (&text_start as *const u8 as usize, &text_end as *const u8 as usize) }
+}
+
+/// Returns the number of allocations until the next sample
+///
+/// Uniformly distributed between 1 and 2 * `rate` - 1, so that periodic
+/// allocation patterns do not hide behind a fixed interval.
+fn next_interval(rate:usize) -> usize {
+    let mut x = random_state.load(Ordering::Relaxed);
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    random_state.store(x, Ordering::Relaxed);
+    1 + (x as usize) % (2 * rate - 1)
+}
+
+fn hash(words:&[u32], seed:u32) -> usize {
+    let mut hash = seed.wrapping_mul(0x9E37_79B9);
+    for &word in words {
+        hash = (hash ^ word).wrapping_mul(0x0100_0193);
+    }
+    hash as usize
+}
+
+fn addr_hash(addr:usize) -> usize {
+    (addr >> 4).wrapping_mul(0x9E37_79B9_7F4A_7C15) >> 16
+}
+
+/// Walks the frame pointers of the current stack, from the caller of the
+/// function capturing it
+///
+/// Stops at the first frame outside the kernel stack of the current
+/// thread or returning outside the kernel text.
+#[inline(always)]
+fn capture_stack(frames:&mut [u32; MAX_DEPTH]) -> usize {
+    let mut rbp : usize;
+    unsafe {
+        asm!("mov {}, rbp", out(reg) rbp, options(nomem, nostack, preserves_flags));
+    }
+    let thread = current_thread();
+    let (stack_low, stack_high) = (thread.stack_base, thread.stack_top());
+    let (text_low, text_high) = text_range();
+    let mut depth = 0;
+    while depth < MAX_DEPTH && rbp >= stack_low && rbp + 16 <= stack_high && rbp % 8 == 0 {
+        let (next, ret) = unsafe { (*(rbp as *const usize), *((rbp + 8) as *const usize)) };
+        if ret < text_low || ret >= text_high {
+            break;
+        }
+        frames[depth] = (ret - text_low) as u32;
+        depth += 1;
+        if next <= rbp {
+            break;
+        }
+        rbp = next;
+    }
+    depth
+}
+
+impl Profiler {
+    /// Returns the index of the site of `kind` with the given stack, creating it if needed
+    fn site(&mut self, kind:AllocKind, frames:&[u32]) -> Option<usize> {
+        let start = hash(frames, kind as u32);
+        for probe in 0..MAX_SITES {
+            let index = (start + probe) & (MAX_SITES - 1);
+            let site = &mut self.sites[index];
+            if site.alloc_count == 0 {
+                site.kind = kind as u8;
+                site.depth = frames.len() as u8;
+                site.frames[..frames.len()].copy_from_slice(frames);
+                return Some(index);
+            }
+            if site.kind == kind as u8 && &site.frames[..site.depth as usize] == frames {
+                return Some(index);
+            }
+        }
+        None
+    }
+
+    fn insert_live(&mut self, object:LiveObject) -> bool {
+        let start = addr_hash(object.addr);
+        for probe in 0..MAX_LIVE {
+            let index = (start + probe) & (MAX_LIVE - 1);
+            if self.live[index].addr == 0 {
+                self.live[index] = object;
+                return true;
+            }
+        }
+        false
+    }
+
+    /// Removes the sampled object at `addr`, keeping the probe sequences
+    /// of the others unbroken by moving them back
+    fn remove_live(&mut self, addr:usize) -> Option<LiveObject> {
+        let mut index = addr_hash(addr) & (MAX_LIVE - 1);
+        loop {
+            match self.live[index].addr {
+                0                      => return None,
+                other if other == addr => break,
+                _                      => index = (index + 1) & (MAX_LIVE - 1),
+            }
+        }
+        let removed = self.live[index];
+        let mut hole = index;
+        let mut next = (index + 1) & (MAX_LIVE - 1);
+        while self.live[next].addr != 0 {
+            let home = addr_hash(self.live[next].addr) & (MAX_LIVE - 1);
+            // an entry can fill the hole if the hole lies between its home and itself
+            if (next.wrapping_sub(home) & (MAX_LIVE - 1)) >= (next.wrapping_sub(hole) & (MAX_LIVE - 1)) {
+                self.live[hole] = self.live[next];
+                hole = next;
+            }
+            next = (next + 1) & (MAX_LIVE - 1);
+        }
+        self.live[hole] = EMPTY_LIVE;
+        Some(removed)
+    }
+}
+
+#[inline(never)]
+fn record(kind:AllocKind, addr:usize, size:usize) {
+    if recording.swap(true, Ordering::Acquire) {
+        return;
+    }
+    let mut frames = [0_u32; MAX_DEPTH];
+    let depth = capture_stack(&mut frames);
+    let mut table = profiler.lock();
+    match table.site(kind, &frames[..depth]) {
+        Some(index) => {
+            let object = LiveObject { addr, site : index as u16, size : size as u32 };
+            let site = &mut table.sites[index];
+            site.alloc_count += 1;
+            site.alloc_bytes += size as u64;
+            if table.insert_live(object) {
+                let site = &mut table.sites[index];
+                site.live_count += 1;
+                site.live_bytes += size as u64;
+                live_samples.fetch_add(1, Ordering::Relaxed);
+            } else {
+                table.dropped += 1;
+            }
+        },
+        None => table.dropped += 1,
+    }
+    drop(table);
+    recording.store(false, Ordering::Release);
+}
+
+#[inline(never)]
+fn forget(addr:usize) {
+    let mut table = profiler.lock();
+    if let Some(object) = table.remove_live(addr) {
+        let site = &mut table.sites[object.site as usize];
+        site.live_count -= 1;
+        site.live_bytes -= object.size as u64;
+        live_samples.fetch_sub(1, Ordering::Relaxed);
+    }
+}
+
+/// Reports an allocation of `size` Bytes at `addr` to the profiler
+///
+/// Costs a single load while the profiler is disabled.
+#[inline(always)]
+pub(crate) fn profile_alloc(kind:AllocKind, addr:usize, size:usize) {
+    let rate = sample_rate.load(Ordering::Relaxed);
+    if rate == 0 || addr == 0 {
+        return;
+    }
+    if countdown.fetch_sub(1, Ordering::Relaxed) > 1 {
+        return;
+    }
+    countdown.store(next_interval(rate), Ordering::Relaxed);
+    record(kind, addr, size);
+}
+
+/// Reports that the object at `addr` was freed
+///
+/// Costs a single load unless some sampled objects are still allocated.
+#[inline(always)]
+pub(crate) fn profile_free(addr:usize) {
+    if live_samples.load(Ordering::Relaxed) != 0 {
+        forget(addr);
+    }
+}
+
+/// Starts sampling one allocation every `rate` on average, or stops with 0
+///
+/// Changing the rate discards the samples taken so far.
+pub(crate) fn set_sample_rate(rate:usize) {
+    sample_rate.store(0, Ordering::Relaxed);
+    let mut table = profiler.lock();
+    table.sites = [EMPTY_SITE; MAX_SITES];
+    table.live = [EMPTY_LIVE; MAX_LIVE];
+    table.dropped = 0;
+    live_samples.store(0, Ordering::Relaxed);
+    drop(table);
+    countdown.store(if rate > 0 { next_interval(rate) } else { 0 }, Ordering::Relaxed);
+    sample_rate.store(rate, Ordering::Relaxed);
+}
+
+/// Sends the profile of `kind` over the serial port
+///
+/// The output is the legacy text heap profile understood by pprof: a
+/// header with the totals, a line per call site with its live and
+/// allocated objects and bytes followed by its stack, and the address
+/// range of the kernel text to resolve the stacks against 'kernel.elf'.
+/// Sampled counts are scaled by the rate to estimate the real ones.
+pub(crate) fn dump_profile(kind:AllocKind) {
+    let rate = core::cmp::max(sample_rate.load(Ordering::Relaxed), 1) as u64;
+    let (text_low, text_high) = text_range();
+    let table = profiler.lock();
+    let sites = table.sites.iter().filter(|site| site.alloc_count > 0 && site.kind == kind as u8);
+    let totals = sites.clone().fold([0_u64; 4], |totals, site| {
+        [totals[0] + site.live_count, totals[1] + site.live_bytes, totals[2] + site.alloc_count, totals[3] + site.alloc_bytes]
+    });
+    serial_print_fmt(format_args!("heap profile: {}: {} [{}: {}] @ heap\n",
+        totals[0] * rate, totals[1] * rate, totals[2] * rate, totals[3] * rate));
+    for site in sites {
+        serial_print_fmt(format_args!("{}: {} [{}: {}] @",
+            site.live_count * rate, site.live_bytes * rate, site.alloc_count * rate, site.alloc_bytes * rate));
+        for &frame in site.frames[..site.depth as usize].iter() {
+            serial_print_fmt(format_args!(" {:#x}", text_low + frame as usize));
+        }
+        serial_write(b"\n");
+    }
+    serial_print_fmt(format_args!("\nMAPPED_LIBRARIES:\n{:x}-{:x} r-xp 00000000 00:00 0 kernel.elf\n", text_low, text_high));
+    if table.dropped > 0 {
+        serial_print_fmt(format_args!("# {} samples dropped\n", table.dropped));
+    }
+}
+
+/// Dumps the free memory and its watermarks, the state of the TLB and
+/// the one of the compressed swap over the serial port
+fn dump_memory_stats() {
+    serial_print_fmt(format_args!("free frames: {} of {}\n", free_frame_count(), managed_frame_count()));
+    serial_print_fmt(format_args!(
+        "watermarks: min {}, low {}, high {}\n",
+        watermark(Watermark::Min),
+        watermark(Watermark::Low),
+        watermark(Watermark::High),
+    ));
+    let tlb = pcid::stats();
+    serial_print_fmt(format_args!("address space switches: {}, TLB flushes: {}\n", tlb.switches, tlb.flushes));
+    if let Some(device) = zram::device() {
+        let stats = device.stats();
+        serial_print_fmt(format_args!(
+            "zram: {} pages, {} same-filled, {} uncompressed, {} Bytes\n",
+            stats.pages.load(Ordering::Relaxed),
+            stats.same_pages.load(Ordering::Relaxed),
+            stats.huge_pages.load(Ordering::Relaxed),
+            stats.compressed_bytes.load(Ordering::Relaxed),
+        ));
+    }
+}
+
+/// Controls the allocation profiler
+///
+/// `PROFILE_SET_RATE` samples one allocation every `arg` (0 disables),
+/// `PROFILE_DUMP` dumps the profile of the allocator `arg` (0 slab,
+/// 1 page, 2 vmalloc) over the serial port, `PROFILE_STACKS` dumps the
+/// usage of the kernel stacks and `PROFILE_MEMORY` the state of the
+/// memory.
+pub(crate) fn sys_alloc_profile(op:usize, arg:usize) -> KResult<usize> {
+    match op {
+        PROFILE_SET_RATE => set_sample_rate(arg),
+        PROFILE_DUMP     => {
+            let kind = match arg {
+                0 => AllocKind::Slab,
+                1 => AllocKind::Page,
+                2 => AllocKind::Vmalloc,
+                _ => return Err(EINVAL),
+            };
+            dump_profile(kind);
+        },
+        PROFILE_STACKS   => dump_stack_stats(),
+        PROFILE_MEMORY   => dump_memory_stats(),
+        _ => return Err(EINVAL),
+    }
+    Ok(0)
+}
@@ -0,0 +1,421 @@
+use crate::sync::*;
+
+use alloc::boxed::Box;
+use alloc::vec::Vec;
+use core::cell::UnsafeCell;
+
+// every node indexes 6 bits of the key
+const RADIX_SHIFT : usize = 6;
+const RADIX_SLOTS : usize = 1 << RADIX_SHIFT;
+const RADIX_MASK  : u64 = RADIX_SLOTS as u64 - 1;
+
+// enough levels for any 64 bits key
+const MAX_HEIGHT : usize = (64 + RADIX_SHIFT - 1) / RADIX_SHIFT;
+
+// the number of tags a tree keeps for its entries
+pub(crate) const RADIX_TAGS : usize = 4;
+
+// set in the slots pointing to nodes, entries have it clear
+const NODE_BIT : usize = 1;
+
+/// A node of the tree
+///
+/// The slots of the nodes in the last level hold the entries, the others
+/// point to the nodes of the next level. Each tag has a bit for every
+/// slot, set when the entry, or some entry below the slot, has the tag.
+struct RadixNode {
+    slots : [usize; RADIX_SLOTS],
+    tags  : [u64; RADIX_TAGS],
+    count : usize,
+}
+
+impl RadixNode {
+    const EMPTY : RadixNode = RadixNode {
+        slots : [0; RADIX_SLOTS],
+        tags  : [0; RADIX_TAGS],
+        count : 0,
+    };
+}
+
+/// Returns the slot of `index` in the nodes of `level`, counted from the entries up
+fn slot(index:u64, level:usize) -> usize {
+    ((index >> (level * RADIX_SHIFT)) & RADIX_MASK) as usize
+}
+
+/// Returns the node a slot points to, if it points to one
+fn child(slot:usize) -> Option<*mut RadixNode> {
+    if slot & NODE_BIT != 0 { Some((slot & !NODE_BIT) as *mut RadixNode) } else { None }
+}
+
+/// Checks whether `index` fits in a tree of `height` levels
+fn fits(index:u64, height:usize) -> bool {
+    height > 0 && (height * RADIX_SHIFT >= 64 || index >> (height * RADIX_SHIFT) == 0)
+}
+
+/// The nodes and the shape of the tree
+///
+/// Nodes are only released with the tree: a removed node goes to a free
+/// list and is reused by the same tree, so a lockless reader racing with
+/// a writer may follow a stale link, but always lands on a valid node.
+struct RadixTreeInner {
+    root   : *mut RadixNode,
+    height : usize,
+    free   : Vec<*mut RadixNode>,
+    nodes  : Vec<*mut RadixNode>,
+}
+
+impl RadixTreeInner {
+    fn alloc_node(&mut self) -> *mut RadixNode {
+        match self.free.pop() {
+            Some(node) => {
+                unsafe {
+                    *node = RadixNode::EMPTY;
+                }
+                node
+            },
+            None => {
+                let node = Box::into_raw(Box::new(RadixNode::EMPTY));
+                self.nodes.push(node);
+                node
+            },
+        }
+    }
+
+    /// Returns the entry at `index`
+    ///
+    /// The walk is bounded by the height even on a stale tree.
+    fn lookup(&self, index:u64) -> Option<usize> {
+        if !fits(index, self.height) || self.root.is_null() {
+            return None;
+        }
+        let mut node = self.root;
+        for level in (1..core::cmp::min(self.height, MAX_HEIGHT)).rev() {
+            node = child(unsafe { (*node).slots[slot(index, level)] })?;
+        }
+        match unsafe { (*node).slots[slot(index, 0)] } {
+            0                              => None,
+            entry if entry & NODE_BIT != 0 => None,
+            entry                          => Some(entry),
+        }
+    }
+
+    /// Fills `path` with the nodes leading to `index`, from the root down,
+    /// returning whether the entry exists
+    fn path(&self, index:u64, path:&mut [*mut RadixNode; MAX_HEIGHT]) -> bool {
+        if !fits(index, self.height) {
+            return false;
+        }
+        let mut node = self.root;
+        for level in (0..self.height).rev() {
+            path[level] = node;
+            let next = unsafe { (*node).slots[slot(index, level)] };
+            if next == 0 {
+                return false;
+            }
+            node = (next & !NODE_BIT) as *mut RadixNode;
+        }
+        true
+    }
+
+    /// Adds levels on top of the tree until `index` fits
+    fn grow(&mut self, index:u64) {
+        while !fits(index, self.height) {
+            let node = self.alloc_node();
+            if !self.root.is_null() {
+                let root = unsafe { &*self.root };
+                let node = unsafe { &mut *node };
+                node.slots[0] = self.root as usize | NODE_BIT;
+                node.count = 1;
+                for tag in 0..RADIX_TAGS {
+                    if root.tags[tag] != 0 {
+                        node.tags[tag] = 1;
+                    }
+                }
+            }
+            self.root = node;
+            self.height += 1;
+        }
+    }
+
+    fn insert(&mut self, index:u64, entry:usize) -> Result<(), usize> {
+        if let Some(existing) = self.lookup(index) {
+            return Err(existing);
+        }
+        self.grow(index);
+        let mut node = self.root;
+        for level in (1..self.height).rev() {
+            let offset = slot(index, level);
+            node = match child(unsafe { (*node).slots[offset] }) {
+                Some(next) => next,
+                None       => {
+                    let next = self.alloc_node();
+                    unsafe {
+                        (*node).slots[offset] = next as usize | NODE_BIT;
+                        (*node).count += 1;
+                    }
+                    next
+                },
+            };
+        }
+        unsafe {
+            (*node).slots[slot(index, 0)] = entry;
+            (*node).count += 1;
+        }
+        Ok(())
+    }
+
+    fn remove(&mut self, index:u64) -> Option<usize> {
+        let mut path = [core::ptr::null_mut(); MAX_HEIGHT];
+        if !self.path(index, &mut path) {
+            return None;
+        }
+        let entry = unsafe { (*path[0]).slots[slot(index, 0)] };
+        // the slot is emptied in every level whose node becomes empty
+        for level in 0..self.height {
+            let node = unsafe { &mut *path[level] };
+            let offset = slot(index, level);
+            node.slots[offset] = 0;
+            node.count -= 1;
+            for tag in node.tags.iter_mut() {
+                *tag &= !(1 << offset);
+            }
+            if node.count > 0 {
+                self.update_tags(index, &path, level + 1);
+                return Some(entry);
+            }
+            self.free.push(path[level]);
+        }
+        self.root = core::ptr::null_mut();
+        self.height = 0;
+        Some(entry)
+    }
+
+    /// Clears the tag bits of the path to `index` from `level` up, where
+    /// the nodes below lost all the entries with the tag
+    fn update_tags(&mut self, index:u64, path:&[*mut RadixNode; MAX_HEIGHT], level:usize) {
+        for tag in 0..RADIX_TAGS {
+            for level in level..self.height {
+                let below = unsafe { &*path[level - 1] };
+                if below.tags[tag] != 0 {
+                    break;
+                }
+                unsafe {
+                    (*path[level]).tags[tag] &= !(1 << slot(index, level));
+                }
+            }
+        }
+    }
+
+    fn set_tag(&mut self, index:u64, tag:usize) -> bool {
+        let mut path = [core::ptr::null_mut(); MAX_HEIGHT];
+        if !self.path(index, &mut path) || unsafe { (*path[0]).tags[tag] } & (1 << slot(index, 0)) != 0 {
+            return false;
+        }
+        for level in 0..self.height {
+            unsafe {
+                (*path[level]).tags[tag] |= 1 << slot(index, level);
+            }
+        }
+        true
+    }
+
+    fn clear_tag(&mut self, index:u64, tag:usize) -> bool {
+        let mut path = [core::ptr::null_mut(); MAX_HEIGHT];
+        if !self.path(index, &mut path) || unsafe { (*path[0]).tags[tag] } & (1 << slot(index, 0)) == 0 {
+            return false;
+        }
+        unsafe {
+            (*path[0]).tags[tag] &= !(1 << slot(index, 0));
+        }
+        for level in 1..self.height {
+            if unsafe { (*path[level - 1]).tags[tag] } != 0 {
+                break;
+            }
+            unsafe {
+                (*path[level]).tags[tag] &= !(1 << slot(index, level));
+            }
+        }
+        true
+    }
+
+    fn get_tag(&self, index:u64, tag:usize) -> bool {
+        let mut path = [core::ptr::null_mut(); MAX_HEIGHT];
+        self.path(index, &mut path) && unsafe { (*path[0]).tags[tag] } & (1 << slot(index, 0)) != 0
+    }
+
+    /// Collects up to `max` entries from `start` on, with `tag` if given,
+    /// skipping the subtrees without the tag
+    fn gather(&self, node:usize, level:usize, base:u64, start:u64, max:usize, tag:Option<usize>, found:&mut Vec<(u64, usize)>) {
+        let node = unsafe { &*(node as *const RadixNode) };
+        let shift = level * RADIX_SHIFT;
+        let span = if shift + RADIX_SHIFT >= 64 { u64::MAX } else { (1_u64 << (shift + RADIX_SHIFT)) - 1 };
+        // the whole node lies below `start`, which the root may do
+        if start > base && start - base > span {
+            return;
+        }
+        let first = if start > base { ((start - base) >> shift) as usize } else { 0 };
+        for offset in first..RADIX_SLOTS {
+            if found.len() == max || (offset as u64) > (u64::MAX >> shift) {
+                return;
+            }
+            if node.slots[offset] == 0 || tag.map_or(false, |tag| node.tags[tag] & (1 << offset) == 0) {
+                continue;
+            }
+            let index = base + ((offset as u64) << shift);
+            if level == 0 {
+                found.push((index, node.slots[offset]));
+            } else {
+                self.gather(node.slots[offset] & !NODE_BIT, level - 1, index, start, max, tag, found);
+            }
+        }
+    }
+}
+
+/// A radix tree mapping 64 bits keys to non null entries, with tags
+///
+/// Lookups are lockless: they are validated through a sequence counter
+/// and retried if a writer modified the tree in the meantime, as for the
+/// `VmaTree`. Modifications are serialized by an internal lock, and so
+/// are the walks over the tags, which are meant for the writers.
+pub(crate) struct RadixTree {
+    inner    : UnsafeCell<RadixTreeInner>,
+    lock     : SpinLock<()>,
+    sequence : SeqCount,
+}
+
+unsafe impl Send for RadixTree {}
+
+unsafe impl Sync for RadixTree {}
+
+impl RadixTree {
+    /// Creates an empty `RadixTree`
+    pub(crate) const fn new() -> Self {
+        RadixTree {
+            inner    : UnsafeCell::new(RadixTreeInner {
+                root   : core::ptr::null_mut(),
+                height : 0,
+                free   : Vec::new(),
+                nodes  : Vec::new(),
+            }),
+            lock     : SpinLock::new(()),
+            sequence : SeqCount::new(),
+        }
+    }
+
+    /// Runs a modification of the tree, excluding other writers and
+    /// invalidating concurrent readers
+    fn write<R>(&self, writer:impl FnOnce(&mut RadixTreeInner) -> R) -> R {
+        let _guard = self.lock.lock();
+        self.sequence.write_begin();
+        let result = writer(unsafe { &mut *self.inner.get() });
+        self.sequence.write_end();
+        result
+    }
+
+    /// Runs a walk of the tree excluding the writers, leaving the readers alone
+    fn walk<R>(&self, walker:impl FnOnce(&RadixTreeInner) -> R) -> R {
+        let _guard = self.lock.lock();
+        walker(unsafe { &*self.inner.get() })
+    }
+
+    /// Returns the entry at `index`, if any
+    pub(crate) fn lookup(&self, index:u64) -> Option<usize> {
+        self.lookup_get(index, |_| true, |_| {})
+    }
+
+    /// Returns the entry at `index` after applying `get` to it, if any
+    ///
+    /// `get` runs before the lookup is validated, so that the entry can be
+    /// pinned while it is still in the tree; it may refuse the entry. If a
+    /// writer raced with the lookup, `put` undoes `get` and the lookup is
+    /// retried.
+    pub(crate) fn lookup_get(&self, index:u64, get:impl Fn(usize) -> bool, put:impl Fn(usize)) -> Option<usize> {
+        loop {
+            let sequence = self.sequence.read_begin();
+            let entry = unsafe { &*self.inner.get() }.lookup(index);
+            let pinned = entry.filter(|&entry| get(entry));
+            if !self.sequence.read_retry(sequence) {
+                return pinned;
+            }
+            if let Some(entry) = pinned {
+                put(entry);
+            }
+        }
+    }
+
+    /// Stores `entry` at `index`, unless another entry is there, which is returned
+    ///
+    /// The entry must not be null and must have its lowest bit clear.
+    pub(crate) fn insert(&self, index:u64, entry:usize) -> Result<(), usize> {
+        debug_assert!(entry != 0 && entry & NODE_BIT == 0);
+        self.write(|inner| inner.insert(index, entry))
+    }
+
+    /// Stores `entry` at `index` with `tags` already set, unless another
+    /// entry is there, which is returned
+    ///
+    /// No reader can see the entry without its tags.
+    pub(crate) fn insert_tagged(&self, index:u64, entry:usize, tags:&[usize]) -> Result<(), usize> {
+        debug_assert!(entry != 0 && entry & NODE_BIT == 0);
+        self.write(|inner| {
+            inner.insert(index, entry)?;
+            for &tag in tags {
+                inner.set_tag(index, tag);
+            }
+            Ok(())
+        })
+    }
+
+    /// Removes the entry at `index` if `check` accepts it with its tags
+    pub(crate) fn remove_if(&self, index:u64, check:impl FnOnce(usize, [bool; RADIX_TAGS]) -> bool) -> Option<usize> {
+        self.write(|inner| {
+            let entry = inner.lookup(index)?;
+            let tags = core::array::from_fn(|tag| inner.get_tag(index, tag));
+            if !check(entry, tags) {
+                return None;
+            }
+            inner.remove(index)
+        })
+    }
+
+    /// Sets `tag` on the entry at `index`, returning whether the entry
+    /// exists and did not have it already
+    pub(crate) fn set_tag(&self, index:u64, tag:usize) -> bool {
+        self.write(|inner| inner.set_tag(index, tag))
+    }
+
+    /// Clears `tag` from the entry at `index`, returning whether it had it
+    pub(crate) fn clear_tag(&self, index:u64, tag:usize) -> bool {
+        self.write(|inner| inner.clear_tag(index, tag))
+    }
+
+    pub(crate) fn get_tag(&self, index:u64, tag:usize) -> bool {
+        self.walk(|inner| inner.get_tag(index, tag))
+    }
+
+    /// Returns up to `max` entries from `start` on, in key order, with their keys
+    pub(crate) fn gang_lookup(&self, start:u64, max:usize) -> Vec<(u64, usize)> {
+        self.gang_lookup_tag(start, max, None)
+    }
+
+    /// Returns up to `max` entries with `tag` from `start` on, in key order
+    ///
+    /// Only the subtrees holding tagged entries are visited.
+    pub(crate) fn gang_lookup_tag(&self, start:u64, max:usize, tag:Option<usize>) -> Vec<(u64, usize)> {
+        self.walk(|inner| {
+            let mut found = Vec::new();
+            if inner.height > 0 && max > 0 {
+                inner.gather(inner.root as usize, inner.height - 1, 0, start, max, tag, &mut found);
+            }
+            found
+        })
+    }
+}
+
+impl Drop for RadixTree {
+    fn drop(&mut self) {
+        for &node in self.inner.get_mut().nodes.iter() {
+            drop(unsafe { Box::from_raw(node) });
+        }
+    }
+}
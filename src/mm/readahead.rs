@@ -0,0 +1,141 @@
+use core::cmp::{max, min};
+
+// the bounds of a readahead window, in pages: from 16 KiB to 4 MiB
+pub(crate) const RA_MIN_PAGES : u64 = 4;
+pub(crate) const RA_MAX_PAGES : u64 = 1024;
+
+/// The pages to read ahead: `count` pages from `start`, the page
+/// `marker`, if any, getting the readahead tag
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub(crate) struct ReadaheadWindow {
+    pub(crate) start  : u64,
+    pub(crate) count  : u64,
+    pub(crate) marker : Option<u64>,
+}
+
+/// The readahead state of an open file
+///
+/// The window is the last range of pages read ahead, the final
+/// `async_size` of which were read before being needed: the first of
+/// them is the marker, and reaching it starts the next window, so that
+/// a sequential reader finds its pages cached while the device already
+/// works on the following ones. The window grows fourfold while small,
+/// then twofold, up to `RA_MAX_PAGES`.
+///
+/// A read not following the previous one is random and reads only what
+/// was asked. When the state was lost to another stream reading the same
+/// file through the same open file, the pages cached right before the
+/// read tell whether it continues a sequential stream anyway.
+#[derive(Clone, Copy)]
+pub(crate) struct Readahead {
+    start      : u64,
+    size       : u64,
+    async_size : u64,
+    /// The last page read, or none
+    prev       : Option<u64>,
+}
+
+/// Returns the first window for a read of `pages`
+fn initial_size(pages:u64) -> u64 {
+    let size = pages.next_power_of_two();
+    let size = if size <= RA_MAX_PAGES / 32 {
+        size * 4
+    } else if size <= RA_MAX_PAGES / 4 {
+        size * 2
+    } else {
+        RA_MAX_PAGES
+    };
+    max(size, RA_MIN_PAGES)
+}
+
+/// Returns the window following one of `size` pages
+fn next_size(size:u64) -> u64 {
+    if size < RA_MAX_PAGES / 16 {
+        size * 4
+    } else {
+        min(size * 2, RA_MAX_PAGES)
+    }
+}
+
+impl Readahead {
+    pub(crate) const fn new() -> Self {
+        Readahead {
+            start      : 0,
+            size       : 0,
+            async_size : 0,
+            prev       : None,
+        }
+    }
+
+    /// Returns the window currently set
+    fn window(&self) -> ReadaheadWindow {
+        ReadaheadWindow {
+            start  : self.start,
+            count  : self.size,
+            marker : if self.async_size > 0 { Some(self.start + self.size - self.async_size) } else { None },
+        }
+    }
+
+    /// Moves the window right after the current one, larger
+    fn ramp_up(&mut self) -> ReadaheadWindow {
+        self.start += self.size;
+        self.size = next_size(self.size);
+        self.async_size = self.size;
+        self.window()
+    }
+
+    /// Returns the window to read when the page `index` is missing from
+    /// the cache, for a read of `pages` pages from there
+    ///
+    /// `cached` tells whether a page is in the cache.
+    pub(crate) fn on_miss(&mut self, index:u64, pages:u64, cached:impl Fn(u64) -> bool) -> ReadaheadWindow {
+        let pages = max(pages, 1);
+        // the marker was evicted before being reached
+        if self.size > 0 && index == self.start + self.size {
+            return self.ramp_up();
+        }
+        let sequential = index == 0 || self.prev.map_or(false, |prev| index == prev || index == prev + 1);
+        if sequential {
+            self.start = index;
+            self.size = initial_size(pages);
+            self.async_size = if self.size > pages { self.size - pages } else { self.size };
+            return self.window();
+        }
+        // another stream may have moved the window
+        let history = (1..=min(index, RA_MAX_PAGES)).take_while(|&back| cached(index - back)).count() as u64;
+        if history >= pages {
+            // a stream from the start of the file goes on for long
+            let size = if history == index { (history + pages) * 2 } else { history + pages };
+            self.start = index;
+            self.size = initial_size(size);
+            self.async_size = self.size;
+            return self.window();
+        }
+        // random, no more than asked
+        self.size = 0;
+        self.async_size = 0;
+        ReadaheadWindow { start : index, count : pages, marker : None }
+    }
+
+    /// Returns the window to read when the page `index` carried the
+    /// readahead tag, for a read of `pages` pages from there
+    ///
+    /// `cached` tells whether a page is in the cache.
+    pub(crate) fn on_marker(&mut self, index:u64, pages:u64, cached:impl Fn(u64) -> bool) -> Option<ReadaheadWindow> {
+        if self.async_size > 0 && index == self.start + self.size - self.async_size {
+            return Some(self.ramp_up());
+        }
+        // the marker of another stream: go on from the end of the pages
+        // cached after it, as far as they reach
+        let next = (index + 1..=index + RA_MAX_PAGES).find(|&page| !cached(page))?;
+        self.start = next;
+        self.size = next_size(min(next - index + max(pages, 1), RA_MAX_PAGES));
+        self.async_size = self.size;
+        Some(self.window())
+    }
+
+    /// Records `index` as the last page read
+    pub(crate) fn record(&mut self, index:u64) {
+        self.prev = Some(index);
+    }
+}
@@ -0,0 +1,298 @@
+use crate::mm::filemap::*;
+use crate::mm::frame::*;
+use crate::mm::paging::*;
+use crate::mm::space::*;
+use crate::mm::swap::*;
+use crate::sync::*;
+use crate::task::*;
+
+/// A list of frames linked through their descriptors, most recent first
+struct LruList {
+    head  : u32,
+    tail  : u32,
+    count : usize,
+}
+
+impl LruList {
+    const fn new() -> Self {
+        LruList { head : NO_FRAME, tail : NO_FRAME, count : 0 }
+    }
+
+    fn push(&mut self, pfn:usize) {
+        let descriptor = frame(pfn);
+        descriptor.prev = NO_FRAME;
+        descriptor.next = self.head;
+        if self.head != NO_FRAME {
+            frame(self.head as usize).prev = pfn as u32;
+        } else {
+            self.tail = pfn as u32;
+        }
+        self.head = pfn as u32;
+        self.count += 1;
+    }
+
+    fn unlink(&mut self, pfn:usize) {
+        let descriptor = frame(pfn);
+        let (prev, next) = (descriptor.prev, descriptor.next);
+        if prev != NO_FRAME {
+            frame(prev as usize).next = next;
+        } else {
+            self.head = next;
+        }
+        if next != NO_FRAME {
+            frame(next as usize).prev = prev;
+        } else {
+            self.tail = prev;
+        }
+        descriptor.prev = NO_FRAME;
+        descriptor.next = NO_FRAME;
+        self.count -= 1;
+    }
+
+    fn tail(&self) -> Option<usize> {
+        if self.tail == NO_FRAME { None } else { Some(self.tail as usize) }
+    }
+}
+
+/// The active and inactive lists of the memory node
+///
+/// Pages enter the inactive list when first mapped. A page referenced
+/// again while inactive is promoted, the active list is aged into the
+/// inactive one to keep the two balanced, and reclaim only evicts from
+/// the tail of the inactive list, so pages in use survive the scans.
+struct Lru {
+    active   : LruList,
+    inactive : LruList,
+}
+
+impl Lru {
+    fn list(&mut self, active:bool) -> &mut LruList {
+        if active { &mut self.active } else { &mut self.inactive }
+    }
+
+    /// Moves `pfn` to the head of the active or inactive list
+    fn move_to(&mut self, pfn:usize, active:bool) {
+        let descriptor = frame(pfn);
+        if descriptor.flags & FRAME_LRU == 0 {
+            return;
+        }
+        let was_active = descriptor.flags & FRAME_ACTIVE != 0;
+        self.list(was_active).unlink(pfn);
+        if active {
+            frame(pfn).flags |= FRAME_ACTIVE;
+        } else {
+            frame(pfn).flags &= !FRAME_ACTIVE;
+        }
+        self.list(active).push(pfn);
+    }
+}
+
+#[allow(non_upper_case_globals)]
+static lru : SpinLock<Lru> = SpinLock::new(Lru { active : LruList::new(), inactive : LruList::new() });
+
+#[allow(non_upper_case_globals)]
+static kswapd_wait : WaitQueue = WaitQueue::new();
+
+/// Adds the anonymous page at `vaddr` of `space`, backed by `paddr`, to the inactive list
+///
+/// Reclaim reaches `space` through the frame, which must leave the lists
+/// before the address space goes away, as its teardown makes sure.
+pub(crate) fn lru_add(paddr:usize, space:&AddressSpace, vaddr:usize) {
+    let pfn = pfn(paddr);
+    let mut lists = lru.lock();
+    let descriptor = frame(pfn);
+    if descriptor.flags & FRAME_LRU != 0 {
+        return;
+    }
+    descriptor.flags = (descriptor.flags | FRAME_LRU) & !FRAME_ACTIVE;
+    descriptor.mapping = space as *const AddressSpace as usize;
+    descriptor.index = vaddr;
+    lists.inactive.push(pfn);
+}
+
+/// Adds the page `index` of `cache`, backed by `paddr`, to the inactive list
+pub(crate) fn lru_add_cache(paddr:usize, cache:&PageCache, index:u64) {
+    let pfn = pfn(paddr);
+    let mut lists = lru.lock();
+    let descriptor = frame(pfn);
+    if descriptor.flags & FRAME_LRU != 0 {
+        return;
+    }
+    descriptor.flags = (descriptor.flags | FRAME_LRU | FRAME_CACHE) & !(FRAME_ACTIVE | FRAME_REF);
+    descriptor.mapping = cache as *const PageCache as usize;
+    descriptor.index = index as usize;
+    lists.inactive.push(pfn);
+}
+
+/// Records a use of the page cache page at `paddr`
+///
+/// A page used twice while inactive is promoted to the active list.
+pub(crate) fn mark_page_accessed(paddr:usize) {
+    let pfn = pfn(paddr);
+    let mut lists = lru.lock();
+    let descriptor = frame(pfn);
+    if descriptor.flags & (FRAME_LRU | FRAME_CACHE) != FRAME_LRU | FRAME_CACHE {
+        return;
+    }
+    if descriptor.flags & (FRAME_ACTIVE | FRAME_REF) == FRAME_REF {
+        descriptor.flags &= !FRAME_REF;
+        lists.move_to(pfn, true);
+    } else {
+        descriptor.flags |= FRAME_REF;
+    }
+}
+
+/// Removes the frame at `paddr` from the LRU lists, if on one
+pub(crate) fn lru_remove(paddr:usize) {
+    let pfn = pfn(paddr);
+    let mut lists = lru.lock();
+    let descriptor = frame(pfn);
+    if descriptor.flags & FRAME_LRU == 0 {
+        return;
+    }
+    let active = descriptor.flags & FRAME_ACTIVE != 0;
+    lists.list(active).unlink(pfn);
+    frame(pfn).flags &= !(FRAME_LRU | FRAME_ACTIVE | FRAME_CACHE | FRAME_REF);
+}
+
+/// Returns the number of pages on the active and inactive lists
+pub(crate) fn lru_counts() -> (usize, usize) {
+    let lists = lru.lock();
+    (lists.active.count, lists.inactive.count)
+}
+
+/// Tests and clears the accessed bit of the mapping of `pfn`, or the
+/// referenced flag of a page cache page
+///
+/// As Linux does on x86, the TLB is not flushed: a stale entry only
+/// delays the next time a reference is noticed.
+fn test_and_clear_referenced(pfn:usize) -> bool {
+    let descriptor = frame(pfn);
+    if descriptor.flags & FRAME_CACHE != 0 {
+        let referenced = descriptor.flags & FRAME_REF != 0;
+        descriptor.flags &= !FRAME_REF;
+        return referenced;
+    }
+    let space = unsafe { &*(descriptor.mapping as *const AddressSpace) };
+    match space.page_table.entry(descriptor.index) {
+        Some(entry) if *entry & PTE_ACCESSED != 0 => {
+            *entry &= !PTE_ACCESSED;
+            true
+        },
+        _ => false,
+    }
+}
+
+/// Ages up to `scan` pages from the tail of the active list, moving the
+/// ones not referenced since the last scan to the inactive list
+fn shrink_active(scan:usize) {
+    let mut lists = lru.lock();
+    for _ in 0..scan {
+        let pfn = match lists.active.tail() {
+            Some(pfn) => pfn,
+            None      => return,
+        };
+        let referenced = test_and_clear_referenced(pfn);
+        lists.move_to(pfn, referenced);
+    }
+}
+
+/// Scans up to `scan` pages from the tail of the inactive list, evicting
+/// the ones not referenced, returning how many were evicted
+fn shrink_inactive(scan:usize) -> usize {
+    let mut reclaimed = 0;
+    for _ in 0..scan {
+        let mut lists = lru.lock();
+        let pfn = match lists.inactive.tail() {
+            Some(pfn) => pfn,
+            None      => break,
+        };
+        if test_and_clear_referenced(pfn) {
+            lists.move_to(pfn, true);
+            continue;
+        }
+        // the page leaves the lists if evicted, else it is given another round
+        lists.move_to(pfn, false);
+        let (mapping, index, cached) = (frame(pfn).mapping, frame(pfn).index, frame(pfn).flags & FRAME_CACHE != 0);
+        drop(lists);
+        // clean page cache pages are dropped, the others are swapped out
+        let evicted = if cached {
+            let cache = unsafe { &*(mapping as *const PageCache) };
+            cache.evict(index as u64, pfn_to_phys(pfn))
+        } else {
+            let space = unsafe { &*(mapping as *const AddressSpace) };
+            space.swap_out_page(index).is_ok()
+        };
+        if evicted {
+            reclaimed += 1;
+        } else {
+            lru.lock().move_to(pfn, true);
+        }
+    }
+    reclaimed
+}
+
+/// Evicts up to `target` pages, returning how many were evicted
+///
+/// The inactive list is refilled from the active one whenever it becomes
+/// the smaller of the two. Each list is scanned at most twice.
+pub(crate) fn reclaim_pages(target:usize) -> usize {
+    let (active, inactive) = lru_counts();
+    let mut budget = 2 * (active + inactive);
+    let mut reclaimed = 0;
+    while reclaimed < target && budget > 0 {
+        let (active, inactive) = lru_counts();
+        if active + inactive == 0 {
+            break;
+        }
+        if inactive < active {
+            shrink_active(SWAP_CLUSTER);
+        }
+        let scan = core::cmp::min(SWAP_CLUSTER, budget);
+        reclaimed += shrink_inactive(scan);
+        budget -= scan;
+    }
+    reclaimed
+}
+
+/// Reclaims memory in the allocating thread, when kswapd did not keep up
+///
+/// Returns whether some memory was freed.
+pub(crate) fn direct_reclaim() -> bool {
+    let reclaimed = reclaim_pages(SWAP_CLUSTER);
+    swap_flush();
+    reclaimed > 0
+}
+
+/// Wakes up the background reclaimer, called when free memory runs low
+pub(crate) fn wakeup_kswapd() {
+    if kswapd_wait.has_waiters() {
+        kswapd_wait.wake_all();
+    }
+}
+
+/// Keeps free memory above the high watermark, in the background
+///
+/// Gives up and waits for the next wake-up when nothing can be evicted.
+fn kswapd_main(_arg:usize) {
+    loop {
+        if !below_watermark(Watermark::Low) {
+            kswapd_wait.sleep();
+            continue;
+        }
+        while below_watermark(Watermark::High) {
+            let reclaimed = reclaim_pages(SWAP_CLUSTER);
+            swap_flush();
+            if reclaimed == 0 {
+                kswapd_wait.sleep();
+                break;
+            }
+            yield_now();
+        }
+    }
+}
+
+/// Starts the background reclaimer
+pub(crate) fn init() {
+    let _ = spawn(kswapd_main, 0, None);
+}
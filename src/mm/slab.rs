@@ -0,0 +1,131 @@
+use crate::mm::*;
+use crate::mm::frame::*;
+use crate::mm::profile::*;
+use crate::sync::*;
+
+use core::alloc::{GlobalAlloc, Layout};
+use core::ptr;
+
+// objects up to 2 KiB are carved out of single frames, larger ones get whole blocks
+const SIZE_CLASSES : [usize; 8] = [16, 32, 64, 128, 256, 512, 1024, 2048];
+
+/// A free object, linked to the next one of the same cache
+struct FreeObject {
+    next : *mut FreeObject,
+}
+
+/// The free objects of a size class
+struct SlabCache {
+    size      : usize,
+    free      : *mut FreeObject,
+    allocated : usize,
+    frames    : usize,
+}
+
+unsafe impl Send for SlabCache {}
+
+impl SlabCache {
+    const fn new(size:usize) -> Self {
+        SlabCache {
+            size,
+            free      : ptr::null_mut(),
+            allocated : 0,
+            frames    : 0,
+        }
+    }
+
+    /// Splits a new frame into objects
+    fn grow(&mut self) -> bool {
+        let paddr = match alloc_frame() {
+            Some(paddr) => paddr,
+            None        => return false,
+        };
+        let base = phys_to_virt(paddr);
+        for offset in (0..PAGE_SIZE).step_by(self.size).rev() {
+            let object = (base + offset) as *mut FreeObject;
+            unsafe {
+                (*object).next = self.free;
+            }
+            self.free = object;
+        }
+        self.frames += 1;
+        true
+    }
+
+    fn alloc(&mut self) -> *mut u8 {
+        if self.free.is_null() && !self.grow() {
+            return ptr::null_mut();
+        }
+        let object = self.free;
+        self.free = unsafe { (*object).next };
+        self.allocated += 1;
+        object as *mut u8
+    }
+
+    fn free(&mut self, object:*mut u8) {
+        let object = object as *mut FreeObject;
+        unsafe {
+            (*object).next = self.free;
+        }
+        self.free = object;
+        self.allocated -= 1;
+    }
+}
+
+/// The kernel heap: a cache per size class, backed by the frame allocator
+///
+/// Objects are aligned to their size class, frames are never given back
+/// by the caches.
+pub(crate) struct KernelAllocator {
+    caches : [SpinLock<SlabCache>; SIZE_CLASSES.len()],
+}
+
+#[global_allocator]
+#[allow(non_upper_case_globals)]
+static kernel_allocator : KernelAllocator = KernelAllocator::new();
+
+impl KernelAllocator {
+    const fn new() -> Self {
+        let mut caches = [const { SpinLock::new(SlabCache::new(0)) }; SIZE_CLASSES.len()];
+        let mut i = 0;
+        while i < SIZE_CLASSES.len() {
+            caches[i] = SpinLock::new(SlabCache::new(SIZE_CLASSES[i]));
+            i += 1;
+        }
+        KernelAllocator { caches }
+    }
+}
+
+/// Returns the index of the smallest size class fitting `layout`
+fn size_class(layout:&Layout) -> Option<usize> {
+    let size = core::cmp::max(layout.size(), layout.align());
+    SIZE_CLASSES.iter().position(|&class| class >= size)
+}
+
+/// Returns the order of the smallest block of frames holding `size` Bytes
+pub(crate) fn size_to_order(size:usize) -> usize {
+    let frames = page_align_up(size) >> PAGE_SHIFT;
+    frames.next_power_of_two().trailing_zeros() as usize
+}
+
+unsafe impl GlobalAlloc for KernelAllocator {
+    unsafe fn alloc(&self, layout:Layout) -> *mut u8 {
+        let object = match size_class(&layout) {
+            Some(class) => self.caches[class].lock().alloc(),
+            None        => match alloc_frames(size_to_order(layout.size())) {
+                Some(paddr) => phys_to_virt(paddr) as *mut u8,
+                None        => ptr::null_mut(),
+            },
+        };
+        profile_alloc(AllocKind::Slab, object as usize, layout.size());
+        object
+    }
+
+    unsafe fn dealloc(&self, object:*mut u8, layout:Layout) {
+        profile_free(object as usize);
+        match size_class(&layout) {
+            Some(class) => self.caches[class].lock().free(object),
+            None        => free_frames(virt_to_phys(object as usize), size_to_order(layout.size())),
+        }
+    }
+}
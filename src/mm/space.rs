@@ -0,0 +1,291 @@
+use crate::cpu::*;
+use crate::mm::*;
+use crate::mm::frame::*;
+use crate::mm::paging::*;
+use crate::mm::pcid;
+use crate::mm::reclaim::*;
+use crate::mm::swap::*;
+use crate::mm::uaccess::*;
+use crate::mm::vma::*;
+use crate::syscall::errno::*;
+use crate::time::vdso;
+
+use alloc::vec::Vec;
+use core::ptr;
+use core::sync::atomic::{AtomicU64, Ordering};
+
+// context identifiers are never reused, 0 is the kernel-only context
+#[allow(non_upper_case_globals)]
+static next_context_id : AtomicU64 = AtomicU64::new(1);
+
+/// Returns the page table flags granting the access allowed by the VMA `flags`
+pub(crate) fn pte_flags(flags:u32) -> u64 {
+    let mut pte_flags = PTE_USER;
+    if flags & VMA_WRITE != 0 {
+        pte_flags |= PTE_WRITABLE;
+    }
+    if flags & VMA_EXEC == 0 {
+        pte_flags |= no_exec();
+    }
+    pte_flags
+}
+
+/// The virtual memory of a user process: its page tables and its mappings
+///
+/// `context_id` identifies the address space for its whole lifetime and is
+/// what the per-CPU PCID caches are keyed on. `tlb_generation` is bumped
+/// whenever translations are removed or restricted, so that processors
+/// holding stale entries under a cached PCID know they must flush it.
+pub(crate) struct AddressSpace {
+    pub(crate) page_table : PageTable,
+    pub(crate) vmas       : VmaTree,
+    context_id            : u64,
+    tlb_generation        : AtomicU64,
+}
+
+impl AddressSpace {
+    /// Creates an address space whose only user mapping is the vDSO
+    pub(crate) fn new() -> Option<Self> {
+        let space = AddressSpace {
+            page_table     : PageTable::new()?,
+            vmas           : VmaTree::new(),
+            context_id     : next_context_id.fetch_add(1, Ordering::Relaxed),
+            tlb_generation : AtomicU64::new(0),
+        };
+        if vdso::map_into(&space).is_err() {
+            return None;
+        }
+        Some(space)
+    }
+
+    /// Returns the current TLB generation
+    pub(crate) fn tlb_generation(&self) -> u64 {
+        self.tlb_generation.load(Ordering::Acquire)
+    }
+
+    /// Checks whether the address space is loaded on the current processor
+    pub(crate) fn is_active(&self) -> bool {
+        pcid::active_context() == self.context_id
+    }
+
+    /// Loads the address space on the current processor
+    pub(crate) fn activate(&self) {
+        pcid::switch_to(self.page_table.root(), self.context_id, self.tlb_generation());
+    }
+
+    /// Invalidates the translation of the page at `vaddr`
+    ///
+    /// The current processor flushes it right away, the others will flush
+    /// the whole PCID the next time they switch to this address space.
+    pub(crate) fn flush_page(&self, vaddr:usize) {
+        self.tlb_generation.fetch_add(1, Ordering::Release);
+        if self.is_active() {
+            invlpg(vaddr);
+            pcid::sync_generation(self.context_id, self.tlb_generation());
+        }
+    }
+
+    /// Invalidates all the translations of the address space
+    pub(crate) fn flush_all(&self) {
+        self.tlb_generation.fetch_add(1, Ordering::Release);
+        if self.is_active() {
+            self.activate();
+        }
+    }
+
+    /// Maps `pages` physically contiguous frames starting at `paddr` at the
+    /// lowest free user address, returning it
+    ///
+    /// The frames keep belonging to the caller, which must unmap them
+    /// before freeing them.
+    pub(crate) fn map_frames(&self, paddr:usize, pages:usize, flags:u32) -> KResult<usize> {
+        let vma = self.vmas.insert_anywhere(pages * PAGE_SIZE, flags).map_err(|_| ENOMEM)?;
+        self.populate(&vma, paddr)?;
+        Ok(vma.start)
+    }
+
+    /// Maps `pages` physically contiguous frames starting at `paddr` at the
+    /// user address `vaddr`, like `map_frames()`
+    #[cfg_attr(not(feature = "bench"), allow(dead_code))]
+    pub(crate) fn map_frames_at(&self, vaddr:usize, paddr:usize, pages:usize, flags:u32) -> KResult<()> {
+        let vma = Vma::new(vaddr, vaddr + pages * PAGE_SIZE, flags);
+        self.vmas.insert(vma).map_err(|error| match error {
+            VmaError::Overlap => EEXIST,
+            VmaError::Full    => ENOMEM,
+            _                 => EINVAL,
+        })?;
+        self.populate(&vma, paddr)
+    }
+
+    /// Translates the whole `vma` to the frames starting at `paddr`,
+    /// removing it on failure
+    fn populate(&self, vma:&Vma, paddr:usize) -> KResult<()> {
+        let pte_flags = pte_flags(vma.flags);
+        for offset in (0..vma.size()).step_by(PAGE_SIZE) {
+            if self.page_table.map(vma.start + offset, paddr + offset, pte_flags).is_err() {
+                self.unmap_range(vma.start);
+                return Err(ENOMEM);
+            }
+        }
+        Ok(())
+    }
+
+    /// Allocates a frame for a user page
+    ///
+    /// User pages do not dig into the frames below the min watermark, which
+    /// are kept for the kernel: the allocating thread reclaims memory itself
+    /// first, as it does when memory is exhausted.
+    fn alloc_page(&self) -> KResult<usize> {
+        if below_watermark(Watermark::Min) {
+            direct_reclaim();
+        }
+        if let Some(paddr) = alloc_frame() {
+            return Ok(paddr);
+        }
+        direct_reclaim();
+        alloc_frame().ok_or(ENOMEM)
+    }
+
+    /// Returns the frame backing the page at `vaddr`, if the page belongs
+    /// to an anonymous mapping allocating a zeroed one on the first touch
+    /// or bringing it back from swap
+    pub(crate) fn fault_in(&self, vaddr:usize) -> KResult<usize> {
+        let page = page_align_down(vaddr);
+        if let Some(paddr) = self.page_table.translate(page) {
+            return Ok(paddr);
+        }
+        let vma = self.vmas.find(page).ok_or(EFAULT)?;
+        if vma.flags & VMA_ANONYMOUS == 0 {
+            return Err(EFAULT);
+        }
+        let swapped = self.page_table.entry(page).and_then(|entry| SwapEntry::from_pte(*entry));
+        let paddr = self.alloc_page()?;
+        match swapped {
+            Some(entry) => {
+                if let Err(errno) = swap_load(entry, paddr) {
+                    free_frame(paddr);
+                    return Err(errno);
+                }
+            },
+            None => unsafe {
+                ptr::write_bytes(phys_to_virt(paddr) as *mut u8, 0, PAGE_SIZE);
+            },
+        }
+        if self.page_table.map(page, paddr, pte_flags(vma.flags)).is_err() {
+            free_frame(paddr);
+            return Err(ENOMEM);
+        }
+        lru_add(paddr, self, page);
+        Ok(paddr)
+    }
+
+    /// Pins the frames backing the user range `[addr, addr + size)`, so
+    /// that a device can transfer to or from them in place
+    ///
+    /// Returns the frames, one per page in order, each with a reference
+    /// taken, which keeps it from being swapped out or freed by an unmap
+    /// until `unpin_pages()`. Only anonymous memory can be pinned, and it
+    /// must be writable when the transfer is to memory.
+    pub(crate) fn pin_pages(&self, addr:usize, size:usize, write:bool) -> KResult<Vec<usize>> {
+        if !access_ok(addr, size) {
+            return Err(EFAULT);
+        }
+        let mut pages = Vec::new();
+        for page in (page_align_down(addr)..addr + size).step_by(PAGE_SIZE) {
+            let pinned = match self.vmas.find(page) {
+                Some(vma) if vma.flags & VMA_ANONYMOUS != 0 && (!write || vma.flags & VMA_WRITE != 0) => self.fault_in(page),
+                _ => Err(EFAULT),
+            };
+            match pinned {
+                Ok(paddr) => {
+                    get_frame(paddr);
+                    pages.push(paddr);
+                },
+                Err(errno) => {
+                    unpin_pages(&pages);
+                    return Err(errno);
+                },
+            }
+        }
+        Ok(pages)
+    }
+
+    /// Moves the anonymous page at `vaddr` to swap, freeing its frame
+    ///
+    /// Pages whose frame is also referenced elsewhere, by a pipe for
+    /// instance, are left in place.
+    pub(crate) fn swap_out_page(&self, vaddr:usize) -> KResult<()> {
+        let entry = self.page_table.entry(vaddr).ok_or(EINVAL)?;
+        if *entry & PTE_PRESENT == 0 {
+            return Err(EINVAL);
+        }
+        let paddr = (*entry & PTE_ADDR_MASK) as usize;
+        if frame(pfn(paddr)).refcount != 1 {
+            return Err(EBUSY);
+        }
+        *entry = swap_store(paddr)?.pte();
+        self.flush_page(vaddr);
+        lru_remove(paddr);
+        put_frame(paddr);
+        Ok(())
+    }
+
+    /// Removes the translation of the page at `vaddr`, returning its frame
+    ///
+    /// The reference to the frame held by the mapping passes to the caller.
+    pub(crate) fn take_page(&self, vaddr:usize) -> Option<usize> {
+        let paddr = self.page_table.unmap(vaddr)?;
+        self.flush_page(vaddr);
+        lru_remove(paddr);
+        Some(paddr)
+    }
+
+    /// Removes the mapping starting at `start` and its translations
+    ///
+    /// The frames and swap entries of anonymous mappings are released, the
+    /// frames of the others belong to whoever mapped them.
+    pub(crate) fn unmap_range(&self, start:usize) {
+        if let Ok(vma) = self.vmas.remove(start) {
+            for page in (vma.start..vma.end).step_by(PAGE_SIZE) {
+                if let Some(entry) = self.page_table.entry(page) {
+                    if let Some(swapped) = SwapEntry::from_pte(*entry) {
+                        *entry = 0;
+                        swap_free(swapped);
+                        continue;
+                    }
+                }
+                let paddr = self.page_table.unmap(page);
+                if let (Some(paddr), true) = (paddr, vma.flags & VMA_ANONYMOUS != 0) {
+                    lru_remove(paddr);
+                    put_frame(paddr);
+                }
+            }
+            self.flush_all();
+        }
+    }
+}
+
+impl Drop for AddressSpace {
+    /// Removes all the mappings and releases the page tables and the PCID
+    ///
+    /// The last reference to a process goes when its last thread exits,
+    /// still running on its page table, hence the switch to the kernel one
+    /// first.
+    fn drop(&mut self) {
+        if self.is_active() {
+            pcid::switch_to_kernel();
+        }
+        // the anonymous frames leave the LRU lists, reclaim would otherwise
+        // reach the address space through them once freed
+        while let Some(vma) = self.vmas.next(USER_SPACE_START) {
+            self.unmap_range(vma.start);
+        }
+        pcid::release(self.context_id);
+        self.page_table.destroy();
+    }
+}
+
+/// Releases the frames pinned by `AddressSpace::pin_pages()`
+pub(crate) fn unpin_pages(pages:&[usize]) {
+    pages.iter().for_each(|&paddr| put_frame(paddr));
+}
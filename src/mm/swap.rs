@@ -0,0 +1,148 @@
+use crate::mm::*;
+use crate::mm::paging::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+use crate::time;
+
+use alloc::sync::Arc;
+use core::sync::atomic::{AtomicU64, Ordering};
+
+// the number of swap devices that can be active at the same time
+pub(crate) const MAX_SWAP_DEVICES : usize = 8;
+
+// the number of pages reclaimed at once when an allocation fails
+pub(crate) const SWAP_CLUSTER : usize = 32;
+
+/// The location of a page in swap, as stored in a non-present page table entry
+///
+/// The slot takes the address bits of the entry, the device the bits right
+/// above `PTE_PRESENT`, and `PTE_SWAP` tells it apart from an empty entry.
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub(crate) struct SwapEntry(u64);
+
+impl SwapEntry {
+    pub(crate) const fn new(device:usize, slot:usize) -> Self {
+        SwapEntry(((slot as u64) << PAGE_SHIFT) | ((device as u64) << 1) | PTE_SWAP)
+    }
+
+    /// Returns the swap entry stored in the page table entry `pte`, if any
+    pub(crate) const fn from_pte(pte:u64) -> Option<Self> {
+        if pte & PTE_PRESENT == 0 && pte & PTE_SWAP != 0 {
+            Some(SwapEntry(pte))
+        } else {
+            None
+        }
+    }
+
+    /// Returns the page table entry representing the swap entry
+    pub(crate) const fn pte(self) -> u64 {
+        self.0
+    }
+
+    pub(crate) const fn device(self) -> usize {
+        ((self.0 >> 1) as usize) & (MAX_SWAP_DEVICES - 1)
+    }
+
+    pub(crate) const fn slot(self) -> usize {
+        (self.0 >> PAGE_SHIFT) as usize
+    }
+}
+
+/// A place where evicted anonymous pages are stored
+pub(crate) trait SwapBackend : Send + Sync {
+    /// Stores a copy of the frame at `paddr`, returning the slot holding it
+    fn store(&self, paddr:usize) -> KResult<usize>;
+
+    /// Copies the page stored in `slot` into the frame at `paddr`
+    fn load(&self, slot:usize, paddr:usize) -> KResult<()>;
+
+    /// Releases `slot`
+    fn release(&self, slot:usize);
+
+    /// Makes sure that the frames of the stored pages are not held anymore
+    fn flush(&self) {}
+}
+
+#[derive(Clone)]
+struct SwapDevice {
+    backend  : Arc<dyn SwapBackend>,
+    priority : i32,
+}
+
+#[allow(non_upper_case_globals)]
+static swap_devices : SpinLock<[Option<SwapDevice>; MAX_SWAP_DEVICES]> = SpinLock::new([const { None }; MAX_SWAP_DEVICES]);
+
+/// Counters of the swap activity
+pub(crate) struct SwapStats {
+    pub(crate) swap_outs  : AtomicU64,
+    pub(crate) swap_ins   : AtomicU64,
+    /// Time spent bringing pages back, in nanoseconds
+    pub(crate) swap_in_ns : AtomicU64,
+}
+
+#[allow(non_upper_case_globals)]
+pub(crate) static swap_stats : SwapStats = SwapStats {
+    swap_outs  : AtomicU64::new(0),
+    swap_ins   : AtomicU64::new(0),
+    swap_in_ns : AtomicU64::new(0),
+};
+
+/// Makes `backend` available for swapping, returning its device number
+///
+/// Pages go to the device with the highest `priority` that has room.
+pub(crate) fn register_swap(backend:Arc<dyn SwapBackend>, priority:i32) -> KResult<usize> {
+    let mut devices = swap_devices.lock();
+    let device = devices.iter().position(|device| device.is_none()).ok_or(ENOSPC)?;
+    devices[device] = Some(SwapDevice { backend, priority });
+    Ok(device)
+}
+
+fn backend(device:usize) -> Option<Arc<dyn SwapBackend>> {
+    swap_devices.lock()[device].as_ref().map(|device| device.backend.clone())
+}
+
+/// Stores a copy of the frame at `paddr` on the best device with room
+pub(crate) fn swap_store(paddr:usize) -> KResult<SwapEntry> {
+    let mut candidates = swap_devices.lock().clone();
+    loop {
+        let best = candidates.iter()
+            .enumerate()
+            .filter_map(|(device, candidate)| candidate.as_ref().map(|candidate| (device, candidate.priority)))
+            .max_by_key(|&(_, priority)| priority);
+        let device = match best {
+            Some((device, _)) => device,
+            None              => return Err(ENOSPC),
+        };
+        let backend = candidates[device].take().unwrap().backend;
+        if let Ok(slot) = backend.store(paddr) {
+            swap_stats.swap_outs.fetch_add(1, Ordering::Relaxed);
+            return Ok(SwapEntry::new(device, slot));
+        }
+    }
+}
+
+/// Copies the page at `entry` into the frame at `paddr`, releasing the entry
+pub(crate) fn swap_load(entry:SwapEntry, paddr:usize) -> KResult<()> {
+    let start = time::monotonic_ns();
+    let backend = backend(entry.device()).ok_or(EIO)?;
+    backend.load(entry.slot(), paddr)?;
+    backend.release(entry.slot());
+    swap_stats.swap_ins.fetch_add(1, Ordering::Relaxed);
+    swap_stats.swap_in_ns.fetch_add(time::monotonic_ns() - start, Ordering::Relaxed);
+    Ok(())
+}
+
+/// Completes the pending writes of all the devices, releasing the frames they hold
+pub(crate) fn swap_flush() {
+    let devices = swap_devices.lock().clone();
+    for device in devices.iter().flatten() {
+        device.backend.flush();
+    }
+}
+
+/// Releases the page at `entry` without reading it back
+pub(crate) fn swap_free(entry:SwapEntry) {
+    if let Some(backend) = backend(entry.device()) {
+        backend.release(entry.slot());
+    }
+}
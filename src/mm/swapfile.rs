@@ -0,0 +1,298 @@
+use crate::block::*;
+use crate::mm::*;
+use crate::mm::frame::*;
+use crate::mm::swap::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+
+use alloc::collections::{BTreeMap, VecDeque};
+use alloc::sync::Arc;
+use alloc::vec;
+use alloc::vec::Vec;
+use core::ptr;
+
+// the header written by mkswap in the first page of the device
+const SWAP_SIGNATURE        : &[u8; 10] = b"SWAPSPACE2";
+const SWAP_SIGNATURE_OFFSET : usize = PAGE_SIZE - 10;
+const SWAP_LAST_PAGE_OFFSET : usize = 1024 + 4;
+
+// slots are handed out sequentially inside clusters of this many slots,
+// so that pages evicted together land next to each other on disk
+const SWAPFILE_CLUSTER : usize = 256;
+
+// the number of pending pages that wakes up the writer
+const SWAP_BATCH : usize = 64;
+
+// the number of slots read after the faulting one, and the number of
+// pages read ahead that are kept around
+const SWAP_READAHEAD       : usize = 8;
+const SWAP_READAHEAD_CACHE : usize = 64;
+
+// the priority of disk swap, below the compressed swap
+pub(crate) const DISK_SWAP_PRIORITY : i32 = 0;
+
+// the disk used for swapping
+const SWAP_DEVICE : &str = "hdb";
+
+struct SwapMap {
+    used            : Vec<u64>,
+    cluster_free    : Vec<u16>,
+    cluster         : usize,
+    next            : usize,
+    /// Pages stored but not written yet, with a reference to their frame
+    pending         : BTreeMap<usize, usize>,
+    /// Pages read ahead, with a reference to their frame
+    readahead       : BTreeMap<usize, usize>,
+    readahead_order : VecDeque<usize>,
+    /// Bumped whenever a slot is released, telling its old content apart
+    generations     : Vec<u32>,
+}
+
+impl SwapMap {
+    fn is_used(&self, slot:usize) -> bool {
+        self.used[slot / 64] & (1 << (slot % 64)) != 0
+    }
+
+    fn set_used(&mut self, slot:usize, used:bool) {
+        if used {
+            self.used[slot / 64] |= 1 << (slot % 64);
+            self.cluster_free[slot / SWAPFILE_CLUSTER] -= 1;
+        } else {
+            self.used[slot / 64] &= !(1 << (slot % 64));
+            self.cluster_free[slot / SWAPFILE_CLUSTER] += 1;
+            self.generations[slot] = self.generations[slot].wrapping_add(1);
+        }
+    }
+
+    /// Returns a free slot, preferring the one after the last allocated
+    ///
+    /// Once the current cluster is exhausted a completely free one is
+    /// taken, falling back to any cluster with room when none is left.
+    fn alloc(&mut self, slots:usize) -> Option<usize> {
+        if self.cluster_free[self.cluster] == 0 {
+            let (current, clusters) = (self.cluster, self.cluster_free.len());
+            let candidates = (1..=clusters).map(|i| (current + i) % clusters);
+            let cluster_size = |cluster:usize| core::cmp::min(SWAPFILE_CLUSTER, slots - cluster * SWAPFILE_CLUSTER);
+            self.cluster = candidates.clone()
+                .find(|&cluster| self.cluster_free[cluster] as usize == cluster_size(cluster))
+                .or_else(|| candidates.clone().find(|&cluster| self.cluster_free[cluster] > 0))?;
+            self.next = self.cluster * SWAPFILE_CLUSTER;
+        }
+        let end = core::cmp::min(slots, (self.cluster + 1) * SWAPFILE_CLUSTER);
+        let start = self.cluster * SWAPFILE_CLUSTER;
+        let slot = (self.next..end).chain(start..self.next).find(|&slot| !self.is_used(slot))?;
+        self.set_used(slot, true);
+        self.next = slot + 1;
+        Some(slot)
+    }
+
+    fn cache_readahead(&mut self, slot:usize, paddr:usize) {
+        if self.readahead_order.len() == SWAP_READAHEAD_CACHE {
+            if let Some(oldest) = self.readahead_order.pop_front() {
+                if let Some(paddr) = self.readahead.remove(&oldest) {
+                    put_frame(paddr);
+                }
+            }
+        }
+        self.readahead.insert(slot, paddr);
+        self.readahead_order.push_back(slot);
+    }
+}
+
+/// A swap partition on a block device, in the format created by mkswap
+///
+/// Stored pages are not written right away: their frames are kept in a
+/// swap cache, where loads still find them, until the writer thread
+/// collects a batch and writes each run of consecutive slots with a
+/// single request. Swap-ins also read the following slots in the same
+/// request, keeping them around for the faults that usually follow.
+pub(crate) struct DiskSwap {
+    device : Arc<dyn BlockDevice>,
+    slots  : usize,
+    map    : SpinLock<SwapMap>,
+    writer : WaitQueue,
+}
+
+/// Returns the first sector of `slot`, the header page comes first
+fn slot_sector(slot:usize) -> u64 {
+    (slot * SECTORS_PER_PAGE) as u64
+}
+
+impl DiskSwap {
+    /// Writes all the pages stored so far, grouping consecutive slots
+    fn write_pending(&self) {
+        let batch : Vec<(usize, usize)> = {
+            let map = self.map.lock();
+            map.pending.iter().map(|(&slot, &paddr)| (slot, paddr)).collect()
+        };
+        let mut requests = Vec::new();
+        let mut first = 0;
+        while first < batch.len() {
+            let mut last = first + 1;
+            while last < batch.len() && batch[last].0 == batch[last - 1].0 + 1 {
+                last += 1;
+            }
+            let pages : Vec<usize> = batch[first..last].iter().map(|&(_, paddr)| paddr).collect();
+            for &paddr in pages.iter() {
+                get_frame(paddr);
+            }
+            let request = BlockRequest::new(BlockOp::Write, slot_sector(batch[first].0), pages);
+            self.device.submit(request.clone());
+            requests.push((first, last, request));
+            first = last;
+        }
+        for (first, last, request) in requests {
+            let written = request.wait().is_ok();
+            let mut map = self.map.lock();
+            for &(slot, paddr) in batch[first..last].iter() {
+                // the slot may have been released, and even reused, meanwhile
+                if written && map.pending.get(&slot) == Some(&paddr) {
+                    map.pending.remove(&slot);
+                    put_frame(paddr);
+                }
+                put_frame(paddr);
+            }
+        }
+    }
+}
+
+impl SwapBackend for DiskSwap {
+    fn store(&self, paddr:usize) -> KResult<usize> {
+        let mut map = self.map.lock();
+        let slot = map.alloc(self.slots).ok_or(ENOSPC)?;
+        get_frame(paddr);
+        map.pending.insert(slot, paddr);
+        let wake = map.pending.len() >= SWAP_BATCH;
+        drop(map);
+        if wake {
+            self.writer.wake_all();
+        }
+        Ok(slot)
+    }
+
+    fn load(&self, slot:usize, paddr:usize) -> KResult<()> {
+        let mut map = self.map.lock();
+        if let Some(&cached) = map.pending.get(&slot) {
+            unsafe {
+                ptr::copy_nonoverlapping(phys_to_virt(cached) as *const u8, phys_to_virt(paddr) as *mut u8, PAGE_SIZE);
+            }
+            return Ok(());
+        }
+        if let Some(cached) = map.readahead.remove(&slot) {
+            map.readahead_order.retain(|&other| other != slot);
+            drop(map);
+            unsafe {
+                ptr::copy_nonoverlapping(phys_to_virt(cached) as *const u8, phys_to_virt(paddr) as *mut u8, PAGE_SIZE);
+            }
+            put_frame(cached);
+            return Ok(());
+        }
+        // read ahead the following slots in use, up to the first hole
+        let mut pages = vec![paddr];
+        let mut generations = Vec::new();
+        for next in slot + 1..core::cmp::min(slot + 1 + SWAP_READAHEAD, self.slots) {
+            if !map.is_used(next) || map.pending.contains_key(&next) || map.readahead.contains_key(&next) {
+                break;
+            }
+            match alloc_frame() {
+                Some(frame) => pages.push(frame),
+                None        => break,
+            }
+            generations.push(map.generations[next]);
+        }
+        drop(map);
+        let request = BlockRequest::new(BlockOp::Read, slot_sector(slot), pages);
+        self.device.submit(request.clone());
+        let result = request.wait();
+        let mut map = self.map.lock();
+        for (i, &frame) in request.pages.iter().enumerate().skip(1) {
+            // a slot released and stored again meanwhile holds a newer page
+            // than the one read, whether or not it was written back already
+            let next = slot + i;
+            if result.is_ok() && map.is_used(next) && map.generations[next] == generations[i - 1]
+            && !map.pending.contains_key(&next) && !map.readahead.contains_key(&next) {
+                map.cache_readahead(next, frame);
+            } else {
+                free_frame(frame);
+            }
+        }
+        result
+    }
+
+    fn release(&self, slot:usize) {
+        let mut map = self.map.lock();
+        if slot >= self.slots || !map.is_used(slot) {
+            return;
+        }
+        map.set_used(slot, false);
+        if let Some(paddr) = map.pending.remove(&slot) {
+            put_frame(paddr);
+        }
+        if let Some(paddr) = map.readahead.remove(&slot) {
+            map.readahead_order.retain(|&other| other != slot);
+            put_frame(paddr);
+        }
+    }
+
+    fn flush(&self) {
+        self.write_pending();
+    }
+}
+
+/// Writes the stored pages in batches, in the background
+fn swap_writer_main(arg:usize) {
+    let swap = unsafe { Arc::from_raw(arg as *const DiskSwap) };
+    loop {
+        swap.writer.wait_until(|| swap.map.lock().pending.len() >= SWAP_BATCH);
+        swap.write_pending();
+    }
+}
+
+/// Starts swapping to the block device `name`, which must hold a swap header
+pub(crate) fn swapon(name:&str) -> KResult<()> {
+    let device = block_device(name).ok_or(ENODEV)?;
+    let header = alloc_frame().ok_or(ENOMEM)?;
+    let result = submit_wait(&*device, BlockOp::Read, 0, vec![header]);
+    let bytes = unsafe { core::slice::from_raw_parts(phys_to_virt(header) as *const u8, PAGE_SIZE) };
+    let signature_ok = &bytes[SWAP_SIGNATURE_OFFSET..] == SWAP_SIGNATURE;
+    let last_page = u32::from_le_bytes(bytes[SWAP_LAST_PAGE_OFFSET..SWAP_LAST_PAGE_OFFSET + 4].try_into().unwrap()) as usize;
+    free_frame(header);
+    result?;
+    if !signature_ok {
+        return Err(EINVAL);
+    }
+    let slots = core::cmp::min(last_page + 1, (device.sector_count() / SECTORS_PER_PAGE as u64) as usize);
+    if slots < 2 {
+        return Err(EINVAL);
+    }
+    let clusters = (slots + SWAPFILE_CLUSTER - 1) / SWAPFILE_CLUSTER;
+    let mut map = SwapMap {
+        used            : vec![0; (slots + 63) / 64],
+        cluster_free    : (0..clusters).map(|cluster| core::cmp::min(SWAPFILE_CLUSTER, slots - cluster * SWAPFILE_CLUSTER) as u16).collect(),
+        cluster         : 0,
+        next            : 0,
+        pending         : BTreeMap::new(),
+        readahead       : BTreeMap::new(),
+        readahead_order : VecDeque::new(),
+        generations     : vec![0; slots],
+    };
+    // the header is never handed out
+    map.set_used(0, true);
+    let swap = Arc::new(DiskSwap { device, slots, map : SpinLock::new(map), writer : WaitQueue::new() });
+    register_swap(swap.clone(), DISK_SWAP_PRIORITY)?;
+    let arg = Arc::into_raw(swap) as usize;
+    if spawn(swap_writer_main, arg, None).is_err() {
+        // the device stays registered: without the writer, pages are still
+        // written when memory runs out
+        unsafe {
+            drop(Arc::from_raw(arg as *const DiskSwap));
+        }
+    }
+    Ok(())
+}
+
+/// Enables the swap partition, if a disk holding one is present
+pub(crate) fn init() {
+    let _ = swapon(SWAP_DEVICE);
+}
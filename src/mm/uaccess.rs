@@ -0,0 +1,210 @@
+use crate::cpu::*;
+use crate::mm::*;
+use crate::syscall::errno::*;
+
+use core::arch::asm;
+use core::mem::{size_of, MaybeUninit};
+
+// the bytes of a word with only their lowest, or highest, bit set
+const ONES  : u64 = 0x0101010101010101;
+const HIGHS : u64 = 0x8080808080808080;
+
+/// Checks whether `[addr, addr + size)` lies inside the user half
+pub(crate) fn access_ok(addr:usize, size:usize) -> bool {
+    match addr.checked_add(size) {
+        Some(end) => addr >= USER_SPACE_START && end <= USER_SPACE_END,
+        None      => false,
+    }
+}
+
+/// Copies `len` Bytes from `src` to `dst`, one of which is a user address
+///
+/// Returns the number of Bytes left uncopied because of a fault. Pages are
+/// not checked beforehand: a fault on the user side resumes at the fixup
+/// registered in the exception table, with RCX holding what is left. With
+/// ERMS or FSRM a single `rep movsb` is the fastest variant at any size,
+/// otherwise the bulk moves by words and the tail by Bytes.
+unsafe fn copy_user_generic(dst:*mut u8, src:*const u8, len:usize) -> usize {
+    let features = features();
+    let remaining : usize;
+    if features.erms || features.fsrm {
+        asm!(
+            "2: rep movsb",
+            "3:",
+            ".pushsection .ex_table, \"a\"",
+            ".balign 8",
+            ".quad 2b, 3b",
+            ".popsection",
+            inout("rcx") len => remaining,
+            inout("rdi") dst => _,
+            inout("rsi") src => _,
+            options(nostack, preserves_flags),
+        );
+    } else {
+        // a fault while moving words restarts at the same place by Bytes,
+        // which faults again at the exact Byte left uncopied
+        asm!(
+            "2: rep movsq",
+            "mov ecx, edx",
+            "3: rep movsb",
+            "4:",
+            ".pushsection .ex_table, \"a\"",
+            ".balign 8",
+            ".quad 2b, 5f",
+            ".quad 3b, 4b",
+            ".popsection",
+            ".pushsection .text.fixup, \"ax\"",
+            "5: lea rcx, [rdx + rcx*8]",
+            "jmp 3b",
+            ".popsection",
+            inout("rcx") len >> 3 => remaining,
+            in("rdx") len & 7,
+            inout("rdi") dst => _,
+            inout("rsi") src => _,
+            options(nostack, preserves_flags),
+        );
+    }
+    remaining
+}
+
+/// Reads a word at the user address `addr`, returning `None` on fault
+#[inline(always)]
+unsafe fn load_user_word(addr:usize) -> Option<u64> {
+    let value : u64;
+    let fault : u64;
+    asm!(
+        "2: mov {value}, qword ptr [{addr}]",
+        "3:",
+        ".pushsection .ex_table, \"a\"",
+        ".balign 8",
+        ".quad 2b, 4f",
+        ".popsection",
+        ".pushsection .text.fixup, \"ax\"",
+        "4: mov {fault}, 1",
+        "xor {value:e}, {value:e}",
+        "jmp 3b",
+        ".popsection",
+        addr  = in(reg) addr,
+        value = out(reg) value,
+        fault = inout(reg) 0_u64 => fault,
+        options(readonly, nostack, preserves_flags),
+    );
+    if fault == 0 { Some(value) } else { None }
+}
+
+/// Reads a Byte at the user address `addr`, returning `None` on fault
+#[inline(always)]
+unsafe fn load_user_byte(addr:usize) -> Option<u8> {
+    let value : u64;
+    let fault : u64;
+    asm!(
+        "2: movzx {value:e}, byte ptr [{addr}]",
+        "3:",
+        ".pushsection .ex_table, \"a\"",
+        ".balign 8",
+        ".quad 2b, 4f",
+        ".popsection",
+        ".pushsection .text.fixup, \"ax\"",
+        "4: mov {fault}, 1",
+        "xor {value:e}, {value:e}",
+        "jmp 3b",
+        ".popsection",
+        addr  = in(reg) addr,
+        value = out(reg) value,
+        fault = inout(reg) 0_u64 => fault,
+        options(readonly, nostack, preserves_flags),
+    );
+    if fault == 0 { Some(value as u8) } else { None }
+}
+
+/// Copies `dst.len()` Bytes from the user address `src`
+///
+/// On fault the part of `dst` that was not copied is zeroed.
+pub(crate) fn copy_from_user(dst:&mut [u8], src:usize) -> KResult<()> {
+    if !access_ok(src, dst.len()) {
+        return Err(EFAULT);
+    }
+    user_access_begin();
+    let remaining = unsafe { copy_user_generic(dst.as_mut_ptr(), src as *const u8, dst.len()) };
+    user_access_end();
+    if remaining != 0 {
+        let copied = dst.len() - remaining;
+        dst[copied..].fill(0);
+        return Err(EFAULT);
+    }
+    Ok(())
+}
+
+/// Copies `src` to the user address `dst`
+pub(crate) fn copy_to_user(dst:usize, src:&[u8]) -> KResult<()> {
+    if !access_ok(dst, src.len()) {
+        return Err(EFAULT);
+    }
+    user_access_begin();
+    let remaining = unsafe { copy_user_generic(dst as *mut u8, src.as_ptr(), src.len()) };
+    user_access_end();
+    if remaining != 0 {
+        return Err(EFAULT);
+    }
+    Ok(())
+}
+
+/// Copies the NUL terminated string at the user address `src` into `dst`
+///
+/// Returns the length of the string, without the terminator which is
+/// copied too. A result equal to `dst.len()` means the string did not fit
+/// and `dst` is not terminated. The string is read a word at a time, the
+/// last words are read by Bytes in case they cross into an unmapped page.
+pub(crate) fn strncpy_from_user(dst:&mut [u8], src:usize) -> KResult<usize> {
+    if src < USER_SPACE_START || src >= USER_SPACE_END {
+        return Err(EFAULT);
+    }
+    let max = core::cmp::min(dst.len(), USER_SPACE_END - src);
+    user_access_begin();
+    let result = unsafe { do_strncpy_from_user(&mut dst[..max], src) };
+    user_access_end();
+    result.ok_or(EFAULT)
+}
+
+unsafe fn do_strncpy_from_user(dst:&mut [u8], src:usize) -> Option<usize> {
+    let max = dst.len();
+    let mut done = 0;
+    while max - done >= size_of::<u64>() {
+        let word = match load_user_word(src + done) {
+            Some(word) => word,
+            None       => break,
+        };
+        // the lowest flagged Byte is the first null one, the others may be false positives
+        let zeros = word.wrapping_sub(ONES) & !word & HIGHS;
+        if zeros != 0 {
+            let length = (zeros.trailing_zeros() / 8) as usize;
+            dst[done..=done + length].copy_from_slice(&word.to_le_bytes()[..=length]);
+            return Some(done + length);
+        }
+        dst[done..done + size_of::<u64>()].copy_from_slice(&word.to_le_bytes());
+        done += size_of::<u64>();
+    }
+    while done < max {
+        let byte = load_user_byte(src + done)?;
+        dst[done] = byte;
+        if byte == 0 {
+            return Some(done);
+        }
+        done += 1;
+    }
+    Some(done)
+}
+
+/// Reads a value of type `T` from the user address `src`
+pub(crate) fn read_user<T:Copy>(src:usize) -> KResult<T> {
+    let mut value = MaybeUninit::<T>::uninit();
+    let bytes = unsafe { core::slice::from_raw_parts_mut(value.as_mut_ptr() as *mut u8, size_of::<T>()) };
+    copy_from_user(bytes, src)?;
+    Ok(unsafe { value.assume_init() })
+}
+
+/// Writes `value` to the user address `dst`
+pub(crate) fn write_user<T:Copy>(dst:usize, value:&T) -> KResult<()> {
+    let bytes = unsafe { core::slice::from_raw_parts(value as *const T as *const u8, size_of::<T>()) };
+    copy_to_user(dst, bytes)
+}
@@ -0,0 +1,463 @@
+use crate::mm::*;
+use crate::sync::*;
+
+use core::cell::UnsafeCell;
+use core::ptr;
+
+// protection and sharing flags of a mapping
+pub(crate) const VMA_READ      : u32 = 0x01;
+pub(crate) const VMA_WRITE     : u32 = 0x02;
+pub(crate) const VMA_EXEC      : u32 = 0x04;
+pub(crate) const VMA_SHARED    : u32 = 0x08;
+pub(crate) const VMA_ANONYMOUS : u32 = 0x10;
+
+// the maximum number of mappings of a single address space
+pub(crate) const MAX_VMAS : usize = 128;
+
+// index used as a null link between nodes
+const NIL : u16 = u16::MAX;
+
+// upper bound to the height of the tree, lockless readers never walk more
+// than this number of nodes (an AVL tree of MAX_VMAS nodes is ~10 levels)
+const MAX_DEPTH : usize = 32;
+
+/// A virtual memory area: the range `[start, end)` mapped with `flags`
+#[derive(Clone, Copy)]
+pub(crate) struct Vma {
+    pub(crate) start : usize,
+    pub(crate) end   : usize,
+    pub(crate) flags : u32,
+}
+
+impl Vma {
+    /// Creates a `Vma` spanning from `start` (included) to `end` (excluded)
+    pub(crate) const fn new(start:usize, end:usize, flags:u32) -> Self {
+        Vma { start, end, flags }
+    }
+
+    /// Returns the size of the area in Bytes
+    pub(crate) const fn size(&self) -> usize {
+        self.end - self.start
+    }
+}
+
+/// Errors reported when modifying a `VmaTree`
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub(crate) enum VmaError {
+    /// The range is empty, unaligned or outside the user space
+    Invalid,
+    /// The range overlaps an existing mapping
+    Overlap,
+    /// No room is left for another mapping
+    Full,
+    /// No mapping starts at the given address
+    NotFound,
+}
+
+/// A node of the tree
+///
+/// Besides the AVL balancing data, every node stores the size of the free
+/// gap between its area and the previous one (in address order), and the
+/// largest of such gaps in its subtree, which lets the unmapped-area search
+/// discard whole subtrees.
+#[derive(Clone, Copy)]
+struct VmaNode {
+    vma     : Vma,
+    left    : u16,
+    right   : u16,
+    height  : u8,
+    gap     : usize,
+    max_gap : usize,
+}
+
+impl VmaNode {
+    const EMPTY : VmaNode = VmaNode {
+        vma     : Vma::new(0, 0, 0),
+        left    : NIL,
+        right   : NIL,
+        height  : 0,
+        gap     : 0,
+        max_gap : 0,
+    };
+}
+
+/// The nodes storage and the tree topology
+///
+/// Nodes live in a fixed arena and are linked by index: a lockless reader
+/// racing with a writer may follow a stale link, but it always lands on a
+/// valid node and the sequence check makes it retry.
+struct VmaTreeInner {
+    nodes  : [VmaNode; MAX_VMAS],
+    root   : u16,
+    free   : u16,
+    unused : u16,
+    count  : usize,
+}
+
+impl VmaTreeInner {
+    const fn new() -> Self {
+        VmaTreeInner {
+            nodes  : [VmaNode::EMPTY; MAX_VMAS],
+            root   : NIL,
+            free   : NIL,
+            unused : 0,
+            count  : 0,
+        }
+    }
+
+    /// Takes a node from the free list, or from the never used ones
+    fn alloc_node(&mut self, vma:Vma) -> Option<u16> {
+        let idx = if self.free != NIL {
+            let idx = self.free;
+            self.free = self.nodes[idx as usize].left;
+            idx
+        } else if (self.unused as usize) < MAX_VMAS {
+            self.unused += 1;
+            self.unused - 1
+        } else {
+            return None;
+        };
+        self.nodes[idx as usize] = VmaNode { vma, height : 1, ..VmaNode::EMPTY };
+        self.count += 1;
+        Some(idx)
+    }
+
+    /// Gives a node back to the free list
+    fn free_node(&mut self, idx:u16) {
+        self.nodes[idx as usize].left = self.free;
+        self.free = idx;
+        self.count -= 1;
+    }
+
+    fn height(&self, idx:u16) -> u8 {
+        if idx == NIL { 0 } else { self.nodes[idx as usize].height }
+    }
+
+    fn max_gap(&self, idx:u16) -> usize {
+        if idx == NIL { 0 } else { self.nodes[idx as usize].max_gap }
+    }
+
+    /// Recomputes the height and the largest gap of a node from its children
+    fn update(&mut self, idx:u16) {
+        let node = self.nodes[idx as usize];
+        let height = 1 + core::cmp::max(self.height(node.left), self.height(node.right));
+        let max_gap = core::cmp::max(node.gap, core::cmp::max(self.max_gap(node.left), self.max_gap(node.right)));
+        let node = &mut self.nodes[idx as usize];
+        node.height = height;
+        node.max_gap = max_gap;
+    }
+
+    fn rotate_right(&mut self, idx:u16) -> u16 {
+        let left = self.nodes[idx as usize].left;
+        self.nodes[idx as usize].left = self.nodes[left as usize].right;
+        self.nodes[left as usize].right = idx;
+        self.update(idx);
+        self.update(left);
+        left
+    }
+
+    fn rotate_left(&mut self, idx:u16) -> u16 {
+        let right = self.nodes[idx as usize].right;
+        self.nodes[idx as usize].right = self.nodes[right as usize].left;
+        self.nodes[right as usize].left = idx;
+        self.update(idx);
+        self.update(right);
+        right
+    }
+
+    /// Restores the AVL invariant of the subtree rooted at `idx`
+    ///
+    /// Returns the new root of the subtree.
+    fn balance(&mut self, idx:u16) -> u16 {
+        self.update(idx);
+        let VmaNode { left, right, .. } = self.nodes[idx as usize];
+        let (lh, rh) = (self.height(left) as i32, self.height(right) as i32);
+        if lh - rh > 1 {
+            let VmaNode { left:ll, right:lr, .. } = self.nodes[left as usize];
+            if self.height(ll) < self.height(lr) {
+                self.nodes[idx as usize].left = self.rotate_left(left);
+            }
+            return self.rotate_right(idx);
+        }
+        if rh - lh > 1 {
+            let VmaNode { left:rl, right:rr, .. } = self.nodes[right as usize];
+            if self.height(rr) < self.height(rl) {
+                self.nodes[idx as usize].right = self.rotate_right(right);
+            }
+            return self.rotate_left(idx);
+        }
+        idx
+    }
+
+    fn insert_at(&mut self, idx:u16, new:u16) -> u16 {
+        if idx == NIL {
+            return new;
+        }
+        if self.nodes[new as usize].vma.start < self.nodes[idx as usize].vma.start {
+            let left = self.insert_at(self.nodes[idx as usize].left, new);
+            self.nodes[idx as usize].left = left;
+        } else {
+            let right = self.insert_at(self.nodes[idx as usize].right, new);
+            self.nodes[idx as usize].right = right;
+        }
+        self.balance(idx)
+    }
+
+    /// Unlinks the leftmost node of the subtree, which is stored in `min`
+    fn remove_min(&mut self, idx:u16, min:&mut u16) -> u16 {
+        let VmaNode { left, right, .. } = self.nodes[idx as usize];
+        if left == NIL {
+            *min = idx;
+            return right;
+        }
+        let left = self.remove_min(left, min);
+        self.nodes[idx as usize].left = left;
+        self.balance(idx)
+    }
+
+    /// Unlinks the node whose area starts at `start`, which is stored in `removed`
+    fn remove_at(&mut self, idx:u16, start:usize, removed:&mut u16) -> u16 {
+        if idx == NIL {
+            return NIL;
+        }
+        let VmaNode { vma, left, right, .. } = self.nodes[idx as usize];
+        if start < vma.start {
+            let left = self.remove_at(left, start, removed);
+            self.nodes[idx as usize].left = left;
+        } else if start > vma.start {
+            let right = self.remove_at(right, start, removed);
+            self.nodes[idx as usize].right = right;
+        } else {
+            *removed = idx;
+            if left == NIL {
+                return right;
+            }
+            if right == NIL {
+                return left;
+            }
+            let mut min = NIL;
+            let right = self.remove_min(right, &mut min);
+            self.nodes[min as usize].left = left;
+            self.nodes[min as usize].right = right;
+            return self.balance(min);
+        }
+        self.balance(idx)
+    }
+
+    /// Sets the gap of the node starting at `start` and fixes the augmented
+    /// data of all its ancestors
+    fn set_gap(&mut self, idx:u16, start:usize, gap:usize) {
+        if idx == NIL {
+            return;
+        }
+        let VmaNode { vma, left, right, .. } = self.nodes[idx as usize];
+        if start < vma.start {
+            self.set_gap(left, start, gap);
+        } else if start > vma.start {
+            self.set_gap(right, start, gap);
+        } else {
+            self.nodes[idx as usize].gap = gap;
+        }
+        self.update(idx);
+    }
+
+    /// Returns the last area starting before `addr` and the first one
+    /// starting at or after it
+    fn neighbours(&self, addr:usize) -> (Option<Vma>, Option<Vma>) {
+        let (mut prev, mut next) = (None, None);
+        let mut idx = self.root;
+        while idx != NIL {
+            let node = &self.nodes[idx as usize];
+            if node.vma.start < addr {
+                prev = Some(node.vma);
+                idx = node.right;
+            } else {
+                next = Some(node.vma);
+                idx = node.left;
+            }
+        }
+        (prev, next)
+    }
+
+    /// Reads a node without assuming that the arena is quiescent
+    fn load(&self, idx:u16) -> Option<VmaNode> {
+        match self.nodes.get(idx as usize) {
+            Some(node) => Some(unsafe { ptr::read_volatile(node) }),
+            None       => None,
+        }
+    }
+
+    /// Finds the area containing `addr`, may be called concurrently with writers
+    fn lookup(&self, addr:usize) -> Option<Vma> {
+        let mut idx = unsafe { ptr::read_volatile(&self.root) };
+        for _ in 0..MAX_DEPTH {
+            let node = self.load(idx)?;
+            if addr < node.vma.start {
+                idx = node.left;
+            } else if addr >= node.vma.end {
+                idx = node.right;
+            } else {
+                return Some(node.vma);
+            }
+        }
+        None
+    }
+
+    /// Finds the lowest free range of `size` Bytes, may be called concurrently with writers
+    ///
+    /// The walk only descends into subtrees whose largest gap is big enough,
+    /// hence it visits at most one path from the root.
+    fn lookup_gap(&self, size:usize) -> Option<usize> {
+        let mut idx = unsafe { ptr::read_volatile(&self.root) };
+        let mut last_end = USER_SPACE_START;
+        for _ in 0..MAX_DEPTH {
+            let node = match self.load(idx) {
+                Some(node) => node,
+                None       => break,
+            };
+            if node.max_gap >= size {
+                match self.load(node.left) {
+                    Some(left) if left.max_gap >= size => {
+                        idx = node.left;
+                        continue;
+                    },
+                    _ => (),
+                }
+                if node.gap >= size {
+                    return Some(node.vma.start - node.gap);
+                }
+                idx = node.right;
+            } else {
+                // no gap is large enough, but the space after the last area may be
+                last_end = node.vma.end;
+                idx = node.right;
+            }
+        }
+        if USER_SPACE_END - last_end >= size {
+            return Some(last_end);
+        }
+        None
+    }
+}
+
+/// The ordered index of the mappings of an address space
+///
+/// Lookups (`find()`, `find_free_area()`) are lockless: they are validated
+/// through a sequence counter and retried if a writer modified the tree in
+/// the meantime, so page faults never wait for the address space lock.
+/// Modifications are serialized by an internal lock.
+pub(crate) struct VmaTree {
+    inner    : UnsafeCell<VmaTreeInner>,
+    lock     : SpinLock<()>,
+    sequence : SeqCount,
+}
+
+unsafe impl Send for VmaTree {}
+
+unsafe impl Sync for VmaTree {}
+
+impl VmaTree {
+    /// Creates an empty `VmaTree`
+    pub(crate) const fn new() -> Self {
+        VmaTree {
+            inner    : UnsafeCell::new(VmaTreeInner::new()),
+            lock     : SpinLock::new(()),
+            sequence : SeqCount::new(),
+        }
+    }
+
+    /// Runs a lockless read of the tree, until it completes without races
+    fn read<R>(&self, reader:impl Fn(&VmaTreeInner) -> R) -> R {
+        loop {
+            let sequence = self.sequence.read_begin();
+            let result = reader(unsafe { &*self.inner.get() });
+            if !self.sequence.read_retry(sequence) {
+                return result;
+            }
+        }
+    }
+
+    /// Runs a modification of the tree, excluding other writers and
+    /// invalidating concurrent readers
+    fn write<R>(&self, writer:impl FnOnce(&mut VmaTreeInner) -> R) -> R {
+        let _guard = self.lock.lock();
+        self.sequence.write_begin();
+        let result = writer(unsafe { &mut *self.inner.get() });
+        self.sequence.write_end();
+        result
+    }
+
+    /// Returns the area containing `addr`, if any
+    pub(crate) fn find(&self, addr:usize) -> Option<Vma> {
+        self.read(|inner| inner.lookup(addr))
+    }
+
+    /// Returns the first area starting at or after `addr`
+    ///
+    /// Walks the tree under the writers lock, to iterate over all the areas.
+    pub(crate) fn next(&self, addr:usize) -> Option<Vma> {
+        let _guard = self.lock.lock();
+        unsafe { &*self.inner.get() }.neighbours(addr).1
+    }
+
+    /// Adds `vma` to the tree
+    ///
+    /// The area must be page aligned, inside the user space, and must not
+    /// overlap any other area.
+    pub(crate) fn insert(&self, vma:Vma) -> Result<(), VmaError> {
+        if vma.start >= vma.end || vma.start < USER_SPACE_START || vma.end > USER_SPACE_END
+        || vma.start != page_align_down(vma.start) || vma.end != page_align_down(vma.end) {
+            return Err(VmaError::Invalid);
+        }
+        self.write(|inner| Self::insert_locked(inner, vma))
+    }
+
+    /// Maps `size` Bytes at the lowest free address, returning the new area
+    pub(crate) fn insert_anywhere(&self, size:usize, flags:u32) -> Result<Vma, VmaError> {
+        let size = page_align_up(size);
+        if size == 0 {
+            return Err(VmaError::Invalid);
+        }
+        self.write(|inner| {
+            let start = inner.lookup_gap(size).ok_or(VmaError::Full)?;
+            let vma = Vma::new(start, start + size, flags);
+            Self::insert_locked(inner, vma).map(|_| vma)
+        })
+    }
+
+    /// Removes the area starting at `start`, returning it
+    pub(crate) fn remove(&self, start:usize) -> Result<Vma, VmaError> {
+        self.write(|inner| {
+            let mut removed = NIL;
+            inner.root = inner.remove_at(inner.root, start, &mut removed);
+            if removed == NIL {
+                return Err(VmaError::NotFound);
+            }
+            let vma = inner.nodes[removed as usize].vma;
+            inner.free_node(removed);
+            // the gap before the next area now extends to the previous one
+            if let (prev, Some(next)) = inner.neighbours(vma.start) {
+                let prev_end = prev.map_or(USER_SPACE_START, |prev| prev.end);
+                inner.set_gap(inner.root, next.start, next.start - prev_end);
+            }
+            Ok(vma)
+        })
+    }
+
+    fn insert_locked(inner:&mut VmaTreeInner, vma:Vma) -> Result<(), VmaError> {
+        let (prev, next) = inner.neighbours(vma.start);
+        let prev_end = prev.map_or(USER_SPACE_START, |prev| prev.end);
+        if prev_end > vma.start || next.map_or(false, |next| next.start < vma.end) {
+            return Err(VmaError::Overlap);
+        }
+        let idx = inner.alloc_node(vma).ok_or(VmaError::Full)?;
+        inner.nodes[idx as usize].gap = vma.start - prev_end;
+        inner.nodes[idx as usize].max_gap = vma.start - prev_end;
+        inner.root = inner.insert_at(inner.root, idx);
+        // the gap before the next area now ends at the new one
+        if let Some(next) = next {
+            inner.set_gap(inner.root, next.start, next.start - vma.end);
+        }
+        Ok(())
+    }
+}
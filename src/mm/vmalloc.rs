@@ -0,0 +1,136 @@
+use crate::cpu::*;
+use crate::mm::*;
+use crate::mm::frame::*;
+use crate::mm::paging::*;
+use crate::mm::profile::*;
+use crate::sync::*;
+
+use alloc::collections::BTreeMap;
+
+// the kernel virtual range of the areas, a whole PML4 entry shared by every address space
+pub(crate) const VMALLOC_START : usize = 0xFFFF_C000_0000_0000;
+pub(crate) const VMALLOC_END   : usize = 0xFFFF_C080_0000_0000;
+
+// every area is preceded by an unmapped page
+const GUARD_SIZE : usize = PAGE_SIZE;
+
+/// The virtual ranges in use and free inside the vmalloc range
+///
+/// Both maps are keyed by the first address, `areas` holds the size of
+/// the mapped part, without the guard page.
+struct VmallocSpace {
+    free  : BTreeMap<usize, usize>,
+    areas : BTreeMap<usize, usize>,
+}
+
+impl VmallocSpace {
+    /// Takes `size` Bytes from the first free range large enough
+    fn reserve(&mut self, size:usize) -> Option<usize> {
+        let (&start, &free) = self.free.iter().find(|(_, &free)| free >= size)?;
+        self.free.remove(&start);
+        if free > size {
+            self.free.insert(start + size, free - size);
+        }
+        Some(start)
+    }
+
+    /// Gives back the range of `size` Bytes at `start`, merging it with its neighbours
+    fn release(&mut self, mut start:usize, mut size:usize) {
+        if let Some((&next, &next_size)) = self.free.range(start + size..).next() {
+            if next == start + size {
+                self.free.remove(&next);
+                size += next_size;
+            }
+        }
+        if let Some((&prev, &prev_size)) = self.free.range(..start).next_back() {
+            if prev + prev_size == start {
+                self.free.remove(&prev);
+                start = prev;
+                size += prev_size;
+            }
+        }
+        self.free.insert(start, size);
+    }
+}
+
+#[allow(non_upper_case_globals)]
+static vmalloc_space : SpinLock<VmallocSpace> = SpinLock::new(VmallocSpace { free : BTreeMap::new(), areas : BTreeMap::new() });
+
+/// Removes the mappings of the `pages` pages at `addr`, freeing their frames
+fn unmap_pages(addr:usize, pages:usize) {
+    let table = PageTable::kernel();
+    for page in 0..pages {
+        let vaddr = addr + page * PAGE_SIZE;
+        if let Some(paddr) = table.unmap(vaddr) {
+            invlpg(vaddr);
+            free_frame(paddr);
+        }
+    }
+}
+
+/// Allocates `size` Bytes of kernel memory filled with zeroes, contiguous
+/// only virtually
+///
+/// The area is rounded up to whole pages, each backed by its own frame,
+/// and preceded by an unmapped guard page, so that running below its
+/// beginning faults instead of corrupting the previous area.
+pub(crate) fn vzalloc(size:usize) -> Option<usize> {
+    if size == 0 {
+        return None;
+    }
+    let size = page_align_up(size);
+    let start = vmalloc_space.lock().reserve(size + GUARD_SIZE)?;
+    let addr = start + GUARD_SIZE;
+    let table = PageTable::kernel();
+    for page in 0..size / PAGE_SIZE {
+        let mapped = match alloc_zeroed_frame() {
+            Some(paddr) => table.map(addr + page * PAGE_SIZE, paddr, PTE_WRITABLE | PTE_GLOBAL).map_err(|_| free_frame(paddr)).is_ok(),
+            None        => false,
+        };
+        if !mapped {
+            unmap_pages(addr, page);
+            vmalloc_space.lock().release(start, size + GUARD_SIZE);
+            return None;
+        }
+    }
+    vmalloc_space.lock().areas.insert(addr, size);
+    profile_alloc(AllocKind::Vmalloc, addr, size);
+    Some(addr)
+}
+
+/// Frees the area at `addr`, returned by `vzalloc()`
+pub(crate) fn vfree(addr:usize) {
+    let size = match vmalloc_space.lock().areas.remove(&addr) {
+        Some(size) => size,
+        None       => return,
+    };
+    profile_free(addr);
+    unmap_pages(addr, size / PAGE_SIZE);
+    vmalloc_space.lock().release(addr - GUARD_SIZE, size + GUARD_SIZE);
+}
+
+/// Returns the last level entry mapping `vaddr`, which must belong to an area
+pub(crate) fn vmalloc_pte(vaddr:usize) -> Option<&'static mut u64> {
+    PageTable::kernel().entry(vaddr)
+}
+
+/// Checks whether `addr` is inside the guard page of an area
+pub(crate) fn is_vmalloc_guard(addr:usize) -> bool {
+    if addr < VMALLOC_START || addr >= VMALLOC_END {
+        return false;
+    }
+    // the lock may be held by the thread that faulted
+    match vmalloc_space.try_lock() {
+        Some(space) => space.areas.range(addr + 1..).next().map_or(false, |(&area, _)| area - addr <= GUARD_SIZE),
+        None        => false,
+    }
+}
+
+/// Reserves the page tables of the vmalloc range in the kernel hierarchy
+///
+/// Must run before any address space is created.
+pub(crate) fn init() {
+    if populate_kernel_pml4(VMALLOC_START) {
+        vmalloc_space.lock().release(VMALLOC_START, VMALLOC_END - VMALLOC_START);
+    }
+}
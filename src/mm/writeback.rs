@@ -0,0 +1,207 @@
+use crate::mm::frame::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+
+use alloc::collections::VecDeque;
+use alloc::sync::Arc;
+use core::sync::atomic::{AtomicUsize, Ordering};
+
+// the share of memory which may be dirty before the flushers start, and
+// before the writers are stopped, in percents
+const DIRTY_BACKGROUND_RATIO : usize = 10;
+const DIRTY_RATIO            : usize = 20;
+
+// the pages a flusher writes from a file before moving to the next one
+const WRITEBACK_CHUNK : usize = 1024;
+
+// the most pages a writer waits for to be written, when about to be stopped
+const MAX_PAUSE_PAGES : usize = 64;
+
+// the dirty pages of all the devices
+#[allow(non_upper_case_globals)]
+static dirty_total : AtomicUsize = AtomicUsize::new(0);
+
+/// A file whose dirty pages a flusher can write back
+pub(crate) trait Writeback : Send + Sync {
+    /// Writes back up to `max` dirty pages, in file order, returning how
+    /// many went out
+    fn write_pages(&self, max:usize) -> KResult<usize>;
+
+    /// Returns the number of dirty pages
+    fn dirty_count(&self) -> usize;
+
+    /// Called when the file, found clean, leaves the list of the flusher
+    fn dequeued(&self);
+}
+
+/// Returns the number of dirty pages at which the flushers start, and the
+/// one at which the writers are stopped
+pub(crate) fn dirty_thresholds() -> (usize, usize) {
+    let total = managed_frame_count();
+    (total * DIRTY_BACKGROUND_RATIO / 100, total * DIRTY_RATIO / 100)
+}
+
+/// Returns the number of dirty pages, on all the devices
+pub(crate) fn global_dirty() -> usize {
+    dirty_total.load(Ordering::Relaxed)
+}
+
+/// The writeback state of a device
+///
+/// The page caches of the files stored on the device account their dirty
+/// pages here, and the files with dirty pages wait in a list, oldest
+/// first. The flusher thread of the device writes them back once dirty
+/// memory passes the background threshold: a large chunk per file, in
+/// file order, so that the device sees long sequential writes the block
+/// layer can merge, then the file goes back to the end of the list if
+/// still dirty.
+///
+/// Writers dirtying pages are throttled by `balance_dirty_pages()`.
+pub(crate) struct BackingDev {
+    dirty        : AtomicUsize,
+    written      : AtomicUsize,
+    files        : SpinLock<VecDeque<Arc<dyn Writeback>>>,
+    /// The passes of the flusher completed
+    rounds       : AtomicUsize,
+    /// Where the flusher waits for work
+    flusher      : WaitQueue,
+    /// Where the writers throttled wait for pages to be written
+    written_wait : WaitQueue,
+}
+
+impl BackingDev {
+    /// Creates the writeback state of a device, with its flusher thread
+    pub(crate) fn new() -> KResult<Arc<Self>> {
+        let backing = Arc::new(BackingDev {
+            dirty        : AtomicUsize::new(0),
+            written      : AtomicUsize::new(0),
+            files        : SpinLock::new(VecDeque::new()),
+            rounds       : AtomicUsize::new(0),
+            flusher      : WaitQueue::new(),
+            written_wait : WaitQueue::new(),
+        });
+        let arg = Arc::into_raw(backing.clone()) as usize;
+        if let Err(errno) = spawn(flusher_main, arg, None) {
+            unsafe {
+                drop(Arc::from_raw(arg as *const BackingDev));
+            }
+            return Err(errno);
+        }
+        Ok(backing)
+    }
+
+    /// Returns the number of dirty pages of the device
+    pub(crate) fn dirty_count(&self) -> usize {
+        self.dirty.load(Ordering::Relaxed)
+    }
+
+    /// Accounts `count` pages more becoming dirty
+    pub(crate) fn account_dirtied(&self, count:usize) {
+        self.dirty.fetch_add(count, Ordering::Relaxed);
+        dirty_total.fetch_add(count, Ordering::Relaxed);
+    }
+
+    /// Accounts `count` dirty pages becoming clean, either written or dropped
+    pub(crate) fn account_cleaned(&self, count:usize) {
+        self.dirty.fetch_sub(count, Ordering::Relaxed);
+        dirty_total.fetch_sub(count, Ordering::Relaxed);
+    }
+
+    /// Accounts `count` pages written, waking up the writers throttled
+    pub(crate) fn account_written(&self, count:usize) {
+        self.written.fetch_add(count, Ordering::Relaxed);
+        if self.written_wait.has_waiters() {
+            self.written_wait.wake_all();
+        }
+    }
+
+    /// Queues `file`, which got its first dirty page, for the flusher
+    pub(crate) fn queue_file(&self, file:Arc<dyn Writeback>) {
+        self.files.lock().push_back(file);
+    }
+
+    /// Checks whether the flusher has something to do
+    fn needs_flush(&self) -> bool {
+        self.dirty_count() > 0 && (global_dirty() > dirty_thresholds().0 || self.written_wait.has_waiters())
+    }
+
+    pub(crate) fn wakeup_flusher(&self) {
+        if self.flusher.has_waiters() {
+            self.flusher.wake_all();
+        }
+    }
+
+    /// Throttles a writer which has just dirtied pages of the device
+    ///
+    /// Below the halfway point between the background threshold and the
+    /// limit, writers run free, so that bursts are absorbed by memory.
+    /// Past it, the writer waits for the flusher to write a number of
+    /// pages growing with the dirty memory, up to `MAX_PAUSE_PAGES` at the
+    /// limit, so that writers slow down gradually rather than stopping at
+    /// once; over the limit it waits until back under it. A writer never
+    /// waits past a pass of the flusher which could not write enough.
+    pub(crate) fn balance_dirty_pages(&self) {
+        let (background, limit) = dirty_thresholds();
+        let freerun = (background + limit) / 2;
+        let dirty = global_dirty();
+        if dirty > background {
+            self.wakeup_flusher();
+        }
+        if dirty <= freerun || self.dirty_count() == 0 {
+            return;
+        }
+        let pages = if dirty >= limit {
+            usize::MAX
+        } else {
+            core::cmp::max(1, MAX_PAUSE_PAGES * (dirty - freerun) / core::cmp::max(limit - freerun, 1))
+        };
+        let start = self.written.load(Ordering::Relaxed);
+        let round = self.rounds.load(Ordering::Relaxed);
+        self.written_wait.wait_until(|| {
+            let dirty = global_dirty();
+            let done = self.written.load(Ordering::Relaxed).wrapping_sub(start) >= pages && dirty < limit;
+            done || dirty <= freerun || self.dirty_count() == 0 || self.rounds.load(Ordering::Relaxed) != round
+        });
+    }
+
+    /// Writes back the files queued, a chunk each, until the flusher has
+    /// nothing left to do or a whole round of the files wrote nothing
+    ///
+    /// The writers throttled get to run between the chunks.
+    fn flush(&self) {
+        let mut idle = 0;
+        while self.needs_flush() {
+            let file = match self.files.lock().pop_front() {
+                Some(file) => file,
+                None       => break,
+            };
+            let written = file.write_pages(WRITEBACK_CHUNK).unwrap_or(0);
+            if file.dirty_count() > 0 {
+                self.files.lock().push_back(file);
+            } else {
+                file.dequeued();
+            }
+            idle = if written == 0 { idle + 1 } else { 0 };
+            if idle > self.files.lock().len() {
+                break;
+            }
+            yield_now();
+        }
+        self.rounds.fetch_add(1, Ordering::Relaxed);
+        self.written_wait.wake_all();
+    }
+}
+
+/// Writes back the dirty pages of a device in the background
+fn flusher_main(arg:usize) {
+    let backing = unsafe { Arc::from_raw(arg as *const BackingDev) };
+    loop {
+        backing.flusher.wait_until(|| backing.needs_flush());
+        backing.flush();
+        // stuck with pages which cannot be written, until woken up again
+        if backing.needs_flush() {
+            backing.flusher.sleep();
+        }
+    }
+}
@@ -0,0 +1,220 @@
+use crate::mm::*;
+use crate::mm::frame::*;
+use crate::mm::lz4;
+use crate::mm::swap::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+
+use alloc::boxed::Box;
+use alloc::sync::Arc;
+use alloc::vec;
+use alloc::vec::Vec;
+use core::slice;
+use core::sync::atomic::{AtomicUsize, Ordering};
+
+// pages compressing worse than this are stored as they are
+const MAX_COMPRESSED_SIZE : usize = PAGE_SIZE * 3 / 4;
+
+// the priority of the compressed swap, above any disk
+pub(crate) const ZRAM_PRIORITY : i32 = 100;
+
+// the compressed swap device, once registered
+#[allow(non_upper_case_globals)]
+static zram_device : SpinLock<Option<Arc<Zram>>> = SpinLock::new(None);
+
+const WORDS_PER_PAGE : usize = PAGE_SIZE / 8;
+
+/// The content of a slot
+enum ZramSlot {
+    Free,
+    /// A page made of the same 64 bits value repeated, zero-filled pages included
+    Same(u64),
+    /// An LZ4 block
+    Compressed(Box<[u8]>),
+    /// A page that did not compress well enough
+    Raw(Box<[u8]>),
+}
+
+struct ZramTable {
+    slots  : Vec<ZramSlot>,
+    free   : Vec<u32>,
+    buffer : Box<[u8]>,
+    hash   : Box<lz4::HashTable>,
+}
+
+/// Counters describing the content of a compressed swap device
+pub(crate) struct ZramStats {
+    /// Slots in use
+    pub(crate) pages            : AtomicUsize,
+    /// Slots holding a same-filled page, which take no memory besides the slot
+    pub(crate) same_pages       : AtomicUsize,
+    /// Slots holding an uncompressed page
+    pub(crate) huge_pages       : AtomicUsize,
+    /// Memory taken by the compressed and uncompressed pages, in Bytes
+    pub(crate) compressed_bytes : AtomicUsize,
+}
+
+/// A swap device keeping the evicted pages compressed in memory
+///
+/// Same-filled pages are detected and stored as their repeated value,
+/// the others are compressed with LZ4 into buffers allocated from the
+/// kernel heap, so small ones share frames through the slab caches.
+/// Swapping in is a decompression, with no I/O involved.
+pub(crate) struct Zram {
+    table    : SpinLock<ZramTable>,
+    capacity : usize,
+    stats    : ZramStats,
+}
+
+/// Returns the words of the frame at `paddr`, through the direct map
+fn page_words(paddr:usize) -> &'static mut [u64] {
+    unsafe { slice::from_raw_parts_mut(phys_to_virt(paddr) as *mut u64, WORDS_PER_PAGE) }
+}
+
+/// Returns the bytes of the frame at `paddr`, through the direct map
+fn page_bytes(paddr:usize) -> &'static mut [u8] {
+    unsafe { slice::from_raw_parts_mut(phys_to_virt(paddr) as *mut u8, PAGE_SIZE) }
+}
+
+/// Copies `data` to the heap, failing instead of aborting when out of memory
+fn try_boxed(data:&[u8]) -> KResult<Box<[u8]>> {
+    let mut buffer = Vec::new();
+    buffer.try_reserve_exact(data.len()).map_err(|_| ENOMEM)?;
+    buffer.extend_from_slice(data);
+    Ok(buffer.into_boxed_slice())
+}
+
+impl Zram {
+    /// Creates a device able to hold up to `capacity` pages
+    pub(crate) fn new(capacity:usize) -> Self {
+        Zram {
+            table    : SpinLock::new(ZramTable {
+                slots  : Vec::new(),
+                free   : Vec::new(),
+                buffer : vec![0; MAX_COMPRESSED_SIZE].into_boxed_slice(),
+                hash   : Box::new([0; lz4::HASH_SIZE]),
+            }),
+            capacity,
+            stats    : ZramStats {
+                pages            : AtomicUsize::new(0),
+                same_pages       : AtomicUsize::new(0),
+                huge_pages       : AtomicUsize::new(0),
+                compressed_bytes : AtomicUsize::new(0),
+            },
+        }
+    }
+
+    /// Returns the counters of the device
+    pub(crate) fn stats(&self) -> &ZramStats {
+        &self.stats
+    }
+
+    /// Returns a free slot index, growing the table up to the capacity
+    fn alloc_slot(table:&mut ZramTable, capacity:usize) -> KResult<usize> {
+        if let Some(slot) = table.free.pop() {
+            return Ok(slot as usize);
+        }
+        if table.slots.len() == capacity {
+            return Err(ENOSPC);
+        }
+        table.slots.try_reserve(1).map_err(|_| ENOMEM)?;
+        table.free.try_reserve(table.slots.len() + 1).map_err(|_| ENOMEM)?;
+        table.slots.push(ZramSlot::Free);
+        Ok(table.slots.len() - 1)
+    }
+
+    /// Updates the counters for `content` leaving the device
+    fn account_release(&self, content:&ZramSlot) {
+        match content {
+            ZramSlot::Same(_)          => { self.stats.same_pages.fetch_sub(1, Ordering::Relaxed); },
+            ZramSlot::Compressed(data) => { self.stats.compressed_bytes.fetch_sub(data.len(), Ordering::Relaxed); },
+            ZramSlot::Raw(data)        => {
+                self.stats.compressed_bytes.fetch_sub(data.len(), Ordering::Relaxed);
+                self.stats.huge_pages.fetch_sub(1, Ordering::Relaxed);
+            },
+            ZramSlot::Free             => {},
+        }
+    }
+}
+
+impl SwapBackend for Zram {
+    fn store(&self, paddr:usize) -> KResult<usize> {
+        let words = page_words(paddr);
+        let content = if words.iter().all(|word| *word == words[0]) {
+            self.stats.same_pages.fetch_add(1, Ordering::Relaxed);
+            ZramSlot::Same(words[0])
+        } else {
+            let mut table = self.table.lock();
+            let ZramTable { buffer, hash, .. } = &mut *table;
+            match lz4::compress(page_bytes(paddr), buffer, hash) {
+                Some(size) => {
+                    let data = try_boxed(&buffer[..size])?;
+                    self.stats.compressed_bytes.fetch_add(size, Ordering::Relaxed);
+                    ZramSlot::Compressed(data)
+                },
+                None => {
+                    let data = try_boxed(page_bytes(paddr))?;
+                    self.stats.compressed_bytes.fetch_add(PAGE_SIZE, Ordering::Relaxed);
+                    self.stats.huge_pages.fetch_add(1, Ordering::Relaxed);
+                    ZramSlot::Raw(data)
+                },
+            }
+        };
+        let mut table = self.table.lock();
+        let slot = match Self::alloc_slot(&mut table, self.capacity) {
+            Ok(slot)   => slot,
+            Err(errno) => {
+                drop(table);
+                self.account_release(&content);
+                return Err(errno);
+            },
+        };
+        table.slots[slot] = content;
+        self.stats.pages.fetch_add(1, Ordering::Relaxed);
+        Ok(slot)
+    }
+
+    fn load(&self, slot:usize, paddr:usize) -> KResult<()> {
+        let table = self.table.lock();
+        match table.slots.get(slot) {
+            Some(ZramSlot::Same(value))      => page_words(paddr).fill(*value),
+            Some(ZramSlot::Compressed(data)) => {
+                if lz4::decompress(data, page_bytes(paddr)) != Some(PAGE_SIZE) {
+                    return Err(EIO);
+                }
+            },
+            Some(ZramSlot::Raw(data))        => page_bytes(paddr).copy_from_slice(data),
+            _                                => return Err(EIO),
+        }
+        Ok(())
+    }
+
+    fn release(&self, slot:usize) {
+        let mut table = self.table.lock();
+        let content = match table.slots.get_mut(slot) {
+            Some(content) => core::mem::replace(content, ZramSlot::Free),
+            None          => return,
+        };
+        if let ZramSlot::Free = content {
+            return;
+        }
+        // the room was reserved when the slot was created
+        table.free.push(slot as u32);
+        drop(table);
+        self.stats.pages.fetch_sub(1, Ordering::Relaxed);
+        self.account_release(&content);
+    }
+}
+
+/// Creates the compressed swap device, sized to half of the memory
+pub(crate) fn init() {
+    let device = Arc::new(Zram::new(managed_frame_count() / 2));
+    if register_swap(device.clone(), ZRAM_PRIORITY).is_ok() {
+        *zram_device.lock() = Some(device);
+    }
+}
+
+/// Returns the compressed swap device, if it was registered
+pub(crate) fn device() -> Option<Arc<Zram>> {
+    zram_device.lock().clone()
+}
@@ -0,0 +1,5 @@
+pub(crate) mod seqcount;
+pub(crate) mod spinlock;
+
+pub(crate) use seqcount::*;
+pub(crate) use spinlock::*;
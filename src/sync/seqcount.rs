@@ -0,0 +1,54 @@
+use core::sync::atomic::{fence, AtomicUsize, Ordering};
+
+/// A sequence counter for lockless readers
+///
+/// Writers (which must already be serialized by other means) make the
+/// counter odd while they modify the protected data, and even again when
+/// they are done. Readers never block: they sample the counter before and
+/// after reading, and retry if a write happened in between.
+///
+/// The layout is the one of a bare 64 bits counter, so that it can be shared
+/// with code outside the kernel.
+#[repr(transparent)]
+pub(crate) struct SeqCount {
+    sequence : AtomicUsize,
+}
+
+impl SeqCount {
+    /// Creates a `SeqCount` with no write in progress
+    pub(crate) const fn new() -> Self {
+        SeqCount {
+            sequence : AtomicUsize::new(0),
+        }
+    }
+
+    /// Starts a read section, returning the sequence to validate against
+    ///
+    /// Spins while a write is in progress.
+    pub(crate) fn read_begin(&self) -> usize {
+        loop {
+            let sequence = self.sequence.load(Ordering::Acquire);
+            if sequence & 1 == 0 {
+                return sequence;
+            }
+            core::hint::spin_loop();
+        }
+    }
+
+    /// Checks whether the data read since `read_begin()` may be inconsistent
+    pub(crate) fn read_retry(&self, sequence:usize) -> bool {
+        fence(Ordering::Acquire);
+        self.sequence.load(Ordering::Relaxed) != sequence
+    }
+
+    /// Marks the beginning of a write section
+    pub(crate) fn write_begin(&self) {
+        self.sequence.fetch_add(1, Ordering::Relaxed);
+        fence(Ordering::Release);
+    }
+
+    /// Marks the end of a write section
+    pub(crate) fn write_end(&self) {
+        self.sequence.fetch_add(1, Ordering::Release);
+    }
+}
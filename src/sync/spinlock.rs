@@ -0,0 +1,69 @@
+use core::cell::UnsafeCell;
+use core::ops::{Deref, DerefMut};
+use core::sync::atomic::{AtomicBool, Ordering};
+
+/// A busy-waiting mutual exclusion lock
+///
+/// The protected data can only be accessed through the `SpinLockGuard`
+/// returned by `lock()`, the lock is released when the guard is dropped.
+pub(crate) struct SpinLock<T> {
+    locked : AtomicBool,
+    data   : UnsafeCell<T>,
+}
+
+unsafe impl<T:Send> Send for SpinLock<T> {}
+
+unsafe impl<T:Send> Sync for SpinLock<T> {}
+
+impl<T> SpinLock<T> {
+    /// Creates an unlocked `SpinLock`
+    pub(crate) const fn new(data:T) -> Self {
+        SpinLock {
+            locked : AtomicBool::new(false),
+            data   : UnsafeCell::new(data),
+        }
+    }
+
+    /// Spins until the lock is acquired
+    pub(crate) fn lock(&self) -> SpinLockGuard<'_, T> {
+        while self.locked.compare_exchange_weak(false, true, Ordering::Acquire, Ordering::Relaxed).is_err() {
+            while self.locked.load(Ordering::Relaxed) {
+                core::hint::spin_loop();
+            }
+        }
+        SpinLockGuard { lock : self }
+    }
+
+    /// Acquires the lock only if it is currently free
+    pub(crate) fn try_lock(&self) -> Option<SpinLockGuard<'_, T>> {
+        match self.locked.compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed) {
+            Ok(_)  => Some(SpinLockGuard { lock : self }),
+            Err(_) => None,
+        }
+    }
+}
+
+/// Scoped access to the data protected by a `SpinLock`
+pub(crate) struct SpinLockGuard<'a, T> {
+    lock : &'a SpinLock<T>,
+}
+
+impl<T> Deref for SpinLockGuard<'_, T> {
+    type Target = T;
+
+    fn deref(&self) -> &T {
+        unsafe { &*self.lock.data.get() }
+    }
+}
+
+impl<T> DerefMut for SpinLockGuard<'_, T> {
+    fn deref_mut(&mut self) -> &mut T {
+        unsafe { &mut *self.lock.data.get() }
+    }
+}
+
+impl<T> Drop for SpinLockGuard<'_, T> {
+    fn drop(&mut self) {
+        self.lock.locked.store(false, Ordering::Release);
+    }
+}
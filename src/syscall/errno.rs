@@ -0,0 +1,36 @@
+/// Error numbers returned to user space, negated, by the system calls
+///
+/// The values are the ones of Linux, so that existing runtimes can
+/// interpret them.
+#[repr(i64)]
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub(crate) enum Errno {
+    EPERM        = 1,
+    ENOENT       = 2,
+    EIO          = 5,
+    EBADF        = 9,
+    EAGAIN       = 11,
+    ENOMEM       = 12,
+    EACCES       = 13,
+    EFAULT       = 14,
+    EBUSY        = 16,
+    EEXIST       = 17,
+    ENODEV       = 19,
+    ENOTDIR      = 20,
+    EISDIR       = 21,
+    EINVAL       = 22,
+    EMFILE       = 24,
+    EFBIG        = 27,
+    ENOSPC       = 28,
+    ESPIPE       = 29,
+    EPIPE        = 32,
+    ENAMETOOLONG = 36,
+    ENOSYS       = 38,
+    ETIME        = 62,
+    ECANCELED    = 125,
+}
+
+pub(crate) use Errno::*;
+
+/// The result of kernel operations which may fail with an `Errno`
+pub(crate) type KResult<T> = Result<T, Errno>;
@@ -0,0 +1,141 @@
+pub(crate) mod errno;
+
+use crate::cpu::*;
+use crate::fs::epoll::*;
+use crate::fs::file::*;
+use crate::fs::pipe::*;
+use crate::fs::vfs::*;
+use crate::io::uring::*;
+use crate::ipc::*;
+use crate::mm::mmap::*;
+use crate::mm::profile::*;
+use crate::task;
+use crate::time;
+use errno::*;
+
+// system call numbers, the same as Linux where an equivalent exists
+pub(crate) const SYS_READ           : u64 = 0;
+pub(crate) const SYS_WRITE          : u64 = 1;
+pub(crate) const SYS_OPEN           : u64 = 2;
+pub(crate) const SYS_CLOSE          : u64 = 3;
+pub(crate) const SYS_MMAP           : u64 = 9;
+pub(crate) const SYS_MUNMAP         : u64 = 11;
+pub(crate) const SYS_PIPE           : u64 = 22;
+pub(crate) const SYS_SCHED_YIELD    : u64 = 24;
+pub(crate) const SYS_GETPID         : u64 = 39;
+pub(crate) const SYS_EXIT           : u64 = 60;
+pub(crate) const SYS_FSYNC          : u64 = 74;
+pub(crate) const SYS_UNLINK         : u64 = 87;
+pub(crate) const SYS_ARCH_PRCTL     : u64 = 158;
+pub(crate) const SYS_SYNC           : u64 = 162;
+pub(crate) const SYS_GETTID         : u64 = 186;
+pub(crate) const SYS_FUTEX          : u64 = 202;
+pub(crate) const SYS_CLOCK_GETTIME  : u64 = 228;
+pub(crate) const SYS_EPOLL_WAIT     : u64 = 232;
+pub(crate) const SYS_EPOLL_CTL      : u64 = 233;
+pub(crate) const SYS_SPLICE         : u64 = 275;
+pub(crate) const SYS_VMSPLICE       : u64 = 278;
+pub(crate) const SYS_EPOLL_CREATE1  : u64 = 291;
+pub(crate) const SYS_PIPE2          : u64 = 293;
+pub(crate) const SYS_IO_URING_SETUP : u64 = 425;
+pub(crate) const SYS_IO_URING_ENTER : u64 = 426;
+
+// system calls specific to Rebel
+pub(crate) const SYS_IPC_ENDPOINT   : u64 = 500;
+pub(crate) const SYS_IPC_MINT       : u64 = 501;
+pub(crate) const SYS_IPC_CALL       : u64 = 502;
+pub(crate) const SYS_IPC_RECV       : u64 = 503;
+pub(crate) const SYS_IPC_REPLY_WAIT : u64 = 504;
+pub(crate) const SYS_CHANNEL_OPEN   : u64 = 505;
+pub(crate) const SYS_ALLOC_PROFILE  : u64 = 506;
+
+// segment selectors loaded by SYSCALL (kernel code, +8 kernel data) and
+// SYSRET (+8 user data, +16 user code), see the GDT in 'kernel.asm'
+const STAR_KERNEL_BASE : u64 = 0x08;
+const STAR_USER_BASE   : u64 = 0x10;
+
+/// The user registers saved by `syscall_entry` (see 'kernel.asm')
+#[repr(C)]
+pub(crate) struct SyscallFrame {
+    pub(crate) r9     : u64,
+    pub(crate) r8     : u64,
+    pub(crate) r10    : u64,
+    pub(crate) rdx    : u64,
+    pub(crate) rsi    : u64,
+    pub(crate) rdi    : u64,
+    pub(crate) number : u64,
+    pub(crate) rip    : u64,
+    pub(crate) rflags : u64,
+    pub(crate) rsp    : u64,
+}
+
+extern "C" {
+    fn syscall_entry();
+}
+
+/// Enables the SYSCALL instruction
+pub(crate) fn init() {
+    write_msr(MSR_EFER, read_msr(MSR_EFER) | EFER_SCE);
+    write_msr(MSR_STAR, (STAR_USER_BASE << 48) | (STAR_KERNEL_BASE << 32));
+    write_msr(MSR_LSTAR, syscall_entry as u64);
+    // interrupts stay disabled until the kernel stack is in place, the
+    // direction and alignment check flags must be clear in kernel mode
+    write_msr(MSR_SFMASK, RFLAGS_IF | RFLAGS_DF | RFLAGS_AC);
+}
+
+/// Runs the system call described by `frame`, called by `syscall_entry`
+///
+/// Errors are returned as negated error numbers.
+#[no_mangle]
+extern "C" fn syscall_handler(frame:&mut SyscallFrame) -> i64 {
+    match dispatch(frame) {
+        Ok(result) => result as i64,
+        Err(errno) => -(errno as i64),
+    }
+}
+
+/// Calls the implementation of the system call
+///
+/// Most of them only see their arguments, the IPC ones also exchange
+/// messages through the other registers of the frame.
+fn dispatch(frame:&mut SyscallFrame) -> KResult<usize> {
+    let args = [frame.rdi, frame.rsi, frame.rdx, frame.r10, frame.r8, frame.r9].map(|arg| arg as usize);
+    match frame.number {
+        SYS_READ           => sys_read(args[0], args[1], args[2]),
+        SYS_WRITE          => sys_write(args[0], args[1], args[2]),
+        SYS_OPEN           => sys_open(args[0], args[1] as u32, args[2] as u32),
+        SYS_CLOSE          => sys_close(args[0]),
+        SYS_MMAP           => sys_mmap(args[0], args[1], args[2], args[3], args[4], args[5]),
+        SYS_MUNMAP         => sys_munmap(args[0], args[1]),
+        SYS_PIPE           => sys_pipe2(args[0], 0),
+        SYS_SCHED_YIELD    => {
+            task::yield_now();
+            Ok(0)
+        },
+        SYS_GETPID         => task::sys_getpid(),
+        SYS_EXIT           => task::exit(),
+        SYS_FSYNC          => sys_fsync(args[0]),
+        SYS_UNLINK         => sys_unlink(args[0]),
+        SYS_ARCH_PRCTL     => task::sys_arch_prctl(args[0], args[1]),
+        SYS_SYNC           => sys_sync(),
+        SYS_GETTID         => task::sys_gettid(),
+        SYS_FUTEX          => sys_futex(args[0], args[1], args[2] as u32, args[3]),
+        SYS_CLOCK_GETTIME  => time::sys_clock_gettime(args[0], args[1]),
+        SYS_EPOLL_WAIT     => sys_epoll_wait(args[0], args[1], args[2], args[3] as i32),
+        SYS_EPOLL_CTL      => sys_epoll_ctl(args[0], args[1], args[2], args[3]),
+        SYS_SPLICE         => sys_splice(args[0], args[1], args[2], args[3], args[4], args[5] as u32),
+        SYS_VMSPLICE       => sys_vmsplice(args[0], args[1], args[2], args[3] as u32),
+        SYS_EPOLL_CREATE1  => sys_epoll_create1(args[0] as u32),
+        SYS_PIPE2          => sys_pipe2(args[0], args[1] as u32),
+        SYS_IO_URING_SETUP => sys_io_uring_setup(args[0] as u32, args[1]),
+        SYS_IO_URING_ENTER => sys_io_uring_enter(args[0], args[1] as u32, args[2] as u32, args[3] as u32),
+        SYS_IPC_ENDPOINT   => sys_ipc_endpoint(),
+        SYS_IPC_MINT       => sys_ipc_mint(args[0], args[1] as u64, args[2] as u32),
+        SYS_IPC_CALL       => sys_ipc_call(frame),
+        SYS_IPC_RECV       => sys_ipc_recv(frame),
+        SYS_IPC_REPLY_WAIT => sys_ipc_reply_wait(frame),
+        SYS_CHANNEL_OPEN   => sys_channel_open(args[0] as u64, args[1]),
+        SYS_ALLOC_PROFILE  => sys_alloc_profile(args[0], args[1]),
+        _                  => Err(ENOSYS),
+    }
+}
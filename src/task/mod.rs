@@ -0,0 +1,11 @@
+pub(crate) mod process;
+pub(crate) mod sched;
+pub(crate) mod stack;
+pub(crate) mod thread;
+pub(crate) mod wait;
+
+pub(crate) use process::*;
+pub(crate) use sched::*;
+pub(crate) use stack::*;
+pub(crate) use thread::*;
+pub(crate) use wait::*;
@@ -0,0 +1,47 @@
+use crate::fs::console::*;
+use crate::fs::file::*;
+use crate::ipc::*;
+use crate::mm::space::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+
+use alloc::sync::Arc;
+use core::sync::atomic::{AtomicUsize, Ordering};
+
+#[allow(non_upper_case_globals)]
+static next_pid : AtomicUsize = AtomicUsize::new(1);
+
+/// A user program: an address space, the files it opened and the IPC
+/// endpoints it can reach, shared by its threads
+pub(crate) struct Process {
+    pub(crate) pid   : usize,
+    pub(crate) space : AddressSpace,
+    pub(crate) files : SpinLock<FileTable>,
+    pub(crate) caps  : SpinLock<CapTable>,
+}
+
+impl Process {
+    /// Creates a process with an empty address space and no capabilities,
+    /// whose standard input, output and error are the console
+    // only the benchmarks start programs so far
+    #[cfg_attr(not(feature = "bench"), allow(dead_code))]
+    pub(crate) fn new() -> KResult<Arc<Process>> {
+        let mut files = FileTable::new();
+        let console = File::new(Arc::new(Console), O_RDWR);
+        for _ in 0..3 {
+            files.install(console.clone())?;
+        }
+        Ok(Arc::new(Process {
+            pid   : next_pid.fetch_add(1, Ordering::Relaxed),
+            space : AddressSpace::new().ok_or(ENOMEM)?,
+            files : SpinLock::new(files),
+            caps  : SpinLock::new(CapTable::new()),
+        }))
+    }
+}
+
+/// Returns the identifier of the current process
+pub(crate) fn sys_getpid() -> KResult<usize> {
+    current_process().map(|process| process.pid).ok_or(EINVAL)
+}
@@ -0,0 +1,161 @@
+use crate::cpu::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+use crate::time;
+
+use alloc::boxed::Box;
+use alloc::sync::Arc;
+
+// the maximum number of threads alive at the same time
+pub(crate) const MAX_THREADS : usize = 64;
+
+// the boot code becomes the idle thread (see 'kernel.asm')
+const BOOT_STACK_TOP : usize = 0xFFFF800007400000;
+const IDLE_THREAD    : usize = 0;
+
+#[allow(non_upper_case_globals)]
+static mut thread_table : [Option<Box<Thread>>; MAX_THREADS] = [const { None }; MAX_THREADS];
+
+#[allow(non_upper_case_globals)]
+static run_queue : SpinLock<ThreadQueue> = SpinLock::new(ThreadQueue::new());
+
+#[allow(non_upper_case_globals)]
+static mut current : usize = IDLE_THREAD;
+
+// a thread that exited, whose stack can be released once it is not in use anymore
+#[allow(non_upper_case_globals)]
+static mut zombie : usize = NO_THREAD;
+
+/// Returns the thread `id`
+///
+/// The thread must exist.
+pub(crate) fn thread(id:usize) -> &'static mut Thread {
+    unsafe { thread_table[id].as_deref_mut().unwrap() }
+}
+
+/// Returns the identifier of the running thread
+pub(crate) fn current_thread_id() -> usize {
+    unsafe { current }
+}
+
+/// Returns the running thread
+pub(crate) fn current_thread() -> &'static mut Thread {
+    thread(current_thread_id())
+}
+
+/// Returns the process of the running thread, if it belongs to one
+pub(crate) fn current_process() -> Option<Arc<Process>> {
+    current_thread().process.clone()
+}
+
+/// Turns the boot code into the idle thread and prepares the stacks of the next ones
+pub(crate) fn init() {
+    unsafe {
+        thread_table[IDLE_THREAD] = Some(Box::new(Thread::boot(BOOT_STACK_TOP)));
+    }
+    set_kernel_stack(BOOT_STACK_TOP);
+    fill_stack_cache();
+}
+
+/// Creates a runnable thread executing `entry(arg)`
+pub(crate) fn spawn(entry:fn(usize), arg:usize, process:Option<Arc<Process>>) -> KResult<usize> {
+    let id = unsafe {
+        (0..MAX_THREADS).find(|&id| thread_table[id].is_none()).ok_or(EAGAIN)?
+    };
+    let new = Box::new(Thread::new(id, entry, arg, process)?);
+    unsafe {
+        thread_table[id] = Some(new);
+    }
+    run_queue.lock().push(id);
+    Ok(id)
+}
+
+/// Switches to the next runnable thread
+///
+/// The current thread is queued again if still runnable. Threads are
+/// never preempted, they run until they yield, block or exit.
+fn schedule() {
+    time::tick();
+    let prev = current_thread_id();
+    if thread(prev).state == ThreadState::Runnable {
+        run_queue.lock().push(prev);
+    }
+    let next = match run_queue.lock().pop() {
+        Some(next) => next,
+        None       => IDLE_THREAD,
+    };
+    switch_to(next);
+}
+
+/// Hands the processor over to the thread `next`, bypassing the run queue
+///
+/// `next` must be runnable and not queued, the current thread must have
+/// been queued or blocked by the caller. This is the path of a direct
+/// handoff between two threads, with no scheduling decision in between.
+pub(crate) fn switch_to(next:usize) {
+    unsafe {
+        let prev = current;
+        if next == prev {
+            return;
+        }
+
+        let next_thread = thread(next);
+        if let Some(process) = &next_thread.process {
+            if !process.space.is_active() {
+                process.space.activate();
+            }
+        }
+        set_kernel_stack(next_thread.stack_top());
+        switch_tls(thread(prev), next_thread);
+
+        current = next;
+        let save = &mut thread(prev).context as *mut usize;
+        switch_context(save, next_thread.context);
+    }
+    finish_switch();
+}
+
+/// Completes a switch on the side of the thread that was resumed
+pub(crate) fn finish_switch() {
+    unsafe {
+        if zombie != NO_THREAD {
+            let dead = thread_table[zombie].take().unwrap();
+            free_stack(dead.stack_base);
+            zombie = NO_THREAD;
+        }
+    }
+}
+
+/// Lets other runnable threads execute
+pub(crate) fn yield_now() {
+    schedule();
+}
+
+/// Suspends the current thread until `wake()` is called on it
+pub(crate) fn block() {
+    current_thread().state = ThreadState::Blocked;
+    schedule();
+}
+
+/// Makes the blocked thread `id` runnable again
+pub(crate) fn wake(id:usize) {
+    let thread = thread(id);
+    if thread.state == ThreadState::Blocked {
+        thread.state = ThreadState::Runnable;
+        run_queue.lock().push(id);
+    }
+}
+
+/// Terminates the current thread
+pub(crate) fn exit() -> ! {
+    // the stack is still in use until the next thread runs
+    finish_switch();
+    unsafe {
+        zombie = current;
+    }
+    current_thread().state = ThreadState::Exited;
+    current_thread().process = None;
+    schedule();
+    unreachable!();
+}
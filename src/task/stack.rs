@@ -0,0 +1,193 @@
+use crate::cpu::*;
+use crate::mm::*;
+use crate::mm::paging::*;
+use crate::mm::vmalloc::*;
+use crate::sync::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+use crate::tty::*;
+
+use core::ptr;
+
+// the number of free stacks kept mapped by each processor, and the
+// number mapped in advance at boot
+const STACK_CACHE_SIZE    : usize = 16;
+const STACK_CACHE_PREFILL : usize = 4;
+
+/// Usage statistics of the kernel stacks
+#[derive(Clone, Copy)]
+pub(crate) struct StackStats {
+    /// Stacks in use by threads
+    pub(crate) in_use       : usize,
+    /// Stacks mapped and waiting in a cache
+    pub(crate) cached       : usize,
+    /// Stacks handed out from a cache rather than mapped anew
+    pub(crate) recycled     : usize,
+    /// Stacks mapped since boot
+    pub(crate) mapped       : usize,
+    /// The most stacks in use at the same time
+    pub(crate) peak_in_use  : usize,
+    /// The deepest use of a stack seen so far, in Bytes
+    pub(crate) peak_depth   : usize,
+    /// The number of threads whose stack reached each page, the first
+    /// entry counting the ones which stayed within the topmost page
+    pub(crate) depth_pages  : [usize; KERNEL_STACK_PAGES],
+}
+
+/// The free stacks of a processor, all filled with zeroes
+struct StackCache {
+    stacks : [usize; STACK_CACHE_SIZE],
+    count  : usize,
+}
+
+#[allow(non_upper_case_globals)]
+static stack_caches : [SpinLock<StackCache>; MAX_CPUS] = [const { SpinLock::new(StackCache { stacks : [0; STACK_CACHE_SIZE], count : 0 }) }; MAX_CPUS];
+
+#[allow(non_upper_case_globals)]
+static stack_usage : SpinLock<StackStats> = SpinLock::new(StackStats {
+    in_use      : 0,
+    cached      : 0,
+    recycled    : 0,
+    mapped      : 0,
+    peak_in_use : 0,
+    peak_depth  : 0,
+    depth_pages : [0; KERNEL_STACK_PAGES],
+});
+
+/// Returns the base of a kernel stack filled with zeroes
+///
+/// Stacks come from the cache of the processor when available, else they
+/// are mapped in the vmalloc range, below a guard page which turns an
+/// overflow into a fault.
+pub(crate) fn alloc_stack() -> KResult<usize> {
+    let cached = {
+        let mut cache = stack_caches[current_id()].lock();
+        if cache.count > 0 {
+            cache.count -= 1;
+            Some(cache.stacks[cache.count])
+        } else {
+            None
+        }
+    };
+    let base = match cached {
+        Some(base) => base,
+        None       => vzalloc(KERNEL_STACK_SIZE).ok_or(ENOMEM)?,
+    };
+    let mut stats = stack_usage.lock();
+    if cached.is_some() {
+        stats.cached -= 1;
+        stats.recycled += 1;
+    } else {
+        stats.mapped += 1;
+    }
+    stats.in_use += 1;
+    stats.peak_in_use = core::cmp::max(stats.peak_in_use, stats.in_use);
+    Ok(base)
+}
+
+/// Zeroes the part of the stack at `base` written since it was last
+/// cleared, returning how deep it was used, in Bytes
+///
+/// The dirty bits of the stack pages tell which pages were written, and
+/// since the stack starts zeroed, the first word not null in the lowest
+/// of them marks the deepest point reached. Only the dirty pages are
+/// cleared, from that point up, then their dirty bits are reset for the
+/// next user of the stack.
+fn clear_stack(base:usize) -> usize {
+    let mut depth = 0;
+    for page in 0..KERNEL_STACK_PAGES {
+        let vaddr = base + page * PAGE_SIZE;
+        let entry = match vmalloc_pte(vaddr) {
+            Some(entry) if *entry & PTE_DIRTY != 0 => entry,
+            _                                      => continue,
+        };
+        let words = unsafe { core::slice::from_raw_parts_mut(vaddr as *mut u64, PAGE_SIZE / 8) };
+        let start = if depth == 0 {
+            match words.iter().position(|&word| word != 0) {
+                Some(first) => {
+                    depth = base + KERNEL_STACK_SIZE - (vaddr + first * 8);
+                    first
+                },
+                None => 0,
+            }
+        } else {
+            0
+        };
+        unsafe {
+            ptr::write_bytes(words[start..].as_mut_ptr(), 0, words.len() - start);
+        }
+        *entry &= !PTE_DIRTY;
+        invlpg(vaddr);
+    }
+    depth
+}
+
+/// Releases the kernel stack at `base`, which must not be in use anymore
+///
+/// The stack is kept mapped in the cache of the processor unless full.
+pub(crate) fn free_stack(base:usize) {
+    let depth = clear_stack(base);
+    let cached = {
+        let mut cache = stack_caches[current_id()].lock();
+        if cache.count < STACK_CACHE_SIZE {
+            let count = cache.count;
+            cache.stacks[count] = base;
+            cache.count += 1;
+            true
+        } else {
+            false
+        }
+    };
+    if !cached {
+        vfree(base);
+    }
+    let mut stats = stack_usage.lock();
+    stats.in_use -= 1;
+    if cached {
+        stats.cached += 1;
+    }
+    stats.peak_depth = core::cmp::max(stats.peak_depth, depth);
+    if depth > 0 {
+        stats.depth_pages[(depth - 1) / PAGE_SIZE] += 1;
+    }
+}
+
+/// Maps a few stacks in advance in the cache of the processor, so that
+/// the first threads are spawned without going through vmalloc
+pub(crate) fn fill_stack_cache() {
+    let mut cache = stack_caches[current_id()].lock();
+    while cache.count < STACK_CACHE_PREFILL {
+        let base = match vzalloc(KERNEL_STACK_SIZE) {
+            Some(base) => base,
+            None       => break,
+        };
+        let count = cache.count;
+        cache.stacks[count] = base;
+        cache.count += 1;
+        let mut stats = stack_usage.lock();
+        stats.mapped += 1;
+        stats.cached += 1;
+    }
+}
+
+/// Returns the usage statistics of the kernel stacks
+pub(crate) fn stack_stats() -> StackStats {
+    *stack_usage.lock()
+}
+
+/// Dumps the usage statistics of the kernel stacks over the serial port
+pub(crate) fn dump_stack_stats() {
+    let stats = stack_stats();
+    serial_print_fmt(format_args!("kernel stacks: {} in use, {} cached, {} recycled, {} mapped, {} peak in use\n",
+        stats.in_use, stats.cached, stats.recycled, stats.mapped, stats.peak_in_use));
+    serial_print_fmt(format_args!("deepest use: {} Bytes\n", stats.peak_depth));
+    for (page, threads) in stats.depth_pages.iter().enumerate() {
+        serial_print_fmt(format_args!("  page {}: {} threads\n", page, threads));
+    }
+}
+
+/// Checks whether the fault address `addr` is the guard page of a kernel
+/// stack, which means that its thread overflowed it
+pub(crate) fn is_stack_overflow(addr:usize) -> bool {
+    is_vmalloc_guard(addr)
+}
@@ -0,0 +1,170 @@
+use crate::block::*;
+use crate::cpu::*;
+use crate::ipc::*;
+use crate::mm::*;
+use crate::mm::uaccess::*;
+use crate::syscall::errno::*;
+use crate::task::*;
+
+use alloc::sync::Arc;
+
+// every thread owns a 16 KiB kernel stack (see 'stack.rs')
+pub(crate) const KERNEL_STACK_PAGES : usize = 4;
+pub(crate) const KERNEL_STACK_SIZE  : usize = PAGE_SIZE * KERNEL_STACK_PAGES;
+
+// null link between threads
+pub(crate) const NO_THREAD : usize = usize::MAX;
+
+// arch_prctl codes
+pub(crate) const ARCH_SET_GS : usize = 0x1001;
+pub(crate) const ARCH_SET_FS : usize = 0x1002;
+pub(crate) const ARCH_GET_FS : usize = 0x1003;
+pub(crate) const ARCH_GET_GS : usize = 0x1004;
+
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub(crate) enum ThreadState {
+    Runnable,
+    Blocked,
+    Exited,
+}
+
+/// A kernel scheduled entity
+///
+/// Threads belonging to a process run with its address space, the others
+/// run on whatever address space was active before them. `context` holds
+/// the saved stack pointer while the thread is not running, the registers
+/// themselves are saved on the stack by `switch_context`. The user FS and
+/// GS bases are only meaningful for threads belonging to a process.
+pub(crate) struct Thread {
+    pub(crate) id          : usize,
+    pub(crate) state       : ThreadState,
+    pub(crate) process     : Option<Arc<Process>>,
+    pub(crate) context     : usize,
+    pub(crate) stack_base  : usize,
+    pub(crate) next        : usize,
+    pub(crate) fs_base     : u64,
+    pub(crate) gs_base     : u64,
+    pub(crate) ipc         : IpcState,
+    pub(crate) plug        : BlockPlug,
+}
+
+extern "C" {
+    // see 'kernel.asm'
+    pub(crate) fn switch_context(save:*mut usize, load:usize);
+    fn thread_start();
+    #[cfg_attr(not(feature = "bench"), allow(dead_code))]
+    pub(crate) fn enter_user(rip:usize, rsp:usize) -> !;
+}
+
+impl Thread {
+    /// Creates a thread which will run `entry(arg)` on a new kernel stack
+    pub(crate) fn new(id:usize, entry:fn(usize), arg:usize, process:Option<Arc<Process>>) -> KResult<Self> {
+        let stack_base = alloc_stack()?;
+        // the stack layout expected by switch_context: the callee-saved
+        // registers, then the return address
+        let frame = [0, 0, arg, entry as usize, 0, 0, thread_start as usize];
+        let context = stack_base + KERNEL_STACK_SIZE - frame.len() * 8;
+        unsafe {
+            core::ptr::copy_nonoverlapping(frame.as_ptr(), context as *mut usize, frame.len());
+        }
+        Ok(Thread {
+            id,
+            state   : ThreadState::Runnable,
+            process,
+            context,
+            stack_base,
+            next    : NO_THREAD,
+            fs_base : 0,
+            gs_base : 0,
+            ipc     : IpcState::new(),
+            plug    : BlockPlug::new(),
+        })
+    }
+
+    /// Wraps the code that is already running on the boot stack
+    pub(crate) const fn boot(stack_top:usize) -> Self {
+        Thread {
+            id         : 0,
+            state      : ThreadState::Runnable,
+            process    : None,
+            context    : 0,
+            stack_base : stack_top - KERNEL_STACK_SIZE,
+            next       : NO_THREAD,
+            fs_base    : 0,
+            gs_base    : 0,
+            ipc        : IpcState::new(),
+            plug       : BlockPlug::new(),
+        }
+    }
+
+    /// Returns the address right above the kernel stack
+    pub(crate) fn stack_top(&self) -> usize {
+        self.stack_base + KERNEL_STACK_SIZE
+    }
+}
+
+/// Saves the user FS and GS bases of `prev` and loads the ones of `next`
+///
+/// User mode can change the bases by itself once FSGSBASE is enabled, so
+/// they are read back on every switch away from a user thread. They are
+/// only written when the incoming values differ from the live ones, and
+/// left in place for kernel threads, which never use them.
+pub(crate) fn switch_tls(prev:&mut Thread, next:&Thread) {
+    let fs_base = read_fs_base();
+    let gs_base = read_user_gs_base();
+    if prev.process.is_some() {
+        prev.fs_base = fs_base;
+        prev.gs_base = gs_base;
+    }
+    if next.process.is_some() {
+        if next.fs_base != fs_base {
+            write_fs_base(next.fs_base);
+        }
+        if next.gs_base != gs_base {
+            write_user_gs_base(next.gs_base);
+        }
+    }
+}
+
+/// Sets or returns the user FS or GS base of the current thread
+///
+/// The GET codes store the base at `addr`, the SET ones take `addr` as
+/// the new base, which must be a user address.
+pub(crate) fn sys_arch_prctl(code:usize, addr:usize) -> KResult<usize> {
+    let thread = current_thread();
+    if thread.process.is_none() {
+        return Err(EINVAL);
+    }
+    match code {
+        ARCH_SET_FS | ARCH_SET_GS => {
+            if addr >= USER_SPACE_END {
+                return Err(EPERM);
+            }
+            if code == ARCH_SET_FS {
+                thread.fs_base = addr as u64;
+                write_fs_base(thread.fs_base);
+            } else {
+                thread.gs_base = addr as u64;
+                write_user_gs_base(thread.gs_base);
+            }
+        },
+        ARCH_GET_FS => write_user(addr, &read_fs_base())?,
+        ARCH_GET_GS => write_user(addr, &read_user_gs_base())?,
+        _           => return Err(EINVAL),
+    }
+    Ok(0)
+}
+
+/// Returns the identifier of the current thread
+pub(crate) fn sys_gettid() -> KResult<usize> {
+    Ok(current_thread().id)
+}
+
+/// Runs the entry point of a new thread, called by `thread_start`
+#[no_mangle]
+extern "C" fn thread_main(entry:usize, arg:usize) -> ! {
+    finish_switch();
+    let entry : fn(usize) = unsafe { core::mem::transmute(entry) };
+    entry(arg);
+    exit();
+}
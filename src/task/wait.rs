@@ -0,0 +1,132 @@
+use crate::sync::*;
+use crate::task::*;
+
+use alloc::sync::Arc;
+use alloc::vec::Vec;
+
+/// A FIFO of threads, linked through their `next` field
+///
+/// A thread is in at most one queue at a time: the run queue while it is
+/// runnable, or the wait queue it sleeps on.
+pub(crate) struct ThreadQueue {
+    head : usize,
+    tail : usize,
+}
+
+impl ThreadQueue {
+    pub(crate) const fn new() -> Self {
+        ThreadQueue {
+            head : NO_THREAD,
+            tail : NO_THREAD,
+        }
+    }
+
+    pub(crate) fn is_empty(&self) -> bool {
+        self.head == NO_THREAD
+    }
+
+    /// Appends the thread `id` to the queue
+    pub(crate) fn push(&mut self, id:usize) {
+        thread(id).next = NO_THREAD;
+        if self.tail == NO_THREAD {
+            self.head = id;
+        } else {
+            thread(self.tail).next = id;
+        }
+        self.tail = id;
+    }
+
+    /// Removes the first thread from the queue
+    pub(crate) fn pop(&mut self) -> Option<usize> {
+        if self.head == NO_THREAD {
+            return None;
+        }
+        let id = self.head;
+        self.head = thread(id).next;
+        if self.head == NO_THREAD {
+            self.tail = NO_THREAD;
+        }
+        thread(id).next = NO_THREAD;
+        Some(id)
+    }
+}
+
+/// A function run by `WaitQueue::notify()` in the context of the waker
+///
+/// Callbacks let an object follow the events of another one without a
+/// thread sleeping on it. They must not touch the queue they belong to.
+pub(crate) trait WakeCallback : Send + Sync {
+    fn wake(self:Arc<Self>, events:u32);
+}
+
+/// A queue of threads waiting for an event
+pub(crate) struct WaitQueue {
+    queue     : SpinLock<ThreadQueue>,
+    callbacks : SpinLock<Vec<Arc<dyn WakeCallback>>>,
+}
+
+impl WaitQueue {
+    pub(crate) const fn new() -> Self {
+        WaitQueue {
+            queue     : SpinLock::new(ThreadQueue::new()),
+            callbacks : SpinLock::new(Vec::new()),
+        }
+    }
+
+    /// Registers `callback` to be run on every notification
+    pub(crate) fn add_callback(&self, callback:Arc<dyn WakeCallback>) {
+        self.callbacks.lock().push(callback);
+    }
+
+    /// Unregisters `callback`
+    pub(crate) fn remove_callback(&self, callback:&Arc<dyn WakeCallback>) {
+        self.callbacks.lock().retain(|other| !Arc::ptr_eq(other, callback));
+    }
+
+    /// Reports `events` to the registered callbacks and wakes up all the
+    /// waiting threads
+    pub(crate) fn notify(&self, events:u32) {
+        for callback in self.callbacks.lock().iter() {
+            callback.clone().wake(events);
+        }
+        self.wake_all();
+    }
+
+    /// Blocks the current thread until it is woken up
+    pub(crate) fn sleep(&self) {
+        let id = current_thread_id();
+        self.queue.lock().push(id);
+        block();
+    }
+
+    /// Blocks the current thread until `condition` holds
+    ///
+    /// The condition is checked again after every wake up.
+    pub(crate) fn wait_until(&self, condition:impl Fn() -> bool) {
+        while !condition() {
+            self.sleep();
+        }
+    }
+
+    /// Wakes up the first waiting thread, if any
+    pub(crate) fn wake_one(&self) -> bool {
+        let id = self.queue.lock().pop();
+        match id {
+            Some(id) => {
+                wake(id);
+                true
+            },
+            None => false,
+        }
+    }
+
+    /// Wakes up all the waiting threads
+    pub(crate) fn wake_all(&self) {
+        while self.wake_one() {}
+    }
+
+    /// Checks whether some thread is waiting
+    pub(crate) fn has_waiters(&self) -> bool {
+        !self.queue.lock().is_empty()
+    }
+}
@@ -0,0 +1,164 @@
+pub(crate) mod rtc;
+pub(crate) mod vdso;
+
+use crate::cpu::*;
+use crate::mm::uaccess::*;
+use crate::syscall::errno::*;
+
+pub(crate) const NSEC_PER_SEC : u64 = 1_000_000_000;
+
+// clocks, the same values as Linux
+pub(crate) const CLOCK_REALTIME  : usize = 0;
+pub(crate) const CLOCK_MONOTONIC : usize = 1;
+
+// the conversion from TSC ticks to nanoseconds is a fixed point multiplication
+pub(crate) const TSC_SHIFT : u32 = 32;
+
+// how old the base of the clock gets before being moved forward
+const REBASE_INTERVAL_NS : u64 = NSEC_PER_SEC;
+
+// PIT channel 2 is used as reference to measure the TSC frequency
+const PIT_FREQUENCY   : u64 = 1_193_182;
+const PIT_CHANNEL_2   : u16 = 0x42;
+const PIT_COMMAND     : u16 = 0x43;
+const PIT_GATE        : u16 = 0x61;
+const CALIBRATION_MS  : u64 = 10;
+
+/// A time value as exchanged with user space
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub(crate) struct Timespec {
+    pub(crate) sec  : i64,
+    pub(crate) nsec : i64,
+}
+
+impl Timespec {
+    /// Returns the value in nanoseconds, if valid
+    pub(crate) fn to_ns(&self) -> Option<u64> {
+        if self.sec < 0 || self.nsec < 0 || self.nsec >= NSEC_PER_SEC as i64 {
+            return None;
+        }
+        (self.sec as u64).checked_mul(NSEC_PER_SEC)?.checked_add(self.nsec as u64)
+    }
+}
+
+/// The parameters to convert TSC values into nanoseconds
+///
+/// `ns = base_ns + ((tsc - tsc_base) * mult) >> TSC_SHIFT`, where `base_ns`
+/// is `monotonic_base`, the monotonic time at `tsc_base` counted from boot,
+/// or `realtime_base`, the wall clock time at `tsc_base` counted from the
+/// Unix epoch.
+#[derive(Clone, Copy)]
+pub(crate) struct ClockSource {
+    pub(crate) tsc_base       : u64,
+    pub(crate) mult           : u64,
+    pub(crate) monotonic_base : u64,
+    pub(crate) realtime_base  : u64,
+}
+
+#[allow(non_upper_case_globals)]
+static mut clock_source : ClockSource = ClockSource {
+    tsc_base       : 0,
+    mult           : 0,
+    monotonic_base : 0,
+    realtime_base  : 0,
+};
+
+/// Measures the TSC frequency (in Hz) against the PIT
+fn calibrate_tsc() -> u64 {
+    let latch = PIT_FREQUENCY * CALIBRATION_MS / 1000;
+
+    // enable the channel 2 gate, keeping the speaker off
+    outb(PIT_GATE, (inb(PIT_GATE) & !0x02) | 0x01);
+    // channel 2, low Byte then high Byte, mode 0 (interrupt on terminal count)
+    outb(PIT_COMMAND, 0b10110000);
+    outb(PIT_CHANNEL_2, latch as u8);
+    outb(PIT_CHANNEL_2, (latch >> 8) as u8);
+
+    let start = rdtsc_ordered();
+    while inb(PIT_GATE) & 0x20 == 0 {
+        core::hint::spin_loop();
+    }
+    let end = rdtsc_ordered();
+
+    (end - start) * 1000 / CALIBRATION_MS
+}
+
+/// Converts a TSC value into nanoseconds since the base of `source`
+fn elapsed_ns(source:&ClockSource, tsc:u64) -> u64 {
+    let delta = tsc.wrapping_sub(source.tsc_base) as u128;
+    ((delta * source.mult as u128) >> TSC_SHIFT) as u64
+}
+
+/// Calibrates the TSC, reads the wall clock and publishes both to the vDSO
+pub(crate) fn init() {
+    let frequency = calibrate_tsc();
+    let tsc_base = rdtsc_ordered();
+    let realtime = rtc::read_unix_time();
+    unsafe {
+        clock_source = ClockSource {
+            tsc_base,
+            mult           : (NSEC_PER_SEC << TSC_SHIFT) / frequency,
+            monotonic_base : 0,
+            realtime_base  : realtime * NSEC_PER_SEC,
+        };
+    }
+    vdso::update(&clock());
+}
+
+/// Moves the base of the clock to the present once it is old enough,
+/// publishing the new one to the vDSO
+///
+/// There is no timer interrupt, the scheduler calls this whenever it
+/// runs. Keeping the base recent bounds the interval that the kernel and
+/// the vDSO convert.
+pub(crate) fn tick() {
+    let mut source = clock();
+    let tsc = rdtsc_ordered();
+    let elapsed = elapsed_ns(&source, tsc);
+    if elapsed < REBASE_INTERVAL_NS {
+        return;
+    }
+    source.tsc_base = tsc;
+    source.monotonic_base += elapsed;
+    source.realtime_base += elapsed;
+    unsafe {
+        clock_source = source;
+    }
+    vdso::update(&source);
+}
+
+/// Returns the current conversion parameters
+pub(crate) fn clock() -> ClockSource {
+    unsafe { clock_source }
+}
+
+/// Returns the nanoseconds elapsed since boot
+pub(crate) fn monotonic_ns() -> u64 {
+    let source = clock();
+    source.monotonic_base + elapsed_ns(&source, rdtsc_ordered())
+}
+
+/// Returns the nanoseconds elapsed since the Unix epoch
+pub(crate) fn realtime_ns() -> u64 {
+    let source = clock();
+    source.realtime_base + elapsed_ns(&source, rdtsc_ordered())
+}
+
+/// Stores the time of the clock `clock` at `addr`
+///
+/// This is the slow path of the `clock_gettime` of the vDSO, for the
+/// programs which do not use it.
+pub(crate) fn sys_clock_gettime(clock:usize, addr:usize) -> KResult<usize> {
+    let ns = match clock {
+        CLOCK_REALTIME  => realtime_ns(),
+        CLOCK_MONOTONIC => monotonic_ns(),
+        _               => return Err(EINVAL),
+    };
+    let time = Timespec {
+        sec  : (ns / NSEC_PER_SEC) as i64,
+        nsec : (ns % NSEC_PER_SEC) as i64,
+    };
+    write_user(addr, &time)?;
+    Ok(0)
+}
@@ -0,0 +1,82 @@
+use crate::cpu::*;
+
+const CMOS_ADDRESS : u16 = 0x70;
+const CMOS_DATA    : u16 = 0x71;
+
+// CMOS registers
+const RTC_SECONDS  : u8 = 0x00;
+const RTC_MINUTES  : u8 = 0x02;
+const RTC_HOURS    : u8 = 0x04;
+const RTC_DAY      : u8 = 0x07;
+const RTC_MONTH    : u8 = 0x08;
+const RTC_YEAR     : u8 = 0x09;
+const RTC_STATUS_A : u8 = 0x0A;
+const RTC_STATUS_B : u8 = 0x0B;
+
+fn read_register(register:u8) -> u8 {
+    outb(CMOS_ADDRESS, register);
+    inb(CMOS_DATA)
+}
+
+fn update_in_progress() -> bool {
+    read_register(RTC_STATUS_A) & 0x80 != 0
+}
+
+/// Returns the date and time registers, read twice until two reads match
+fn read_registers() -> [u8; 6] {
+    let read = || {
+        while update_in_progress() {
+            core::hint::spin_loop();
+        }
+        [RTC_SECONDS, RTC_MINUTES, RTC_HOURS, RTC_DAY, RTC_MONTH, RTC_YEAR].map(read_register)
+    };
+    let mut last = read();
+    loop {
+        let current = read();
+        if current == last {
+            return current;
+        }
+        last = current;
+    }
+}
+
+/// Returns the number of days from 1970-01-01 to the given date
+fn days_from_epoch(year:u64, month:u64, day:u64) -> u64 {
+    // shift the year to start in March, so that the leap day is the last one
+    let (year, month) = if month <= 2 { (year - 1, month + 9) } else { (year, month - 3) };
+    let era = year / 400;
+    let year_of_era = year % 400;
+    let day_of_year = (153 * month + 2) / 5 + day - 1;
+    let day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    era * 146097 + day_of_era - 719468
+}
+
+/// Reads the CMOS real time clock, returning the seconds since the Unix epoch
+///
+/// The clock is assumed to hold UTC time of the 21st century.
+pub(crate) fn read_unix_time() -> u64 {
+    let [mut seconds, mut minutes, mut hours, mut day, mut month, mut year] = read_registers();
+    let status = read_register(RTC_STATUS_B);
+
+    let pm = hours & 0x80 != 0;
+    hours &= 0x7F;
+    if status & 0x04 == 0 {
+        let bcd = |value:u8| (value & 0x0F) + (value >> 4) * 10;
+        seconds = bcd(seconds);
+        minutes = bcd(minutes);
+        hours = bcd(hours);
+        day = bcd(day);
+        month = bcd(month);
+        year = bcd(year);
+    }
+    if status & 0x02 == 0 {
+        // 12 hours format
+        hours %= 12;
+        if pm {
+            hours += 12;
+        }
+    }
+
+    let days = days_from_epoch(2000 + year as u64, month as u64, day as u64);
+    days * 86400 + hours as u64 * 3600 + minutes as u64 * 60 + seconds as u64
+}
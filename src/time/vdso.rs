@@ -0,0 +1,105 @@
+use crate::cpu::*;
+use crate::mm::*;
+use crate::mm::paging::*;
+use crate::mm::space::*;
+use crate::mm::vma::*;
+use crate::sync::*;
+use crate::time::*;
+
+use core::ptr;
+
+// the vDSO is mapped at the same address in every process: the data page
+// first, immediately followed by the code, which begins with the jump table
+// of clock_gettime, gettimeofday and getcpu, 8 Bytes apart (see 'vdso.asm')
+pub(crate) const VDSO_BASE : usize = USER_SPACE_END - 0x10000;
+pub(crate) const VDSO_TEXT : usize = VDSO_BASE + PAGE_SIZE;
+
+// how the vDSO reads TSC_AUX for getcpu
+const GETCPU_NONE   : u32 = 0;
+const GETCPU_RDTSCP : u32 = 1;
+const GETCPU_RDPID  : u32 = 2;
+
+/// The data shared with the vDSO code
+///
+/// The layout must match the offsets used in 'vdso.asm'. Readers retry
+/// while `sequence` is odd or changed during their read.
+#[repr(C)]
+struct VdsoData {
+    sequence       : SeqCount,
+    tsc_base       : u64,
+    tsc_mult       : u64,
+    tsc_shift      : u32,
+    getcpu_mode    : u32,
+    monotonic_base : u64,
+    realtime_base  : u64,
+}
+
+/// The data page, alone in its page since it is mapped into user space
+#[repr(C, align(4096))]
+struct VdsoPage {
+    data : VdsoData,
+}
+
+#[allow(non_upper_case_globals)]
+static mut vdso_page : VdsoPage = VdsoPage {
+    data : VdsoData {
+        sequence       : SeqCount::new(),
+        tsc_base       : 0,
+        tsc_mult       : 0,
+        tsc_shift      : TSC_SHIFT,
+        getcpu_mode    : GETCPU_NONE,
+        monotonic_base : 0,
+        realtime_base  : 0,
+    },
+};
+
+extern "C" {
+    // page aligned bounds of the vDSO code (see 'kernel.asm')
+    static vdso_start : u8;
+    static vdso_end   : u8;
+}
+
+/// Publishes new clock parameters to the vDSO data page
+pub(crate) fn update(source:&ClockSource) {
+    let features = features();
+    let getcpu_mode = if features.rdpid {
+        GETCPU_RDPID
+    } else if features.rdtscp {
+        GETCPU_RDTSCP
+    } else {
+        GETCPU_NONE
+    };
+    unsafe {
+        let data = &raw mut vdso_page.data;
+        (*data).sequence.write_begin();
+        ptr::write_volatile(&raw mut (*data).tsc_base, source.tsc_base);
+        ptr::write_volatile(&raw mut (*data).tsc_mult, source.mult);
+        ptr::write_volatile(&raw mut (*data).getcpu_mode, getcpu_mode);
+        ptr::write_volatile(&raw mut (*data).monotonic_base, source.monotonic_base);
+        ptr::write_volatile(&raw mut (*data).realtime_base, source.realtime_base);
+        (*data).sequence.write_end();
+    }
+}
+
+/// Maps the vDSO data page and code, read-only, into `space`
+///
+/// Only the code is executable.
+pub(crate) fn map_into(space:&AddressSpace) -> Result<(), MapError> {
+    let (text_start, text_end) = unsafe {
+        (&vdso_start as *const u8 as usize, &vdso_end as *const u8 as usize)
+    };
+    let text_size = text_end - text_start;
+    let (data_flags, text_flags) = (VMA_READ, VMA_READ | VMA_EXEC);
+
+    space.vmas.insert(Vma::new(VDSO_BASE, VDSO_TEXT, data_flags))
+        .map_err(|_| MapError::AlreadyMapped)?;
+    space.vmas.insert(Vma::new(VDSO_TEXT, VDSO_TEXT + text_size, text_flags))
+        .map_err(|_| MapError::AlreadyMapped)?;
+
+    let data = &raw const vdso_page as usize;
+    space.page_table.map(VDSO_BASE, virt_to_phys(data), pte_flags(data_flags))?;
+    for offset in (0..text_size).step_by(PAGE_SIZE) {
+        space.page_table.map(VDSO_TEXT + offset, virt_to_phys(text_start + offset), pte_flags(text_flags))?;
+    }
+    Ok(())
+}
@@ -1,6 +1,8 @@
 
 pub(crate) mod colors;
+pub(crate) mod serial;
 pub(crate) mod tty;
 
+pub(crate) use serial::*;
 pub(crate) use tty::*;
 
@@ -0,0 +1,69 @@
+use crate::cpu::io::*;
+use crate::sync::*;
+
+use core::fmt::{self, Write};
+
+// the first serial port
+const COM1 : u16 = 0x3F8;
+
+// register offsets from the base port
+const DATA            : u16 = 0;
+const INTERRUPT       : u16 = 1;
+const FIFO_CONTROL    : u16 = 2;
+const LINE_CONTROL    : u16 = 3;
+const MODEM_CONTROL   : u16 = 4;
+const LINE_STATUS     : u16 = 5;
+
+const LINE_DLAB       : u8 = 0x80;   // the data and interrupt registers hold the baud rate divisor
+const LINE_8N1        : u8 = 0x03;   // 8 data bits, no parity, 1 stop bit
+const FIFO_ENABLE     : u8 = 0xC7;   // enabled and cleared, 14 Bytes threshold
+const MODEM_READY     : u8 = 0x03;   // DTR and RTS
+const STATUS_TX_EMPTY : u8 = 0x20;
+
+// 115200 / 1
+const BAUD_DIVISOR : u16 = 1;
+
+// serializes the writers, so that lines are not interleaved
+#[allow(non_upper_case_globals)]
+static serial_lock : SpinLock<()> = SpinLock::new(());
+
+/// Configures the first serial port at 115200 bauds, without interrupts
+pub(crate) fn init() {
+    outb(COM1 + INTERRUPT, 0);
+    outb(COM1 + LINE_CONTROL, LINE_DLAB);
+    outb(COM1 + DATA, BAUD_DIVISOR as u8);
+    outb(COM1 + INTERRUPT, (BAUD_DIVISOR >> 8) as u8);
+    outb(COM1 + LINE_CONTROL, LINE_8N1);
+    outb(COM1 + FIFO_CONTROL, FIFO_ENABLE);
+    outb(COM1 + MODEM_CONTROL, MODEM_READY);
+}
+
+fn write_byte(byte:u8) {
+    while inb(COM1 + LINE_STATUS) & STATUS_TX_EMPTY == 0 {}
+    outb(COM1 + DATA, byte);
+}
+
+/// Sends the raw Bytes of `buf` over the serial port
+pub(crate) fn serial_write(buf:&[u8]) {
+    let _guard = serial_lock.lock();
+    for &byte in buf {
+        write_byte(byte);
+    }
+}
+
+/// Sends the formatted `args` over the serial port
+pub(crate) fn serial_print_fmt(args:fmt::Arguments) {
+    let _guard = serial_lock.lock();
+    let _ = SerialWriter.write_fmt(args);
+}
+
+struct SerialWriter;
+
+impl fmt::Write for SerialWriter {
+    fn write_str(&mut self, msg:&str) -> fmt::Result {
+        for &byte in msg.as_bytes() {
+            write_byte(byte);
+        }
+        Ok(())
+    }
+}
@@ -1,5 +1,8 @@
+use crate::mm::PHYS_OFFSET;
 use crate::tty::colors::*;
 
+use core::fmt::{self, Write};
+
 const LINE_SIZE : usize = 160;
 const COLUMNS   : usize = 80;
 const ROWS      : usize = 25;
@@ -33,7 +36,7 @@ impl ScreenBuffer {
     /// Creates a `ScreenBuffer`
     const fn new() -> Self {
         ScreenBuffer {
-            buf : 0xB8000 as *mut u8,
+            buf : (PHYS_OFFSET + 0xB8000) as *mut u8,
             col : 0_usize,
             row : 0_usize,
         }
@@ -146,6 +149,28 @@ pub(crate) fn print(msg:&str) {
     }
 }
 
+/// Prints the raw Bytes of `buf` on screen
+pub(crate) fn write(buf:&[u8]) {
+    unsafe {
+        (*core::ptr::addr_of_mut!(screen_buffer)).write(buf.as_ptr(), buf.len(), FG_WHITE);
+    }
+}
+
+/// Prints the formatted `args` on screen
+#[cfg_attr(not(feature = "bench"), allow(dead_code))]
+pub(crate) fn print_fmt(args:fmt::Arguments) {
+    let _ = ScreenWriter.write_fmt(args);
+}
+
+struct ScreenWriter;
+
+impl fmt::Write for ScreenWriter {
+    fn write_str(&mut self, msg:&str) -> fmt::Result {
+        print(msg);
+        Ok(())
+    }
+}
+
 /// Clears the entire screen
 pub(crate) fn clear() {
     unsafe {
@@ -0,0 +1,126 @@
+; Virtual Dynamic Shared Object
+;
+; This code is mapped read-only into every process (see 'vdso.rs'), right after the data page
+; the kernel keeps up to date. Time and processor queries are answered from there without
+; entering the kernel. The entry points follow the System V calling convention and are reached
+; through the jump table at the beginning of the image.
+
+[BITS 64]
+
+DEFAULT REL
+
+%define VDSO_DATA                   ($$ - 4096)         ; the data page precedes the code
+%define DATA_SEQUENCE               VDSO_DATA + 0
+%define DATA_TSC_BASE               VDSO_DATA + 8
+%define DATA_TSC_MULT               VDSO_DATA + 16
+%define DATA_TSC_SHIFT              VDSO_DATA + 24
+%define DATA_GETCPU_MODE            VDSO_DATA + 28
+%define DATA_MONOTONIC_BASE         VDSO_DATA + 32
+%define DATA_REALTIME_BASE          VDSO_DATA + 40
+
+CLOCK_REALTIME:     equ 0
+CLOCK_MONOTONIC:    equ 1
+
+GETCPU_RDTSCP:      equ 1
+GETCPU_RDPID:       equ 2
+
+EINVAL:             equ 22
+NSEC_PER_SEC:       equ 1000000000
+
+jump_table:                                     ; each entry is 8 Bytes
+    jmp near clock_gettime                      ; int clock_gettime(clockid_t clock, struct timespec *ts)
+    align 8
+    jmp near gettimeofday                       ; int gettimeofday(struct timeval *tv, struct timezone *tz)
+    align 8
+    jmp near getcpu                             ; int getcpu(unsigned *cpu, unsigned *node)
+    align 8
+
+
+read_clock:                                     ; R9 holds the address of the clock base, returns the nanoseconds in RAX
+    mov r8, [DATA_SEQUENCE]
+    test r8, 1                                  ; an odd sequence means that the kernel is updating the data
+    jnz .wait
+    lfence                                      ; don't let RDTSC execute before the sequence is read
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    sub rax, [DATA_TSC_BASE]
+    mul qword [DATA_TSC_MULT]                   ; RDX:RAX holds the 128 bits product
+    mov ecx, [DATA_TSC_SHIFT]
+    shrd rax, rdx, cl
+    add rax, [r9]
+    cmp r8, [DATA_SEQUENCE]                     ; retry if the kernel updated the data in the meanwhile
+    jne read_clock
+    ret
+.wait:
+    pause
+    jmp read_clock
+
+
+clock_gettime:                                  ; arguments are stored in RDI (clockid_t clock), RSI (struct timespec *ts)
+    cmp edi, CLOCK_REALTIME
+    je .realtime
+    cmp edi, CLOCK_MONOTONIC
+    jne .invalid
+    lea r9, [DATA_MONOTONIC_BASE]
+    jmp .read
+.realtime:
+    lea r9, [DATA_REALTIME_BASE]
+.read:
+    call read_clock
+    xor edx, edx
+    mov rcx, NSEC_PER_SEC
+    div rcx                                     ; RAX holds the seconds, RDX the nanoseconds
+    mov [rsi], rax
+    mov [rsi+8], rdx
+    xor eax, eax
+    ret
+.invalid:
+    mov rax, -EINVAL
+    ret
+
+
+gettimeofday:                                   ; arguments are stored in RDI (struct timeval *tv), RSI (struct timezone *tz, ignored)
+    test rdi, rdi
+    jz .done
+    lea r9, [DATA_REALTIME_BASE]
+    call read_clock
+    xor edx, edx
+    mov rcx, 1000
+    div rcx                                     ; RAX holds the microseconds
+    xor edx, edx
+    mov rcx, 1000000
+    div rcx                                     ; RAX holds the seconds, RDX the microseconds
+    mov [rdi], rax
+    mov [rdi+8], rdx
+.done:
+    xor eax, eax
+    ret
+
+
+getcpu:                                         ; arguments are stored in RDI (unsigned *cpu), RSI (unsigned *node)
+    xor eax, eax                                ; without RDTSCP nor RDPID, report processor 0 of node 0
+    mov ecx, [DATA_GETCPU_MODE]
+    cmp ecx, GETCPU_RDPID
+    je .rdpid
+    cmp ecx, GETCPU_RDTSCP
+    jne .store
+    rdtscp                                      ; TSC_AUX is returned in ECX, the kernel sets it to (node << 12) | processor
+    mov eax, ecx
+    jmp .store
+.rdpid:
+    rdpid rax
+.store:
+    test rdi, rdi
+    jz .node
+    mov ecx, eax
+    and ecx, 0xFFF
+    mov [rdi], ecx
+.node:
+    test rsi, rsi
+    jz .done
+    shr eax, 12
+    mov [rsi], eax
+.done:
+    xor eax, eax
+    ret